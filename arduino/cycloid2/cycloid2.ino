@@ -0,0 +1,235 @@
+// The v2 firmware: streams every encoder edge and servo sample to the host,
+// timestamped, over USB serial, and takes controls and clock sync requests
+// back. The protocol is described in src/hw/car/teensyproto.h, and this
+// has to be kept in step with it; src/hw/car/teensyemu.cc emulates this
+// file for the host side's tests, so changes here belong there too.
+
+static const float PWM_HZ = 100;
+
+static const int PIN_PWM_CH1 = 3;
+static const int PIN_PWM_CH2 = 4;
+
+static const int PIN_ENCs[] = {5, 6, 7, 8};  // wheel encoders
+
+// framing
+static const uint8_t SYNC0 = 0xc5, SYNC1 = 0x1d;
+static const int HEADER_LEN = 5;
+static const int CRC_LEN = 2;
+static const int MAX_PAYLOAD = 250;
+static const int MAX_FRAME = HEADER_LEN + MAX_PAYLOAD + CRC_LEN;
+
+static const uint8_t TYPE_SENSORS = 0x01;
+static const uint8_t TYPE_SYNC_REPLY = 0x02;
+static const uint8_t TYPE_CONTROLS = 0x81;
+static const uint8_t TYPE_SYNC_REQUEST = 0x82;
+
+static const int SENSORS_HEADER_LEN = 14;
+static const int EDGE_LEN = 7;
+static const int SERVO_LEN = 6;
+static const uint8_t EDGE_RISING = 0x80;
+static const int MAX_EDGES = 24;
+static const int MAX_SERVO = 8;
+static const uint32_t PACKET_US = 5000;
+static const uint32_t SERVO_SAMPLE_US = 1000;
+
+// edges, from the pin change interrupts to loop(); if loop() falls this far
+// behind, an edge still counts but its time is lost
+static const int EDGE_RING = 64;
+struct EdgeEvent {
+  uint8_t which;
+  uint16_t count;
+  uint32_t t_us;
+};
+static volatile EdgeEvent ring[EDGE_RING];
+static volatile uint16_t ring_head = 0;
+static uint16_t ring_tail = 0;
+static volatile uint16_t enc_counts[4] = {0, 0, 0, 0};
+
+static uint8_t servo_samples[MAX_SERVO * SERVO_LEN];
+static int nservo = 0;
+static uint32_t last_servo_us, last_packet_us;
+static uint8_t tx_seq = 0;
+
+// the frame coming in
+static uint8_t rx[MAX_FRAME];
+static int rx_len = 0;
+
+static inline void put16(uint8_t *p, uint16_t x) {
+  p[0] = x;
+  p[1] = x >> 8;
+}
+
+static inline void put32(uint8_t *p, uint32_t x) {
+  p[0] = x;
+  p[1] = x >> 8;
+  p[2] = x >> 16;
+  p[3] = x >> 24;
+}
+
+static uint16_t crc16(const uint8_t *data, int len) {
+  // CRC-16/CCITT-FALSE
+  uint16_t crc = 0xffff;
+  for (int i = 0; i < len; i++) {
+    crc ^= (uint16_t) data[i] << 8;
+    for (int j = 0; j < 8; j++) {
+      crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+    }
+  }
+  return crc;
+}
+
+static void onEdge(int i) {
+  uint32_t t = micros();
+  bool w = digitalReadFast(PIN_ENCs[i]);
+  uint16_t count = enc_counts[i] + 1;
+  enc_counts[i] = count;
+  if ((uint16_t) (ring_head - ring_tail) < EDGE_RING) {
+    volatile EdgeEvent *ev = &ring[ring_head % EDGE_RING];
+    ev->which = i | (w ? EDGE_RISING : 0);
+    ev->count = count;
+    ev->t_us = t;
+    ring_head++;
+  }
+}
+
+static void onEdge0() { onEdge(0); }
+static void onEdge1() { onEdge(1); }
+static void onEdge2() { onEdge(2); }
+static void onEdge3() { onEdge(3); }
+
+void setup() {
+  pinMode(PIN_PWM_CH1, OUTPUT);  // Channel 1 PWM  (ESC)
+  pinMode(PIN_PWM_CH2, OUTPUT);  // Channel 2 PWM  (Servo)
+  pinMode(13, OUTPUT);  // 13 is the LED
+  for (int8_t i = 0; i < 4; i++) {
+    pinMode(PIN_ENCs[i], INPUT);
+  }
+  attachInterrupt(PIN_ENCs[0], onEdge0, CHANGE);
+  attachInterrupt(PIN_ENCs[1], onEdge1, CHANGE);
+  attachInterrupt(PIN_ENCs[2], onEdge2, CHANGE);
+  attachInterrupt(PIN_ENCs[3], onEdge3, CHANGE);
+  analogWriteFrequency(3, PWM_HZ);
+  analogWriteResolution(16);
+
+  Serial.begin(115200);  // USB; the baud rate is ignored
+  last_servo_us = last_packet_us = micros();
+}
+
+uint16_t servo_pw(int8_t value) {
+  // convert an int8_t -127..127 value to a 1ms..2ms pulse  (0 is 1.5ms)
+  // so 65536 is 10ms; see cycloid/cycloid.ino
+  return (12484608L + 32768L * value) / 1270;
+}
+
+static void send(uint8_t type, const uint8_t *payload, int len) {
+  uint8_t frame[MAX_FRAME];
+  frame[0] = SYNC0;
+  frame[1] = SYNC1;
+  frame[2] = type;
+  frame[3] = tx_seq++;
+  frame[4] = len;
+  memcpy(frame + HEADER_LEN, payload, len);
+  put16(frame + HEADER_LEN + len, crc16(frame + 2, 3 + len));
+  Serial.write(frame, HEADER_LEN + len + CRC_LEN);
+}
+
+static void sendSensors(uint32_t now) {
+  uint8_t p[MAX_PAYLOAD];
+  put32(p, now);
+  cli();
+  for (int i = 0; i < 4; i++) {
+    put16(p + 4 + 2*i, enc_counts[i]);
+  }
+  uint16_t head = ring_head;
+  sei();
+  uint8_t *e = p + SENSORS_HEADER_LEN;
+  int nedges = 0;
+  while (ring_tail != head && nedges < MAX_EDGES) {
+    volatile EdgeEvent *ev = &ring[ring_tail % EDGE_RING];
+    e[0] = ev->which;
+    put16(e + 1, ev->count);
+    put32(e + 3, ev->t_us);
+    e += EDGE_LEN;
+    ring_tail++;
+    nedges++;
+  }
+  memcpy(e, servo_samples, nservo * SERVO_LEN);
+  p[12] = nedges;
+  p[13] = nservo;
+  int len = SENSORS_HEADER_LEN + nedges * EDGE_LEN + nservo * SERVO_LEN;
+  nservo = 0;
+  last_packet_us = now;
+  send(TYPE_SENSORS, p, len);
+}
+
+static void onFrame(uint32_t rx_us) {
+  uint8_t type = rx[2];
+  int len = rx[4];
+  const uint8_t *p = rx + HEADER_LEN;
+  if (type == TYPE_CONTROLS && len == 3) {
+    digitalWrite(13, p[0] & 1);
+    analogWrite(PIN_PWM_CH1, servo_pw((int8_t) p[1]));
+    analogWrite(PIN_PWM_CH2, servo_pw((int8_t) p[2]));
+  } else if (type == TYPE_SYNC_REQUEST && len == 4) {
+    uint8_t reply[12];
+    memcpy(reply, p, 4);
+    put32(reply + 4, rx_us);
+    put32(reply + 8, micros());
+    send(TYPE_SYNC_REPLY, reply, sizeof(reply));
+  }
+}
+
+// hunts for a frame's sync bytes, and on a bad one, drops a byte and
+// hunts again from there
+static void receive(uint8_t c, uint32_t now) {
+  rx[rx_len++] = c;
+  for (;;) {
+    int n = rx_len;
+    bool bad = false;
+    if (n >= 1 && rx[0] != SYNC0) {
+      bad = true;
+    } else if (n >= 2 && rx[1] != SYNC1) {
+      bad = true;
+    } else if (n >= HEADER_LEN && rx[4] > MAX_PAYLOAD) {
+      bad = true;
+    } else if (n >= HEADER_LEN && n == HEADER_LEN + rx[4] + CRC_LEN) {
+      int len = rx[4];
+      uint16_t crc = rx[HEADER_LEN + len] | (rx[HEADER_LEN + len + 1] << 8);
+      if (crc == crc16(rx + 2, 3 + len)) {
+        onFrame(now);
+        rx_len = 0;
+        return;
+      }
+      bad = true;
+    }
+    if (!bad) {
+      return;
+    }
+    memmove(rx, rx + 1, --rx_len);
+  }
+}
+
+void loop() {
+  uint32_t now = micros();
+
+  while (Serial.available()) {
+    receive(Serial.read(), now);
+  }
+
+  if (now - last_servo_us >= SERVO_SAMPLE_US) {
+    last_servo_us += SERVO_SAMPLE_US;
+    if (nservo < MAX_SERVO) {
+      put32(servo_samples + nservo * SERVO_LEN, now);
+      put16(servo_samples + nservo * SERVO_LEN + 4, analogRead(0));
+      nservo++;
+    }
+  }
+
+  cli();
+  uint16_t pending = ring_head - ring_tail;
+  sei();
+  if (now - last_packet_us >= PACKET_US || pending >= MAX_EDGES ||
+      nservo == MAX_SERVO) {
+    sendSensors(now);
+  }
+}
@@ -1,4 +1,6 @@
+import os
 import sympy as sp
+from sympy.codegen.ast import real, float32
 from sympy.printing.python import PythonPrinter
 
 C_UFs = {
@@ -22,16 +24,23 @@ def ccode(expr):
     return sp.ccode(expr, user_functions=C_UFs)
 
 
+def cfloat(expr):
+    ''' C code for expr in single precision (sinf, powf, 1.0F literals) so the
+    generated filter doesn't drop into double or long double math '''
+    return sp.ccode(expr, user_functions=C_UFs,
+                    type_aliases={real: float32})
+
+
 def pycode(expr):
     return pyprint._str(expr.subs(Py_UFs))
 
 
-def ccode_matrix(matexpr, indent):
+def ccode_matrix(matexpr, indent, printer=ccode):
     lines = []
     H, W = matexpr.shape
     indent = ' '*indent
     for j in range(H):
-        lines.append(', '.join([ccode(expr) for expr in matexpr[W*j:W*(j+1)]]))
+        lines.append(', '.join([printer(expr) for expr in matexpr[W*j:W*(j+1)]]))
     return (',\n' + indent).join(lines) + ';'
 
 
@@ -45,6 +54,60 @@ def pycode_matrix(matexpr, indent):
     return (',\n' + indent).join(lines)
 
 
+def cfactor(expr):
+    ''' cfloat(expr), parenthesized if it's a sum '''
+    if expr.is_Add:
+        return '(%s)' % cfloat(expr)
+    return cfloat(expr)
+
+
+def cterm(coef, name):
+    ''' coef * name, without multiplying by 1 or -1 '''
+    if coef == '1':
+        return name
+    if coef == '-1':
+        return '-' + name
+    return '%s * %s' % (coef, name)
+
+
+def csum(terms):
+    ''' sum of C expressions, folding "+ -x" into "- x" '''
+    out = terms[0]
+    for t in terms[1:]:
+        if t.startswith('-'):
+            out += ' - ' + t[1:]
+        else:
+            out += ' + ' + t
+    return out
+
+
+def sparse_scalars(mat, name, fout):
+    ''' Emit a float for each nonzero, non-constant entry of mat and return
+    {(i, j): C expression or constant} for the nonzero ones '''
+    H, W = mat.shape
+    nz = {}
+    for i in range(H):
+        for j in range(W):
+            term = mat[i, j]
+            if term == 0:
+                continue
+            if term.is_Number:
+                nz[(i, j)] = cfloat(term)
+            else:
+                v = '%s%d_%d' % (name, i, j)
+                print >>fout, '  float %s = %s;' % (v, cfloat(term))
+                nz[(i, j)] = v
+    return nz
+
+
+def used_states(X, exprs):
+    ''' the state variables referenced by any of exprs '''
+    syms = set()
+    for e in exprs:
+        syms |= e.free_symbols
+    return [(i, x) for i, x in enumerate(X) if x in syms]
+
+
 class EKFGen:
     def __init__(self, X):
         self.X = X
@@ -69,34 +132,39 @@ class EKFGen:
 
 class EKF {
  public:
+  typedef Eigen::Matrix<float, %d, 1> State;
+  typedef Eigen::Matrix<float, %d, %d> Covariance;
+
   EKF();
-  
+
   void Reset();
-'''
-        print >>self.fcc, '''#include <Eigen/Dense>
+''' % (N, N, N)
+        print >>self.fcc, '''#include <math.h>
+#include <Eigen/Dense>
 #include "ekf.h"
 
 // This file is auto-generated by ekf/codegen.py. DO NOT EDIT.
 
-using Eigen::VectorXf;
-using Eigen::MatrixXf;
+// All matrices are fixed-size, so Predict and Update* never touch the heap;
+// Jacobians are applied only through their nonzero entries.
 
 #define Min(x, y) fminf(x, y)
 #define Max(x, y) fmaxf(x, y)
 
-static inline float Heaviside(float x) {
-  return x < 0 ? 0 : 1;
+// newer sympy prints the value at 0 as a second argument
+static inline float Heaviside(float x, float h0 = 1) {
+  return x < 0 ? 0 : x > 0 ? 1 : h0;
 }
 
 static inline float DiracDelta(float x) {
   return x == 0;
 }
 
-EKF::EKF() : x_(%d), P_(%d, %d) {
+EKF::EKF() {
   Reset();
 }
 
-''' % (N, N, N)
+'''
         print >>self.fcc, 'void EKF::Reset() {'
         print >>self.fcc, '  x_ <<', ccode_matrix(x0, 8)
         print >>self.fcc, '  P_.setIdentity();'
@@ -131,12 +199,14 @@ def initial_state():'''
     def close(self):
         print >>self.fh, '''
 
-  Eigen::VectorXf& GetState() { return x_; }
-  Eigen::MatrixXf& GetCovariance() { return P_; }
+  State& GetState() { return x_; }
+  Covariance& GetCovariance() { return P_; }
+
+  EIGEN_MAKE_ALIGNED_OPERATOR_NEW
 
  private:
-  Eigen::VectorXf x_;
-  Eigen::MatrixXf P_;
+  State x_;
+  Covariance P_;
 };
 
 #endif  // MODEL_EKF_H_
@@ -238,34 +308,66 @@ def initial_state():'''
         print >>self.fcc, "void EKF::Predict(%s) {" % ', '.join(arglist)
         print >>self.fh, '  void Predict(%s);' % ', '.join(arglist)
 
-        for i, elem in enumerate(self.X):
-            if elem in (f - self.X).free_symbols:
-                print >>self.fcc, "  float %s = x_[%d];" % (ccode(elem), i)
+        for i, elem in used_states(
+                self.X, [x[1] for x in vs] + list(es[0]) + list(es[1]) +
+                list(es[2])):
+            print >>self.fcc, "  float %s = x_[%d];" % (ccode(elem), i)
 
         print >>self.fcc, ""
 
         for x in vs:
-            print >>self.fcc, '  float %s = %s;' % (ccode(x[0]), ccode(x[1]))
+            print >>self.fcc, '  float %s = %s;' % (ccode(x[0]), cfloat(x[1]))
 
-        print >>self.fcc, '\n  MatrixXf F(%d, %d);' % (N, N)
-        print >>self.fcc, '  F.setIdentity();'
-        for i, term in enumerate(es[0]):
-            if term != 0:
-                print >>self.fcc, '  F(%d, %d) += %s;' % (i / N, i % N, ccode(term))
-
-        print >>self.fcc, '\n  VectorXf Q(%d);' % N
-        print >>self.fcc, '  Q <<', ', '.join([ccode(x*x) for x in es[2]]) + ';'
+        # F = I + dF, with dF sparse; P = F P F^T is done as row updates
+        # (FP = F P) and then column updates (FP F^T) over the nonzeros only
+        print >>self.fcc, ''
+        dF = sparse_scalars(es[0], 'dF', self.fcc)
+        rows = {}
+        for (i, j), c in sorted(dF.items()):
+            rows.setdefault(i, []).append((j, c))
 
+        print >>self.fcc, ''
         for i, term in enumerate(es[1]):
             if term != 0:
-                print >>self.fcc, '  x_[%d] += %s;' % (i, ccode(term))
-        
-        print >>self.fcc, '\n  P_ = F * P_ * F.transpose();'
-        print >>self.fcc, '  P_.diagonal() += ' + ccode(dt) + ' * Q;'
+                print >>self.fcc, '  x_[%d] += %s;' % (i, cfloat(term))
+
+        if rows:
+            print >>self.fcc, '\n  Covariance FP = P_;'
+            for i in sorted(rows):
+                print >>self.fcc, '  FP.row(%d) += %s;' % (i, csum(
+                    [cterm(c, 'P_.row(%d)' % j) for j, c in rows[i]]))
+            print >>self.fcc, '  P_ = FP;'
+            for i in sorted(rows):
+                print >>self.fcc, '  P_.col(%d) += %s;' % (i, csum(
+                    [cterm(c, 'FP.col(%d)' % j) for j, c in rows[i]]))
+
+        # Q is either a full covariance matrix or a vector of std. deviations
+        print >>self.fcc, ''
+        if Q.shape[1] > 1:
+            for i, term in enumerate(es[2]):
+                if term != 0:
+                    print >>self.fcc, '  P_(%d, %d) += %s * %s;' % (
+                        i / N, i % N, ccode(dt), cfactor(term))
+        else:
+            for i, term in enumerate(es[2]):
+                if term != 0:
+                    print >>self.fcc, '  P_(%d, %d) += %s * %s;' % (
+                        i, i, ccode(dt), cfactor(term*term))
         print >>self.fcc, '}\n'
 
-
-    def generate_measurement(self, name, h_x, h_z, z_k, R_k):
+    def generate_measurement(self, name, h_x, h_z, z_k, R_k, mode='joint'):
+        ''' mode selects how the C++ update is done:
+          joint:      K = P Hk^T S^-1 with S inverted in closed form
+          sequential: one scalar update per measurement row, no inverse;
+                      P -= g g^T with g = P h^T / sqrt(s)
+          joseph:     scalar updates with the Joseph-form covariance,
+                      P - k p^T - p k^T + s k k^T, which is less sensitive to
+                      rounding in k
+        Correlated measurement noise is whitened with a Cholesky factor first
+        for the scalar modes. EKF_UPDATE_MODE in the environment overrides
+        mode for every measurement, for comparing them. '''
+        mode = os.environ.get('EKF_UPDATE_MODE', mode)
+        assert mode in ('joint', 'sequential', 'joseph')
         H = h_x.jacobian(self.X)
         M = h_z.jacobian(z_k) + h_x.jacobian(z_k)
         y_k = h_z - h_x
@@ -273,13 +375,13 @@ def initial_state():'''
                         symbols=sp.numbered_symbols("tmp"))
 
         self.generate_measurement_cc(
-            name, h_x, h_z, z_k, R_k, H, M, y_k, vs, es)
+            name, h_x, h_z, z_k, R_k, H, M, y_k, vs, es, mode)
 
         self.generate_measurement_py(
             name, h_x, h_z, z_k, R_k, H, M, y_k, vs, es)
 
     def generate_measurement_cc(self, name, h_x, h_z, z_k, R_k,
-                                H, M, y_k, vs, es):
+                                H, M, y_k, vs, es, mode):
         ''' Generate a method for doing an EKF measurement update. h(X) -> X is the
         measurement function of the state, X is the symbolic state vector, z_k is
         the symbolic measurement vector, R is the measurement noise covariance
@@ -291,66 +393,173 @@ def initial_state():'''
         '''
 
         N = self.N
+        Ny = H.shape[0]
+        Nz = len(z_k)
         arglist = ["float " + ccode(ui) for ui in z_k]
         if not R_k.is_Matrix and R_k.is_Symbol:
-            arglist.append("Eigen::MatrixXf Rk")
+            arglist.append(
+                "const Eigen::Matrix<float, %d, %d> &Rk" % (Nz, Nz))
         name = name[0].upper() + name[1:]
         print >>self.fcc, 'bool EKF::Update%s(%s) {' % (name, ', '.join(arglist))
         print >>self.fh, '  bool Update%s(%s);' % (name, ', '.join(arglist))
 
-        for i, elem in enumerate(self.X):
-            if elem in h_x.free_symbols:
-                print >>self.fcc, "  float %s = x_[%d];" % (ccode(elem), i)
+        for i, elem in used_states(
+                self.X, [x[1] for x in vs] + list(es[0]) + list(es[1]) +
+                list(es[2])):
+            print >>self.fcc, "  float %s = x_[%d];" % (ccode(elem), i)
 
         for x in vs:
-            print >>self.fcc, '  float %s = %s;' % (ccode(x[0]), ccode(x[1]))
+            print >>self.fcc, '  float %s = %s;' % (ccode(x[0]), cfloat(x[1]))
 
         print >>self.fcc, ""
 
-        print >>self.fcc, '\n  VectorXf yk(%d);' % (y_k.shape[0])
-        print >>self.fcc, '  yk <<', ccode_matrix(es[0], 8)
+        print >>self.fcc, '  Eigen::Matrix<float, %d, 1> yk;' % Ny
+        print >>self.fcc, '  yk <<', ccode_matrix(es[0], 8, cfloat)
+
+        # Hk is sparse (most measurements see a few states); PHt = P Hk^T and
+        # S = Hk P Hk^T are summed over its nonzero columns only
+        print >>self.fcc, ''
+        Hnz = sparse_scalars(es[1], 'H', self.fcc)
+        if mode != 'joint':
+            self.generate_scalar_updates_cc(mode, Ny, Nz, R_k, M, es, Hnz)
+            print >>self.fcc, '}\n'
+            return
+
+        print >>self.fcc, '  Eigen::Matrix<float, %d, %d> PHt;' % (N, Ny)
+        for m in range(Ny):
+            terms = [cterm(c, 'P_.col(%d)' % j)
+                     for (i, j), c in sorted(Hnz.items()) if i == m]
+            if terms:
+                print >>self.fcc, '  PHt.col(%d) = %s;' % (m, csum(terms))
+            else:
+                print >>self.fcc, '  PHt.col(%d).setZero();' % m
+        print >>self.fcc, '  Eigen::Matrix<float, %d, %d> S;' % (Ny, Ny)
+        for m in range(Ny):
+            terms = [cterm(c, 'PHt.row(%d)' % j)
+                     for (i, j), c in sorted(Hnz.items()) if i == m]
+            if terms:
+                print >>self.fcc, '  S.row(%d) = %s;' % (m, csum(terms))
+            else:
+                print >>self.fcc, '  S.row(%d).setZero();' % m
+
+        R = self.generate_R_cc(Ny, Nz, R_k, M, es)
+        if isinstance(R, list):
+            for m, r in enumerate(R):
+                print >>self.fcc, '  S(%d, %d) += %s;' % (m, m, r)
+        else:
+            print >>self.fcc, '  S += %s;' % R
+        print >>self.fcc, '\n  Eigen::Matrix<float, %d, %d> Sinv;' % (Ny, Ny)
+        if Ny <= 4:
+            print >>self.fcc, '  bool invertible;'
+            # Eigen's default determinant threshold (1e-5 for float) is far
+            # too coarse for small measurement variances; only refuse exactly
+            # singular S
+            print >>self.fcc, '  S.computeInverseWithCheck(Sinv, invertible, 0);'
+            print >>self.fcc, '  if (!invertible) {'
+            print >>self.fcc, '    return false;'
+            print >>self.fcc, '  }'
+        else:
+            print >>self.fcc, '  Sinv = S.inverse();'
+        print >>self.fcc, '  Eigen::Matrix<float, %d, %d> K = PHt * Sinv;' % (N, Ny)
 
-        print >>self.fcc, '\n  MatrixXf Hk(%d, %d);' % H.shape
-        print >>self.fcc, '  Hk <<', ccode_matrix(es[1], 8)
+        # P is symmetric, so Hk P = PHt^T; rounding error would otherwise
+        # accumulate in the antisymmetric part and blow up, so re-symmetrize
+        print >>self.fcc, '\n  x_.noalias() += K * yk;'
+        print >>self.fcc, '  P_.noalias() -= K * PHt.transpose();'
+        print >>self.fcc, '  Covariance Pt = P_.transpose();'
+        print >>self.fcc, '  P_ = 0.5f * (P_ + Pt);'
 
+        print >>self.fcc, '  return true;'
+        print >>self.fcc, '}\n'
+
+    def generate_R_cc(self, Ny, Nz, R_k, M, es):
+        ''' Emit the measurement noise covariance in terms of yk; returns a
+        list of diagonal entries if it's diagonal, otherwise the name of the
+        matrix '''
         if R_k.is_Matrix:
             if R_k.shape[1] > 1:
-                print >>self.fcc, '\n  MatrixXf Rk(%d, %d);' % R_k.shape
-                print >>self.fcc, '  Rk <<', ccode_matrix(R_k, 8)
-            else:
-                print >>self.fcc, '\n  VectorXf Rk(%d);' % R_k.shape[0]
-                # in this case we need to square it also
-                # print >>self.fcc, '  Rk <<', ccode_matrix(R_k, 8)
-                print >>self.fcc, '  Rk <<', ', '.join([ccode(x*x) for x in R_k]) + ';'
+                print >>self.fcc, '\n  Eigen::Matrix<float, %d, %d> Rk;' % R_k.shape
+                print >>self.fcc, '  Rk <<', ccode_matrix(R_k, 8, cfloat)
 
         if not M.is_Identity:
-            print >>self.fcc, '  MatrixXf Mk(%d, %d);' % M.shape
-            print >>self.fcc, '  Mk <<', ccode_matrix(es[2], 8)
-            print >>self.fcc, '  Rk = Mk * Rk * Mk.transpose();'
-
-        Sshape = es[1].shape[0]
-        if Sshape >= 2 and Sshape <= 6:
-            Sshape = str(Sshape)
-        else:
-            Sshape = 'X'
-        if R_k.is_Matrix and R_k.shape[1] == 1:
+            if R_k.is_Matrix and R_k.shape[1] == 1:
+                print >>self.fcc, '\n  Eigen::Matrix<float, %d, %d> Rk;' % (
+                    Nz, Nz)
+                print >>self.fcc, '  Rk.setZero();'
+                print >>self.fcc, '  Rk.diagonal() <<', ', '.join(
+                    [cfloat(x*x) for x in R_k]) + ';'
+            print >>self.fcc, '  Eigen::Matrix<float, %d, %d> Mk;' % M.shape
+            print >>self.fcc, '  Mk <<', ccode_matrix(es[2], 8, cfloat)
             print >>self.fcc, \
-                '\n  Eigen::Matrix%sf S = Hk * P_ * Hk.transpose();' % (
-                    Sshape)
-            print >>self.fcc, '  S.diagonal() += Rk;'
+                '  Eigen::Matrix<float, %d, %d> R = Mk * Rk * Mk.transpose();' % (
+                    Ny, Ny)
+            return 'R'
+        elif R_k.is_Matrix and R_k.shape[1] == 1:
+            # std. deviations; square them
+            return [cfloat(r*r) for r in R_k]
+        return 'Rk'
+
+    def generate_scalar_updates_cc(self, mode, Ny, Nz, R_k, M, es, Hnz):
+        ''' Sequential scalar updates for each row of yk. The residuals are
+        all linearized at the prior state; each later row is corrected by the
+        state change from the earlier ones (dx). '''
+        N = self.N
+        R = self.generate_R_cc(Ny, Nz, R_k, M, es)
+        if isinstance(R, list):
+            rows = [[(j, c) for (i, j), c in sorted(Hnz.items()) if i == m]
+                    for m in range(Ny)]
         else:
-            print >>self.fcc, \
-                '\n  Eigen::Matrix%sf S = Hk * P_ * Hk.transpose() + Rk;' % (
-                    Sshape)
-        print >>self.fcc, '  MatrixXf K = P_ * Hk.transpose() * S.inverse();'
-        # FIXME: return false if S is not invertible?
-
-        print >>self.fcc, '\n  x_.noalias() += K * yk;'
-        print >>self.fcc, \
-            '  P_ = (MatrixXf::Identity(%d, %d) - K*Hk) * P_;' % (N, N)
+            # decorrelate: with R = L L^T, L^-1 yk has unit variance with
+            # Jacobian L^-1 Hk, which is nonzero only on Hk's nonzero columns
+            cols = sorted(set(j for (i, j) in Hnz))
+            print >>self.fcc, '  Eigen::Matrix<float, %d, %d> Hw;' % (
+                Ny, len(cols))
+            print >>self.fcc, '  Hw << ' + (',\n' + ' '*8).join([', '.join(
+                [Hnz.get((m, j), '0') for j in cols]) for m in range(Ny)]) + ';'
+            print >>self.fcc, '  Eigen::LLT<Eigen::Matrix<float, %d, %d> > llt(%s);' % (
+                Ny, Ny, R)
+            print >>self.fcc, '  if (llt.info() != Eigen::Success) {'
+            print >>self.fcc, '    return false;'
+            print >>self.fcc, '  }'
+            print >>self.fcc, '  llt.matrixL().solveInPlace(yk);'
+            print >>self.fcc, '  llt.matrixL().solveInPlace(Hw);'
+            rows = [[(j, 'Hw(%d, %d)' % (m, c)) for c, j in enumerate(cols)]
+                    for m in range(Ny)]
+            R = ['1'] * Ny
+
+        print >>self.fcc, '\n  State dx = State::Zero();'
+        print >>self.fcc, '  State p, k;'
+        print >>self.fcc, '  float s, y;'
+        for m in range(Ny):
+            print >>self.fcc, ''
+            if not rows[m]:
+                continue
+            print >>self.fcc, '  p = %s;' % csum(
+                [cterm(c, 'P_.col(%d)' % j) for j, c in rows[m]])
+            print >>self.fcc, '  s = %s + %s;' % (csum(
+                [cterm(c, 'p[%d]' % j) for j, c in rows[m]]), R[m])
+            if m == 0:
+                print >>self.fcc, '  y = yk[0];'
+            else:
+                print >>self.fcc, '  y = yk[%d] - (%s);' % (m, csum(
+                    [cterm(c, 'dx[%d]' % j) for j, c in rows[m]]))
+            print >>self.fcc, '  if (!(s > 0)) {'
+            print >>self.fcc, '    x_ += dx;'
+            print >>self.fcc, '    return false;'
+            print >>self.fcc, '  }'
+            print >>self.fcc, '  k = p / s;'
+            print >>self.fcc, '  dx += k * y;'
+            # both forms are exactly symmetric in floating point
+            if mode == 'sequential':
+                print >>self.fcc, '  k = p / sqrtf(s);'
+                print >>self.fcc, '  P_.noalias() -= k * k.transpose();'
+            else:
+                print >>self.fcc, '  P_ -= k * p.transpose() + p * k.transpose();'
+                print >>self.fcc, '  k *= sqrtf(s);'
+                print >>self.fcc, '  P_.noalias() += k * k.transpose();'
 
+        print >>self.fcc, '\n  x_ += dx;'
         print >>self.fcc, '  return true;'
-        print >>self.fcc, '}\n'
 
     def generate_measurement_py(self, name, h_x, h_z, z_k, R_k,
                                 H, M, y_k, vs, es):
@@ -0,0 +1,55 @@
+// Benchmark for the generated 15-state EKF in out_cc, run on a synthetic
+// drive: predict at 100Hz with IMU and encoder updates, and a centerline
+// update every third step. Built by hand:
+//   g++ -O3 -DEIGEN_RUNTIME_NO_MALLOC -I/usr/include/eigen3 -I. ekf_bench.cc
+//       out_cc/ekf.cc -o ekf_bench
+// With EIGEN_RUNTIME_NO_MALLOC, Eigen asserts if the filter allocates.
+// Regenerate with EKF_UPDATE_MODE=joint|sequential|joseph python model.py to
+// compare update forms.
+
+#include <math.h>
+#include <stdio.h>
+#include <sys/time.h>
+#include <Eigen/Dense>
+#include "out_cc/ekf.h"
+
+static double Now() {
+  timeval t;
+  gettimeofday(&t, NULL);
+  return t.tv_sec + t.tv_usec * 1e-6;
+}
+
+int main() {
+  const int steps = 100000;
+  EKF ekf;
+  Eigen::Matrix<float, 4, 4> Rk = Eigen::Matrix<float, 4, 4>::Identity();
+  Rk *= 0.01;
+
+  int fails = 0;
+  double t0 = Now();
+#ifdef EIGEN_RUNTIME_NO_MALLOC
+  Eigen::internal::set_is_malloc_allowed(false);
+#endif
+  for (int i = 0; i < steps; i++) {
+    float t = i * 0.01;
+    float u_M = 0.5 + 0.3 * sinf(t * 0.7);
+    float u_delta = 0.4 * sinf(t * 0.3);
+    ekf.Predict(0.01, u_M, u_delta);
+    fails += !ekf.UpdateIMU(0.5 * sinf(t * 0.3));
+    fails += !ekf.UpdateEncoders(60 + 10 * sinf(t * 0.7), 125 - 14 * u_delta);
+    if (i % 3 == 0) {
+      fails += !ekf.UpdateCenterline(0.02 * sinf(t * 0.1), 0.05, 0.1, 0.5, Rk);
+    }
+  }
+#ifdef EIGEN_RUNTIME_NO_MALLOC
+  Eigen::internal::set_is_malloc_allowed(true);
+#endif
+  double t1 = Now();
+
+  EKF::State &x = ekf.GetState();
+  printf("v %f delta %f y_e %f psi_e %f kappa %f\n", x[0], x[1], x[2], x[3],
+      x[4]);
+  printf("%d failed updates\n", fails);
+  printf("%0.2f us/step\n", 1e6 * (t1 - t0) / steps);
+  return 0;
+}
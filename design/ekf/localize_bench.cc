@@ -0,0 +1,104 @@
+// Replays a recorded coneslam log through the generated 3-state landmark EKF
+// in localize_cc, with nearest-bearing data association against the
+// surveyed map, and prints the track, timing and how well-conditioned P
+// stays. Regenerate with EKF_UPDATE_MODE=joint|sequential|joseph python
+// slam.py to compare update forms. Built by hand:
+//   g++ -O3 -I/usr/include/eigen3 -Ilocalize_cc localize_bench.cc
+//       localize_cc/ekf.cc -o localize_bench
+
+#include <math.h>
+#include <stdio.h>
+#include <sys/time.h>
+#include <Eigen/Dense>
+#include "localize_cc/ekf.h"
+
+const char *testdata_file = "../../src/coneslam/testdata/194625.txt";
+const char *lm_file = "../../src/coneslam/testdata/lm.txt";
+
+static double Now() {
+  timeval t;
+  gettimeofday(&t, NULL);
+  return t.tv_sec + t.tv_usec * 1e-6;
+}
+
+int main() {
+  float lm[64][2];
+  int n_lm = 0;
+  FILE *fp = fopen(lm_file, "r");
+  if (!fp) {
+    perror(lm_file);
+    return 1;
+  }
+  if (fscanf(fp, "%d", &n_lm) != 1 || n_lm > 64) {
+    return 1;
+  }
+  for (int i = 0; i < n_lm; i++) {
+    if (fscanf(fp, "%f %f", &lm[i][0], &lm[i][1]) != 2) {
+      return 1;
+    }
+  }
+  fclose(fp);
+
+  fp = fopen(testdata_file, "r");
+  if (!fp) {
+    perror(testdata_file);
+    return 1;
+  }
+
+  EKF ekf;
+  // bearing precision 10, as drive uses; landmarks are surveyed to ~5 ticks
+  Eigen::Matrix<float, 3, 3> Rk = Eigen::Matrix<float, 3, 3>::Zero();
+  Rk.diagonal() << 0.1, 25, 25;
+
+  double tpredict = 0, tupdate = 0;
+  int frames = 0, updates = 0, fails = 0;
+  float minvar = 1e30, maxasym = 0;
+  float dt, ds, w;
+  int nLM;
+  while (fscanf(fp, "%f %f %f %d", &dt, &ds, &w, &nLM) == 4) {
+    double t0 = Now();
+    ekf.Predict(dt, ds, w);
+    tpredict += Now() - t0;
+    for (int j = 0; j < nLM; j++) {
+      float bearing;
+      if (fscanf(fp, "%f", &bearing) != 1) {
+        return 1;
+      }
+      // the log's bearings are clockwise-positive
+      bearing = -bearing;
+      const EKF::State &x = ekf.GetState();
+      int best = -1;
+      float bestdiff = 0.3;
+      for (int i = 0; i < n_lm; i++) {
+        float b = atan2f(lm[i][1] - x[1], lm[i][0] - x[0]) - x[2];
+        float d = fabsf(remainderf(b - bearing, 2 * M_PI));
+        if (d < bestdiff) {
+          bestdiff = d;
+          best = i;
+        }
+      }
+      if (best == -1) {
+        continue;
+      }
+      t0 = Now();
+      fails += !ekf.UpdateLm_bearing(bearing, lm[best][0], lm[best][1], Rk);
+      tupdate += Now() - t0;
+      updates++;
+    }
+
+    const EKF::Covariance &P = ekf.GetCovariance();
+    Eigen::SelfAdjointEigenSolver<EKF::Covariance> es(P);
+    if (es.eigenvalues()[0] < minvar) minvar = es.eigenvalues()[0];
+    float asym = (P - P.transpose()).cwiseAbs().maxCoeff();
+    if (asym > maxasym) maxasym = asym;
+    const EKF::State &x = ekf.GetState();
+    printf("%d: %f %f %f\n", frames++, x[0], x[1], x[2]);
+  }
+  fclose(fp);
+
+  printf("%d frames, %d updates, %d failed\n", frames, updates, fails);
+  printf("predict %0.3f us, update %0.3f us\n", 1e6 * tpredict / frames,
+      1e6 * tupdate / updates);
+  printf("min eigenvalue of P %g, max asymmetry %g\n", minvar, maxasym);
+  return 0;
+}
@@ -1,99 +1,115 @@
+#include <math.h>
 #include <Eigen/Dense>
 #include "ekf.h"
 
 // This file is auto-generated by ekf/codegen.py. DO NOT EDIT.
 
-using Eigen::VectorXf;
-using Eigen::MatrixXf;
+// All matrices are fixed-size, so Predict and Update* never touch the heap;
+// Jacobians are applied only through their nonzero entries.
 
 #define Min(x, y) fminf(x, y)
 #define Max(x, y) fmaxf(x, y)
 
-static inline float Heaviside(float x) {
-  return x < 0 ? 0 : 1;
+// newer sympy prints the value at 0 as a second argument
+static inline float Heaviside(float x, float h0 = 1) {
+  return x < 0 ? 0 : x > 0 ? 1 : h0;
 }
 
 static inline float DiracDelta(float x) {
   return x == 0;
 }
 
-EKF::EKF() : x_(3), P_(3, 3) {
+EKF::EKF() {
   Reset();
 }
 
 
 void EKF::Reset() {
-  x_ << 0.0,
-        0.0,
-        0.0;
+  x_ << 0,
+        0,
+        0;
   P_.setIdentity();
-  P_.diagonal() << 0.0100000,
-    0.0100000,
-    0.0100000;
+  P_.diagonal() << 0.010000000707805157,
+    0.010000000707805157,
+    0.010000000707805157;
 }
 
 void EKF::Predict(float Delta_t, float u_x, float u_theta) {
   float theta = x_[2];
 
   float tmp0 = Delta_t*u_theta;
-  float tmp1 = theta + (1.0L/2.0L)*tmp0;
-  float tmp2 = sin(tmp1);
+  float tmp1 = theta + (1.0F/2.0F)*tmp0;
+  float tmp2 = sinf(tmp1);
   float tmp3 = tmp2*u_x;
-  float tmp4 = cos(tmp1);
+  float tmp4 = cosf(tmp1);
   float tmp5 = tmp4*u_x;
-  float tmp6 = 0.25*u_theta;
-  float tmp7 = pow(tmp2, 2);
-  float tmp8 = 200*u_x;
-  float tmp9 = pow(tmp4, 2);
-  float tmp10 = -1.0L/2.0L*(tmp6 - tmp8)*sin(2*theta + tmp0);
-
-  MatrixXf F(3, 3);
-  F.setIdentity();
-  F(0, 2) += -tmp3;
-  F(1, 2) += tmp5;
-
-  VectorXf Q(3);
-  Q << pow(tmp6*tmp7 + tmp8*tmp9, 2), pow(tmp10, 2), 0, pow(tmp10, 2), pow(tmp6*tmp9 + tmp7*tmp8, 2), 0, 0, 0, 0.000400000000000000;
+  float tmp6 = powf(tmp2, 2);
+  float tmp7 = 0.25F*u_theta;
+  float tmp8 = powf(tmp4, 2);
+  float tmp9 = 200*u_x;
+  float tmp10 = -1.0F/2.0F*(tmp7 - tmp9)*sinf(2*theta + tmp0);
+
+  float dF0_2 = -tmp3;
+  float dF1_2 = tmp5;
+
   x_[0] += tmp5;
   x_[1] += tmp3;
   x_[2] += tmp0;
 
-  P_ = F * P_ * F.transpose();
-  P_.diagonal() += Delta_t * Q;
+  Covariance FP = P_;
+  FP.row(0) += dF0_2 * P_.row(2);
+  FP.row(1) += dF1_2 * P_.row(2);
+  P_ = FP;
+  P_.col(0) += dF0_2 * FP.col(2);
+  P_.col(1) += dF1_2 * FP.col(2);
+
+  P_(0, 0) += Delta_t * (tmp6*tmp7 + tmp8*tmp9);
+  P_(0, 1) += Delta_t * tmp10;
+  P_(1, 0) += Delta_t * tmp10;
+  P_(1, 1) += Delta_t * (tmp6*tmp9 + tmp7*tmp8);
+  P_(2, 2) += Delta_t * 0.02F;
 }
 
-bool EKF::UpdateLm_bearing(float l_px, float l_x, float l_y, Eigen::MatrixXf Rk) {
+bool EKF::UpdateLm_bearing(float l_px, float l_x, float l_y, const Eigen::Matrix<float, 3, 3> &Rk) {
   float p_x = x_[0];
   float p_y = x_[1];
   float theta = x_[2];
-  float tmp0 = cos(theta);
-  float tmp1 = l_y - p_y;
-  float tmp2 = tmp0*tmp1;
-  float tmp3 = sin(theta);
-  float tmp4 = l_x - p_x;
-  float tmp5 = tmp3*tmp4;
-  float tmp6 = tmp0*tmp4 + tmp1*tmp3;
-  float tmp7 = -tmp2 + tmp5;
-  float tmp8 = 1.0/(pow(tmp6, 2) + pow(tmp7, 2));
-  float tmp9 = tmp3*tmp6;
-  float tmp10 = tmp0*tmp7;
-  float tmp11 = tmp8*(tmp0*tmp6 + tmp3*tmp7);
-
-
-  VectorXf yk(1);
-  yk << l_px - atan2(tmp2 - tmp5, tmp6);
-
-  MatrixXf Hk(1, 3);
-  Hk << tmp8*(-tmp10 + tmp9), -tmp11, -1;
-  MatrixXf Mk(1, 3);
-  Mk << 1, tmp8*(tmp10 - tmp9), tmp11;
-  Rk = Mk * Rk * Mk.transpose();
-
-  Eigen::MatrixXf S = Hk * P_ * Hk.transpose() + Rk;
-  MatrixXf K = P_ * Hk.transpose() * S.inverse();
+  float tmp0 = sinf(theta);
+  float tmp1 = l_x - p_x;
+  float tmp2 = cosf(theta);
+  float tmp3 = l_y - p_y;
+  float tmp4 = tmp0*tmp1 - tmp2*tmp3;
+  float tmp5 = tmp0*tmp3 + tmp1*tmp2;
+  float tmp6 = 1.0F/(powf(tmp4, 2) + powf(tmp5, 2));
+  float tmp7 = -tmp0*tmp5 + tmp2*tmp4;
+  float tmp8 = tmp6*(tmp0*tmp4 + tmp2*tmp5);
+
+  Eigen::Matrix<float, 1, 1> yk;
+  yk << l_px - atan2f(-tmp4, tmp5);
+
+  float H0_0 = -tmp6*tmp7;
+  float H0_1 = -tmp8;
+  Eigen::Matrix<float, 3, 1> PHt;
+  PHt.col(0) = H0_0 * P_.col(0) + H0_1 * P_.col(1) - P_.col(2);
+  Eigen::Matrix<float, 1, 1> S;
+  S.row(0) = H0_0 * PHt.row(0) + H0_1 * PHt.row(1) - PHt.row(2);
+  Eigen::Matrix<float, 1, 3> Mk;
+  Mk << 1, tmp6*tmp7, tmp8;
+  Eigen::Matrix<float, 1, 1> R = Mk * Rk * Mk.transpose();
+  S += R;
+
+  Eigen::Matrix<float, 1, 1> Sinv;
+  bool invertible;
+  S.computeInverseWithCheck(Sinv, invertible, 0);
+  if (!invertible) {
+    return false;
+  }
+  Eigen::Matrix<float, 3, 1> K = PHt * Sinv;
 
   x_.noalias() += K * yk;
-  P_ = (MatrixXf::Identity(3, 3) - K*Hk) * P_;
+  P_.noalias() -= K * PHt.transpose();
+  Covariance Pt = P_.transpose();
+  P_ = 0.5f * (P_ + Pt);
   return true;
 }
 
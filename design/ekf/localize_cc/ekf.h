@@ -7,20 +7,25 @@
 
 class EKF {
  public:
+  typedef Eigen::Matrix<float, 3, 1> State;
+  typedef Eigen::Matrix<float, 3, 3> Covariance;
+
   EKF();
-  
+
   void Reset();
 
   void Predict(float Delta_t, float u_x, float u_theta);
-  bool UpdateLm_bearing(float l_px, float l_x, float l_y, Eigen::MatrixXf Rk);
+  bool UpdateLm_bearing(float l_px, float l_x, float l_y, const Eigen::Matrix<float, 3, 3> &Rk);
+
 
+  State& GetState() { return x_; }
+  Covariance& GetCovariance() { return P_; }
 
-  Eigen::VectorXf& GetState() { return x_; }
-  Eigen::MatrixXf& GetCovariance() { return P_; }
+  EIGEN_MAKE_ALIGNED_OPERATOR_NEW
 
  private:
-  Eigen::VectorXf x_;
-  Eigen::MatrixXf P_;
+  State x_;
+  Covariance P_;
 };
 
 #endif  // MODEL_EKF_H_
@@ -1,59 +1,61 @@
+#include <math.h>
 #include <Eigen/Dense>
 #include "ekf.h"
 
 // This file is auto-generated by ekf/codegen.py. DO NOT EDIT.
 
-using Eigen::VectorXf;
-using Eigen::MatrixXf;
+// All matrices are fixed-size, so Predict and Update* never touch the heap;
+// Jacobians are applied only through their nonzero entries.
 
 #define Min(x, y) fminf(x, y)
 #define Max(x, y) fmaxf(x, y)
 
-static inline float Heaviside(float x) {
-  return x < 0 ? 0 : 1;
+// newer sympy prints the value at 0 as a second argument
+static inline float Heaviside(float x, float h0 = 1) {
+  return x < 0 ? 0 : x > 0 ? 1 : h0;
 }
 
 static inline float DiracDelta(float x) {
   return x == 0;
 }
 
-EKF::EKF() : x_(15), P_(15, 15) {
+EKF::EKF() {
   Reset();
 }
 
 
 void EKF::Reset() {
-  x_ << 0.0,
-        0.0,
-        0.0,
-        0.0,
-        0.0,
-        2.70000004768372,
-        1.04999995231628,
-        2.00000000000000,
-        -0.649999976158142,
-        -1.39999997615814,
-        0.200000002980232,
-        3.79999995231628,
-        -35.0000000000000,
-        125.000000000000,
-        0.0;
+  x_ << 0,
+        0,
+        0,
+        0,
+        0,
+        2.7000000476837158,
+        1.0499999523162842,
+        2.0,
+        -0.64999997615814209,
+        -1.3999999761581421,
+        0.20000000298023224,
+        3.7999999523162842,
+        -35.0,
+        125.0,
+        0;
   P_.setIdentity();
-  P_.diagonal() << 1.00000011116208e-6,
-    0.0100000007078052,
-    4.00000000000000,
-    1.00000000000000,
-    0.160000011324883,
-    0.0400000028312206,
-    0.0400000028312206,
-    16.0000000000000,
-    0.250000000000000,
-    0.250000000000000,
-    0.250000000000000,
-    0.250000000000000,
-    10000.0000000000,
-    10000.0000000000,
-    1.00000000000000;
+  P_.diagonal() << 1.0000001111620804e-6,
+    0.010000000707805157,
+    4.0,
+    1.0,
+    0.16000001132488251,
+    0.040000002831220627,
+    0.040000002831220627,
+    16.0,
+    0.25,
+    0.25,
+    0.25,
+    0.25,
+    10000.0,
+    10000.0,
+    1.0;
 }
 
 void EKF::Predict(float Delta_t, float u_M, float u_delta) {
@@ -70,118 +72,178 @@ void EKF::Predict(float Delta_t, float u_M, float u_delta) {
   float srv_b = x_[10];
   float srv_r = x_[11];
 
-  float tmp0 = exp(ml_4);
+  float tmp0 = expf(ml_4);
   float tmp1 = fabsf(u_M);
-  float tmp2 = tmp1*exp(ml_2);
+  float tmp2 = tmp1*expf(ml_2);
   float tmp3 = tmp2*v;
-  float tmp4 = tmp1*exp(ml_1)*Heaviside(u_M);
-  float tmp5 = exp(ml_3);
-  float tmp6 = -v;
-  float tmp7 = tmp6 + 0.2;
-  float tmp8 = tmp5*Heaviside(tmp7);
-  float tmp9 = Heaviside(-Delta_t*(-tmp0 - tmp3 + tmp4 - tmp8) - v);
-  float tmp10 = -Delta_t*(tmp0 + tmp3 - tmp4 + tmp8);
-  float tmp11 = Heaviside(tmp10 + v);
-  float tmp12 = Delta_t*tmp11;
-  float tmp13 = tmp12*(tmp2 - tmp5*DiracDelta(tmp7));
-  float tmp14 = -delta + srv_a*u_delta + srv_b;
-  float tmp15 = Delta_t*srv_r;
-  float tmp16 = fabsf(tmp14);
-  float tmp17 = Min(tmp15, tmp16);
-  float tmp18 = (((tmp14) > 0) - ((tmp14) < 0));
-  float tmp19 = 2*tmp17*DiracDelta(tmp14) + pow(tmp18, 2)*Heaviside(tmp15 - tmp16);
-  float tmp20 = sin(psi_e);
-  float tmp21 = Delta_t*((1.0L/2.0L)*tmp13 + (1.0L/2.0L)*tmp9 - 1);
-  float tmp22 = cos(psi_e);
-  float tmp23 = Max(tmp10, tmp6);
-  float tmp24 = Delta_t*((1.0L/2.0L)*tmp23 + v);
-  float tmp25 = tmp22*tmp24;
-  float tmp26 = pow(Delta_t, 2);
-  float tmp27 = (1.0L/2.0L)*tmp11*tmp20*tmp26;
-  float tmp28 = kappa*y_e;
-  float tmp29 = tmp28 - 1;
-  float tmp30 = 1.0/tmp29;
-  float tmp31 = kappa*tmp30;
-  float tmp32 = delta + tmp22*tmp31;
-  float tmp33 = tmp20*tmp24;
-  float tmp34 = (1.0L/2.0L)*tmp11*tmp26*tmp32;
-
-  MatrixXf F(15, 15);
-  F.setIdentity();
-  F(0, 0) += -tmp13 - tmp9;
-  F(0, 5) += tmp12*tmp4;
-  F(0, 6) += -tmp12*tmp3;
-  F(0, 7) += -tmp12*tmp8;
-  F(0, 8) += -tmp0*tmp12;
-  F(1, 1) += -tmp19;
-  F(1, 9) += tmp19*u_delta;
-  F(1, 10) += tmp19;
-  F(1, 11) += Delta_t*tmp18*Heaviside(-tmp15 + tmp16);
-  F(2, 0) += tmp20*tmp21;
-  F(2, 3) += -tmp25;
-  F(2, 5) += -tmp27*tmp4;
-  F(2, 6) += tmp27*tmp3;
-  F(2, 7) += tmp27*tmp8;
-  F(2, 8) += tmp0*tmp27;
-  F(3, 0) += tmp21*tmp32;
-  F(3, 1) += -tmp24;
-  F(3, 2) += pow(kappa, 2)*tmp25/pow(tmp29, 2);
-  F(3, 3) += tmp31*tmp33;
-  F(3, 4) += tmp25*tmp30*(tmp28*tmp30 - 1);
-  F(3, 5) += -tmp34*tmp4;
-  F(3, 6) += tmp3*tmp34;
-  F(3, 7) += tmp34*tmp8;
-  F(3, 8) += tmp0*tmp34;
-
-  VectorXf Q(15);
-  Q << 4, 0.490000000000000, pow(0.1*v + 0.001, 2), pow(0.15*v + 0.001, 2), pow(0.75*v + 0.001, 2), 0, 0, 0, 0, 0, 0, 0, 0, 0, 1.00000000000000e-6;
-  x_[0] += tmp23;
-  x_[1] += tmp17*tmp18;
-  x_[2] += -tmp33;
-  x_[3] += -tmp24*tmp32;
-
-  P_ = F * P_ * F.transpose();
-  P_.diagonal() += Delta_t * Q;
+  float tmp4 = tmp1*expf(ml_1)*Heaviside(u_M, 1.0F/2.0F);
+  float tmp5 = expf(ml_3);
+  float tmp6 = 0.2F - v;
+  float tmp7 = tmp5*Heaviside(tmp6, 1.0F/2.0F);
+  float tmp8 = tmp0 + tmp3 - tmp4 + tmp7;
+  float tmp9 = Heaviside(Delta_t*tmp8 - v, 1.0F/2.0F);
+  float tmp10 = -v;
+  float tmp11 = Delta_t*tmp8;
+  float tmp12 = Heaviside(-tmp10 - tmp11, 1.0F/2.0F);
+  float tmp13 = Delta_t*tmp12;
+  float tmp14 = tmp13*(tmp2 - tmp5*DiracDelta(tmp6));
+  float tmp15 = -delta + srv_a*u_delta + srv_b;
+  float tmp16 = Delta_t*srv_r;
+  float tmp17 = fabsf(tmp15);
+  float tmp18 = fminf(tmp16, tmp17);
+  float tmp19 = (((tmp15) > 0) - ((tmp15) < 0));
+  float tmp20 = tmp16 - tmp17;
+  float tmp21 = 2*tmp18*DiracDelta(tmp15) + powf(tmp19, 2)*Heaviside(tmp20, 1.0F/2.0F);
+  float tmp22 = sinf(psi_e);
+  float tmp23 = Delta_t*((1.0F/2.0F)*tmp14 + (1.0F/2.0F)*tmp9 - 1);
+  float tmp24 = cosf(psi_e);
+  float tmp25 = fmaxf(tmp10, -tmp11);
+  float tmp26 = Delta_t*((1.0F/2.0F)*tmp25 + v);
+  float tmp27 = tmp24*tmp26;
+  float tmp28 = (1.0F/2.0F)*powf(Delta_t, 2)*tmp12;
+  float tmp29 = tmp22*tmp28;
+  float tmp30 = tmp28*tmp7;
+  float tmp31 = tmp0*tmp28;
+  float tmp32 = kappa*y_e;
+  float tmp33 = tmp32 - 1;
+  float tmp34 = 1.0F/tmp33;
+  float tmp35 = kappa*tmp34;
+  float tmp36 = delta + tmp24*tmp35;
+  float tmp37 = tmp22*tmp26;
+  float tmp38 = tmp28*tmp36;
+
+  float dF0_0 = -tmp14 - tmp9;
+  float dF0_5 = tmp13*tmp4;
+  float dF0_6 = -tmp13*tmp3;
+  float dF0_7 = -tmp13*tmp7;
+  float dF0_8 = -tmp0*tmp13;
+  float dF1_1 = -tmp21;
+  float dF1_9 = tmp21*u_delta;
+  float dF1_10 = tmp21;
+  float dF1_11 = Delta_t*tmp19*Heaviside(-tmp20, 1.0F/2.0F);
+  float dF2_0 = tmp22*tmp23;
+  float dF2_3 = -tmp27;
+  float dF2_5 = -tmp29*tmp4;
+  float dF2_6 = tmp29*tmp3;
+  float dF2_7 = tmp22*tmp30;
+  float dF2_8 = tmp22*tmp31;
+  float dF3_0 = tmp23*tmp36;
+  float dF3_1 = -tmp26;
+  float dF3_2 = powf(kappa, 2)*tmp27/powf(tmp33, 2);
+  float dF3_3 = tmp35*tmp37;
+  float dF3_4 = tmp27*tmp34*(tmp32*tmp34 - 1);
+  float dF3_5 = -tmp38*tmp4;
+  float dF3_6 = tmp3*tmp38;
+  float dF3_7 = tmp30*tmp36;
+  float dF3_8 = tmp31*tmp36;
+
+  x_[0] += tmp25;
+  x_[1] += tmp18*tmp19;
+  x_[2] += -tmp37;
+  x_[3] += -tmp26*tmp36;
+
+  Covariance FP = P_;
+  FP.row(0) += dF0_0 * P_.row(0) + dF0_5 * P_.row(5) + dF0_6 * P_.row(6) + dF0_7 * P_.row(7) + dF0_8 * P_.row(8);
+  FP.row(1) += dF1_1 * P_.row(1) + dF1_9 * P_.row(9) + dF1_10 * P_.row(10) + dF1_11 * P_.row(11);
+  FP.row(2) += dF2_0 * P_.row(0) + dF2_3 * P_.row(3) + dF2_5 * P_.row(5) + dF2_6 * P_.row(6) + dF2_7 * P_.row(7) + dF2_8 * P_.row(8);
+  FP.row(3) += dF3_0 * P_.row(0) + dF3_1 * P_.row(1) + dF3_2 * P_.row(2) + dF3_3 * P_.row(3) + dF3_4 * P_.row(4) + dF3_5 * P_.row(5) + dF3_6 * P_.row(6) + dF3_7 * P_.row(7) + dF3_8 * P_.row(8);
+  P_ = FP;
+  P_.col(0) += dF0_0 * FP.col(0) + dF0_5 * FP.col(5) + dF0_6 * FP.col(6) + dF0_7 * FP.col(7) + dF0_8 * FP.col(8);
+  P_.col(1) += dF1_1 * FP.col(1) + dF1_9 * FP.col(9) + dF1_10 * FP.col(10) + dF1_11 * FP.col(11);
+  P_.col(2) += dF2_0 * FP.col(0) + dF2_3 * FP.col(3) + dF2_5 * FP.col(5) + dF2_6 * FP.col(6) + dF2_7 * FP.col(7) + dF2_8 * FP.col(8);
+  P_.col(3) += dF3_0 * FP.col(0) + dF3_1 * FP.col(1) + dF3_2 * FP.col(2) + dF3_3 * FP.col(3) + dF3_4 * FP.col(4) + dF3_5 * FP.col(5) + dF3_6 * FP.col(6) + dF3_7 * FP.col(7) + dF3_8 * FP.col(8);
+
+  P_(0, 0) += Delta_t * 4;
+  P_(1, 1) += Delta_t * 0.49F;
+  P_(2, 2) += Delta_t * powf(0.1F*v + 0.001F, 2);
+  P_(3, 3) += Delta_t * powf(0.15F*v + 0.001F, 2);
+  P_(4, 4) += Delta_t * powf(0.75F*v + 0.001F, 2);
+  P_(14, 14) += Delta_t * 1.0e-6F;
 }
 
-bool EKF::UpdateCenterline(float a, float b, float c, float y_c, Eigen::MatrixXf Rk) {
+bool EKF::UpdateCenterline(float a, float b, float c, float y_c, const Eigen::Matrix<float, 4, 4> &Rk) {
   float y_e = x_[2];
   float psi_e = x_[3];
   float kappa = x_[4];
-  float tmp0 = a*y_c;
-  float tmp1 = b + 2*tmp0;
-  float tmp2 = pow(tmp1, 2) + 1;
-  float tmp3 = pow(tmp2, -1.0L/2.0L);
-  float tmp4 = a*pow(y_c, 2) + b*y_c + c - tmp1*y_c;
-  float tmp5 = 2*pow(tmp2, -1.5);
-  float tmp6 = 1.0/tmp2;
-  float tmp7 = 2*tmp6;
-  float tmp8 = tmp1*tmp4;
-  float tmp9 = 2*a;
-  float tmp10 = pow(tmp2, -2.5);
-  float tmp11 = 12.0*tmp1*tmp10;
-
-
-  VectorXf yk(3);
-  yk << -tmp3*tmp4 - y_e,
-        -psi_e + atan(tmp1),
-        a*tmp5 - kappa;
-
-  MatrixXf Hk(3, 15);
-  Hk << 0, 0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-        0, 0, 0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-        0, 0, 0, 0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0;
-  MatrixXf Mk(3, 4);
-  Mk << tmp3*y_c*(tmp7*tmp8 + y_c), tmp8/pow(tmp2, 3.0L/2.0L), -tmp3, tmp3*tmp9*(tmp6*tmp8 + y_c),
-        tmp7*y_c, tmp6, 0, a*tmp7,
-        -tmp0*tmp11 + tmp5, -tmp10*tmp9*(3.0*b + 6.0*tmp0), 0, -pow(a, 2)*tmp11;
-  Rk = Mk * Rk * Mk.transpose();
-
-  Eigen::Matrix3f S = Hk * P_ * Hk.transpose() + Rk;
-  MatrixXf K = P_ * Hk.transpose() * S.inverse();
-
-  x_.noalias() += K * yk;
-  P_ = (MatrixXf::Identity(15, 15) - K*Hk) * P_;
+  float tmp0 = 2*y_c;
+  float tmp1 = a*tmp0 + b;
+  float tmp2 = powf(tmp1, 2) + 1;
+  float tmp3 = powf(tmp2, -1.0F/2.0F);
+  float tmp4 = tmp1*y_c;
+  float tmp5 = a*powf(y_c, 2) + b*y_c + c - tmp4;
+  float tmp6 = powf(tmp2, -1.5F);
+  float tmp7 = 1.0F/tmp2;
+  float tmp8 = tmp1*tmp5;
+  float tmp9 = tmp7*tmp8;
+  float tmp10 = 2*a;
+  float tmp11 = powf(tmp2, -2.5F);
+  float tmp12 = 12.0F*tmp11;
+
+  Eigen::Matrix<float, 3, 1> yk;
+  yk << -tmp3*tmp5 - y_e,
+        -psi_e + atanf(tmp1),
+        2*a*tmp6 - kappa;
+
+  Eigen::Matrix<float, 3, 4> Mk;
+  Mk << tmp3*y_c*(2*tmp9 + y_c), tmp8/powf(tmp2, 3.0F/2.0F), -tmp3, tmp10*tmp3*(tmp9 + y_c),
+        tmp0*tmp7, tmp7, 0, tmp10*tmp7,
+        -a*tmp12*tmp4 + 2*tmp6, -tmp10*tmp11*(6.0F*a*y_c + 3.0F*b), 0, -powf(a, 2)*tmp1*tmp12;
+  Eigen::Matrix<float, 3, 3> R = Mk * Rk * Mk.transpose();
+  Eigen::Matrix<float, 3, 3> Hw;
+  Hw << 1, 0, 0,
+        0, 1, 0,
+        0, 0, 1;
+  Eigen::LLT<Eigen::Matrix<float, 3, 3> > llt(R);
+  if (llt.info() != Eigen::Success) {
+    return false;
+  }
+  llt.matrixL().solveInPlace(yk);
+  llt.matrixL().solveInPlace(Hw);
+
+  State dx = State::Zero();
+  State p, k;
+  float s, y;
+
+  p = Hw(0, 0) * P_.col(2) + Hw(0, 1) * P_.col(3) + Hw(0, 2) * P_.col(4);
+  s = Hw(0, 0) * p[2] + Hw(0, 1) * p[3] + Hw(0, 2) * p[4] + 1;
+  y = yk[0];
+  if (!(s > 0)) {
+    x_ += dx;
+    return false;
+  }
+  k = p / s;
+  dx += k * y;
+  P_ -= k * p.transpose() + p * k.transpose();
+  k *= sqrtf(s);
+  P_.noalias() += k * k.transpose();
+
+  p = Hw(1, 0) * P_.col(2) + Hw(1, 1) * P_.col(3) + Hw(1, 2) * P_.col(4);
+  s = Hw(1, 0) * p[2] + Hw(1, 1) * p[3] + Hw(1, 2) * p[4] + 1;
+  y = yk[1] - (Hw(1, 0) * dx[2] + Hw(1, 1) * dx[3] + Hw(1, 2) * dx[4]);
+  if (!(s > 0)) {
+    x_ += dx;
+    return false;
+  }
+  k = p / s;
+  dx += k * y;
+  P_ -= k * p.transpose() + p * k.transpose();
+  k *= sqrtf(s);
+  P_.noalias() += k * k.transpose();
+
+  p = Hw(2, 0) * P_.col(2) + Hw(2, 1) * P_.col(3) + Hw(2, 2) * P_.col(4);
+  s = Hw(2, 0) * p[2] + Hw(2, 1) * p[3] + Hw(2, 2) * p[4] + 1;
+  y = yk[2] - (Hw(2, 0) * dx[2] + Hw(2, 1) * dx[3] + Hw(2, 2) * dx[4]);
+  if (!(s > 0)) {
+    x_ += dx;
+    return false;
+  }
+  k = p / s;
+  dx += k * y;
+  P_ -= k * p.transpose() + p * k.transpose();
+  k *= sqrtf(s);
+  P_.noalias() += k * k.transpose();
+
+  x_ += dx;
   return true;
 }
 
@@ -190,22 +252,29 @@ bool EKF::UpdateIMU(float g_z) {
   float delta = x_[1];
   float o_g = x_[14];
 
-
-  VectorXf yk(1);
+  Eigen::Matrix<float, 1, 1> yk;
   yk << delta*v + g_z - o_g;
 
-  MatrixXf Hk(1, 15);
-  Hk << -delta, -v, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1;
-
-  VectorXf Rk(1);
-  Rk << 0.0100000000000000;
-
-  Eigen::MatrixXf S = Hk * P_ * Hk.transpose();
-  S.diagonal() += Rk;
-  MatrixXf K = P_ * Hk.transpose() * S.inverse();
-
-  x_.noalias() += K * yk;
-  P_ = (MatrixXf::Identity(15, 15) - K*Hk) * P_;
+  float H0_0 = -delta;
+  float H0_1 = -v;
+
+  State dx = State::Zero();
+  State p, k;
+  float s, y;
+
+  p = H0_0 * P_.col(0) + H0_1 * P_.col(1) + P_.col(14);
+  s = H0_0 * p[0] + H0_1 * p[1] + p[14] + 0.01F;
+  y = yk[0];
+  if (!(s > 0)) {
+    x_ += dx;
+    return false;
+  }
+  k = p / s;
+  dx += k * y;
+  k = p / sqrtf(s);
+  P_.noalias() -= k * k.transpose();
+
+  x_ += dx;
   return true;
 }
 
@@ -215,24 +284,42 @@ bool EKF::UpdateEncoders(float dsdt, float fb_delta) {
   float srvfb_a = x_[12];
   float srvfb_b = x_[13];
 
-
-  VectorXf yk(2);
-  yk << dsdt - 63.0316606304536*v,
+  Eigen::Matrix<float, 2, 1> yk;
+  yk << dsdt - 63.0316606F*v,
         -delta*srvfb_a + fb_delta - srvfb_b;
 
-  MatrixXf Hk(2, 15);
-  Hk << 63.0316606304536, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-        0, srvfb_a, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, delta, 1, 0;
-
-  VectorXf Rk(2);
-  Rk << 14400, 49;
-
-  Eigen::Matrix2f S = Hk * P_ * Hk.transpose();
-  S.diagonal() += Rk;
-  MatrixXf K = P_ * Hk.transpose() * S.inverse();
-
-  x_.noalias() += K * yk;
-  P_ = (MatrixXf::Identity(15, 15) - K*Hk) * P_;
+  float H1_1 = srvfb_a;
+  float H1_12 = delta;
+
+  State dx = State::Zero();
+  State p, k;
+  float s, y;
+
+  p = 63.0316606F * P_.col(0);
+  s = 63.0316606F * p[0] + 14400;
+  y = yk[0];
+  if (!(s > 0)) {
+    x_ += dx;
+    return false;
+  }
+  k = p / s;
+  dx += k * y;
+  k = p / sqrtf(s);
+  P_.noalias() -= k * k.transpose();
+
+  p = H1_1 * P_.col(1) + H1_12 * P_.col(12) + P_.col(13);
+  s = H1_1 * p[1] + H1_12 * p[12] + p[13] + 49;
+  y = yk[1] - (H1_1 * dx[1] + H1_12 * dx[12] + dx[13]);
+  if (!(s > 0)) {
+    x_ += dx;
+    return false;
+  }
+  k = p / s;
+  dx += k * y;
+  k = p / sqrtf(s);
+  P_.noalias() -= k * k.transpose();
+
+  x_ += dx;
   return true;
 }
 
@@ -7,22 +7,27 @@
 
 class EKF {
  public:
+  typedef Eigen::Matrix<float, 15, 1> State;
+  typedef Eigen::Matrix<float, 15, 15> Covariance;
+
   EKF();
-  
+
   void Reset();
 
   void Predict(float Delta_t, float u_M, float u_delta);
-  bool UpdateCenterline(float a, float b, float c, float y_c, Eigen::MatrixXf Rk);
+  bool UpdateCenterline(float a, float b, float c, float y_c, const Eigen::Matrix<float, 4, 4> &Rk);
   bool UpdateIMU(float g_z);
   bool UpdateEncoders(float dsdt, float fb_delta);
 
 
-  Eigen::VectorXf& GetState() { return x_; }
-  Eigen::MatrixXf& GetCovariance() { return P_; }
+  State& GetState() { return x_; }
+  Covariance& GetCovariance() { return P_; }
+
+  EIGEN_MAKE_ALIGNED_OPERATOR_NEW
 
  private:
-  Eigen::VectorXf x_;
-  Eigen::MatrixXf P_;
+  State x_;
+  Covariance P_;
 };
 
 #endif  // MODEL_EKF_H_
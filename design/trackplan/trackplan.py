@@ -1,4 +1,6 @@
 # racetrack route planner
+# (superseded for track generation by src/drive/trackplan, which optimizes
+# the radii and writes track.bin)
 # based on apex cone locations and track widths, get a 
 import numpy as np
 
@@ -0,0 +1,411 @@
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "coneslam/fastslam.h"
+#include "coneslam/posestats.h"
+#include "coneslam/rng.h"
+
+namespace coneslam {
+
+// same motion model as Localizer
+const float NOISE_ANGULAR = 0.008;
+const float NOISE_LONG = 16;
+const float NOISE_LAT = 8;
+
+// if no landmark in a particle's map explains a measurement with
+// log-likelihood better than this, it creates a new one NEW_LM_DIST ticks
+// away along the bearing
+const float NEW_LM_THRESH = -2.8;
+const float NEW_LM_DIST = 300;
+
+// the range to a new landmark is a guess, but its bearing isn't, so its
+// covariance is stretched along the ray rather than round: NEW_LM_COV along
+// it, and the bearing variance at NEW_LM_DIST across it. A round one is
+// wide enough across the ray to take sightings of neighbouring cones, and
+// the map comes out distorted.
+const float NEW_LM_COV = 300*300;
+
+// a new landmark is provisional until it's been seen MIN_SIGHTINGS times;
+// it's left out of the map until then, and its slot is reused once it's
+// gone unseen for PROVISIONAL_UPDATES. Real cones are seen hundreds of
+// times a run; false detections and duplicates only a handful.
+const int MIN_SIGHTINGS = 20;
+const int PROVISIONAL_UPDATES = 300;
+
+// resample when the effective number of particles falls below this
+// fraction of them
+const float RESAMPLE_NEFF = 0.5;
+
+// covariance of landmarks loaded from an initial map
+const float INIT_LM_COV = 10*10;
+
+FastSLAM::FastSLAM(int n_particles, int max_landmarks) {
+  n_particles_ = n_particles;
+  max_landmarks_ = max_landmarks;
+  particles_ = new Particle[n_particles];
+  newparticles_ = new Particle[n_particles];
+  pmap_ = new int[n_particles];
+  newpmap_ = new int[n_particles];
+  LL_ = new float[n_particles];
+  logw_ = new float[n_particles];
+
+  // every particle references exactly one map, so there can never be more
+  // than n_particles live maps
+  maps_ = new LandmarkEKF[n_particles * max_landmarks];
+  map_nlm_ = new int[n_particles];
+  map_refs_ = new int[n_particles];
+  freemaps_ = new int[n_particles];
+  n_freemaps_ = n_particles;
+  for (int i = 0; i < n_particles; i++) {
+    map_refs_[i] = 0;
+    freemaps_[i] = n_particles - 1 - i;
+  }
+  for (int i = 0; i < n_particles; i++) {
+    pmap_[i] = -1;
+  }
+
+  initmap_ = new LandmarkEKF[max_landmarks];
+  n_initmap_ = 0;
+  bestlandmarks_ = new Landmark[max_landmarks];
+  n_bestlandmarks_ = 0;
+
+  Seed(0);
+  Reset();
+}
+
+FastSLAM::~FastSLAM() {
+  delete[] particles_;
+  delete[] newparticles_;
+  delete[] pmap_;
+  delete[] newpmap_;
+  delete[] LL_;
+  delete[] logw_;
+  delete[] maps_;
+  delete[] map_nlm_;
+  delete[] map_refs_;
+  delete[] freemaps_;
+  delete[] initmap_;
+  delete[] bestlandmarks_;
+}
+
+void FastSLAM::Seed(uint64_t seed) {
+  uint64_t x = seed;
+  rng_ = splitmix64(&x) | 1;
+}
+
+int FastSLAM::AllocMap() {
+  // can't fail; see constructor
+  int m = freemaps_[--n_freemaps_];
+  map_refs_[m] = 1;
+  return m;
+}
+
+void FastSLAM::ReleaseMap(int m) {
+  if (--map_refs_[m] == 0) {
+    freemaps_[n_freemaps_++] = m;
+  }
+}
+
+int FastSLAM::WritableMap(int i) {
+  int m = pmap_[i];
+  if (map_refs_[m] == 1) {
+    return m;
+  }
+  int newm = AllocMap();
+  memcpy(maps_ + newm*max_landmarks_, maps_ + m*max_landmarks_,
+      map_nlm_[m] * sizeof(LandmarkEKF));
+  map_nlm_[newm] = map_nlm_[m];
+  map_refs_[m]--;
+  pmap_[i] = newm;
+  return newm;
+}
+
+void FastSLAM::Reset() {
+  for (int i = 0; i < n_particles_; i++) {
+    if (pmap_[i] != -1) {
+      ReleaseMap(pmap_[i]);
+    }
+  }
+
+  // everyone starts out sharing the initial map
+  int m = AllocMap();
+  memcpy(maps_ + m*max_landmarks_, initmap_, n_initmap_ * sizeof(LandmarkEKF));
+  map_nlm_[m] = n_initmap_;
+  map_refs_[m] = n_particles_;
+
+  for (int i = 0; i < n_particles_; i++) {
+    pmap_[i] = m;
+    logw_[i] = 0;
+    if (n_initmap_ > 0) {
+      // scatter around the starting line, as in Localizer
+      particles_[i].x = 12*randn(&rng_);
+      particles_[i].y = 12*randn(&rng_);
+      particles_[i].theta = randn(&rng_) * 0.2;
+    } else {
+      // with no map, the starting pose defines the coordinate system
+      particles_[i].x = 0;
+      particles_[i].y = 0;
+      particles_[i].theta = 0;
+    }
+  }
+
+  memset(&estimate_, 0, sizeof(estimate_));
+  if (n_initmap_ > 0) {
+    estimate_.cov[0][0] = estimate_.cov[1][1] = 12*12;
+    estimate_.cov[2][2] = 0.2*0.2;
+  }
+  estimate_.R = 1;
+  estimate_.multimodal = false;
+
+  updates_ = 0;
+  n_bestlandmarks_ = n_initmap_;
+  for (int j = 0; j < n_initmap_; j++) {
+    bestlandmarks_[j].x = initmap_[j].x;
+    bestlandmarks_[j].y = initmap_[j].y;
+  }
+}
+
+bool FastSLAM::LoadLandmarks(const char *filename) {
+  n_initmap_ = 0;
+
+  FILE *fp = fopen(filename, "r");
+  if (!fp) {
+    perror(filename);
+    return false;
+  }
+
+  int n;
+  if (fscanf(fp, "%d\n", &n) != 1) {
+    fprintf(stderr, "unable to read number of landmarks from %s\n", filename);
+    fclose(fp);
+    return false;
+  }
+  if (n > max_landmarks_) {
+    fprintf(stderr, "%s: %d landmarks, only using the first %d\n", filename,
+        n, max_landmarks_);
+    n = max_landmarks_;
+  }
+  for (int i = 0; i < n; i++) {
+    LandmarkEKF &l = initmap_[i];
+    if (fscanf(fp, "%f %f\n", &l.x, &l.y) != 2) {
+      fprintf(stderr, "unable to read landmark #%d from %s\n", i, filename);
+      fclose(fp);
+      return false;
+    }
+    l.p11 = INIT_LM_COV;
+    l.p12 = 0;
+    l.p22 = INIT_LM_COV;
+    l.seen = MIN_SIGHTINGS;
+    l.last_seen = 0;
+  }
+  fclose(fp);
+  n_initmap_ = n;
+
+  Reset();
+  return true;
+}
+
+bool FastSLAM::SaveLandmarks(const char *filename) const {
+  FILE *fp = fopen(filename, "w");
+  if (!fp) {
+    perror(filename);
+    return false;
+  }
+  fprintf(fp, "%d\n", n_bestlandmarks_);
+  for (int j = 0; j < n_bestlandmarks_; j++) {
+    fprintf(fp, "%f %f\n", bestlandmarks_[j].x, bestlandmarks_[j].y);
+  }
+  fclose(fp);
+  return true;
+}
+
+void FastSLAM::Predict(float ds, float w, float dt) {
+  PoseStatsRef ref;
+  PredictStatsRef(estimate_, ds, w, dt, &ref);
+  PoseStats stats;
+  stats.Clear();
+  for (int i = 0; i < n_particles_; i++) {
+    Particle &p = particles_[i];
+    float t = p.theta + w*dt + randn(&rng_)*NOISE_ANGULAR*ds*dt;
+    float S = sin((p.theta + t)*0.5);
+    float C = cos((p.theta + t)*0.5);
+
+    float dx = ds + randn(&rng_)*NOISE_LONG*ds*dt;
+    float dy = randn(&rng_)*NOISE_LAT*ds*dt;
+
+    p.x += dx*C - dy*S;
+    p.y += dx*S + dy*C;
+    p.theta = t;
+    stats.Add(ref, exp(logw_[i]), p);
+  }
+  stats.Finish(ref, &estimate_);
+}
+
+void FastSLAM::UpdateLM(float lm_bearing, float precision) {
+  float r = 1.0f / precision;  // bearing measurement variance
+  float LLmax = -1e6;
+  updates_++;
+  int besti = 0;
+
+  for (int i = 0; i < n_particles_; i++) {
+    const Particle &p = particles_[i];
+    float S = sin(p.theta),
+          C = cos(p.theta);
+
+    // find the maximum likelihood landmark; the expressions below are
+    // generated in design/coneslam/rbekf.ipynb and copied from pfrb.py
+    int m = pmap_[i];
+    const LandmarkEKF *lms = maps_ + m*max_landmarks_;
+    float bestLL = -1e6, besty = 0, bestS = 1, bestH1 = 0, bestH2 = 0;
+    int bestj = -1;
+    for (int j = 0; j < map_nlm_[m]; j++) {
+      const LandmarkEKF &l = lms[j];
+      float k1 = l.x - p.x;
+      float k2 = S*k1;
+      float k4 = l.y - p.y;
+      float k5 = C*k4;
+      float k6 = k2 - k5;
+      float k7 = S*k4 + k1*C;
+      float y = lm_bearing - atan2f(k6, k7);
+      if (y > M_PI) y -= 2*M_PI;
+      if (y < -M_PI) y += 2*M_PI;
+      float k9 = 1.0f / (k6*k6 + k7*k7);
+      float k10 = k7*k9;
+      float k11 = k9*(k5 - k2);
+      float H1 = S*k10 + k11*C;
+      float H2 = S*k11 - k10*C;
+      float Sk = H1*(H1*l.p11 + H2*l.p12) + H2*(H1*l.p12 + H2*l.p22) + r;
+      float LL = -0.5f*logf(4*M_PI*M_PI*Sk) - y*y/Sk;
+      if (LL > bestLL) {
+        bestLL = LL;
+        bestj = j;
+        besty = y;
+        bestS = Sk;
+        bestH1 = H1;
+        bestH2 = H2;
+      }
+    }
+
+    if (bestj != -1 && bestLL > NEW_LM_THRESH) {
+      // EKF update of the landmark position
+      m = WritableMap(i);
+      LandmarkEKF &l = maps_[m*max_landmarks_ + bestj];
+      float H1 = bestH1, H2 = bestH2;
+      float k0 = 1.0f / bestS;
+      float k1 = H2*l.p12;
+      float k2 = k0*(H1*l.p11 + k1);
+      float k3 = H1*l.p12;
+      float k4 = H2*l.p22;
+      float k5 = k0*(k3 + k4);
+      float k6 = H1*k2 - 1;
+      l.x += k2*besty;
+      l.y += k5*besty;
+      float p11 = -k1*k2 - k6*l.p11;
+      float p12 = -k2*k4 - k6*l.p12;
+      float p22 = -k3*k5 - l.p22*(H2*k5 - 1);
+      l.p11 = p11;
+      l.p12 = p12;
+      l.p22 = p22;
+      l.seen++;
+      l.last_seen = updates_;
+    } else {
+      // nothing explains this cone; must be a new one, in place of a stale
+      // provisional one if there is one
+      int k = map_nlm_[m];
+      for (int j = 0; j < map_nlm_[m]; j++) {
+        if (lms[j].seen < MIN_SIGHTINGS &&
+            updates_ - lms[j].last_seen > PROVISIONAL_UPDATES) {
+          k = j;
+          break;
+        }
+      }
+      if (k < max_landmarks_) {
+        m = WritableMap(i);
+        if (k == map_nlm_[m]) {
+          map_nlm_[m]++;
+        }
+        LandmarkEKF &l = maps_[m*max_landmarks_ + k];
+        float C = cos(p.theta - lm_bearing), S = sin(p.theta - lm_bearing);
+        float vt = NEW_LM_DIST*NEW_LM_DIST*r;
+        l.x = p.x + C*NEW_LM_DIST;
+        l.y = p.y + S*NEW_LM_DIST;
+        l.p11 = NEW_LM_COV*C*C + vt*S*S;
+        l.p12 = (NEW_LM_COV - vt)*C*S;
+        l.p22 = NEW_LM_COV*S*S + vt*C*C;
+        l.seen = 1;
+        l.last_seen = updates_;
+      }
+      if (bestj == -1) {
+        bestLL = NEW_LM_THRESH;
+      }
+    }
+
+    logw_[i] += bestLL;
+    if (logw_[i] > LLmax) {
+      LLmax = logw_[i];
+      besti = i;
+    }
+  }
+
+  // remember the likeliest map for display / saving
+  {
+    const LandmarkEKF *lms = maps_ + pmap_[besti]*max_landmarks_;
+    n_bestlandmarks_ = 0;
+    for (int j = 0; j < map_nlm_[pmap_[besti]]; j++) {
+      if (lms[j].seen >= MIN_SIGHTINGS) {
+        bestlandmarks_[n_bestlandmarks_].x = lms[j].x;
+        bestlandmarks_[n_bestlandmarks_].y = lms[j].y;
+        n_bestlandmarks_++;
+      }
+    }
+  }
+
+  // the estimate comes from the weighted particles; they're only resampled
+  // once the weights have degenerated, as resampling throws away the
+  // diversity in the particles' maps which lets a bad one be corrected
+  PoseStatsRef ref;
+  PredictStatsRef(estimate_, 0, 0, 0, &ref);
+  PoseStats stats;
+  stats.Clear();
+  float totalP = 0, totalP2 = 0;
+  for (int i = 0; i < n_particles_; i++) {
+    logw_[i] -= LLmax;
+    float wt = exp(logw_[i]);
+    stats.Add(ref, wt, particles_[i]);
+    totalP += wt;
+    totalP2 += wt*wt;
+    LL_[i] = totalP;
+  }
+  stats.Finish(ref, &estimate_);
+  if (totalP*totalP > RESAMPLE_NEFF*n_particles_*totalP2) {
+    return;
+  }
+
+  // systematic resampling; maps are shared by reference, not copied
+  float deltaP = totalP / n_particles_;
+  float r0 = rng_uniform(&rng_);
+  int j = 0;
+  for (int i = 0; i < n_particles_; i++) {
+    float u = (r0 + i) * deltaP;
+    while (j < n_particles_ - 1 && LL_[j] <= u) {
+      j++;
+    }
+    newparticles_[i] = particles_[j];
+    newpmap_[i] = pmap_[j];
+    map_refs_[pmap_[j]]++;
+    logw_[i] = 0;
+  }
+  for (int i = 0; i < n_particles_; i++) {
+    ReleaseMap(pmap_[i]);
+  }
+
+  Particle *newp = newparticles_;
+  newparticles_ = particles_;
+  particles_ = newp;
+  int *newpmap = newpmap_;
+  newpmap_ = pmap_;
+  pmap_ = newpmap;
+}
+
+}  // namespace coneslam
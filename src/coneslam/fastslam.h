@@ -0,0 +1,97 @@
+#ifndef CONESLAM_FASTSLAM_H_
+#define CONESLAM_FASTSLAM_H_
+
+#include <stdint.h>
+
+#include "coneslam/localize.h"
+
+namespace coneslam {
+
+// landmark position estimate with 2x2 covariance [p11 p12; p12 p22], how
+// many times it's been seen, and the update it was last seen on
+struct LandmarkEKF {
+  float x, y;
+  float p11, p12, p22;
+  int seen, last_seen;
+};
+
+// Rao-Blackwellized particle filter (FastSLAM 1.0) which learns cone
+// positions as it goes; C++ port of design/coneslam/pfrb.py.
+//
+// Each particle carries its own landmark map, one 2x2 EKF per cone. Maps are
+// reference counted and shared copy-on-write, so resampling only copies map
+// indices; a map is cloned the first time a particle sharing it updates it.
+// All map storage is preallocated, so nothing is allocated per frame.
+class FastSLAM: public PoseEstimator {
+ public:
+  FastSLAM(int n_particles, int max_landmarks);
+  ~FastSLAM();
+
+  void Seed(uint64_t seed);
+
+  // load an initial map (lm.txt format), e.g. a rough survey; the positions
+  // are refined online and new landmarks are still added as they're seen
+  bool LoadLandmarks(const char *filename);
+  // write the map of the most likely particle in lm.txt format
+  bool SaveLandmarks(const char *filename) const;
+
+  // put all particles near the origin with the initial map
+  virtual void Reset();
+
+  virtual void Predict(float ds, float w, float dt);
+  // associate bearing with each particle's most likely landmark and update
+  // its EKF, or create a new landmark if none is likely enough; then resample
+  virtual void UpdateLM(float lm_bearing, float precision);
+
+  virtual bool GetPoseEstimate(PoseEstimate *est) const {
+    *est = estimate_;
+    return true;
+  }
+
+  // the map of the most likely particle as of the last update, leaving out
+  // landmarks too new to be sure of
+  virtual const Landmark *GetLandmarks() const { return bestlandmarks_; }
+  virtual int NumLandmarks() const { return n_bestlandmarks_; }
+
+  virtual const Particle *GetParticles() const { return particles_; }
+  virtual int NumParticles() const { return n_particles_; }
+
+ private:
+  int AllocMap();
+  void ReleaseMap(int m);
+  // return a map index for particle i which is safe to modify
+  int WritableMap(int i);
+
+  int n_particles_;
+  int max_landmarks_;
+  Particle *particles_;
+  Particle *newparticles_;
+  int *pmap_;     // map index for each particle
+  int *newpmap_;
+  float *LL_;
+  // log importance weights, accumulated between resamplings
+  float *logw_;
+
+  // map pool: n_particles_ maps of max_landmarks_ landmarks each
+  LandmarkEKF *maps_;
+  int *map_nlm_;
+  int *map_refs_;
+  int *freemaps_;
+  int n_freemaps_;
+
+  // initial map, from LoadLandmarks
+  LandmarkEKF *initmap_;
+  int n_initmap_;
+
+  Landmark *bestlandmarks_;
+  int n_bestlandmarks_;
+
+  PoseEstimate estimate_;
+
+  int updates_;  // UpdateLM calls since Reset
+  uint64_t rng_;
+};
+
+}  // namespace coneslam
+
+#endif  // CONESLAM_FASTSLAM_H_
@@ -0,0 +1,221 @@
+#include <math.h>
+#include <stdio.h>
+#include <sys/time.h>
+#include "coneslam/fastslam.h"
+
+using coneslam::FastSLAM;
+using coneslam::Landmark;
+using coneslam::Particle;
+
+// replay the localize_test log with no prior map, then line the learned map
+// up with the surveyed one by the best rigid transform and check that every
+// cone was learned once, close to where it really is
+
+const char *testdata_file = "../src/coneslam/testdata/194625.txt";
+const char *lm_file = "../src/coneslam/testdata/lm.txt";
+
+const int MAX_LM = 32;
+// in encoder ticks; the cones are at least 160 apart
+const float MAX_RMS = 60;
+const float MAX_RESIDUAL = 120;
+
+struct Fit {
+  float theta, tx, ty;
+  float rms, worst;
+  int match[MAX_LM];  // surveyed landmark for each learned one
+};
+
+static void Transform(const Fit &f, const Landmark &l, float *x, float *y) {
+  float S = sin(f.theta), C = cos(f.theta);
+  *x = C*l.x - S*l.y + f.tx;
+  *y = S*l.x + C*l.y + f.ty;
+}
+
+// pair up each learned landmark with a surveyed one, closest pairs first,
+// under the current transform; then solve for the rigid transform which
+// best fits those pairs
+static void Refine(const Landmark *learned, int nl, const Landmark *survey,
+    int ns, Fit *f) {
+  bool lused[MAX_LM] = {false}, sused[MAX_LM] = {false};
+  float lx[MAX_LM], ly[MAX_LM];
+  for (int i = 0; i < nl; i++) {
+    Transform(*f, learned[i], &lx[i], &ly[i]);
+    f->match[i] = -1;
+  }
+  for (int k = 0; k < nl && k < ns; k++) {
+    int bi = -1, bj = -1;
+    float bd = 1e30;
+    for (int i = 0; i < nl; i++) {
+      for (int j = 0; j < ns && !lused[i]; j++) {
+        float dx = lx[i] - survey[j].x, dy = ly[i] - survey[j].y;
+        if (!sused[j] && dx*dx + dy*dy < bd) {
+          bd = dx*dx + dy*dy;
+          bi = i;
+          bj = j;
+        }
+      }
+    }
+    lused[bi] = sused[bj] = true;
+    f->match[bi] = bj;
+  }
+
+  // 2D Kabsch: centroids, then the rotation from the cross-covariance
+  float mlx = 0, mly = 0, msx = 0, msy = 0;
+  int n = 0;
+  for (int i = 0; i < nl; i++) {
+    if (f->match[i] == -1) continue;
+    mlx += learned[i].x;
+    mly += learned[i].y;
+    msx += survey[f->match[i]].x;
+    msy += survey[f->match[i]].y;
+    n++;
+  }
+  mlx /= n; mly /= n; msx /= n; msy /= n;
+  float sxx = 0, sxy = 0;
+  for (int i = 0; i < nl; i++) {
+    if (f->match[i] == -1) continue;
+    float ax = learned[i].x - mlx, ay = learned[i].y - mly;
+    float bx = survey[f->match[i]].x - msx, by = survey[f->match[i]].y - msy;
+    sxx += ax*bx + ay*by;
+    sxy += ax*by - ay*bx;
+  }
+  f->theta = atan2(sxy, sxx);
+  float S = sin(f->theta), C = cos(f->theta);
+  f->tx = msx - (C*mlx - S*mly);
+  f->ty = msy - (S*mlx + C*mly);
+
+  float ss = 0;
+  f->worst = 0;
+  for (int i = 0; i < nl; i++) {
+    if (f->match[i] == -1) continue;
+    float x, y;
+    Transform(*f, learned[i], &x, &y);
+    float d2 = (x - survey[f->match[i]].x) * (x - survey[f->match[i]].x) +
+      (y - survey[f->match[i]].y) * (y - survey[f->match[i]].y);
+    ss += d2;
+    if (d2 > f->worst * f->worst) {
+      f->worst = sqrt(d2);
+    }
+  }
+  f->rms = sqrt(ss / n);
+}
+
+// the map is only learned up to a rigid transform, so try lining up every
+// pair of learned landmarks with every pair of surveyed ones about as far
+// apart, refine each, and keep the best
+static Fit Align(const Landmark *learned, int nl, const Landmark *survey,
+    int ns) {
+  Fit best;
+  best.rms = 1e30;
+  for (int i = 0; i < nl; i++) {
+    for (int j = 0; j < nl; j++) {
+      if (i == j) continue;
+      float ldx = learned[j].x - learned[i].x;
+      float ldy = learned[j].y - learned[i].y;
+      for (int a = 0; a < ns; a++) {
+        for (int b = 0; b < ns; b++) {
+          if (a == b) continue;
+          float sdx = survey[b].x - survey[a].x;
+          float sdy = survey[b].y - survey[a].y;
+          float ld = sqrt(ldx*ldx + ldy*ldy), sd = sqrt(sdx*sdx + sdy*sdy);
+          if (fabs(ld - sd) > 2 * MAX_RESIDUAL) continue;
+          Fit f;
+          f.theta = atan2(sdy, sdx) - atan2(ldy, ldx);
+          float S = sin(f.theta), C = cos(f.theta);
+          f.tx = survey[a].x - (C*learned[i].x - S*learned[i].y);
+          f.ty = survey[a].y - (S*learned[i].x + C*learned[i].y);
+          for (int iter = 0; iter < 5; iter++) {
+            Refine(learned, nl, survey, ns, &f);
+          }
+          if (f.rms < best.rms) {
+            best = f;
+          }
+        }
+      }
+    }
+  }
+  return best;
+}
+
+int main() {
+  FastSLAM slam(1000, MAX_LM);
+
+  FILE *fp = fopen(testdata_file, "r");
+  if (!fp) {
+    perror(testdata_file);
+    return 1;
+  }
+
+  timeval t0, t1;
+  gettimeofday(&t0, NULL);
+  Particle p;
+  float dt, ds, w;
+  int nLM;
+  int frame = 0;
+  while (fscanf(fp, "%f %f %f %d\n", &dt, &ds, &w, &nLM) == 4) {
+    slam.Predict(ds, w, dt);
+    for (int j = 0; j < nLM; j++) {
+      float lm_bearing;
+      fscanf(fp, "%f\n", &lm_bearing);
+      slam.UpdateLM(lm_bearing, 10);
+    }
+    slam.GetLocationEstimate(&p);
+    printf("%d: %f %f %f (%d landmarks)\n", frame++, p.x, p.y, p.theta,
+        slam.NumLandmarks());
+  }
+  fclose(fp);
+  gettimeofday(&t1, NULL);
+  double t = t1.tv_sec - t0.tv_sec + (t1.tv_usec - t0.tv_usec) * 1e-6;
+  printf("%f ms/frame\n", 1000 * t / frame);
+
+  Landmark survey[MAX_LM];
+  int ns = 0;
+  fp = fopen(lm_file, "r");
+  if (!fp) {
+    perror(lm_file);
+    return 1;
+  }
+  if (fscanf(fp, "%d\n", &ns) != 1 || ns > MAX_LM) {
+    fprintf(stderr, "%s: bad landmark count\n", lm_file);
+    return 1;
+  }
+  for (int i = 0; i < ns; i++) {
+    if (fscanf(fp, "%f %f\n", &survey[i].x, &survey[i].y) != 2) {
+      fprintf(stderr, "%s: can't read landmark #%d\n", lm_file, i);
+      return 1;
+    }
+  }
+  fclose(fp);
+
+  const Landmark *learned = slam.GetLandmarks();
+  int nl = slam.NumLandmarks();
+  if (nl < 2) {
+    printf("FAIL: learned %d landmarks\n", nl);
+    return 1;
+  }
+  Fit f = Align(learned, nl, survey, ns);
+  printf("learned landmarks, aligned (rotated %f, moved %f %f):\n",
+      f.theta, f.tx, f.ty);
+  for (int i = 0; i < nl; i++) {
+    float x, y;
+    Transform(f, learned[i], &x, &y);
+    if (f.match[i] == -1) {
+      printf("  %f %f unmatched\n", x, y);
+    } else {
+      printf("  %f %f surveyed at %f %f\n", x, y, survey[f.match[i]].x,
+          survey[f.match[i]].y);
+    }
+  }
+  printf("rms residual %f, worst %f\n", f.rms, f.worst);
+
+  int failures = 0;
+  if (nl != ns) {
+    printf("FAIL: learned %d landmarks; %d were surveyed\n", nl, ns);
+    failures++;
+  }
+  if (f.rms > MAX_RMS || f.worst > MAX_RESIDUAL) {
+    printf("FAIL: learned map doesn't fit the survey\n");
+    failures++;
+  }
+  return failures ? 1 : 0;
+}
@@ -1,7 +1,11 @@
 #include <math.h>
 #include <stdio.h>
+#include <string.h>
 
 #include "coneslam/localize.h"
+#include "coneslam/posestats.h"
+#include "coneslam/rng.h"
+#include "util/workerpool.h"
 
 namespace coneslam {
 
@@ -13,27 +17,99 @@ const float NOISE_ANGULAR = 0.008;
 const float NOISE_LONG = 16;
 const float NOISE_LAT = 8;
 
-static double randn() {
-  // #include <random> doesn't work in my ARM cross-compiler so I'm just
-  // doing something dumb here
-  // it's slightly heavier-tailed than a gaussian and cuts off at -6..6, but
-  // that's OK
-  double n = drand48();
-  for (int i = 1; i < 6; i++) n += drand48();
-  return 2*n - 6;
+// KLD-sampling parameters (Fox, "Adapting the Sample Size in Particle
+// Filters Through KLD-Sampling"): choose the number of particles so that
+// the K-L divergence between the sampled and true posterior is < KLD_EPSILON
+// with probability 1 - delta
+const float KLD_EPSILON = 0.1;
+const float KLD_Z = 2.326;  // upper quantile of N(0, 1) for delta = 0.01
+const float KLD_BIN_XY = 40;  // bin size in encoder ticks (~80cm)
+const int KLD_BINS_THETA = 16;  // must be a power of 2
+
+// particles are processed in blocks of this size; each block has its own
+// random number stream and partial sums
+const int BLOCK_SIZE = 64;
+
+void Localizer::Init(int min_particles, int max_particles) {
+  min_particles_ = min_particles;
+  max_particles_ = max_particles;
+  n_particles_ = max_particles;
+  particles_ = new Particle[max_particles];
+  newparticles_ = new Particle[max_particles];
+  LL_ = new float[max_particles];
+  cum_ = new float[max_particles];
+
+  pool_ = NULL;
+  int nblocks = NumBlocks(max_particles);
+  blockrng_ = new uint64_t[nblocks];
+  blockaccum_ = new float[nblocks];
+  blockstats_ = new PoseStats[nblocks];
+
+  // keep the bin hash table at most half full
+  uint32_t binsize = 1;
+  while (binsize < 2u * max_particles) {
+    binsize <<= 1;
+  }
+  bins_ = new uint32_t[binsize];
+  binmask_ = binsize - 1;
+  n_bins_ = 0;
+
+  n_landmarks_ = 0;
+  landmarks_ = NULL;
+  Seed(0);
+  Reset();
 }
 
 Localizer::~Localizer() {
   delete[] particles_;
+  delete[] newparticles_;
+  delete[] LL_;
+  delete[] cum_;
+  delete[] blockrng_;
+  delete[] blockaccum_;
+  delete[] blockstats_;
+  delete[] bins_;
   delete[] landmarks_;
 }
 
+void Localizer::Seed(uint64_t seed) {
+  uint64_t x = seed;
+  rng_ = splitmix64(&x) | 1;
+  for (int b = 0; b < NumBlocks(max_particles_); b++) {
+    blockrng_[b] = splitmix64(&x) | 1;  // xorshift state must be nonzero
+  }
+}
+
+int Localizer::NumBlocks(int n) const {
+  return (n + BLOCK_SIZE - 1) / BLOCK_SIZE;
+}
+
+void Localizer::ParallelFor(void (*fn)(void *arg, int block), void *arg,
+    int nblocks) {
+  if (pool_) {
+    pool_->Run(fn, arg, nblocks);
+  } else {
+    for (int b = 0; b < nblocks; b++) {
+      fn(arg, b);
+    }
+  }
+}
+
 void Localizer::Reset() {
+  n_particles_ = max_particles_;
   for (int i = 0; i < n_particles_; i++) {
-    particles_[i].x = 12*randn();
-    particles_[i].y = 12*randn();
-    particles_[i].theta = randn() * 0.2;
+    uint64_t *rng = &blockrng_[i / BLOCK_SIZE];
+    particles_[i].x = 12*randn(rng);
+    particles_[i].y = 12*randn(rng);
+    particles_[i].theta = randn(rng) * 0.2;
   }
+
+  // the distribution we just drew from
+  memset(&estimate_, 0, sizeof(estimate_));
+  estimate_.cov[0][0] = estimate_.cov[1][1] = 12*12;
+  estimate_.cov[2][2] = 0.2*0.2;
+  estimate_.R = 1;
+  estimate_.multimodal = false;
 }
 
 bool Localizer::LoadLandmarks(const char *filename) {
@@ -62,115 +138,290 @@ bool Localizer::LoadLandmarks(const char *filename) {
   return true;
 }
 
-void Localizer::Predict(float ds, float w, float dt) {
-  for (int i = 0; i < n_particles_; i++) {
-    float t = particles_[i].theta + w*dt + randn()*NOISE_ANGULAR*ds*dt;
-    float S = sin((particles_[i].theta + t)*0.5);
-    float C = cos((particles_[i].theta + t)*0.5);
+namespace {
+
+struct PredictArgs {
+  Localizer *self;
+  float ds, w, dt;
+  PoseStatsRef ref;
+};
+
+struct UpdateArgs {
+  Localizer *self;
+  PoseStatsRef ref;
+  float lm_bearing, precision;
+  float LLmax;
+  float r, deltaP;  // systematic resampling offset and step
+  int n_new;
+};
+
+}  // empty namespace
+
+void Localizer::PredictTask(void *arg, int block) {
+  const PredictArgs &a = *reinterpret_cast<PredictArgs*>(arg);
+  Localizer *l = a.self;
+  uint64_t *rng = &l->blockrng_[block];
+  float ds = a.ds, w = a.w, dt = a.dt;
+  PoseStats stats;
+  stats.Clear();
+  int i1 = block*BLOCK_SIZE + BLOCK_SIZE;
+  if (i1 > l->n_particles_) i1 = l->n_particles_;
+  for (int i = block*BLOCK_SIZE; i < i1; i++) {
+    Particle &p = l->particles_[i];
+    float t = p.theta + w*dt + randn(rng)*NOISE_ANGULAR*ds*dt;
+    float S = sin((p.theta + t)*0.5);
+    float C = cos((p.theta + t)*0.5);
 
-    float dx = ds + randn()*NOISE_LONG*ds*dt;
-    float dy = randn()*NOISE_LAT*ds*dt;
+    float dx = ds + randn(rng)*NOISE_LONG*ds*dt;
+    float dy = randn(rng)*NOISE_LAT*ds*dt;
 
-    particles_[i].x += dx*C - dy*S;
-    particles_[i].y += dx*S + dy*C;
-    particles_[i].theta = t;
+    p.x += dx*C - dy*S;
+    p.y += dx*S + dy*C;
+    p.theta = t;
+    // particles are equally weighted after resampling
+    stats.Add(a.ref, 1, p);
   }
+  l->blockstats_[block] = stats;
 }
 
-void Localizer::UpdateLM(float lm_bearing, float precision) {
-  float *LL;
-  LL = new float[n_particles_];
-  float LLmax = -1e6;
+void Localizer::Predict(float ds, float w, float dt) {
+  PredictArgs args;
+  args.self = this;
+  args.ds = ds;
+  args.w = w;
+  args.dt = dt;
+  PredictStatsRef(estimate_, ds, w, dt, &args.ref);
+  int nblocks = NumBlocks(n_particles_);
+  ParallelFor(PredictTask, &args, nblocks);
+  UpdateEstimate(args.ref, nblocks);
+}
 
-  // for each particle, find likeliest landmark and its likelihood
-  for (int i = 0; i < n_particles_; i++) {
-    const Particle &p = particles_[i];
+void Localizer::UpdateEstimate(const PoseStatsRef &ref, int nblocks) {
+  PoseStats stats = blockstats_[0];
+  for (int b = 1; b < nblocks; b++) {
+    stats.Merge(blockstats_[b]);
+  }
+  stats.Finish(ref, &estimate_);
+}
+
+// for each particle, find likeliest landmark and its likelihood; leaves the
+// block maximum in blockaccum_
+void Localizer::LikelihoodTask(void *arg, int block) {
+  const UpdateArgs &a = *reinterpret_cast<UpdateArgs*>(arg);
+  Localizer *l = a.self;
+  float LLmax = -1e6;
+  int i1 = block*BLOCK_SIZE + BLOCK_SIZE;
+  if (i1 > l->n_particles_) i1 = l->n_particles_;
+  for (int i = block*BLOCK_SIZE; i < i1; i++) {
+    const Particle &p = l->particles_[i];
     float S = sin(p.theta),
           C = cos(p.theta);
-    LL[i] = -1e6;
-#ifdef PF_DEBUG
-    printf("%d: ", i);
-#endif
-    for (int j = 0; j < n_landmarks_; j++) {
-      const Landmark &l = landmarks_[j];
-      float dx = l.x - p.x,
-            dy = l.y - p.y;
+    float LL = -1e6;
+    for (int j = 0; j < l->n_landmarks_; j++) {
+      const Landmark &lm = l->landmarks_[j];
+      float dx = lm.x - p.x,
+            dy = lm.y - p.y;
       float z = dx*C + dy*S,
             y = dx*S - dy*C;
-      float diff = atan2f(y, z) - lm_bearing;
-      float L = -precision*diff*diff;
-#ifdef PF_DEBUG
-      printf("[%d]%f %f ", j, diff, L);
-#endif
-      if (L > LL[i]) {
-        LL[i] = L;
+      float diff = atan2f(y, z) - a.lm_bearing;
+      float L = -a.precision*diff*diff;
+      if (L > LL) {
+        LL = L;
       }
     }
-#ifdef PF_DEBUG
-    printf("LL[i]=%f\n", LL[i]);
-#endif
-    if (LL[i] > LLmax) {
-      LLmax = LL[i];
+    l->LL_[i] = LL;
+    if (LL > LLmax) {
+      LLmax = LL;
+    }
+  }
+  l->blockaccum_[block] = LLmax;
+}
+
+// normalize likelihoods into weights and take the cumulative sum within the
+// block; leaves the block total in blockaccum_ and the weighted pose
+// statistics in blockstats_
+void Localizer::WeightTask(void *arg, int block) {
+  const UpdateArgs &a = *reinterpret_cast<UpdateArgs*>(arg);
+  Localizer *l = a.self;
+  PoseStats stats;
+  stats.Clear();
+  float total = 0;
+  int i1 = block*BLOCK_SIZE + BLOCK_SIZE;
+  if (i1 > l->n_particles_) i1 = l->n_particles_;
+  for (int i = block*BLOCK_SIZE; i < i1; i++) {
+    float wt = exp(l->LL_[i] - a.LLmax);
+    stats.Add(a.ref, wt, l->particles_[i]);
+    total += wt;
+    l->cum_[i] = total;
+  }
+  l->blockaccum_[block] = total;
+  l->blockstats_[block] = stats;
+}
+
+// add the block's starting offset (exclusive prefix sum of block totals) to
+// the cumulative weights
+void Localizer::OffsetTask(void *arg, int block) {
+  const UpdateArgs &a = *reinterpret_cast<UpdateArgs*>(arg);
+  Localizer *l = a.self;
+  float offset = l->blockaccum_[block];
+  int i1 = block*BLOCK_SIZE + BLOCK_SIZE;
+  if (i1 > l->n_particles_) i1 = l->n_particles_;
+  for (int i = block*BLOCK_SIZE; i < i1; i++) {
+    l->cum_[i] += offset;
+  }
+}
+
+// systematic resampling of output particles [block*BLOCK_SIZE, ...): output
+// i is the first particle whose cumulative weight exceeds (r + i) * deltaP
+void Localizer::ResampleTask(void *arg, int block) {
+  const UpdateArgs &a = *reinterpret_cast<UpdateArgs*>(arg);
+  Localizer *l = a.self;
+  const float *cum = l->cum_;
+  int n = l->n_particles_;
+  int i0 = block*BLOCK_SIZE;
+  int i1 = i0 + BLOCK_SIZE;
+  if (i1 > a.n_new) i1 = a.n_new;
+
+  // binary search for the first source particle, then walk forward
+  float u = (a.r + i0) * a.deltaP;
+  int lo = 0, hi = n - 1;
+  while (lo < hi) {
+    int mid = (lo + hi) >> 1;
+    if (cum[mid] > u) {
+      hi = mid;
+    } else {
+      lo = mid + 1;
+    }
+  }
+  int j = lo;
+  for (int i = i0; i < i1; i++) {
+    u = (a.r + i) * a.deltaP;
+    while (j < n - 1 && cum[j] <= u) {
+      j++;
+    }
+    l->newparticles_[i] = l->particles_[j];
+  }
+}
+
+void Localizer::ClearBins() {
+  memset(bins_, 0, (binmask_ + 1) * sizeof(bins_[0]));
+  n_bins_ = 0;
+}
+
+void Localizer::AddToBin(const Particle &p) {
+  // 10 bits each of x and y bin (wrapping every ~600m, which is fine), and
+  // theta wrapped around the circle; 0 is reserved for an empty slot
+  uint32_t xi = static_cast<int>(floorf(p.x / KLD_BIN_XY)) & 0x3ff;
+  uint32_t yi = static_cast<int>(floorf(p.y / KLD_BIN_XY)) & 0x3ff;
+  uint32_t ti = static_cast<int>(
+      floorf(p.theta * (KLD_BINS_THETA / (2 * M_PI)))) & (KLD_BINS_THETA - 1);
+  uint32_t key = 1 + ((xi << 14) | (yi << 4) | ti);
+
+  uint32_t h = key * 0x9e3779b1;
+  h ^= h >> 16;
+  for (;;) {
+    h &= binmask_;
+    if (bins_[h] == key) {
+      return;
+    }
+    if (bins_[h] == 0) {
+      bins_[h] = key;
+      n_bins_++;
+      return;
+    }
+    h++;
+  }
+}
+
+int Localizer::KLDParticleCount(int k) const {
+  if (k <= 1) {
+    return min_particles_;
+  }
+  // Wilson-Hilferty approximation of the chi-square quantile
+  float a = 2.0f / (9 * (k - 1));
+  float b = 1 - a + sqrtf(a) * KLD_Z;
+  float n = (k - 1) / (2 * KLD_EPSILON) * b * b * b;
+  if (n < min_particles_) {
+    return min_particles_;
+  }
+  if (n > max_particles_) {
+    return max_particles_;
+  }
+  return static_cast<int>(ceilf(n));
+}
+
+void Localizer::UpdateLM(float lm_bearing, float precision) {
+  UpdateArgs args;
+  args.self = this;
+  args.lm_bearing = lm_bearing;
+  args.precision = precision;
+
+  int nblocks = NumBlocks(n_particles_);
+  ParallelFor(LikelihoodTask, &args, nblocks);
+  float LLmax = -1e6;
+  for (int b = 0; b < nblocks; b++) {
+    if (blockaccum_[b] > LLmax) {
+      LLmax = blockaccum_[b];
     }
   }
 #ifdef PF_DEBUG
   printf("LLmax=%f (%d landmarks)\n", LLmax, n_landmarks_);
 #endif
 
-  // now, normalize the distribution and resample particles
+  // now, normalize the distribution and take a (two-level) prefix sum of the
+  // weights for resampling; the estimate comes from the weighted particles
+  // before resampling
+  args.LLmax = LLmax;
+  PredictStatsRef(estimate_, 0, 0, 0, &args.ref);
+  ParallelFor(WeightTask, &args, nblocks);
+  UpdateEstimate(args.ref, nblocks);
   float totalP = 0;
-  for (int i = 0; i < n_particles_; i++) {
-    LL[i] = exp(LL[i] - LLmax);
-    totalP += LL[i];
-#ifdef PF_DEBUG
-    printf("%0.3f ", LL[i]);
-#endif
+  for (int b = 0; b < nblocks; b++) {
+    float blocktotal = blockaccum_[b];
+    blockaccum_[b] = totalP;
+    totalP += blocktotal;
   }
+  ParallelFor(OffsetTask, &args, nblocks);
 #ifdef PF_DEBUG
-  printf(" | total=%f\nresample: ", totalP);
+  printf("total=%f\n", totalP);
 #endif
-  float deltaP = totalP / n_particles_;
+
   // pick a random starting location weighted by particle likelihood
-  float randP = drand48() * totalP;
-  Particle *newp = new Particle[n_particles_];
-  int j = 0;
-  for (int i = 0; i < n_particles_; i++) {
-    while (randP > LL[j]) {
-      randP -= LL[j];
-      j++;
-      if (j == n_particles_) {
-        j = 0;
+  float r = rng_uniform(&rng_);
+
+  int n_new = n_particles_;
+  if (min_particles_ != max_particles_) {
+    // count the bins occupied by the posterior, as represented by a
+    // systematic resampling at the current particle count, and choose the
+    // new particle count from that
+    ClearBins();
+    float deltaP = totalP / n_particles_;
+    int j = 0, lastj = -1;
+    for (int i = 0; i < n_particles_; i++) {
+      float u = (r + i) * deltaP;
+      while (j < n_particles_ - 1 && cum_[j] <= u) {
+        j++;
+      }
+      if (j != lastj) {
+        AddToBin(particles_[j]);
+        lastj = j;
       }
     }
-    newp[i] = particles_[j];
+    n_new = KLDParticleCount(n_bins_);
 #ifdef PF_DEBUG
-    printf("%d ", j);
+    printf("%d bins -> %d particles\n", n_bins_, n_new);
 #endif
-    randP += deltaP;
   }
-#ifdef PF_DEBUG
-  printf("\n");
-#endif
 
-  delete[] particles_;
-  particles_ = newp;
+  args.r = r;
+  args.deltaP = totalP / n_new;
+  args.n_new = n_new;
+  ParallelFor(ResampleTask, &args, NumBlocks(n_new));
 
-  delete[] LL;
-}
-
-bool Localizer::GetLocationEstimate(Particle *mean) {
-  mean->x = 0;
-  mean->y = 0;
-  mean->theta = 0;
-  for (int i = 0; i < n_particles_; i++) {
-    mean->x += particles_[i].x;
-    mean->y += particles_[i].y;
-    mean->theta += particles_[i].theta;
-  }
-  mean->x /= n_particles_;
-  mean->y /= n_particles_;
-  mean->theta /= n_particles_;
-  return true;
+  Particle *newp = newparticles_;
+  newparticles_ = particles_;
+  particles_ = newp;
+  n_particles_ = n_new;
 }
 
 }  // namespace coneslam
@@ -1,8 +1,11 @@
 #ifndef CONESLAM_LOCALIZE_H_
 #define CONESLAM_LOCALIZE_H_
 
+#include <stdint.h>
 #include <stdlib.h>
 
+class WorkerPool;
+
 namespace coneslam {
 
 struct Particle {
@@ -14,39 +17,151 @@ struct Landmark {
   float x, y;
 };
 
+// weighted mean pose of the particle set, with covariance
+struct PoseEstimate {
+  float x, y;
+  float theta;  // circular mean, in (-pi, pi]
+  float cov[3][3];  // covariance of (x, y, theta)
+  float R;  // mean resultant length of theta (1: all particles agree)
+  // the particles don't form a single blob around the mean (e.g. several
+  // places on the track explain the cones equally well), so the mean isn't
+  // meaningful
+  bool multimodal;
+};
+
+struct PoseStats;
+struct PoseStatsRef;
+
+// Common interface of the localizers drive can run (fixed-map Localizer,
+// FastSLAM and TrackLocalizer), so the driver and display don't care which one
+// is in use
+class PoseEstimator {
+ public:
+  virtual ~PoseEstimator() {}
+
+  virtual void Reset() = 0;
+
+  // predict after encoder / gyro measurement
+  virtual void Predict(float ds, float w, float dt) = 0;
+  // update after landmark measurement
+  virtual void UpdateLM(float lm_bearing, float precision) = 0;
+  // update after a curvature measurement from centerline detection; only
+  // used by the track-following localizer, the cone localizers ignore it
+  virtual void UpdateCurvature(float kappa, float precision) {}
+
+  // estimate as of the last Predict / UpdateLM; O(1), as the statistics are
+  // accumulated during those
+  virtual bool GetPoseEstimate(PoseEstimate *est) const = 0;
+
+  bool GetLocationEstimate(Particle *mean) const {
+    PoseEstimate est;
+    if (!GetPoseEstimate(&est)) {
+      return false;
+    }
+    mean->x = est.x;
+    mean->y = est.y;
+    mean->theta = est.theta;
+    return true;
+  }
+
+  // current (best) landmark map and particle set, for display
+  virtual const Landmark *GetLandmarks() const = 0;
+  virtual int NumLandmarks() const = 0;
+  virtual const Particle *GetParticles() const = 0;
+  virtual int NumParticles() const = 0;
+};
+
 // Localization, assuming cone locations are all known
-class Localizer {
+//
+// Particles are processed in fixed-size blocks, each with its own random
+// number stream, and all sums are reduced in block order; so given the same
+// seed, the results are identical no matter how many threads are used.
+class Localizer: public PoseEstimator {
  public:
+  // fixed particle count
   explicit Localizer(int n_particles) {
-    n_particles_ = n_particles;
-    particles_ = new Particle[n_particles];
-    n_landmarks_ = 0;
-    landmarks_ = NULL;
-    Reset();
+    Init(n_particles, n_particles);
+  }
+
+  // KLD-sampling: the number of particles is chosen at each resampling step
+  // from the number of occupied (x, y, theta) histogram bins, within
+  // [min_particles, max_particles]
+  Localizer(int min_particles, int max_particles) {
+    Init(min_particles, max_particles);
   }
 
   ~Localizer();
 
+  // split Predict and UpdateLM across a worker pool;
+  // NULL (the default) runs everything on the calling thread
+  void SetWorkerPool(WorkerPool *pool) { pool_ = pool; }
+
+  // reseed all random number streams
+  void Seed(uint64_t seed);
+
   bool LoadLandmarks(const char *filename);
 
-  void Reset();
+  // scatter particles around the starting line, using the maximum particle
+  // count as we have no idea where we are
+  virtual void Reset();
 
-  // predict after encoder / gyro measurement
-  void Predict(float ds, float w, float dt);
-  // update after landmark measurement
-  void UpdateLM(float lm_bearing, float precision);
+  virtual void Predict(float ds, float w, float dt);
+  virtual void UpdateLM(float lm_bearing, float precision);
 
-  bool GetLocationEstimate(Particle *mean);
+  virtual bool GetPoseEstimate(PoseEstimate *est) const {
+    *est = estimate_;
+    return true;
+  }
 
-  const Landmark *GetLandmarks() const { return landmarks_; }
-  int NumLandmarks() const { return n_landmarks_; }
+  virtual const Landmark *GetLandmarks() const { return landmarks_; }
+  virtual int NumLandmarks() const { return n_landmarks_; }
 
-  const Particle *GetParticles() const { return particles_; }
-  int NumParticles() const { return n_particles_; }
+  // currently active particles (changes over time under KLD-sampling)
+  virtual const Particle *GetParticles() const { return particles_; }
+  virtual int NumParticles() const { return n_particles_; }
+
+  int MinParticles() const { return min_particles_; }
+  int MaxParticles() const { return max_particles_; }
+  // number of occupied histogram bins seen during the last resample
+  int NumOccupiedBins() const { return n_bins_; }
 
  private:
+  void Init(int min_particles, int max_particles);
+
+  int NumBlocks(int n) const;
+  void ParallelFor(void (*fn)(void *arg, int block), void *arg, int nblocks);
+  static void PredictTask(void *arg, int block);
+  static void LikelihoodTask(void *arg, int block);
+  static void WeightTask(void *arg, int block);
+  static void OffsetTask(void *arg, int block);
+  static void ResampleTask(void *arg, int block);
+  // merge per-block statistics into estimate_
+  void UpdateEstimate(const PoseStatsRef &ref, int nblocks);
+
+  void ClearBins();
+  // mark particle's bin occupied, counting it in n_bins_ if it was empty
+  void AddToBin(const Particle &p);
+  int KLDParticleCount(int k) const;
+
   int n_particles_;
+  int min_particles_, max_particles_;
   Particle *particles_;
+  Particle *newparticles_;  // resampling back buffer
+  float *LL_;               // per-particle log-likelihood / weight scratch
+  float *cum_;              // cumulative weights for resampling
+
+  WorkerPool *pool_;
+  uint64_t *blockrng_;      // random number stream for each block
+  uint64_t rng_;            // stream for the resampling offset
+  float *blockaccum_;       // per-block partial results
+  PoseStats *blockstats_;   // per-block pose statistics
+
+  PoseEstimate estimate_;
+
+  // open-addressed hash set of occupied bins, size binmask_+1
+  uint32_t *bins_;
+  uint32_t binmask_;
+  int n_bins_;
 
   int n_landmarks_;
   Landmark *landmarks_;
@@ -0,0 +1,92 @@
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <vector>
+
+#include "coneslam/localize.h"
+#include "util/workerpool.h"
+
+using coneslam::Localizer;
+using coneslam::Particle;
+
+// replays the test log through the particle filter at various particle and
+// thread counts; the final estimate should be bit-identical across thread
+// counts
+
+const char *testdata_file = "../src/coneslam/testdata/194625.txt";
+const char *lm_file = "../src/coneslam/testdata/lm.txt";
+
+struct Frame {
+  float dt, ds, w;
+  std::vector<float> bearings;
+};
+
+static double Replay(Localizer *loc, const std::vector<Frame> &frames,
+    Particle *p) {
+  timeval t0, t1;
+  gettimeofday(&t0, NULL);
+  for (size_t i = 0; i < frames.size(); i++) {
+    const Frame &f = frames[i];
+    loc->Predict(f.ds, f.w, f.dt);
+    for (size_t j = 0; j < f.bearings.size(); j++) {
+      loc->UpdateLM(f.bearings[j], 10);
+    }
+    loc->GetLocationEstimate(p);
+  }
+  gettimeofday(&t1, NULL);
+  return t1.tv_sec - t0.tv_sec + (t1.tv_usec - t0.tv_usec) * 1e-6;
+}
+
+int main() {
+  FILE *fp = fopen(testdata_file, "r");
+  if (!fp) {
+    perror(testdata_file);
+    return 1;
+  }
+  std::vector<Frame> frames;
+  Frame f;
+  int nLM;
+  while (fscanf(fp, "%f %f %f %d\n", &f.dt, &f.ds, &f.w, &nLM) == 4) {
+    f.bearings.resize(nLM);
+    for (int j = 0; j < nLM; j++) {
+      fscanf(fp, "%f\n", &f.bearings[j]);
+    }
+    frames.push_back(f);
+  }
+  fclose(fp);
+
+  // the scaling only means anything with as many cores as threads
+  printf("%ld cpus online\n", sysconf(_SC_NPROCESSORS_ONLN));
+  const int particlecounts[] = {300, 1000, 5000};
+  for (int n = 0; n < 3; n++) {
+    Particle p1 = {0, 0, 0};
+    double t1 = 0;
+    for (int nthreads = 1; nthreads <= 4; nthreads++) {
+      WorkerPool pool(nthreads);
+      Localizer loc(particlecounts[n]);
+      if (!loc.LoadLandmarks(lm_file)) {
+        return 1;
+      }
+      loc.SetWorkerPool(&pool);
+      loc.Seed(1);
+      loc.Reset();
+      Particle p = {0, 0, 0};
+      double t = Replay(&loc, frames, &p);
+      if (nthreads == 1) {
+        p1 = p;
+        t1 = t;
+      }
+      bool same = !memcmp(&p, &p1, sizeof(p));
+      printf("%5d particles %d threads: %7.3f ms/frame (%.2fx) "
+          "final %f %f %f%s\n", particlecounts[n], nthreads,
+          1000 * t / frames.size(), t1 / t, p.x, p.y, p.theta,
+          same ? "" : " MISMATCH");
+      if (!same) {
+        return 1;
+      }
+    }
+  }
+
+  return 0;
+}
@@ -1,13 +1,15 @@
+#include <math.h>
 #include <stdio.h>
 #include "coneslam/localize.h"
 
 using coneslam::Localizer;
 using coneslam::Particle;
+using coneslam::PoseEstimate;
 
 const char *testdata_file = "../src/coneslam/testdata/194625.txt";
 
 int main() {
-  Localizer loc(300);
+  Localizer loc(50, 1000);
   if (!loc.LoadLandmarks("../src/coneslam/testdata/lm.txt")) {
     return 1;
   }
@@ -30,9 +32,13 @@ int main() {
     for (int j = 0; j < nLM; j++) {
       float lm_bearing;
       fscanf(fp, "%f\n", &lm_bearing);
-      loc.UpdateLM(lm_bearing);
+      loc.UpdateLM(lm_bearing, 10);
     }
-    loc.GetLocationEstimate(&p);
-    printf("%d: %f %f %f\n", frame++, p.x, p.y, p.theta);
+    PoseEstimate est;
+    loc.GetPoseEstimate(&est);
+    printf("%d: %f %f %f sigma %f %f %f (%d particles)%s\n", frame++,
+        est.x, est.y, est.theta, sqrt(est.cov[0][0]), sqrt(est.cov[1][1]),
+        sqrt(est.cov[2][2]), loc.NumParticles(),
+        est.multimodal ? " multimodal" : "");
   }
 }
@@ -0,0 +1,131 @@
+#ifndef CONESLAM_POSESTATS_H_
+#define CONESLAM_POSESTATS_H_
+
+#include <math.h>
+
+#include "coneslam/localize.h"
+
+namespace coneslam {
+
+// if less than this fraction of the weight is within half a (previous)
+// standard deviation of the predicted mean, the posterior isn't a single
+// blob; a gaussian would have 1 - exp(-1/8) = 12% there, two well-separated
+// clusters next to nothing
+const float MULTIMODAL_NEAR_FRAC = 0.04;
+// mean resultant length below which heading is considered ambiguous
+const float MULTIMODAL_MIN_R = 0.5;
+
+// reference pose and its inverse xy covariance; see PoseStats
+struct PoseStatsRef {
+  float x, y, theta;
+  float ixx, ixy, iyy;
+};
+
+// Weighted sufficient statistics of a particle set, accumulated while the
+// particles are touched anyway (predict / weighting passes) so that the
+// estimate doesn't need a pass of its own.
+//
+// Positions are accumulated relative to a reference pose (the previous
+// estimate, moved by the same odometry as the particles) to keep the float
+// sums well-conditioned; that reference and its covariance are also used to
+// count how much weight sits near the expected mean for the multimodality
+// test. theta is summed as (cos, sin) so it wraps properly.
+struct PoseStats {
+  float w;
+  float x, y, xx, xy, yy;
+  float C, S, CC, SC, SS;
+  float xC, xS, yC, yS;
+  float near;
+
+  void Clear() {
+    w = x = y = xx = xy = yy = 0;
+    C = S = CC = SC = SS = 0;
+    xC = xS = yC = yS = 0;
+    near = 0;
+  }
+
+  void Add(const PoseStatsRef &ref, float wt, const Particle &p) {
+    float dx = p.x - ref.x, dy = p.y - ref.y;
+    float c = cosf(p.theta), s = sinf(p.theta);
+    w += wt;
+    x += wt*dx;
+    y += wt*dy;
+    xx += wt*dx*dx;
+    xy += wt*dx*dy;
+    yy += wt*dy*dy;
+    C += wt*c;
+    S += wt*s;
+    CC += wt*c*c;
+    SC += wt*s*c;
+    SS += wt*s*s;
+    xC += wt*dx*c;
+    xS += wt*dx*s;
+    yC += wt*dy*c;
+    yS += wt*dy*s;
+    if (dx*dx*ref.ixx + 2*dx*dy*ref.ixy + dy*dy*ref.iyy < 0.25f) {
+      near += wt;
+    }
+  }
+
+  void Merge(const PoseStats &o) {
+    w += o.w;
+    x += o.x; y += o.y; xx += o.xx; xy += o.xy; yy += o.yy;
+    C += o.C; S += o.S; CC += o.CC; SC += o.SC; SS += o.SS;
+    xC += o.xC; xS += o.xS; yC += o.yC; yS += o.yS;
+    near += o.near;
+  }
+
+  // heading deviation from the circular mean mu is linearized as
+  // sin(theta - mu) = sin(theta) cos(mu) - cos(theta) sin(mu)
+  bool Finish(const PoseStatsRef &ref, PoseEstimate *est) const {
+    if (w <= 0) {
+      return false;
+    }
+    float iw = 1.0f / w;
+    float mx = x*iw, my = y*iw;
+    est->x = ref.x + mx;
+    est->y = ref.y + my;
+
+    float mC = C*iw, mS = S*iw;
+    est->R = sqrtf(mC*mC + mS*mS);
+    float mu = atan2f(mS, mC);
+    est->theta = mu;
+    float cm = cosf(mu), sm = sinf(mu);
+
+    est->cov[0][0] = xx*iw - mx*mx;
+    est->cov[0][1] = est->cov[1][0] = xy*iw - mx*my;
+    est->cov[1][1] = yy*iw - my*my;
+    est->cov[0][2] = est->cov[2][0] = (cm*xS - sm*xC)*iw - mx*(cm*mS - sm*mC);
+    est->cov[1][2] = est->cov[2][1] = (cm*yS - sm*yC)*iw - my*(cm*mS - sm*mC);
+    est->cov[2][2] = (cm*cm*SS - 2*sm*cm*SC + sm*sm*CC)*iw;
+
+    est->multimodal = near*iw < MULTIMODAL_NEAR_FRAC ||
+        est->R < MULTIMODAL_MIN_R;
+    return true;
+  }
+};
+
+// set the reference for the next round of statistics to the estimate,
+// moved forward by odometry
+inline void PredictStatsRef(const PoseEstimate &est, float ds, float w,
+    float dt, PoseStatsRef *ref) {
+  float t = est.theta + w*dt;
+  ref->x = est.x + ds*cosf((est.theta + t)*0.5f);
+  ref->y = est.y + ds*sinf((est.theta + t)*0.5f);
+  ref->theta = t;
+  // inverse of the 2x2 position covariance; if it's degenerate (e.g. all
+  // particles on the same spot) just count everything as near
+  float a = est.cov[0][0], b = est.cov[0][1], d = est.cov[1][1];
+  float det = a*d - b*b;
+  if (det > 1e-6f) {
+    ref->ixx = d / det;
+    ref->ixy = -b / det;
+    ref->iyy = a / det;
+  } else {
+    ref->ixx = ref->ixy = ref->iyy = 0;
+  }
+}
+
+}  // namespace coneslam
+
+#endif  // CONESLAM_POSESTATS_H_
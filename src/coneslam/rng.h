@@ -0,0 +1,42 @@
+#ifndef CONESLAM_RNG_H_
+#define CONESLAM_RNG_H_
+
+#include <stdint.h>
+
+namespace coneslam {
+
+// #include <random> doesn't work in my ARM cross-compiler, and drand48 has
+// global state anyway, so here's a tiny xorshift64* generator
+inline uint64_t rng_next(uint64_t *s) {
+  uint64_t x = *s;
+  x ^= x >> 12;
+  x ^= x << 25;
+  x ^= x >> 27;
+  *s = x;
+  return x * 0x2545f4914f6cdd1dULL;
+}
+
+// uniform [0, 1)
+inline float rng_uniform(uint64_t *s) {
+  return (rng_next(s) >> 40) * (1.0f / 16777216.0f);
+}
+
+inline float randn(uint64_t *s) {
+  // it's slightly heavier-tailed than a gaussian and cuts off at -6..6, but
+  // that's OK
+  float n = rng_uniform(s);
+  for (int i = 1; i < 6; i++) n += rng_uniform(s);
+  return 2*n - 6;
+}
+
+// used to seed the streams so that nearby seeds aren't correlated
+inline uint64_t splitmix64(uint64_t *x) {
+  uint64_t z = (*x += 0x9e3779b97f4a7c15ULL);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return z ^ (z >> 31);
+}
+
+}  // namespace coneslam
+
+#endif  // CONESLAM_RNG_H_
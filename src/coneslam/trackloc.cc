@@ -0,0 +1,346 @@
+#include <ctype.h>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+#include "coneslam/trackloc.h"
+
+namespace coneslam {
+
+const float KMAP_ENTRIES_PER_METER = 5;
+// pose output and ds input are in encoder ticks (2cm each)
+const float TICKS_PER_METER = 50;
+
+// odometry uncertainty: sigma is this fraction of the distance travelled,
+// plus a bit of variance (in bins^2) every step
+const float ODO_NOISE_REL = 0.1;
+const float ODO_NOISE_VAR = 0.01;
+
+// gaussian kernels wider than this (3 sigma, in bins) are done with box
+// filters instead of direct convolution
+const int MAX_KERNEL_RADIUS = 16;
+
+// the peak around the most likely bin extends as long as the probability is
+// over this fraction of the maximum; if it holds less than
+// MIN_PEAK_MASS of the total, we're ambiguous
+const float PEAK_FRAC = 0.05;
+const float MIN_PEAK_MASS = 0.75;
+
+// we don't know where we are across the track
+const float LATERAL_SIGMA_M = 0.3;
+
+const int N_PEAKS = 10;
+const int CENTERLINE_DECIMATE = 5;
+
+// reads one number per line, ignoring trailing commas (C array initializer
+// format, as written by the track generator and read by localize.py)
+static bool LoadNumbers(const char *fname, std::vector<float> *out) {
+  FILE *fp = fopen(fname, "r");
+  if (!fp) {
+    perror(fname);
+    return false;
+  }
+  out->clear();
+  float v;
+  while (fscanf(fp, "%f", &v) == 1) {
+    out->push_back(v);
+    int c;
+    while ((c = fgetc(fp)) == ',' || isspace(c)) {}
+    if (c != EOF) {
+      ungetc(c, fp);
+    }
+  }
+  fclose(fp);
+  return true;
+}
+
+TrackLocalizer::TrackLocalizer() {
+  n_bins_ = 0;
+  prob_ = NULL;
+  tmp_ = NULL;
+  kmap_ = NULL;
+  trackx_ = NULL;
+  tracku_ = NULL;
+  centerline_ = NULL;
+  n_centerline_ = 0;
+  peaks_ = new Particle[N_PEAKS];
+  n_peaks_ = 0;
+  memset(&estimate_, 0, sizeof(estimate_));
+}
+
+TrackLocalizer::~TrackLocalizer() {
+  delete[] prob_;
+  delete[] tmp_;
+  delete[] kmap_;
+  delete[] trackx_;
+  delete[] tracku_;
+  delete[] centerline_;
+  delete[] peaks_;
+}
+
+bool TrackLocalizer::LoadTrack(const char *prefix) {
+  std::vector<float> k, x, u;
+  char fname[256];
+  snprintf(fname, sizeof(fname), "%s_track_k.txt", prefix);
+  if (!LoadNumbers(fname, &k)) return false;
+  snprintf(fname, sizeof(fname), "%s_track_x.txt", prefix);
+  if (!LoadNumbers(fname, &x)) return false;
+  snprintf(fname, sizeof(fname), "%s_track_u.txt", prefix);
+  if (!LoadNumbers(fname, &u)) return false;
+
+  // there can be a slight mismatch in lengths
+  int n = k.size();
+  if (static_cast<int>(x.size() / 2) < n) n = x.size() / 2;
+  if (static_cast<int>(u.size() / 2) < n) n = u.size() / 2;
+  if (n < 2) {
+    fprintf(stderr, "%s: track map is empty\n", prefix);
+    return false;
+  }
+
+  delete[] prob_;
+  delete[] tmp_;
+  delete[] kmap_;
+  delete[] trackx_;
+  delete[] tracku_;
+  delete[] centerline_;
+  n_bins_ = n;
+  prob_ = new float[n];
+  tmp_ = new float[n + 2*MAX_KERNEL_RADIUS + 2];
+  kmap_ = new float[n];
+  trackx_ = new float[2*n];
+  tracku_ = new float[2*n];
+  memcpy(kmap_, &k[0], n * sizeof(float));
+  memcpy(trackx_, &x[0], 2 * n * sizeof(float));
+  memcpy(tracku_, &u[0], 2 * n * sizeof(float));
+
+  n_centerline_ = (n + CENTERLINE_DECIMATE - 1) / CENTERLINE_DECIMATE;
+  centerline_ = new Landmark[n_centerline_];
+  for (int i = 0; i < n_centerline_; i++) {
+    centerline_[i].x = trackx_[2*i*CENTERLINE_DECIMATE] * TICKS_PER_METER;
+    centerline_[i].y = trackx_[2*i*CENTERLINE_DECIMATE + 1] * TICKS_PER_METER;
+  }
+
+  fprintf(stderr, "*** loaded %d bin (%0.1fm) track map\n", n,
+      n / KMAP_ENTRIES_PER_METER);
+  Reset();
+  return true;
+}
+
+void TrackLocalizer::Reset() {
+  if (n_bins_ == 0) {
+    return;
+  }
+  memset(prob_, 0, n_bins_ * sizeof(float));
+  prob_[0] = 1;
+  UpdateEstimate();
+}
+
+void TrackLocalizer::Normalize() {
+  float total = 0;
+  for (int i = 0; i < n_bins_; i++) {
+    total += prob_[i];
+  }
+  if (!(total > 0)) {
+    // no probability mass left anywhere; start over knowing nothing
+    fprintf(stderr, "TrackLocalizer: no probability mass, reset\n");
+    for (int i = 0; i < n_bins_; i++) {
+      prob_[i] = 1.0f / n_bins_;
+    }
+    return;
+  }
+  float scale = 1.0f / total;
+  for (int i = 0; i < n_bins_; i++) {
+    prob_[i] *= scale;
+  }
+}
+
+void TrackLocalizer::Convolve(float dbins, float var) {
+  int N = n_bins_;
+  int dsi = floorf(dbins);
+  float f = dbins - dsi;
+  int R = var > 0 ? ceilf(3*sqrtf(var)) : 0;
+
+  // gaussian centered on the integer part, then linearly interpolated by
+  // the fractional part, as in localize.py; kernel covers shifts kmin..kmax
+  float g[MAX_KERNEL_RADIUS + 1];
+  float gsum = 0;
+  for (int j = 0; j <= R; j++) {
+    g[j] = var > 0 ? expf(-j*j / (2*var)) : 1;
+    gsum += j == 0 ? g[j] : 2*g[j];
+  }
+  int kmin = dsi - R, kmax = dsi + R + 1;
+  int nk = kmax - kmin + 1;
+  float kern[2*MAX_KERNEL_RADIUS + 2];
+  for (int t = 0; t < nk; t++) {
+    int j = t - R;  // offset from dsi
+    float a = (j >= -R && j <= R) ? g[j < 0 ? -j : j] : 0;
+    float b = (j - 1 >= -R && j - 1 <= R) ? g[j - 1 < 0 ? 1 - j : j - 1] : 0;
+    kern[t] = ((1 - f)*a + f*b) / gsum;
+  }
+
+  // circularly padded copy: pad[j] = prob[(j - kmax) mod N], so that
+  // prob[i - k] = pad[i + kmax - k] and each tap is a contiguous
+  // multiply-accumulate over the whole histogram, which vectorizes
+  float *pad = tmp_;
+  int npad = N + nk - 1;
+  int start = ((-kmax) % N + N) % N;
+  for (int j = 0; j < npad; j++) {
+    pad[j] = prob_[start];
+    if (++start == N) start = 0;
+  }
+  memset(prob_, 0, N * sizeof(float));
+  for (int t = 0; t < nk; t++) {
+    const float *src = pad + (nk - 1 - t);
+    float c = kern[t];
+    for (int i = 0; i < N; i++) {
+      prob_[i] += c * src[i];
+    }
+  }
+}
+
+void TrackLocalizer::Shift(float dbins) {
+  Convolve(dbins, 0);
+}
+
+void TrackLocalizer::BoxBlur(float var) {
+  int N = n_bins_;
+  // three passes of a width-w box have variance (w^2 - 1) / 4
+  int w = sqrtf(4*var + 1);
+  w |= 1;
+  if (w >= N) {
+    for (int i = 0; i < N; i++) {
+      prob_[i] = 1.0f / N;
+    }
+    return;
+  }
+  int r = w / 2;
+  float scale = 1.0f / w;
+  for (int pass = 0; pass < 3; pass++) {
+    memcpy(tmp_, prob_, N * sizeof(float));
+    float sum = 0;
+    for (int j = -r; j <= r; j++) {
+      sum += tmp_[(j + N) % N];
+    }
+    int out = N - r - 1, in = r;  // indices leaving / entering the window
+    for (int i = 0; i < N; i++) {
+      prob_[i] = sum * scale;
+      if (++out == N) out = 0;
+      if (++in == N) in = 0;
+      sum += tmp_[in] - tmp_[out];
+    }
+  }
+}
+
+void TrackLocalizer::Predict(float ds, float w, float dt) {
+  if (n_bins_ == 0) {
+    return;
+  }
+  float dbins = ds * (KMAP_ENTRIES_PER_METER / TICKS_PER_METER);
+  float var = ODO_NOISE_REL*ODO_NOISE_REL*dbins*dbins + ODO_NOISE_VAR;
+  if (3*sqrtf(var) <= MAX_KERNEL_RADIUS) {
+    Convolve(dbins, var);
+  } else {
+    Shift(dbins);
+    BoxBlur(var);
+  }
+  UpdateEstimate();
+}
+
+void TrackLocalizer::UpdateCurvature(float kappa, float precision) {
+  if (n_bins_ == 0) {
+    return;
+  }
+  float *LL = tmp_;
+  float LLmax = -1e30;
+  for (int i = 0; i < n_bins_; i++) {
+    float d = kmap_[i] - kappa;
+    LL[i] = -d*d*precision;
+    if (LL[i] > LLmax) LLmax = LL[i];
+  }
+  for (int i = 0; i < n_bins_; i++) {
+    prob_[i] *= expf(LL[i] - LLmax);
+  }
+  Normalize();
+  UpdateEstimate();
+}
+
+void TrackLocalizer::UpdateEstimate() {
+  int N = n_bins_;
+  int imax = 0;
+  for (int i = 1; i < N; i++) {
+    if (prob_[i] > prob_[imax]) imax = i;
+  }
+  float pmax = prob_[imax];
+
+  // mass, centroid and variance of the peak around the most likely bin
+  float mass = pmax, m1 = 0, m2 = 0;
+  for (int dir = -1; dir <= 1; dir += 2) {
+    for (int d = 1; d < N/2; d++) {
+      int i = (imax + dir*d + N) % N;
+      if (prob_[i] < PEAK_FRAC * pmax) break;
+      mass += prob_[i];
+      m1 += prob_[i] * dir*d;
+      m2 += prob_[i] * d*d;
+    }
+  }
+  float ds = m1 / mass;
+  float var = m2 / mass - ds*ds + 1.0f/12;  // + quantization
+
+  // interpolate centerline position at s = imax + ds
+  float s = imax + ds;
+  int i0 = floorf(s);
+  float f = s - i0;
+  i0 = (i0 + N) % N;
+  int i1 = (i0 + 1) % N;
+  float x = (1-f)*trackx_[2*i0] + f*trackx_[2*i1];
+  float y = (1-f)*trackx_[2*i0 + 1] + f*trackx_[2*i1 + 1];
+  // heading is along the track, perpendicular to the normal
+  float tx = tracku_[2*i0 + 1], ty = -tracku_[2*i0];
+  float k = kmap_[i0];
+
+  estimate_.x = x * TICKS_PER_METER;
+  estimate_.y = y * TICKS_PER_METER;
+  estimate_.theta = atan2f(ty, tx);
+
+  // uncertainty along the track from the histogram; across it, a guess
+  float var_s = var * (TICKS_PER_METER / KMAP_ENTRIES_PER_METER) *
+      (TICKS_PER_METER / KMAP_ENTRIES_PER_METER);
+  float var_n = LATERAL_SIGMA_M*LATERAL_SIGMA_M *
+      TICKS_PER_METER*TICKS_PER_METER;
+  float nx = -ty, ny = tx;
+  estimate_.cov[0][0] = var_s*tx*tx + var_n*nx*nx;
+  estimate_.cov[0][1] = estimate_.cov[1][0] = var_s*tx*ty + var_n*nx*ny;
+  estimate_.cov[1][1] = var_s*ty*ty + var_n*ny*ny;
+  // heading changes by kappa per meter travelled
+  float k_ticks = k / TICKS_PER_METER;
+  estimate_.cov[0][2] = estimate_.cov[2][0] = k_ticks*var_s*tx;
+  estimate_.cov[1][2] = estimate_.cov[2][1] = k_ticks*var_s*ty;
+  estimate_.cov[2][2] = k_ticks*k_ticks*var_s;
+  estimate_.R = 1;
+  estimate_.multimodal = mass < MIN_PEAK_MASS;
+
+  // top bins for display (N is a few hundred, so this is cheap enough)
+  n_peaks_ = 0;
+  float last = 2;
+  int lasti = -1;
+  for (int n = 0; n < N_PEAKS; n++) {
+    int best = -1;
+    for (int i = 0; i < N; i++) {
+      float p = prob_[i];
+      if ((p < last || (p == last && i > lasti)) &&
+          (best == -1 || p > prob_[best])) {
+        best = i;
+      }
+    }
+    if (best == -1 || prob_[best] <= 0) break;
+    last = prob_[best];
+    lasti = best;
+    Particle &pk = peaks_[n_peaks_++];
+    pk.x = trackx_[2*best] * TICKS_PER_METER;
+    pk.y = trackx_[2*best + 1] * TICKS_PER_METER;
+    pk.theta = atan2f(-tracku_[2*best], tracku_[2*best + 1]);
+  }
+}
+
+}  // namespace coneslam
@@ -0,0 +1,80 @@
+#ifndef CONESLAM_TRACKLOC_H_
+#define CONESLAM_TRACKLOC_H_
+
+#include "coneslam/localize.h"
+
+namespace coneslam {
+
+// 1-D localization along a known track: a histogram over arc length s
+// (KMAP_ENTRIES_PER_METER bins per meter, wrapping around the lap), updated
+// from measured centerline curvature; C++ port of tools/replay/localize.py.
+//
+// The track map is the same as localize.py's: <prefix>_track_k.txt
+// (curvature of each bin), _track_x.txt (centerline x, y) and _track_u.txt
+// (track normal), one number per line.
+//
+// Pose output is the centerline point of the most likely bin, in encoder
+// ticks like the cone localizers. Cone measurements are ignored.
+class TrackLocalizer: public PoseEstimator {
+ public:
+  TrackLocalizer();
+  ~TrackLocalizer();
+
+  bool LoadTrack(const char *prefix);
+
+  // all probability on the start line
+  virtual void Reset();
+
+  // shift the distribution by ds encoder ticks, blurring by the odometry
+  // uncertainty
+  virtual void Predict(float ds, float w, float dt);
+  virtual void UpdateLM(float lm_bearing, float precision) {}
+  // multiply by likelihood of each bin's curvature given measured kappa
+  // (1/m) with the given precision (1/sigma^2)
+  virtual void UpdateCurvature(float kappa, float precision);
+
+  virtual bool GetPoseEstimate(PoseEstimate *est) const {
+    *est = estimate_;
+    return true;
+  }
+
+  // for display: the centerline (decimated) as "landmarks", and the most
+  // likely bins as "particles"
+  virtual const Landmark *GetLandmarks() const { return centerline_; }
+  virtual int NumLandmarks() const { return n_centerline_; }
+  virtual const Particle *GetParticles() const { return peaks_; }
+  virtual int NumParticles() const { return n_peaks_; }
+
+  const float *GetDistribution() const { return prob_; }
+  int NumBins() const { return n_bins_; }
+
+ private:
+  void Normalize();
+  void UpdateEstimate();
+  // circular shift by a fractional number of bins, linearly interpolating
+  void Shift(float dbins);
+  // gaussian blur by explicit convolution with a short kernel centered on
+  // dbins; shifts at the same time
+  void Convolve(float dbins, float var);
+  // gaussian blur approximated with three box filters, for wide kernels
+  void BoxBlur(float var);
+
+  int n_bins_;
+  float *prob_;
+  float *tmp_;      // scratch, n_bins_ + padding for convolution
+  float *kmap_;     // curvature at each bin (1/m)
+  float *trackx_;   // centerline x, y (m)
+  float *tracku_;   // track normal
+
+  Landmark *centerline_;
+  int n_centerline_;
+
+  Particle *peaks_;
+  int n_peaks_;
+
+  PoseEstimate estimate_;
+};
+
+}  // namespace coneslam
+
+#endif  // CONESLAM_TRACKLOC_H_
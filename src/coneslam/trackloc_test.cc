@@ -0,0 +1,122 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+#include "coneslam/trackloc.h"
+
+using coneslam::PoseEstimate;
+using coneslam::TrackLocalizer;
+
+// drive a synthetic track (straight, right-hand hairpin, straight, wide
+// left-hand sweeper, ...) with noisy odometry and curvature, and check the
+// arc length estimate against the truth
+
+const float BINS_PER_M = 5;
+const float TICKS_PER_M = 50;
+
+static float Curvature(float s) {
+  // 50m lap, 250 bins
+  if (s < 10) return 0;
+  if (s < 10 + M_PI * 2) return 0.5;     // r = 2m, half turn
+  if (s < 20 + M_PI * 2) return 0;
+  if (s < 20 + M_PI * 2 + M_PI * 4) return -0.25;  // r = 4m, half turn
+  return 0.1;
+}
+
+static double Now() {
+  timeval t;
+  gettimeofday(&t, NULL);
+  return t.tv_sec + t.tv_usec * 1e-6;
+}
+
+static float Noise() {
+  // roughly unit gaussian
+  float s = 0;
+  for (int i = 0; i < 6; i++) s += drand48();
+  return (s - 3) * sqrtf(2);
+}
+
+int main() {
+  const char *prefix = "/tmp/trackloc_test";
+  int n = 250;
+  char fname[256];
+  FILE *fk, *fx, *fu;
+  snprintf(fname, sizeof(fname), "%s_track_k.txt", prefix);
+  fk = fopen(fname, "w");
+  snprintf(fname, sizeof(fname), "%s_track_x.txt", prefix);
+  fx = fopen(fname, "w");
+  snprintf(fname, sizeof(fname), "%s_track_u.txt", prefix);
+  fu = fopen(fname, "w");
+  if (!fk || !fx || !fu) {
+    perror(prefix);
+    return 1;
+  }
+  float x = 0, y = 0, theta = 0;
+  for (int i = 0; i < n; i++) {
+    float k = Curvature(i / BINS_PER_M);
+    fprintf(fk, "%f,\n", k);
+    fprintf(fx, "%f,\n%f,\n", x, y);
+    // normal points left of the direction of travel
+    fprintf(fu, "%f,\n%f,\n", -sinf(theta), cosf(theta));
+    x += cosf(theta) / BINS_PER_M;
+    y += sinf(theta) / BINS_PER_M;
+    theta += k / BINS_PER_M;
+  }
+  fclose(fk);
+  fclose(fx);
+  fclose(fu);
+
+  TrackLocalizer loc;
+  if (!loc.LoadTrack(prefix)) {
+    return 1;
+  }
+
+  // two laps at 2m/s, 30Hz, odometry 5% off
+  srand48(1);
+  float s = 0;
+  float maxerr = 0;
+  int nmulti = 0, frames = 0;
+  double t0 = Now();
+  for (; s < 100; frames++) {
+    float ds = 2.0 / 30;
+    s += ds;
+    loc.Predict(ds * 1.05 * TICKS_PER_M, 0, 1.0 / 30);
+    loc.UpdateCurvature(Curvature(fmodf(s, 50)) + 0.05 * Noise(), 100);
+
+    PoseEstimate est;
+    loc.GetPoseEstimate(&est);
+    // find the estimate's arc length by nearest bin
+    const float *p = loc.GetDistribution();
+    int imax = 0;
+    for (int i = 1; i < n; i++) {
+      if (p[i] > p[imax]) imax = i;
+    }
+    float err = fmodf(imax / BINS_PER_M - fmodf(s, 50) + 75, 50) - 25;
+    if (s > 50 && fabsf(err) > maxerr) maxerr = fabsf(err);
+    nmulti += est.multimodal;
+    if (frames % 100 == 0) {
+      printf("s %6.2f est %6.2f (%0.1f %0.1f %0.2f) sigma_s %0.2fm%s\n",
+          fmodf(s, 50), imax / BINS_PER_M, est.x, est.y, est.theta,
+          sqrtf(est.cov[0][0] + est.cov[1][1]) / TICKS_PER_M,
+          est.multimodal ? " (ambiguous)" : "");
+    }
+  }
+  double t1 = Now();
+  printf("second lap max error %0.2fm, %d/%d frames ambiguous\n",
+      maxerr, nmulti, frames);
+  printf("%0.1f us/frame\n", 1e6 * (t1 - t0) / frames);
+
+  // wide blur path: big jumps in odometry
+  t0 = Now();
+  for (int i = 0; i < 1000; i++) {
+    loc.Predict(500, 0, 1.0 / 30);
+  }
+  t1 = Now();
+  printf("wide predict %0.1f us\n", 1e6 * (t1 - t0) / 1000);
+  const float *p = loc.GetDistribution();
+  float total = 0;
+  for (int i = 0; i < n; i++) total += p[i];
+  printf("total probability %f\n", total);
+
+  return maxerr < 1 ? 0 : 1;
+}
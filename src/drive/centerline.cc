@@ -0,0 +1,250 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "drive/centerline.h"
+#include "drive/telemetry.h"
+#include "ekf.h"
+
+static int ElapsedUs(const struct timeval &t0, const struct timeval &t1) {
+  return (t1.tv_sec - t0.tv_sec) * 1000000 + (t1.tv_usec - t0.tv_usec);
+}
+
+CenterlinePipeline::SlotQueue::SlotQueue() {
+  pthread_mutex_init(&mutex_, NULL);
+  pthread_cond_init(&cond_, NULL);
+  head_ = count_ = 0;
+}
+
+CenterlinePipeline::SlotQueue::~SlotQueue() {
+  pthread_cond_destroy(&cond_);
+  pthread_mutex_destroy(&mutex_);
+}
+
+void CenterlinePipeline::SlotQueue::Push(int slot) {
+  // there are only NSLOTS slots plus one shutdown marker, so this can't
+  // overflow
+  pthread_mutex_lock(&mutex_);
+  slots_[(head_ + count_) % (NSLOTS + 1)] = slot;
+  count_++;
+  pthread_cond_signal(&cond_);
+  pthread_mutex_unlock(&mutex_);
+}
+
+int CenterlinePipeline::SlotQueue::Pop() {
+  pthread_mutex_lock(&mutex_);
+  while (count_ == 0) {
+    pthread_cond_wait(&cond_, &mutex_);
+  }
+  int slot = slots_[head_];
+  head_ = (head_ + 1) % (NSLOTS + 1);
+  count_--;
+  pthread_mutex_unlock(&mutex_);
+  return slot;
+}
+
+bool CenterlinePipeline::SlotQueue::TryPop(int *slot) {
+  pthread_mutex_lock(&mutex_);
+  bool ok = count_ > 0;
+  if (ok) {
+    *slot = slots_[head_];
+    head_ = (head_ + 1) % (NSLOTS + 1);
+    count_--;
+  }
+  pthread_mutex_unlock(&mutex_);
+  return ok;
+}
+
+CenterlinePipeline::CenterlinePipeline(const DriverConfig *config,
+    WorkerPool *pool, CenterlineReceiver *receiver) {
+  config_ = config;
+  pool_ = pool;
+  receiver_ = receiver;
+  ekf_ = new EKF;
+  reset_ = false;
+  slots_ = new Slot[NSLOTS];
+  for (int i = 0; i < NSLOTS; i++) {
+    free_.Push(i);
+  }
+  running_ = false;
+  memset(stage_time_, 0, sizeof(stage_time_));
+  memset(&latency_, 0, sizeof(latency_));
+  frames_ = overruns_ = 0;
+  drops_ = 0;
+  dropped_dt_ = 0;
+}
+
+CenterlinePipeline::~CenterlinePipeline() {
+  Shutdown();
+  delete[] slots_;
+  delete ekf_;
+}
+
+bool CenterlinePipeline::Init() {
+  if (pthread_create(&filter_thread_, NULL, filter_entry, this) != 0) {
+    perror("CenterlinePipeline: pthread_create");
+    return false;
+  }
+  if (pthread_create(&update_thread_, NULL, update_entry, this) != 0) {
+    perror("CenterlinePipeline: pthread_create");
+    filter_.Push(-1);
+    pthread_join(filter_thread_, NULL);
+    return false;
+  }
+  running_ = true;
+  return true;
+}
+
+void CenterlinePipeline::Shutdown() {
+  if (!running_) {
+    return;
+  }
+  // the marker follows any frames still in flight through both stages
+  filter_.Push(-1);
+  pthread_join(filter_thread_, NULL);
+  pthread_join(update_thread_, NULL);
+  running_ = false;
+}
+
+bool CenterlinePipeline::Submit(const uint8_t *yuv,
+    const CenterlineInputs &inputs) {
+  int i;
+  if (!free_.TryPop(&i)) {
+    dropped_dt_ += inputs.dt;
+    drops_++;
+    return false;
+  }
+  Slot *s = &slots_[i];
+  s->inputs = inputs;
+  s->inputs.dt += dropped_dt_;
+  dropped_dt_ = 0;
+
+  struct timeval t0, t1;
+  gettimeofday(&t0, NULL);
+  imgproc::Reproject(yuv, &s->ws, pool_);
+  gettimeofday(&t1, NULL);
+  s->stage_us[REPROJECT] = ElapsedUs(t0, t1);
+
+  filter_.Push(i);
+  return true;
+}
+
+void* CenterlinePipeline::filter_entry(void *arg) {
+  reinterpret_cast<CenterlinePipeline*>(arg)->FilterThread();
+  return NULL;
+}
+
+void* CenterlinePipeline::update_entry(void *arg) {
+  reinterpret_cast<CenterlinePipeline*>(arg)->UpdateThread();
+  return NULL;
+}
+
+void CenterlinePipeline::FilterThread() {
+  for (;;) {
+    int i = filter_.Pop();
+    if (i == -1) {
+      update_.Push(-1);
+      return;
+    }
+    Slot *s = &slots_[i];
+
+    struct timeval t0, t1;
+    gettimeofday(&t0, NULL);
+    // interleave the birdseye view for the display, for TophatFilter to
+    // mark up
+    const int N = imgproc::uxsiz * imgproc::uysiz;
+    for (int c = 0; c < N; c++) {
+      s->birdseye[3*c] = s->ws.planes[c];
+      s->birdseye[3*c + 1] = s->ws.planes[N + c];
+      s->birdseye[3*c + 2] = s->ws.planes[2*N + c];
+    }
+    s->detected = imgproc::TophatFilter(*config_, &s->ws,
+        &s->B, &s->y_c, &s->Rk, s->birdseye);
+    gettimeofday(&t1, NULL);
+    s->stage_us[FILTER] = ElapsedUs(t0, t1);
+
+    update_.Push(i);
+  }
+}
+
+void CenterlinePipeline::UpdateThread() {
+  for (;;) {
+    int i = update_.Pop();
+    if (i == -1) {
+      return;
+    }
+    Slot *s = &slots_[i];
+    const CenterlineInputs &in = s->inputs;
+
+    struct timeval t0, t1;
+    gettimeofday(&t0, NULL);
+    if (reset_) {
+      ekf_->Reset();
+      reset_ = false;
+    }
+    ekf_->Predict(in.dt, in.u_a, in.u_s);
+    ekf_->UpdateIMU(in.gyro_z);
+    ekf_->UpdateEncoders(in.dsdt, in.servo_pos);
+    bool detected = s->detected && ekf_->UpdateCenterline(
+        s->B[0], s->B[1], s->B[2], s->y_c, s->Rk);
+    gettimeofday(&t1, NULL);
+    s->stage_us[UPDATE] = ElapsedUs(t0, t1);
+
+    const EKF::State &x = ekf_->GetState();
+    CenterlineEstimate est;
+    est.inputs = &in;
+    est.detected = detected;
+    est.v = x[0];
+    est.delta = x[1];
+    est.y_e = x[2];
+    est.psi_e = x[3];
+    est.kappa = x[4];
+    est.kappa_var = ekf_->GetCovariance()(4, 4);
+    est.birdseye = s->birdseye;
+    receiver_->OnCenterline(est);
+
+    Record(*s);
+    free_.Push(i);
+  }
+}
+
+void CenterlinePipeline::Record(const Slot &s) {
+  for (int k = 0; k < NSTAGES; k++) {
+    stage_time_[k].sum_us += s.stage_us[k];
+    if (s.stage_us[k] > stage_time_[k].max_us) {
+      stage_time_[k].max_us = s.stage_us[k];
+    }
+  }
+  // end to end, from the frame's timestamp to its estimate being delivered
+  struct timeval t;
+  gettimeofday(&t, NULL);
+  int latency = ElapsedUs(s.inputs.t, t);
+  latency_.sum_us += latency;
+  if (latency > latency_.max_us) {
+    latency_.max_us = latency;
+  }
+  if (latency > BUDGET_US) {
+    overruns_++;
+  }
+
+  if (++frames_ < REPORT_FRAMES) {
+    return;
+  }
+  // overruns are frames whose latency went over BUDGET_US
+  static_assert(telemetry::CENTERLINE_TIMING_FIELDS == 5 + 2*NSTAGES,
+      "CENTERLINE_TIMING's schema doesn't match Record()");
+  float rec[telemetry::CENTERLINE_TIMING_FIELDS];
+  int n = 0;
+  rec[n++] = frames_;
+  for (int k = 0; k < NSTAGES; k++) {
+    rec[n++] = static_cast<float>(stage_time_[k].sum_us) / frames_;
+    rec[n++] = stage_time_[k].max_us;
+  }
+  rec[n++] = static_cast<float>(latency_.sum_us) / frames_;
+  rec[n++] = latency_.max_us;
+  rec[n++] = overruns_;
+  rec[n++] = drops_.exchange(0);
+  telemetry::Log(telemetry::CENTERLINE_TIMING, rec);
+  memset(stage_time_, 0, sizeof(stage_time_));
+  memset(&latency_, 0, sizeof(latency_));
+  frames_ = overruns_ = 0;
+}
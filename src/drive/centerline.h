@@ -0,0 +1,143 @@
+#ifndef DRIVE_CENTERLINE_H_
+#define DRIVE_CENTERLINE_H_
+
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/time.h>
+
+#include <atomic>
+
+#include "drive/config.h"
+#include "drive/imgproc.h"
+#include "drive/odohistory.h"
+
+class EKF;
+class WorkerPool;
+
+// everything the EKF needs from the car besides the camera frame, sampled
+// when the frame arrives
+struct CenterlineInputs {
+  struct timeval t;
+  float dt;          // time since the previous frame
+  float u_a, u_s;    // throttle and steering in effect over dt, -1..1
+  float gyro_z;
+  float dsdt;        // mean wheel encoder rate, ticks/s
+  uint8_t servo_pos;
+  uint16_t wheel_delta[4];
+  bool odo_valid;
+  Odometry odo;      // as of the frame's exposure
+};
+
+struct CenterlineEstimate {
+  const CenterlineInputs *inputs;
+  bool detected;  // whether this frame's centerline fit was used
+  float v, delta, y_e, psi_e, kappa;
+  float kappa_var;  // the EKF's variance on kappa
+  // interleaved uxsiz x uysiz birdseye YUV image with detections marked,
+  // only valid during the callback
+  const uint8_t *birdseye;
+};
+
+class CenterlineReceiver {
+ public:
+  // called on the pipeline's EKF thread, in frame order
+  virtual void OnCenterline(const CenterlineEstimate &est) = 0;
+};
+
+// Camera centerline following, as three pipelined stages on their own
+// threads so consecutive frames overlap:
+//
+//   reprojection  (caller's thread, split across the WorkerPool)
+//   tophat filter (filter thread)
+//   EKF update    (EKF thread, which also calls the receiver)
+//
+// Each frame in flight has its own slot with an imgproc::Workspace; if all
+// slots are busy the frame is dropped rather than blocking the camera.
+class CenterlinePipeline {
+ public:
+  CenterlinePipeline(const DriverConfig *config, WorkerPool *pool,
+      CenterlineReceiver *receiver);
+  ~CenterlinePipeline();
+
+  bool Init();
+  void Shutdown();
+
+  // reprojects yuv, which need only be valid until this returns, and
+  // queues it for the rest of the pipeline; returns false if dropped
+  bool Submit(const uint8_t *yuv, const CenterlineInputs &inputs);
+
+  // reset the EKF to its initial state before the next frame
+  void ResetFilter() { reset_ = true; }
+
+  // per-frame latency budget at 30fps
+  static const int BUDGET_US = 33333;
+
+ private:
+  // one per frame in flight; frames flow through the stages in order
+  static const int NSLOTS = 3;
+  // timing is logged as CENTERLINE_TIMING every this many frames
+  static const int REPORT_FRAMES = 300;
+
+  enum Stage { REPROJECT, FILTER, UPDATE, NSTAGES };
+
+  struct Slot {
+    imgproc::Workspace ws;
+    uint8_t birdseye[imgproc::uxsiz * imgproc::uysiz * 3];
+    CenterlineInputs inputs;
+    bool detected;
+    Eigen::Vector3f B;
+    float y_c;
+    Eigen::Matrix4f Rk;
+    int stage_us[NSTAGES];
+
+    EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+  };
+
+  // blocking FIFO of slot indices; -1 tells a stage thread to exit
+  class SlotQueue {
+   public:
+    SlotQueue();
+    ~SlotQueue();
+    void Push(int slot);
+    int Pop();
+    bool TryPop(int *slot);
+
+   private:
+    pthread_mutex_t mutex_;
+    pthread_cond_t cond_;
+    int slots_[NSLOTS + 1];
+    int head_, count_;
+  };
+
+  struct Timing {
+    int64_t sum_us;
+    int max_us;
+  };
+
+  static void* filter_entry(void *arg);
+  static void* update_entry(void *arg);
+  void FilterThread();
+  void UpdateThread();
+  void Record(const Slot &s);
+
+  const DriverConfig *config_;
+  WorkerPool *pool_;
+  CenterlineReceiver *receiver_;
+  EKF *ekf_;
+  volatile bool reset_;
+
+  Slot *slots_;
+  SlotQueue free_, filter_, update_;
+  pthread_t filter_thread_, update_thread_;
+  bool running_;
+
+  // only touched on the EKF thread
+  Timing stage_time_[NSTAGES];
+  Timing latency_;
+  int frames_, overruns_;
+
+  std::atomic<int> drops_;
+  float dropped_dt_;  // carried into the next frame's prediction
+};
+
+#endif  // DRIVE_CENTERLINE_H_
@@ -4,6 +4,8 @@
 #include <cstdint>
 #include <cstdio>
 
+enum { CONTROLLER_LAW = 0, CONTROLLER_MPC = 1 };
+
 // Dynamic configuration variables
 // can be changed via commandline or controller
 class DriverConfig {
@@ -13,6 +15,8 @@ class DriverConfig {
   // all these int16_ts are 1/100th scale
   int16_t speed_limit;  // m/s, maximum allowed speed
   int16_t traction_limit;  // m/s^2 (lateral force, v*w product)
+  int16_t accel_limit;  // m/s^2, planned acceleration out of turns
+  int16_t brake_limit;  // m/s^2, planned braking into turns
 
   int16_t steering_kpy;  // PID curve following proportional const
   int16_t steering_kvy;  // derivative const
@@ -22,12 +26,32 @@ class DriverConfig {
 
   int16_t lm_precision;  // landmark precision (1/sigma^2)
 
+  // centerline (-c) mode: yellow line activation is
+  // (y_scale*Y + u_scale*U + v_scale*V)/100 - yellow_thresh
+  // on the tophat-filtered birdseye image
+  int16_t y_scale;
+  int16_t u_scale;
+  int16_t v_scale;
+  int16_t yellow_thresh;
+
+  // autodrive steering and speed: CONTROLLER_LAW is
+  // DriveController::LineCurvature with the speed profile, CONTROLLER_MPC
+  // the sampling MPC
+  int16_t controller;
+
+  // Hz; steering and throttle are updated this often from the gyro and
+  // encoders on a thread of their own (100..500), or with every camera
+  // frame if 0. read at startup
+  int16_t control_hz;
+
   DriverConfig() {
     // Default values
     cone_thresh = 300;
 
     speed_limit = 4.0 * 100;
     traction_limit = 4.0 * 100;
+    accel_limit = 2.0 * 100;
+    brake_limit = 3.0 * 100;
 
     steering_kpy = 1.0 * 100;
     steering_kvy = 5.0 * 100;
@@ -36,6 +60,14 @@ class DriverConfig {
     yaw_bw = 0.50 * 100;
 
     lm_precision = 1.0 * 100;
+
+    y_scale = 0.25 * 100;
+    u_scale = -2.0 * 100;
+    v_scale = 0.5 * 100;
+    yellow_thresh = 30;
+
+    controller = CONTROLLER_LAW;
+    control_hz = 200;
   }
 
   bool Save() {
@@ -1,8 +1,10 @@
 #include <math.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <unistd.h>
 
 #include "drive/controller.h"
+#include "drive/telemetry.h"
 
 using Eigen::Vector3f;
 
@@ -20,9 +22,14 @@ const float M_K2 = 5.6;
 const float M_K3 = 0.5;
 
 DriveController::DriveController() {
+  follow_line_ = false;
+  profile_speed_limit_ = -1;
   ResetState();
-  if (!track_.LoadTrack("track.txt")) {
-    fprintf(stderr, "***WARNING: NO TRACK LOADED; check track.txt***\n");
+  // prefer the binary track written by trackplan, if there is one
+  const char *trackfile = access("track.bin", R_OK) == 0 ?
+    "track.bin" : "track.txt";
+  if (!track_.LoadTrack(trackfile)) {
+    fprintf(stderr, "***WARNING: NO TRACK LOADED; check %s***\n", trackfile);
   }
 }
 
@@ -31,6 +38,7 @@ void DriveController::ResetState() {
   w_ = 0;
   ierr_v_ = 0;
   ierr_w_ = 0;
+  mpc_k_ = 0;
 }
 
 static inline float clip(float x, float min, float max) {
@@ -62,33 +70,110 @@ void DriveController::UpdateState(const DriverConfig &config,
   w_ = gyro[2];
 }
 
+// rebuild the track's speed profile if the limits it was built with have
+// been changed
+void DriveController::UpdateSpeedProfile(const DriverConfig &config) {
+  if (config.speed_limit == profile_speed_limit_ &&
+      config.traction_limit == profile_traction_limit_ &&
+      config.accel_limit == profile_accel_limit_ &&
+      config.brake_limit == profile_brake_limit_) {
+    return;
+  }
+  profile_speed_limit_ = config.speed_limit;
+  profile_traction_limit_ = config.traction_limit;
+  profile_accel_limit_ = config.accel_limit;
+  profile_brake_limit_ = config.brake_limit;
+  track_.BuildSpeedProfile(config.speed_limit * 0.01,
+      config.traction_limit * 0.01, config.accel_limit * 0.01,
+      config.brake_limit * 0.01, V_SCALE);
+}
+
 // this is the main autodrive control system
 float DriveController::TargetCurvature(const DriverConfig &config) {
-  float cx, cy, nx, ny, k, t;
-  if (!track_.GetTarget(x_, y_, &cx, &cy, &nx, &ny, &k, &t)) {
+  if (follow_line_) {
+    return LineCurvature(config, line_ye_,
+        cos(line_psie_), sin(line_psie_), line_kappa_);
+  }
+
+  float ye, Cp, Sp, k;
+  if (!TrackError(&ye, &Cp, &Sp, &k)) {
     return 2;  // circle right if you're confused
   }
+  return LineCurvature(config, ye, Cp, Sp, k);
+}
+
+// our offset (m), heading error and the curvature (1/m) of the closest
+// point on the track map
+bool DriveController::TrackError(float *ye, float *Cp, float *Sp, float *k) {
+  float cx, cy, nx, ny, t;
+  if (!track_.GetTarget(x_, y_, &cx, &cy, &nx, &ny, k, &t)) {
+    return false;
+  }
 
-  float ye = ((x_ - cx)*nx + (y_ - cy)*ny) * V_SCALE;
-  k /= V_SCALE;
+  *ye = ((x_ - cx)*nx + (y_ - cy)*ny) * V_SCALE;
+  *k /= V_SCALE;
 
   float C = cos(theta_), S = sin(theta_);
   // cosine of psie = (S, -C).(nx, ny)
-  float Cp = S*nx - C*ny;
+  *Cp = S*nx - C*ny;
   // sine of psie = (S, -C)x(nx, ny)  (i think?)
-  float Sp = S*ny + C*nx;
+  *Sp = S*ny + C*nx;
   // float Sp = -S*ny - C*nx;
+  return true;
+}
+
+// steering and speed from the sampling MPC, along the centerline or the
+// track map's speed profile
+bool DriveController::MPCTarget(const DriverConfig &config,
+    float *k, float *v) {
+  MPCController::Reference ref;
+  float ye, Cp, Sp;
+  if (follow_line_) {
+    // the line's curvature is all we know of what's ahead
+    ye = line_ye_;
+    Cp = cos(line_psie_);
+    Sp = sin(line_psie_);
+    float vmax = config.speed_limit * 0.01;
+    float alat = config.traction_limit * 0.01;
+    float vr = vmax;
+    if (fabs(line_kappa_) * vmax * vmax > alat) {
+      vr = sqrt(alat / fabs(line_kappa_));
+    }
+    for (int t = 0; t < MPCController::HORIZON; t++) {
+      ref.k[t] = line_kappa_;
+      ref.v[t] = vr;
+    }
+  } else {
+    float kr;
+    if (!track_.HasSpeedProfile() || !TrackError(&ye, &Cp, &Sp, &kr)) {
+      return false;
+    }
+    float s = track_.GetArcLength(x_, y_);
+    for (int t = 0; t < MPCController::HORIZON; t++) {
+      ref.v[t] = track_.GetProfileSpeed(s);
+      ref.k[t] = track_.GetCurvature(s) / V_SCALE;
+      s += ref.v[t] * MPCController::DT / V_SCALE;
+    }
+  }
+
+  // at a crawl the gyro says little about curvature, so go by what we
+  // last asked for
+  float k0 = velocity_ > 0.5 ? w_ / velocity_ : mpc_k_;
+  mpc_.Plan(config, ye, Cp, Sp, velocity_, k0, ref, k, v);
+  mpc_k_ = *k;
+  return true;
+}
+
+// curvature to steer to converge onto a line we're ye off of, at an angle
+// with cosine Cp and sine Sp, which itself has curvature k
+float DriveController::LineCurvature(const DriverConfig &config, float ye,
+    float Cp, float Sp, float k) {
   float Cpy = Cp / (1 - k * ye);
 
   float Kpy = config.steering_kpy * 0.01;
   float Kvy = config.steering_kvy * 0.01;
   float targetk = -Cpy*(ye*Cpy*(-Kpy*Cp) + Sp*(k*Sp - Kvy*Cp) + k);
 
-  printf("x=%f,%f c=%f,%f n=(%f,%f)\n", x_, y_, cx, cy, nx, ny);
-  printf("ye=%f psie=(%f,%f) k=%f Cpy=%f\n", ye, Cp, Sp, k, Cpy);
-  printf("psie=%f Kpp=%f Kvy=%f targetk=%f\n", atan2(Sp, Cp), Kpy, Kvy, targetk);
-
-  //printf("targetk=%f\n", targetk);
   return targetk;
   // return ye * Kpy;  // - k;
 }
@@ -112,17 +197,30 @@ bool DriveController::GetControl(const DriverConfig &config,
   // max curvature is 1m radius
   float k = -steering_in * 2;
   float vmax = throttle_in * config.speed_limit * 0.01;
-  if (autodrive) {
-    k = TargetCurvature(config);
-    vmax = config.speed_limit * 0.01;
-    // FIXME: brake before turns
+  float target_v;
+  if (autodrive && !follow_line_) {
+    UpdateSpeedProfile(config);
   }
+  if (autodrive && config.controller == CONTROLLER_MPC &&
+      MPCTarget(config, &k, &target_v)) {
+    // the MPC plans its own speed, braking ahead of turns on the track
+  } else if (autodrive && !follow_line_ && track_.HasSpeedProfile()) {
+    // on the track map, speed comes from the precomputed profile, which
+    // already brakes ahead of turns
+    k = TargetCurvature(config);
+    target_v = track_.GetTargetSpeed(x_, y_);
+  } else {
+    if (autodrive) {
+      k = TargetCurvature(config);
+      vmax = config.speed_limit * 0.01;
+    }
 
-  float kmin = config.traction_limit * 0.01 / (vmax*vmax);
+    float kmin = config.traction_limit * 0.01 / (vmax*vmax);
 
-  float target_v = vmax;
-  if (fabs(k) > kmin) {  // any curvature more than this will reduce speed
-    target_v = sqrt(config.traction_limit * 0.01 / fabs(k));
+    target_v = vmax;
+    if (fabs(k) > kmin) {  // any curvature more than this will reduce speed
+      target_v = sqrt(config.traction_limit * 0.01 / fabs(k));
+    }
   }
 
   // use average of target velocity and current velocity to determine
@@ -134,25 +232,25 @@ bool DriveController::GetControl(const DriverConfig &config,
 
   float BW_w = 2*M_PI*0.01*config.yaw_bw;
   *steering_out = clip(-BW_w/target_v * (ierr_w_ + err_w / BW_SRV), -1, 1);
-  printf("k=%f v=%f kv=%f\n", k, velocity_, target_w);
-  printf("w control: w=%f/%f err_w=%f ierr_w=%f out=%f\n",
-      w_, target_w, err_w, ierr_w_, *steering_out);
 
   float BW_v = 2*M_PI*0.01*config.motor_bw;
   float Kp = BW_v / (M_K1 - M_K2*velocity_);
   float Ki = M_K3;
   *throttle_out = clip(-Kp*(err_v + Ki*ierr_v_), 0, 1);
-  if (*throttle_out == 0 && velocity_ > 0) {  // handle braking
+  bool braking = *throttle_out == 0 && velocity_ > 0;
+  if (braking) {
     // alternate control law
-    float Kp2 = BW_v / (-M_K2*velocity_);
-    *throttle_out = clip(Kp2*(err_v + Ki*ierr_v_), -1, 0);
-    // printf("v brake: v=%f/%f Kp=%f Ki=%f err_v=%f ierr_v=%f out=%f\n",
-    //     velocity_, target_v, Kp, Ki, err_v, ierr_v_, *throttle_out);
-  } else {
-    printf("v control: v=%f/%f Kp=%f Ki=%f err_v=%f ierr_v=%f out=%f\n",
-        velocity_, target_v, Kp, Ki, err_v, ierr_v_, *throttle_out);
+    Kp = BW_v / (-M_K2*velocity_);
+    *throttle_out = clip(Kp*(err_v + Ki*ierr_v_), -1, 0);
   }
 
+  // as in telemetry::schemas
+  float rec[] = {
+    k, velocity_, target_v, w_, target_w, err_w, ierr_w_, *steering_out,
+    Kp, Ki, err_v, ierr_v_, *throttle_out, static_cast<float>(braking)
+  };
+  telemetry::Log(telemetry::CONTROL, rec);
+
   ierr_v_ += dt*err_v;
   if ((*steering_out > -1 && *steering_out < 1) ||
       (err_w > 0 && ierr_w_ < 0) || (err_w < 0 && ierr_w_ > 0)) {
@@ -5,6 +5,7 @@
 #include <math.h>
 
 #include "drive/config.h"
+#include "drive/mpc.h"
 #include "drive/trajtrack.h"
 
 class DriveController {
@@ -24,6 +25,16 @@ class DriveController {
     theta_ = theta;
   }
 
+  // steer by the camera's centerline estimate rather than the track map;
+  // y_e and psi_e are our offset and heading relative to the line, kappa
+  // its curvature
+  void UpdateCenterline(float y_e, float psi_e, float kappa) {
+    follow_line_ = true;
+    line_ye_ = y_e;
+    line_psie_ = psi_e;
+    line_kappa_ = kappa;
+  }
+
   bool GetControl(const DriverConfig &config,
       float throttle_in, float steering_in,
       float *throttle_out, float *steering_out, float dt,
@@ -33,8 +44,24 @@ class DriveController {
 
   TrajectoryTracker *GetTracker() { return &track_; }
 
+  void GetLocation(float *x, float *y, float *theta) const {
+    *x = x_;
+    *y = y_;
+    *theta = theta_;
+  }
+  float GetVelocity() const { return velocity_; }
+
+  // the geometric steering law: curvature to steer to converge onto a line
+  // we're ye off of, at an angle with cosine Cp and sine Sp, which itself
+  // has curvature k
+  static float LineCurvature(const DriverConfig &config, float ye,
+      float Cp, float Sp, float k);
+
  private:
   float TargetCurvature(const DriverConfig &config);
+  bool TrackError(float *ye, float *Cp, float *Sp, float *k);
+  bool MPCTarget(const DriverConfig &config, float *k, float *v);
+  void UpdateSpeedProfile(const DriverConfig &config);
 
   // car state
   float x_, y_, theta_;
@@ -42,7 +69,14 @@ class DriveController {
   float w_;  // yaw rate
   float ierr_v_;  // integration error for velocity
   float ierr_w_;  // integration error for yaw rate
+  bool follow_line_;
+  float line_ye_, line_psie_, line_kappa_;
   TrajectoryTracker track_;
+  MPCController mpc_;
+  float mpc_k_;  // last curvature the MPC asked for
+  // config the track's speed profile was built for
+  int16_t profile_speed_limit_, profile_traction_limit_;
+  int16_t profile_accel_limit_, profile_brake_limit_;
 };
 
 #endif  // DRIVE_CONTROLLER_H_
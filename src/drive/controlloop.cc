@@ -0,0 +1,250 @@
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "drive/controlloop.h"
+#include "drive/telemetry.h"
+
+static int64_t ElapsedNs(const struct timespec &t0,
+    const struct timespec &t1) {
+  return (t1.tv_sec - t0.tv_sec) * 1000000000LL + (t1.tv_nsec - t0.tv_nsec);
+}
+
+static void AddNs(struct timespec *t, int64_t ns) {
+  ns += t->tv_nsec;
+  t->tv_sec += ns / 1000000000;
+  t->tv_nsec = ns % 1000000000;
+}
+
+ControlLoop::ControlLoop(DriveController *controller,
+    DriverConfig *config, ControlHardware *hw,
+    OdometryHistory *odometry) {
+  controller_ = controller;
+  config_ = config;
+  hw_ = hw;
+  odometry_ = odometry;
+  running_ = done_ = false;
+  pthread_mutex_init(&mutex_, NULL);
+  corrected_ = false;
+  line_valid_ = false;
+  reset_ = reload_ = false;
+  history_n_ = 0;
+  throttle_ = steering_ = 0;
+  actuate_us_ = 0;
+  ticks_ = overruns_ = 0;
+  tick_sum_ns_ = 0;
+  tick_max_ns_ = 0;
+}
+
+ControlLoop::~ControlLoop() {
+  Shutdown();
+  pthread_mutex_destroy(&mutex_);
+}
+
+bool ControlLoop::Init() {
+  done_ = false;
+  if (pthread_create(&thread_, NULL, thread_entry, this) != 0) {
+    perror("ControlLoop: pthread_create");
+    return false;
+  }
+  // ahead of the camera and localizer threads if we're allowed; it's fine
+  // if not
+  struct sched_param param;
+  param.sched_priority = 10;
+  pthread_setschedparam(thread_, SCHED_FIFO, &param);
+  running_ = true;
+  return true;
+}
+
+void ControlLoop::Shutdown() {
+  if (!running_) {
+    return;
+  }
+  done_ = true;
+  pthread_join(thread_, NULL);
+  running_ = false;
+}
+
+void ControlLoop::CorrectPose(const Odometry &at, float x, float y,
+    float theta) {
+  pthread_mutex_lock(&mutex_);
+  corrected_ = true;
+  correction_at_ = at;
+  correction_x_ = x;
+  correction_y_ = y;
+  correction_theta_ = theta;
+  pthread_mutex_unlock(&mutex_);
+}
+
+void ControlLoop::SetCenterline(const Odometry &at, float y_e, float psi_e,
+    float kappa) {
+  pthread_mutex_lock(&mutex_);
+  line_valid_ = true;
+  line_at_ = at;
+  line_ye_ = y_e;
+  line_psie_ = psi_e;
+  line_kappa_ = kappa;
+  pthread_mutex_unlock(&mutex_);
+}
+
+void ControlLoop::Reset(const DriverConfig *config) {
+  pthread_mutex_lock(&mutex_);
+  reset_ = true;
+  if (config) {
+    reload_ = true;
+    reload_config_ = *config;
+  }
+  pthread_mutex_unlock(&mutex_);
+}
+
+void* ControlLoop::thread_entry(void *arg) {
+  reinterpret_cast<ControlLoop*>(arg)->Run();
+  return NULL;
+}
+
+void ControlLoop::Run() {
+  struct timespec next, last;
+  clock_gettime(CLOCK_MONOTONIC, &next);
+  last = next;
+  report_t_ = next;
+  while (!done_) {
+    int hz = config_->control_hz;
+    if (hz < MIN_HZ) hz = MIN_HZ;
+    if (hz > MAX_HZ) hz = MAX_HZ;
+    int64_t period_ns = 1000000000 / hz;
+
+    AddNs(&next, period_ns);
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+
+    struct timespec now, end;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    float dt = ElapsedNs(last, now) * 1e-9;
+    last = now;
+    Tick(dt, now);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    // if we've fallen a whole period behind, skip ahead rather than trying
+    // to catch up
+    if (ElapsedNs(next, end) > period_ns) {
+      overruns_++;
+      next = end;
+    }
+    Report(ElapsedNs(now, end));
+  }
+}
+
+void ControlLoop::Tick(float dt, const struct timespec &now) {
+  pthread_mutex_lock(&mutex_);
+  bool reset = reset_;
+  reset_ = false;
+  if (reload_) {
+    *config_ = reload_config_;
+    reload_ = false;
+  }
+  pthread_mutex_unlock(&mutex_);
+  if (reset) {
+    controller_->ResetState();
+  }
+
+  SensorState s;
+  bool first = history_n_ == 0;
+  if (!hw_->ReadSensors(&s)) {
+    if (first) {
+      return;
+    }
+    s = sensors_;  // carry on with what we had
+  }
+
+  // carry the latest estimate over to when this tick's controls should
+  // take effect
+  Odometry act;
+  odometry_->At(AddMicros(now, actuate_us_), &act);
+  float x = 0, y = 0, theta = 0;
+  bool located, follow_line;
+  float ye, psie, kappa;
+  pthread_mutex_lock(&mutex_);
+  located = corrected_;
+  if (corrected_) {
+    x = correction_x_;
+    y = correction_y_;
+    theta = correction_theta_;
+    OdometryHistory::Propagate(correction_at_, act, &x, &y, &theta);
+  }
+  follow_line = line_valid_;
+  ye = line_ye_;
+  psie = line_psie_;
+  kappa = line_kappa_;
+  if (line_valid_) {
+    OdometryHistory::PropagateCenterline(line_at_, act, kappa, &ye, &psie);
+  }
+  pthread_mutex_unlock(&mutex_);
+
+  // wheel speed since the most recent sample at least VELOCITY_WINDOW ago,
+  // or the oldest we have
+  int h = history_n_ % HISTORY;
+  history_t_[h] = now;
+  memcpy(history_wheels_[h], s.wheel_pos, sizeof(s.wheel_pos));
+  history_n_++;
+  int oldest = (history_n_ < HISTORY ? history_n_ : HISTORY) - 1;
+  int back = 0;
+  while (back < oldest &&
+      ElapsedNs(history_t_[(h + HISTORY - back) % HISTORY], now) * 1e-9
+      < VELOCITY_WINDOW) {
+    back++;
+  }
+  int h0 = (h + HISTORY - back) % HISTORY;
+  uint16_t wheel_delta[4];
+  for (int i = 0; i < 4; i++) {
+    wheel_delta[i] = s.wheel_pos[i] - history_wheels_[h0][i];
+  }
+  float window = ElapsedNs(history_t_[h0], now) * 1e-9;
+
+  if (follow_line) {
+    controller_->UpdateCenterline(ye, psie, kappa);
+  } else if (located) {
+    controller_->UpdateLocation(x, y, theta);
+  }
+  if (window > 0) {
+    controller_->UpdateState(*config_, throttle_ / 127.0, steering_ / 127.0,
+        s.accel, s.gyro, s.servo_pos, wheel_delta, window);
+  }
+
+  float js_throttle, js_steering, u_a, u_s;
+  bool autodrive;
+  hw_->GetCommands(&js_throttle, &js_steering, &autodrive);
+  if (dt > 0 && controller_->GetControl(*config_, js_throttle, js_steering,
+        &u_a, &u_s, dt, autodrive)) {
+    throttle_ = 127 * u_a;
+    steering_ = 127 * u_s;
+    hw_->Actuate(throttle_, steering_);
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    // smoothed, so one slow I2C write doesn't throw the next tick off
+    int us = ElapsedNs(now, end) / 1000 + hw_->ActuationDelayMicros();
+    actuate_us_ += (us - actuate_us_) / 8;
+  }
+  sensors_ = s;
+}
+
+void ControlLoop::Report(int tick_ns) {
+  ticks_++;
+  tick_sum_ns_ += tick_ns;
+  if (tick_ns > tick_max_ns_) {
+    tick_max_ns_ = tick_ns;
+  }
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  float elapsed = ElapsedNs(report_t_, t) * 1e-9;
+  if (elapsed < REPORT_SECS) {
+    return;
+  }
+  float rec[] = {
+    ticks_ / elapsed, tick_sum_ns_ / ticks_ / 1000.0f, tick_max_ns_ / 1000.0f,
+    static_cast<float>(overruns_), static_cast<float>(actuate_us_)
+  };
+  telemetry::Log(telemetry::CONTROL_TIMING, rec);
+  ticks_ = overruns_ = 0;
+  tick_sum_ns_ = 0;
+  tick_max_ns_ = 0;
+  report_t_ = t;
+}
@@ -0,0 +1,117 @@
+#ifndef DRIVE_CONTROLLOOP_H_
+#define DRIVE_CONTROLLOOP_H_
+
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "drive/config.h"
+#include "drive/controller.h"
+#include "drive/odohistory.h"
+#include "drive/sensorstate.h"
+
+// where the control loop gets its sensors and commands and sends its
+// outputs; the car, or a simulation of it
+class ControlHardware {
+ public:
+  virtual ~ControlHardware() {}
+
+  // the latest reading; the hardware integrates every reading, including
+  // any between ticks, into the loop's OdometryHistory
+  virtual bool ReadSensors(SensorState *s) = 0;
+  // joystick throttle and steering, -1..1, and whether to drive ourselves
+  virtual void GetCommands(float *throttle, float *steering,
+      bool *autodrive) = 0;
+  virtual void Actuate(int8_t throttle, int8_t steering) = 0;
+  // if Actuate only leaves the controls to be sent, how long they've lately
+  // been taking to go out after it returns
+  virtual int ActuationDelayMicros() { return 0; }
+};
+
+// Runs DriveController on its own thread at config.control_hz, reading the
+// gyro and encoders every tick, so steering reacts to them within a tick
+// rather than a camera frame.
+//
+// The hardware integrates every sensor reading into an OdometryHistory.
+// The camera thread looks up the odometry as of each frame's exposure, and
+// hands it back with the localizer's estimate for that frame; the odometry
+// since then, and what's expected before the tick's controls reach the
+// car, is carried over onto the estimate, so the correction can arrive as
+// late as it likes.
+class ControlLoop {
+ public:
+  ControlLoop(DriveController *controller, DriverConfig *config,
+      ControlHardware *hw, OdometryHistory *odometry);
+  ~ControlLoop();
+
+  bool Init();
+  void Shutdown();
+  bool IsRunning() const { return running_; }
+
+  // the localizer's estimate of where we were at odometry at
+  void CorrectPose(const Odometry &at, float x, float y, float theta);
+
+  // in centerline mode, the latest estimate as of odometry at
+  void SetCenterline(const Odometry &at, float y_e, float psi_e,
+      float kappa);
+
+  // reset the controller's state, and if config isn't NULL, copy it over
+  // the loop's config, at the start of the next tick; so other threads
+  // needn't touch either while a tick might be using them
+  void Reset(const DriverConfig *config);
+
+  // how long from the start of a tick until its controls are sent,
+  // including any ActuationDelayMicros, which is how far ahead it predicts
+  int GetActuationMicros() const { return actuate_us_; }
+
+  // control rates outside this range are clamped
+  static const int MIN_HZ = 100, MAX_HZ = 500;
+
+ private:
+  // wheel speed is measured over at least this long, so individual encoder
+  // ticks don't make it jump around
+  static constexpr float VELOCITY_WINDOW = 1.0 / 30;
+  static const int HISTORY = MAX_HZ / 10;  // > VELOCITY_WINDOW at MAX_HZ
+  // timing is reported every this many seconds
+  static const int REPORT_SECS = 10;
+
+  static void* thread_entry(void *arg);
+  void Run();
+  void Tick(float dt, const struct timespec &now);
+  void Report(int tick_ns);
+
+  DriveController *controller_;
+  DriverConfig *config_;
+  ControlHardware *hw_;
+  OdometryHistory *odometry_;
+
+  pthread_t thread_;
+  volatile bool running_, done_;
+
+  // guards everything below which other threads touch
+  pthread_mutex_t mutex_;
+  // the pose at odometry correction_at_ was correction_
+  bool corrected_;
+  Odometry correction_at_;
+  float correction_x_, correction_y_, correction_theta_;
+  bool line_valid_;
+  Odometry line_at_;
+  float line_ye_, line_psie_, line_kappa_;
+  bool reset_, reload_;
+  DriverConfig reload_config_;
+
+  // only touched on the control thread
+  SensorState sensors_;
+  struct timespec history_t_[HISTORY];
+  uint16_t history_wheels_[HISTORY][4];
+  int history_n_;
+  int8_t throttle_, steering_;
+  volatile int actuate_us_;
+
+  int ticks_, overruns_;
+  int64_t tick_sum_ns_;
+  int tick_max_ns_;
+  struct timespec report_t_;
+};
+
+#endif  // DRIVE_CONTROLLOOP_H_
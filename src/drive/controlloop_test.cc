@@ -0,0 +1,176 @@
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <atomic>
+
+#include "drive/controlloop.h"
+
+// drive a simulated car around a circle under manual control, and check
+// the loop's rate, dead reckoning, pose corrections and speed estimate,
+// then reset it with a new config
+
+const float SPEED = 50;  // encoder ticks/s, 1m/s
+const float YAW_RATE = 0.5;
+
+class SimCar : public ControlHardware {
+ public:
+  explicit SimCar(OdometryHistory *odometry) : odometry_(odometry) {
+    clock_gettime(CLOCK_MONOTONIC, &t0_);
+    reads = actuations = 0;
+  }
+
+  // where we are t seconds in
+  void Pose(double t, float *x, float *y, float *theta) const {
+    float r = SPEED / YAW_RATE;
+    *theta = YAW_RATE * t;
+    *x = r * sin(*theta);
+    *y = r * (1 - cos(*theta));
+  }
+
+  double Now() const {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (t.tv_sec - t0_.tv_sec) + (t.tv_nsec - t0_.tv_nsec) * 1e-9;
+  }
+
+  virtual bool ReadSensors(SensorState *s) {
+    double t = Now();
+    clock_gettime(CLOCK_MONOTONIC, &s->t);
+    s->accel = Eigen::Vector3f(0, 0, 0);
+    s->gyro = Eigen::Vector3f(0, 0, YAW_RATE);
+    s->servo_pos = 110;
+    for (int i = 0; i < 4; i++) {
+      s->wheel_pos[i] = static_cast<uint16_t>(SPEED * t);
+      s->wheel_dt[i] = 2e6 / SPEED;  // us between every other tick
+    }
+    odometry_->Integrate(*s);
+    reads++;
+    return true;
+  }
+
+  virtual void GetCommands(float *throttle, float *steering,
+      bool *autodrive) {
+    *throttle = 0.5;
+    *steering = 0.1;
+    *autodrive = false;
+  }
+
+  virtual void Actuate(int8_t throttle, int8_t steering) {
+    actuations++;
+  }
+
+  std::atomic<int> reads, actuations;
+
+ private:
+  OdometryHistory *odometry_;
+  struct timespec t0_;
+};
+
+int main() {
+  DriverConfig config;
+  config.control_hz = 250;
+  DriveController controller;
+  OdometryHistory odometry;
+  SimCar car(&odometry);
+  ControlLoop loop(&controller, &config, &car, &odometry);
+  int failures = 0;
+
+  if (!loop.Init()) {
+    return 1;
+  }
+  usleep(500000);
+
+  // a frame taken now, whose pose estimate arrives 100ms later
+  struct timespec exposure;
+  clock_gettime(CLOCK_MONOTONIC, &exposure);
+  double tframe = car.Now();
+  usleep(100000);
+  Odometry at;
+  odometry.At(exposure, &at);
+  float x, y, theta;
+  car.Pose(tframe, &x, &y, &theta);
+  // the estimate's off by a constant offset, which should carry through
+  loop.CorrectPose(at, x + 10, y - 5, theta);
+  usleep(400000);
+
+  Odometry odo;
+  odometry.Latest(&odo);
+  double t = car.Now();
+  loop.Shutdown();
+
+  float hz = car.reads / t;
+  printf("%0.1f Hz, %d reads, %d actuations\n", hz, int(car.reads),
+      int(car.actuations));
+  if (fabs(hz - config.control_hz) > 0.1 * config.control_hz) {
+    printf("FAIL: control rate %f, expected %d\n", hz, config.control_hz);
+    failures++;
+  }
+  if (car.actuations < car.reads - 2) {
+    printf("FAIL: only %d actuations\n", int(car.actuations));
+    failures++;
+  }
+
+  // odometry starts at the origin when the loop does, so it's the true
+  // pose less where we were at the first tick
+  float x0, y0, theta0, xt, yt, thetat;
+  car.Pose(t - odo.s / SPEED, &x0, &y0, &theta0);
+  car.Pose(t, &xt, &yt, &thetat);
+  float C = cos(-theta0), S = sin(-theta0);
+  float ex = C*(xt - x0) - S*(yt - y0), ey = S*(xt - x0) + C*(yt - y0);
+  printf("odometry (%0.2f, %0.2f, %0.3f) expected (%0.2f, %0.2f, %0.3f), "
+      "%0.1f ticks/s\n", odo.x, odo.y, odo.theta, ex, ey, thetat - theta0,
+      odo.v);
+  if (hypot(odo.x - ex, odo.y - ey) > 1.0 ||
+      fabs(odo.theta - (thetat - theta0)) > 0.02 ||
+      fabs(odo.v - SPEED) > 0.01 * SPEED) {
+    printf("FAIL: dead reckoning\n");
+    failures++;
+  }
+
+  // the controller got the corrected pose: apply the same correction
+  float v = controller.GetVelocity();
+  printf("velocity %0.3f m/s\n", v);
+  if (fabs(v - SPEED * 0.02) > 0.1) {
+    printf("FAIL: velocity %f, expected %f\n", v, SPEED * 0.02);
+    failures++;
+  }
+  float cx, cy, ctheta;
+  controller.GetLocation(&cx, &cy, &ctheta);
+  float tx, ty, ttheta;
+  car.Pose(t, &tx, &ty, &ttheta);
+  printf("controller pose (%0.2f, %0.2f, %0.3f) expected (%0.2f, %0.2f, "
+      "%0.3f)\n", cx, cy, ctheta, tx + 10, ty - 5, ttheta);
+  if (hypot(cx - (tx + 10), cy - (ty - 5)) > 1.0 ||
+      fabs(ctheta - ttheta) > 0.02) {
+    printf("FAIL: corrected pose\n");
+    failures++;
+  }
+
+  // a config posted with a reset takes over at the next tick
+  DriverConfig reload = config;
+  reload.control_hz = 125;
+  loop.Reset(&reload);
+  if (!loop.Init()) {
+    return 1;
+  }
+  usleep(100000);
+  int reads0 = car.reads;
+  double t0 = car.Now();
+  usleep(400000);
+  hz = (car.reads - reads0) / (car.Now() - t0);
+  loop.Shutdown();
+  printf("after reset: %0.1f Hz, velocity %0.3f m/s\n", hz,
+      controller.GetVelocity());
+  if (config.control_hz != reload.control_hz ||
+      fabs(hz - reload.control_hz) > 0.1 * reload.control_hz) {
+    printf("FAIL: control rate %f after reloading, expected %d\n", hz,
+        reload.control_hz);
+    failures++;
+  }
+
+  printf("%d failures\n", failures);
+  return failures ? 1 : 0;
+}
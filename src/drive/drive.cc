@@ -1,28 +1,54 @@
 #include <fcntl.h>
 #include <fenv.h>
 #include <getopt.h>
+#include <math.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/time.h>
 
+#include "coneslam/fastslam.h"
 #include "coneslam/imgproc.h"
 #include "coneslam/localize.h"
+#include "coneslam/trackloc.h"
+#include "drive/centerline.h"
 #include "drive/config.h"
 #include "drive/controller.h"
+#include "drive/controlloop.h"
 #include "drive/flushthread.h"
+#include "drive/imgproc.h"
+#include "drive/odohistory.h"
+#include "drive/sensorstate.h"
+#include "drive/telemetry.h"
 #include "hw/cam/cam.h"
 // #include "hw/car/pca9685.h"
 #include "hw/car/teensy.h"
+#include "hw/gpio/i2cbus.h"
 #include "hw/imu/imu.h"
 #include "hw/input/js.h"
 #include "ui/display.h"
+#include "util/workerpool.h"
 
 // #undef this to disable camera, just to record w/ raspivid while
 // driving around w/ controller
 #define CAMERA 1
 
-const int NUM_PARTICLES = 300;
+// particle count bounds for KLD-sampling; the localizer starts out (and
+// resets to) the maximum and shrinks as it converges
+const int MIN_PARTICLES = 50;
+const int MAX_PARTICLES = 1000;
+
+// FastSLAM (-s) mode: particle count and map capacity
+const int SLAM_PARTICLES = 1000;
+const int SLAM_MAX_LANDMARKS = 32;
+
+// track (-t) mode localizes from the centerline EKF's curvature, with its
+// precision deflated by this as tools/replay/localize.py does
+const float TRACK_KAPPA_PRECISION = 0.01;
+
+// the camera callback thread plus three workers, one per core
+const int NUM_THREADS = 4;
 
 volatile bool done = false;
 
@@ -36,19 +62,37 @@ int16_t js_throttle_ = 0, js_steering_ = 0;
 void handle_sigint(int signo) { done = true; }
 
 I2C i2c;
-// PCA9685 pca(i2c);
-Teensy teensy(i2c);
-IMU imu(i2c);
+// everything on the bus goes through its thread
+I2CBus i2c_bus(i2c);
+// PCA9685 pca(i2c_bus);
+Teensy teensy(i2c_bus);
+IMU imu(i2c_bus);
+// the teensy's feedback is polled in the background, and read sensors take
+// the latest unless it's more than a few polls old
+const int TEENSY_POLL_HZ = 200;
+int teensy_poll_ = -1;
+// and its controls are left in a mailbox for the bus thread, so nothing
+// computing them waits on the bus
+int teensy_controls_ = -1;
+// and how often the bus reports how busy it's been
+const int I2C_REPORT_SECS = 10;
+// the IMU's interrupt pin, pulsed as it takes each sample
+const int IMU_DRDY_GPIO = 17;
+GPIOEdge imu_drdy_;
 UIDisplay display_;
 FlushThread flush_thread_;
-Eigen::Vector3f accel_(0, 0, 0), gyro_(0, 0, 0);
-uint8_t servo_pos_ = 110;
-uint16_t wheel_pos_[4] = {0, 0, 0, 0};
-uint16_t wheel_dt_[4] = {0, 0, 0, 0};
+WorkerPool worker_pool_(NUM_THREADS);
+// both fed by whichever thread reads the sensors
+SensorLog sensor_log_;
+OdometryHistory odometry_;
+
+// how often the capture-to-actuation latency is reported
+const int LATENCY_REPORT_SECS = 10;
 
-class Driver: public CameraReceiver {
+class Driver: public CameraReceiver, public CenterlineReceiver,
+    public ControlHardware {
  public:
-  Driver(coneslam::Localizer *loc) {
+  Driver(coneslam::PoseEstimator *loc) {
     output_fd_ = -1;
     frame_ = 0;
     frameskip_ = 0;
@@ -58,7 +102,18 @@ class Driver: public CameraReceiver {
       fprintf(stderr, "Loaded driver configuration\n");
     }
     localizer_ = loc;
+    centerline_ = NULL;
+    track_localize_ = false;
+    reset_track_ = false;
+    control_ = NULL;
+    pthread_mutex_init(&reset_mutex_, NULL);
+    reset_controller_ = reload_config_ = false;
     firstframe_ = true;
+    odo_valid_ = false;
+    actuate_us_ = 0;
+    latency_n_ = 0;
+    latency_sum_ = latency_max_ = 0;
+    clock_gettime(CLOCK_MONOTONIC, &latency_t_);
   }
 
   bool StartRecording(const char *fname, int frameskip) {
@@ -89,13 +144,140 @@ class Driver: public CameraReceiver {
 
   ~Driver() {
     StopRecording();
+    pthread_mutex_destroy(&reset_mutex_);
+  }
+
+  coneslam::PoseEstimator *GetLocalizer() { return localizer_; }
+  void SetLocalizer(coneslam::PoseEstimator *loc) { localizer_ = loc; }
+
+  // follow the painted centerline through pipeline instead of localizing
+  void SetCenterline(CenterlinePipeline *pipeline) { centerline_ = pipeline; }
+  // and localize along the track with loc, from the centerline's curvature
+  void SetTrackLocalizer(coneslam::PoseEstimator *loc) {
+    localizer_ = loc;
+    track_localize_ = true;
+  }
+
+  // steer from control's thread, which also reads the sensors, rather than
+  // once a frame; it gets our pose estimates as corrections
+  void SetControlLoop(ControlLoop *control) {
+    control_ = control;
+    // the controller's tracker belongs to the control thread now, so the
+    // display needs its own
+    TrajectoryTracker *track = controller_.GetTracker();
+    if (track->NumPoints() > 0) {
+      display_track_.SetTrack(track->GetPoints(), track->NumPoints());
+    }
+  }
+
+  // ControlHardware, called on the control thread, or by the main loop if
+  // there isn't one. Every IMU sample since the last call is published to
+  // sensor_log_ and integrated into odometry_ as of when it was taken, the
+  // newest with the encoders and servo read now; anything which couldn't
+  // be read keeps its last value, and s->t only moves on with a new IMU
+  // sample.
+  virtual bool ReadSensors(SensorState *s) {
+    sensor_log_.Latest(s);  // main() publishes the first reading
+    IMUSample samples[IMU::FIFO_SAMPLES];
+    int lost;
+    int n = imu.ReadFIFO(samples, IMU::FIFO_SAMPLES, &lost);
+    if (lost > 0) {
+      float v = lost;
+      telemetry::Log(telemetry::IMU_LOST, &v);
+    }
+    for (int i = 0; i < n; i++) {
+      if (i > 0) {
+        sensor_log_.Publish(*s);
+        odometry_.Integrate(*s);
+      }
+      s->t = samples[i].t;
+      s->accel = samples[i].accel;
+      s->gyro = samples[i].gyro;
+    }
+    bool ok = n >= 0;
+    uint8_t feedback[Teensy::FEEDBACK_LEN];
+    struct timespec polled, now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (i2c_bus.GetPoll(teensy_poll_, feedback, &polled) &&
+        ElapsedSecs(polled, now) < 3.0 / TEENSY_POLL_HZ) {
+      Teensy::DecodeFeedback(feedback, &s->servo_pos, s->wheel_pos,
+          s->wheel_dt);
+    } else {
+      ok = false;
+    }
+    if (n > 0) {
+      sensor_log_.Publish(*s);
+      odometry_.Integrate(*s);
+    }
+    return ok;
+  }
+
+  virtual void GetCommands(float *throttle, float *steering,
+      bool *autodrive) {
+    *throttle = js_throttle_ / 32767.0;
+    *steering = js_steering_ / 32767.0;
+    *autodrive = autodrive_;
+  }
+
+  virtual void Actuate(int8_t throttle, int8_t steering) {
+    throttle_ = throttle;
+    steering_ = steering;
+    SendControls();
+  }
+
+  virtual int ActuationDelayMicros() {
+    struct timespec cmd_t, sent_t;
+    if (!i2c_bus.LastSent(teensy_controls_, &cmd_t, &sent_t)) {
+      return 0;
+    }
+    return ElapsedSecs(cmd_t, sent_t) * 1e6;
+  }
+
+  // post the controls to the bus thread, which sends the latest
+  void SendControls() {
+    uint8_t buf[Teensy::CONTROLS_LEN];
+    Teensy::EncodeControls(frame_ & 4 ? 1 : 0, throttle_, steering_, buf);
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    i2c_bus.Post(teensy_controls_, buf, now);
+  }
+
+  void ResetEstimate() {
+    if (centerline_) {
+      centerline_->ResetFilter();
+      // the EKF thread owns the track localizer
+      reset_track_ = true;
+    } else {
+      localizer_->Reset();
+    }
+  }
+
+  // reset the controller, and load config over ours if it isn't NULL, on
+  // the thread which runs the controller
+  void ResetController(const DriverConfig *config) {
+    if (control_) {
+      control_->Reset(config);
+      return;
+    }
+    pthread_mutex_lock(&reset_mutex_);
+    reset_controller_ = true;
+    if (config) {
+      reload_config_ = true;
+      pending_config_ = *config;
+    }
+    pthread_mutex_unlock(&reset_mutex_);
   }
 
-  void OnFrame(uint8_t *buf, size_t length) {
+  void OnFrame(uint8_t *buf, size_t length,
+      const struct timespec &exposure) {
     struct timeval t;
     gettimeofday(&t, NULL);
     frame_++;
 
+    // the sensors as of the frame rather than as of now
+    SensorState sensors;
+    sensor_log_.At(exposure, &sensors);
+
     if (IsRecording() && frame_ > frameskip_) {
       frame_ = 0;
       uint32_t flushlen = 55 + length;
@@ -107,15 +289,15 @@ class Driver: public CameraReceiver {
       memcpy(flushbuf+8, &t.tv_usec, 4);
       memcpy(flushbuf+12, &throttle_, 1);
       memcpy(flushbuf+13, &steering_, 1);
-      memcpy(flushbuf+14, &accel_[0], 4);
-      memcpy(flushbuf+14+4, &accel_[1], 4);
-      memcpy(flushbuf+14+8, &accel_[2], 4);
-      memcpy(flushbuf+26, &gyro_[0], 4);
-      memcpy(flushbuf+26+4, &gyro_[1], 4);
-      memcpy(flushbuf+26+8, &gyro_[2], 4);
-      memcpy(flushbuf+38, &servo_pos_, 1);
-      memcpy(flushbuf+39, wheel_pos_, 2*4);
-      memcpy(flushbuf+47, wheel_dt_, 2*4);
+      memcpy(flushbuf+14, &sensors.accel[0], 4);
+      memcpy(flushbuf+14+4, &sensors.accel[1], 4);
+      memcpy(flushbuf+14+8, &sensors.accel[2], 4);
+      memcpy(flushbuf+26, &sensors.gyro[0], 4);
+      memcpy(flushbuf+26+4, &sensors.gyro[1], 4);
+      memcpy(flushbuf+26+8, &sensors.gyro[2], 4);
+      memcpy(flushbuf+38, &sensors.servo_pos, 1);
+      memcpy(flushbuf+39, sensors.wheel_pos, 2*4);
+      memcpy(flushbuf+47, sensors.wheel_dt, 2*4);
       // write the whole 640x480 buffer
       memcpy(flushbuf+55, buf, length);
 
@@ -123,8 +305,8 @@ class Driver: public CameraReceiver {
       gettimeofday(&t1, NULL);
       float dt = t1.tv_sec - t.tv_sec + (t1.tv_usec - t.tv_usec) * 1e-6;
       if (dt > 0.1) {
-        fprintf(stderr, "CameraThread::OnFrame: WARNING: "
-            "alloc/copy took %fs\n", dt);
+        float rec[] = {telemetry::SLOW_COPY, dt};
+        telemetry::Log(telemetry::FRAME_SLOW, rec);
       }
 
       flush_thread_.AddEntry(output_fd_, flushbuf, flushlen);
@@ -132,8 +314,8 @@ class Driver: public CameraReceiver {
       gettimeofday(&t2, NULL);
       dt = t2.tv_sec - t1.tv_sec + (t2.tv_usec - t1.tv_usec) * 1e-6;
       if (dt > 0.1) {
-        fprintf(stderr, "CameraThread::OnFrame: WARNING: "
-            "flush_thread.AddEntry took %fs\n", dt);
+        float rec[] = {telemetry::SLOW_ENQUEUE, dt};
+        telemetry::Log(telemetry::FRAME_SLOW, rec);
       }
     }
 
@@ -141,8 +323,8 @@ class Driver: public CameraReceiver {
       static struct timeval t0 = {0, 0};
       float dt = t.tv_sec - t0.tv_sec + (t.tv_usec - t0.tv_usec) * 1e-6;
       if (dt > 0.1 && t0.tv_sec != 0) {
-        fprintf(stderr, "CameraThread::OnFrame: WARNING: "
-            "%fs gap between frames?!\n", dt);
+        float rec[] = {telemetry::SLOW_FRAME_GAP, dt};
+        telemetry::Log(telemetry::FRAME_SLOW, rec);
       }
       t0 = t;
     }
@@ -150,59 +332,241 @@ class Driver: public CameraReceiver {
     float dt = t.tv_sec - last_t_.tv_sec + (t.tv_usec - last_t_.tv_usec) * 1e-6;
 
     if (firstframe_) {
-      memcpy(last_encoders_, wheel_pos_, 4*sizeof(uint16_t));
+      memcpy(last_encoders_, sensors.wheel_pos, 4*sizeof(uint16_t));
       firstframe_ = false;
       dt = 1.0 / 30.0;
     }
     uint16_t wheel_delta[4];
     for (int i = 0; i < 4; i++) {
-      wheel_delta[i] = wheel_pos_[i] - last_encoders_[i];
+      wheel_delta[i] = sensors.wheel_pos[i] - last_encoders_[i];
     }
-    memcpy(last_encoders_, wheel_pos_, 4*sizeof(uint16_t));
+    memcpy(last_encoders_, sensors.wheel_pos, 4*sizeof(uint16_t));
 
     // predict using front wheel distance
     float ds = 0.25 * (
             wheel_delta[0] + wheel_delta[1] +
             + wheel_delta[2] + wheel_delta[3]);
+    float w = sensors.gyro[2];
+    last_t_ = t;
+
+    // predict from the motion between exposures instead if we have it,
+    // integrated from every gyro sample and encoder tick; our estimate is
+    // then as of this frame's exposure, and gets carried forward from it
+    Odometry odo;
+    bool have_odo = odometry_.At(exposure, &odo);
+    if (have_odo) {
+      Motion m;
+      if (odo_valid_ && odometry_.Between(last_odo_.t, odo.t, &m)) {
+        ds = m.ds;
+        if (m.dt > 0) {
+          dt = m.dt;
+          w = m.dtheta / m.dt;
+        }
+      } else {
+        ds = 0;
+      }
+      last_odo_ = odo;
+      odo_valid_ = true;
+    }
+
+#ifdef HAVE_CENTERLINE
+    if (centerline_) {
+      // the rest happens in OnCenterline once the pipeline gets to it
+      CenterlineInputs in;
+      in.t = t;
+      in.dt = dt;
+      in.u_a = throttle_ / 127.0;
+      in.u_s = steering_ / 127.0;
+      in.gyro_z = sensors.gyro[2];
+      // the encoders' periods are as of their last tick, rather than an
+      // average over the frame
+      in.dsdt = have_odo ? odo.v : ds / dt;
+      in.servo_pos = sensors.servo_pos;
+      memcpy(in.wheel_delta, wheel_delta, sizeof(wheel_delta));
+      in.odo_valid = have_odo;
+      in.odo = odo;
+      centerline_->Submit(buf, in);
+      return;
+    }
+#endif
+
     int conesx[10];
     float conestheta[10];
     int ncones = coneslam::FindCones(buf, config_.cone_thresh,
-        gyro_[2], 10, conesx, conestheta);
+        sensors.gyro[2], 10, conesx, conestheta);
 
     if (ds > 0) {  // only do coneslam updates while we're moving
-      localizer_->Predict(ds, gyro_[2], dt);
+      localizer_->Predict(ds, w, dt);
       for (int i = 0; i < ncones; i++) {
         localizer_->UpdateLM(conestheta[i], config_.lm_precision * 0.1);
       }
     }
 
     display_.UpdateConeView(buf, ncones, conesx);
-    display_.UpdateEncoders(wheel_pos_);
+    display_.UpdateEncoders(sensors.wheel_pos);
     {
-      coneslam::Particle meanp;
-      localizer_->GetLocationEstimate(&meanp);
+      coneslam::PoseEstimate est;
+      localizer_->GetPoseEstimate(&est);
       float cx, cy, nx, ny, k, t;
-      controller_.UpdateLocation(meanp.x, meanp.y, meanp.theta);
-      controller_.GetTracker()->GetTarget(meanp.x, meanp.y,
-          &cx, &cy, &nx, &ny, &k, &t);
+      if (control_) {
+        if (have_odo) {
+          control_->CorrectPose(odo, est.x, est.y, est.theta);
+          ReportLatency(exposure, telemetry::LATENCY_POSE);
+        }
+        display_track_.GetTarget(est.x, est.y, &cx, &cy, &nx, &ny, &k, &t);
+      } else {
+        float x = est.x, y = est.y, theta = est.theta;
+        if (have_odo) {
+          PredictToActuation(odo, &x, &y, &theta);
+        }
+        controller_.UpdateLocation(x, y, theta);
+        controller_.GetTracker()->GetTarget(est.x, est.y,
+            &cx, &cy, &nx, &ny, &k, &t);
+      }
 
       display_.UpdateParticleView(localizer_, cx, cy, nx, ny);
     }
 
+    if (!control_) {
+      Control(wheel_delta, dt);
+      if (have_odo) {
+        ReportLatency(exposure, telemetry::LATENCY_ACTUATION);
+      }
+    }
+  }
+
+  void OnCenterline(const CenterlineEstimate &est) {
+    display_.UpdateBirdseye(est.birdseye, imgproc::uxsiz, imgproc::uysiz);
+    display_.UpdateStateEstimate(est.v, est.delta, est.y_e, est.psi_e,
+        est.kappa);
+    SensorState sensors;
+    sensor_log_.Latest(&sensors);
+    display_.UpdateEncoders(sensors.wheel_pos);
+    const CenterlineInputs *in = est.inputs;
+    if (track_localize_) {
+      UpdateTrackLocalizer(est);
+    }
+    if (control_) {
+      if (in->odo_valid) {
+        control_->SetCenterline(in->odo, est.y_e, est.psi_e, est.kappa);
+        ReportLatency(in->odo.t, telemetry::LATENCY_CENTERLINE);
+      }
+      return;
+    }
+    float y_e = est.y_e, psi_e = est.psi_e;
+    if (in->odo_valid) {
+      Odometry act;
+      odometry_.At(ActuationTime(), &act);
+      OdometryHistory::PropagateCenterline(in->odo, act, est.kappa,
+          &y_e, &psi_e);
+    }
+    controller_.UpdateCenterline(y_e, psi_e, est.kappa);
+    Control(in->wheel_delta, in->dt);
+    if (in->odo_valid) {
+      ReportLatency(in->odo.t, telemetry::LATENCY_ACTUATION);
+    }
+  }
+
+  // on the EKF thread, alongside the centerline filter
+  void UpdateTrackLocalizer(const CenterlineEstimate &est) {
+    const CenterlineInputs *in = est.inputs;
+    if (reset_track_) {
+      localizer_->Reset();
+      reset_track_ = false;
+    }
+    float ds = in->dsdt * in->dt;
+    if (ds > 0) {
+      localizer_->Predict(ds, in->gyro_z, in->dt);
+    }
+    // only when this frame's centerline fit went into kappa
+    if (est.detected && est.kappa_var > 0) {
+      localizer_->UpdateCurvature(est.kappa,
+          TRACK_KAPPA_PRECISION / est.kappa_var);
+    }
+    coneslam::PoseEstimate pose;
+    localizer_->GetPoseEstimate(&pose);
+    float rec[] = {
+      pose.x, pose.y, pose.theta, sqrtf(pose.cov[0][0] + pose.cov[1][1]),
+      static_cast<float>(pose.multimodal)
+    };
+    telemetry::Log(telemetry::TRACK_POSE, rec);
+  }
+
+  // when controls we send now should reach the car
+  struct timespec ActuationTime() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return AddMicros(now, actuate_us_);
+  }
+
+  // carry a pose estimated as of odometry at forward to ActuationTime()
+  void PredictToActuation(const Odometry &at, float *x, float *y,
+      float *theta) {
+    Odometry act;
+    odometry_.At(ActuationTime(), &act);
+    OdometryHistory::Propagate(at, act, x, y, theta);
+  }
+
+  // how long from exposure until what (telemetry::LATENCY_*); a correction
+  // to the control thread takes effect on its next tick, which it reports
+  // itself
+  void ReportLatency(const struct timespec &exposure, int what) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    float latency = ElapsedSecs(exposure, now);
+    latency_n_++;
+    latency_sum_ += latency;
+    if (latency > latency_max_) {
+      latency_max_ = latency;
+    }
+    float elapsed = ElapsedSecs(latency_t_, now);
+    if (elapsed < LATENCY_REPORT_SECS) {
+      return;
+    }
+    float rec[] = {
+      static_cast<float>(what), latency_sum_ * 1000 / latency_n_,
+      latency_max_ * 1000, static_cast<float>(latency_n_)
+    };
+    telemetry::Log(telemetry::LATENCY, rec);
+    latency_n_ = 0;
+    latency_sum_ = latency_max_ = 0;
+    latency_t_ = now;
+  }
+
+  void Control(const uint16_t *wheel_delta, float dt) {
+    struct timespec t0;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    pthread_mutex_lock(&reset_mutex_);
+    bool reset = reset_controller_;
+    reset_controller_ = false;
+    if (reload_config_) {
+      config_ = pending_config_;
+      reload_config_ = false;
+    }
+    pthread_mutex_unlock(&reset_mutex_);
+    if (reset) {
+      controller_.ResetState();
+    }
     float u_a = throttle_ / 127.0;
     float u_s = steering_ / 127.0;
+    SensorState s;
+    sensor_log_.Latest(&s);
     controller_.UpdateState(config_,
             u_a, u_s,
-            accel_, gyro_,
-            servo_pos_, wheel_delta,
+            s.accel, s.gyro,
+            s.servo_pos, wheel_delta,
             dt);
-    last_t_ = t;
 
     if (controller_.GetControl(config_, js_throttle_ / 32767.0,
           js_steering_ / 32767.0, &u_a, &u_s, dt, autodrive_)) {
       steering_ = 127 * u_s;
       throttle_ = 127 * u_a;
-      teensy.SetControls(frame_ & 4 ? 1 : 0, throttle_, steering_);
+      SendControls();
+      struct timespec t1;
+      clock_gettime(CLOCK_MONOTONIC, &t1);
+      // smoothed, as ControlLoop does
+      int us = ElapsedSecs(t0, t1) * 1e6 + ActuationDelayMicros();
+      actuate_us_ += (us - actuate_us_) / 8;
       // pca.SetPWM(PWMCHAN_STEERING, steering_);
       // pca.SetPWM(PWMCHAN_ESC, throttle_);
     }
@@ -220,12 +584,47 @@ class Driver: public CameraReceiver {
   int output_fd_;
   int frameskip_;
   struct timeval last_t_;
-  coneslam::Localizer *localizer_;
+  coneslam::PoseEstimator *localizer_;
+  CenterlinePipeline *centerline_;
+  bool track_localize_;
+  volatile bool reset_track_;
+  ControlLoop *control_;
+  // ResetController() requests for Control(), if there's no control_
+  pthread_mutex_t reset_mutex_;
+  bool reset_controller_, reload_config_;
+  DriverConfig pending_config_;
+  TrajectoryTracker display_track_;
+  bool odo_valid_;
+  Odometry last_odo_;
+  int actuate_us_;  // from Control() until the teensy has the controls
+  int latency_n_;
+  float latency_sum_, latency_max_;
+  struct timespec latency_t_;
 };
 
-coneslam::Localizer localizer_(NUM_PARTICLES);
+coneslam::Localizer localizer_(MIN_PARTICLES, MAX_PARTICLES);
+coneslam::FastSLAM slam_(SLAM_PARTICLES, SLAM_MAX_LANDMARKS);
+coneslam::TrackLocalizer trackloc_;
 Driver driver_(&localizer_);
-
+#ifdef HAVE_CENTERLINE
+CenterlinePipeline centerline_(&driver_.config_, &worker_pool_, &driver_);
+#endif
+ControlLoop control_loop_(&driver_.controller_, &driver_.config_, &driver_,
+    &odometry_);
+
+static void ReportI2CBus() {
+  I2CBus::Stats stats;
+  i2c_bus.TakeStats(&stats);
+  float rec[] = {
+    stats.utilization, static_cast<float>(stats.transactions),
+    static_cast<float>(stats.batches), static_cast<float>(stats.failures),
+    stats.avg_latency_us[I2CBus::ACTUATE],
+    stats.max_latency_us[I2CBus::ACTUATE],
+    stats.avg_latency_us[I2CBus::SENSE], stats.max_latency_us[I2CBus::SENSE],
+    static_cast<float>(stats.superseded)
+  };
+  telemetry::Log(telemetry::I2C_BUS, rec);
+}
 
 static inline float clip(float x, float min, float max) {
   if (x < min) return min;
@@ -317,7 +716,7 @@ class DriverInputReceiver : public InputReceiver {
         }
         break;
       case 'H':  // home button: init to start line
-        localizer_.Reset();
+        driver_.ResetEstimate();
         display_.UpdateStatus("starting line", 0x07e0);
         break;
       case 'L':
@@ -326,16 +725,21 @@ class DriverInputReceiver : public InputReceiver {
           driver_.autodrive_ = true;
         }
         break;
-      case 'B':
-        driver_.controller_.ResetState();
-        if (config_->Load()) {
+      case 'B': {
+        // the controller and its config belong to the control thread, so
+        // read the file here and hand it over with the reset
+        DriverConfig loaded = *config_;
+        bool ok = loaded.Load();
+        driver_.ResetController(ok ? &loaded : NULL);
+        if (ok) {
           fprintf(stderr, "config loaded\n");
-          int16_t *values = ((int16_t*) config_);
+          int16_t *values = ((int16_t*) &loaded);
           display_.UpdateConfig(configmenu, N_CONFIGITEMS, config_item_, values);
           display_.UpdateStatus("config loaded", 0xffff);
         }
         fprintf(stderr, "reset kalman filter\n");
         break;
+      }
       case 'A':
         if (config_->Save()) {
           fprintf(stderr, "config saved\n");
@@ -397,21 +801,63 @@ const char *DriverInputReceiver::configmenu[] = {
   "cone thresh",
   "max speed",
   "traction limit",
+  "accel limit",
+  "brake limit",
   "steering kP",
   "steering kD",
   "motor bw",
   "yaw rate bw",
   "cone precision",
+  "yellow Y scale",
+  "yellow U scale",
+  "yellow V scale",
+  "yellow thresh",
+  "controller",
+  "control Hz",
 };
 const int DriverInputReceiver::N_CONFIGITEMS = sizeof(configmenu) / sizeof(configmenu[0]);
 
 int main(int argc, char *argv[]) {
+  bool slam = false, centerline = false;
+  const char *track = NULL, *telemetry_log = NULL;
+  int opt;
+  while ((opt = getopt(argc, argv, "cl:st:")) != -1) {
+    switch (opt) {
+      case 'c':
+        centerline = true;
+        break;
+      case 'l':
+        telemetry_log = optarg;
+        break;
+      case 's':
+        slam = true;
+        break;
+      case 't':
+        track = optarg;
+        break;
+      default:
+        fprintf(stderr, "usage: %s [-c] [-s | -t <prefix>] [-l <log>]\n"
+            "  -c  follow the painted centerline with the camera and EKF\n"
+            "  -l  log controller telemetry to <log>; see telemetry_dump\n"
+            "  -s  FastSLAM mode: learn cone map online (lm.txt is optional\n"
+            "      and only used as a starting point)\n"
+            "  -t  localize along the track map <prefix>_track_{k,x,u}.txt\n"
+            "      from centerline curvature instead of cones (implies -c)\n",
+            argv[0]);
+        return 1;
+    }
+  }
+
   signal(SIGINT, handle_sigint);
 
   feenableexcept(FE_INVALID | FE_DIVBYZERO | FE_OVERFLOW | FE_UNDERFLOW);
 
   int fps = 30;
 
+  if (!telemetry::Init(telemetry_log)) {
+    return 1;
+  }
+
   if (!flush_thread_.Init()) {
     return 1;
   }
@@ -427,6 +873,9 @@ int main(int argc, char *argv[]) {
     fprintf(stderr, "need to enable i2c in raspi-config, probably\n");
     return 1;
   }
+  if (!i2c_bus.Start()) {
+    return 1;
+  }
 
   if (!display_.Init()) {
     fprintf(stderr, "run this:\n"
@@ -435,9 +884,35 @@ int main(int argc, char *argv[]) {
     return 1;
   }
 
-  if (!localizer_.LoadLandmarks("lm.txt")) {
-    fprintf(stderr, "if no landmarks yet, just echo 0 >lm.txt and rerun\n");
+  if (centerline || track) {
+#ifdef HAVE_CENTERLINE
+    if (!centerline_.Init()) {
+      return 1;
+    }
+    driver_.SetCenterline(&centerline_);
+    if (track) {
+      if (!trackloc_.LoadTrack(track)) {
+        return 1;
+      }
+      driver_.SetTrackLocalizer(&trackloc_);
+    }
+#else
+    fprintf(stderr, "-c and -t are unavailable: built without imgproc's "
+        "tables, which need the camera calibration in tools/camcal\n");
     return 1;
+#endif
+  } else if (slam) {
+    if (!slam_.LoadLandmarks("lm.txt")) {
+      fprintf(stderr, "no initial map; building one from scratch\n");
+    }
+    driver_.SetLocalizer(&slam_);
+  } else {
+    if (!localizer_.LoadLandmarks("lm.txt")) {
+      fprintf(stderr, "if no landmarks yet, just echo 0 >lm.txt and rerun\n"
+          "or run with -s to map them\n");
+      return 1;
+    }
+    localizer_.SetWorkerPool(&worker_pool_);
   }
 
   bool has_joystick = false;
@@ -449,17 +924,44 @@ int main(int argc, char *argv[]) {
 
   teensy.Init();
   teensy.SetControls(0, 0, 0);
-  teensy.GetFeedback(&servo_pos_, wheel_pos_, wheel_dt_);
+  SensorState sensors;
+  teensy.GetFeedback(&sensors.servo_pos, sensors.wheel_pos, sensors.wheel_dt);
+  clock_gettime(CLOCK_MONOTONIC, &sensors.t);
+  sensor_log_.Publish(sensors);
+  odometry_.Integrate(sensors);
+  teensy_poll_ = i2c_bus.AddPoll(Teensy::ADDRESS, 0, Teensy::FEEDBACK_LEN,
+      TEENSY_POLL_HZ);
+  teensy_controls_ = i2c_bus.AddMailbox(Teensy::ADDRESS,
+      Teensy::CONTROLS_REG, Teensy::CONTROLS_LEN);
   fprintf(stderr, "initial teensy state feedback: \n"
           "  servo %d encoders %d %d %d %d\r",
-          servo_pos_, wheel_pos_[0], wheel_pos_[1],
-          wheel_pos_[2], wheel_pos_[3]);
+          sensors.servo_pos, sensors.wheel_pos[0], sensors.wheel_pos[1],
+          sensors.wheel_pos[2], sensors.wheel_pos[3]);
 
   // pca.Init(100);  // 100Hz output
   // pca.SetPWM(PWMCHAN_STEERING, 614);
   // pca.SetPWM(PWMCHAN_ESC, 614);
 
   imu.Init();
+  // without the interrupt the FIFO still keeps every sample, but they're
+  // only timed to when they're read
+  GPIOEdge *drdy = &imu_drdy_;
+  if (!imu_drdy_.Open(IMU_DRDY_GPIO)) {
+    fprintf(stderr, "no IMU data ready interrupt on GPIO %d; polling\n",
+        IMU_DRDY_GPIO);
+    drdy = NULL;
+  }
+  if (!imu.EnableFIFO(drdy)) {
+    fprintf(stderr, "couldn't set up the IMU's FIFO\n");
+    return 1;
+  }
+
+  if (driver_.config_.control_hz > 0) {
+    if (!control_loop_.Init()) {
+      return 1;
+    }
+    driver_.SetControlLoop(&control_loop_);
+  }
 
   struct timeval tv;
   gettimeofday(&tv, NULL);
@@ -475,23 +977,42 @@ int main(int argc, char *argv[]) {
   fprintf(stderr, "%d.%06d started camera\n", tv.tv_sec, tv.tv_usec);
 #endif
 
+  struct timespec i2c_report_t;
+  clock_gettime(CLOCK_MONOTONIC, &i2c_report_t);
   while (!done) {
     int t = 0, s = 0;
     uint16_t b = 0;
     if (has_joystick && js.ReadInput(&input_receiver)) {
       // nothing to do here
     }
-    // FIXME: predict step here?
-    {
-      float temp;
-      imu.ReadIMU(&accel_, &gyro_, &temp);
+    // the control thread reads the sensors itself; otherwise wake for
+    // each IMU sample
+    if (control_loop_.IsRunning() || !imu.WaitForData(10)) {
+      usleep(1000);
+    }
+    if (!control_loop_.IsRunning()) {
       // FIXME: imu EKF update step?
-      teensy.GetFeedback(&servo_pos_, wheel_pos_, wheel_dt_);
+      driver_.ReadSensors(&sensors);
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (ElapsedSecs(i2c_report_t, now) >= I2C_REPORT_SECS) {
+      ReportI2CBus();
+      i2c_report_t = now;
     }
-    usleep(1000);
   }
 
 #ifdef CAMERA
   Camera::StopRecord();
 #endif
+#ifdef HAVE_CENTERLINE
+  centerline_.Shutdown();
+#endif
+  control_loop_.Shutdown();
+  i2c_bus.Stop();
+  telemetry::Shutdown();
+
+  if (slam && slam_.SaveLandmarks("lm_slam.txt")) {
+    fprintf(stderr, "saved learned cone map to lm_slam.txt\n");
+  }
 }
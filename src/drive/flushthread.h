@@ -7,6 +7,8 @@
 
 #include <deque>
 
+#include "drive/telemetry.h"
+
 // asynchronous flush to sdcard
 struct FlushEntry {
   int fd_;
@@ -69,8 +71,8 @@ class FlushThread {
     count++;
     if (count >= 15) {
       if (siz > 2) {
-        fprintf(stderr, "[FlushThread %d]\r", siz);
-        fflush(stderr);
+        float queued = siz;
+        telemetry::Log(telemetry::FLUSH_QUEUE, &queued);
       }
       count = 0;
     }
@@ -1,9 +1,11 @@
 #include <stdio.h>
 #include <stdint.h>
+#include <algorithm>
 #include <Eigen/Dense>
 #include <iostream>
 
 #include "drive/imgproc.h"
+#include "util/workerpool.h"
 
 using Eigen::Matrix3f;
 using Eigen::Matrix4f;
@@ -17,139 +19,233 @@ static const float bucketcount[uxsiz * uysiz] = {
 #include "bucketcount.txt"
 };
 
-static const uint16_t floodmap[uxsiz * uysiz] = {
-#include "floodmap.txt"
+// per output cell (row-major): start and length of its list in gatherpix,
+// and 1/length in Q16; cells no pixels land in use the list of the cell
+// they're flood-filled from. generated by tools/mapgen along with the rest
+static const uint16_t gatherstart[uxsiz * uysiz] = {
+#include "gatherstart.txt"
 };
 
-static const uint8_t udmask[320*(240-ytop)] = {
-#include "udmask.txt"
+static const uint16_t gathercount[uxsiz * uysiz] = {
+#include "gathercount.txt"
 };
 
-static const int8_t udplane[320*(240-ytop)*2] = {
-#include "udplane.txt"
+static const uint32_t gatherrecip[uxsiz * uysiz] = {
+#include "gatherrecip.txt"
 };
 
-static int32_t accumbuf[uxsiz * uysiz * 3];
-int32_t *Reproject(const uint8_t *yuv) {
-  // input is a 640x480 YUV420 image
-  memset(accumbuf, 0, uxsiz * uysiz * 3 * sizeof(accumbuf[0]));
-
-  // for each yuv, (maybe) remap into detected
-  size_t bufidx = ytop*320;
-  size_t udidx = 0;
-  for (int j = 0; j < 240 - ytop; j++) {
-    for (int i = 0; i < 320; i++, bufidx++, udidx++) {
-      uint8_t y = yuv[(j+ytop)*2*640 + 2*i];
-      uint8_t u = yuv[640*480 + bufidx];
-      uint8_t v = yuv[640*480 + 320*240 + bufidx];
-
-      if (!udmask[udidx]) continue;
-      int dx = udplane[udidx*2] - ux0;
-      int dy = udplane[udidx*2 + 1] - uy0;
-
-      accumbuf[(uxsiz * dy + dx) * 3] += y;
-      accumbuf[(uxsiz * dy + dx) * 3 + 1] += u;
-      accumbuf[(uxsiz * dy + dx) * 3 + 2] += v;
+// source pixel (j << 16) | i in the 320x(240-ytop) half-resolution image
+// below ytop, grouped by output cell
+static const uint32_t gatherpix[] = {
+#include "gatherpix.txt"
+};
+
+static const int N = uxsiz * uysiz;
+
+static void ParallelFor(WorkerPool *pool, int rows, WorkerPool::TaskFn fn,
+    void *arg) {
+  int nbands = (uysiz + rows - 1) / rows;
+  if (pool) {
+    pool->Run(fn, arg, nbands);
+  } else {
+    for (int b = 0; b < nbands; b++) {
+      fn(arg, b);
     }
   }
+}
 
-  size_t uidx = 0;
-  // average
-  for (int j = 0; j < uysiz; j++) {
-    for (int i = 0; i < uxsiz; uidx++, i++) {
-      if (bucketcount[uidx] > 0) {
-        accumbuf[uidx*3] *= bucketcount[uidx];
-        accumbuf[uidx*3 + 1] *= bucketcount[uidx];
-        accumbuf[uidx*3 + 2] *= bucketcount[uidx];
-      }
+struct ReprojectArgs {
+  const uint8_t *yuv;
+  Workspace *ws;
+  int rows;
+};
+
+static void ReprojectBand(void *arg, int band) {
+  const ReprojectArgs *args = reinterpret_cast<ReprojectArgs*>(arg);
+  // input is a 640x480 YUV420 image; Y is subsampled to match U and V
+  const uint8_t *yuv = args->yuv;
+  const uint8_t *uplane = yuv + 640*480;
+  const uint8_t *vplane = uplane + 320*240;
+  int32_t *planes = args->ws->planes;
+
+  // gather each output cell's pixels, average, and write it exactly once;
+  // no clearing, scattered read-modify-writes, or separate average and
+  // flood-fill passes over the planes
+  int cend = std::min(N, (band + 1) * args->rows * uxsiz);
+  for (int c = band * args->rows * uxsiz; c < cend; c++) {
+    const uint32_t *pix = gatherpix + gatherstart[c];
+    int n = gathercount[c];
+    uint32_t ysum = 0, usum = 0, vsum = 0;
+    for (int k = 0; k < n; k++) {
+      int j = (pix[k] >> 16) + ytop, i = pix[k] & 0xffff;
+      ysum += yuv[j*2*640 + 2*i];
+      usum += uplane[j*320 + i];
+      vsum += vplane[j*320 + i];
     }
+    // sums are at most 255*n, so the Q16 products fit in 32 bits
+    uint32_t r = gatherrecip[c];
+    planes[c] = (ysum * r + 32768) >> 16;
+    planes[N + c] = (usum * r + 32768) >> 16;
+    planes[2*N + c] = (vsum * r + 32768) >> 16;
   }
+}
 
-  // flood-fill
-  uidx = 0;
-  for (int j = 0; j < uysiz; j++) {
-    for (int i = 0; i < uxsiz; uidx++, i++) {
-      if (bucketcount[uidx] == 0) {
-        accumbuf[uidx*3] = accumbuf[floodmap[uidx]*3];
-        accumbuf[uidx*3 + 1] = accumbuf[floodmap[uidx]*3 + 1];
-        accumbuf[uidx*3 + 2] = accumbuf[floodmap[uidx]*3 + 2];
+void Reproject(const uint8_t *yuv, Workspace *ws, WorkerPool *pool,
+    int rows) {
+  ReprojectArgs args = { yuv, ws, rows };
+  ParallelFor(pool, rows, ReprojectBand, &args);
+}
+
+// number of tophat outputs per row, and lanes of the per-row sums
+static const int tophatw = uxsiz - 7;
+static const int nlanes = 8;
+static const int tophatwpad = (tophatw + nlanes - 1) / nlanes * nlanes;
+
+struct TophatArgs {
+  float ys, us, vs, thresh;
+  Workspace *ws;
+  uint8_t *annotatedyuv;
+  int rows;
+};
+
+static void TophatRow(const TophatArgs &args, int j) {
+  const int32_t *py = args.ws->planes + j*uxsiz,
+        *pu = args.ws->planes + N + j*uxsiz,
+        *pv = args.ws->planes + 2*N + j*uxsiz;
+  RowSums *sums = &args.ws->rows[j];
+
+  // horizontal convolution w/ [-1, -1, 2, 2, -1, -1], then the color
+  // weighting and threshold; w is the activation where detected, else 0.
+  // with only six taps the direct form is cheaper than a cumsum, whose
+  // serial dependency keeps it from vectorizing. both ends of the filter
+  // must be on mapped pixels; the right end runs past the table on the
+  // last row, and w is zero-padded out to a whole number of lanes
+  const int iend = std::min(tophatw, N - 9 - j*uxsiz);
+  float w[tophatwpad];
+  for (int i = iend; i < tophatwpad; i++) {
+    w[i] = 0;
+  }
+  for (int i = 0; i < iend; i++) {
+    int32_t yd = 2*(py[i + 3] + py[i + 4])
+      - (py[i + 1] + py[i + 2] + py[i + 5] + py[i + 6]);
+    int32_t ud = 2*(pu[i + 3] + pu[i + 4])
+      - (pu[i + 1] + pu[i + 2] + pu[i + 5] + pu[i + 6]);
+    int32_t vd = 2*(pv[i + 3] + pv[i + 4])
+      - (pv[i + 1] + pv[i + 2] + pv[i + 5] + pv[i + 6]);
+    float detected = args.ys*yd + args.us*ud + args.vs*vd - args.thresh;
+    int k = j*uxsiz + i;
+    bool hit = (detected > 0) & (bucketcount[k] != 0)
+      & (bucketcount[k + 9] != 0);
+    w[i] = hit ? detected : 0;
+  }
+
+  int rn = 0;
+  for (int i = 0; i < tophatw; i++) {
+    rn += w[i] > 0;
+  }
+  sums->n = rn;
+  if (rn == 0) {
+    sums->w = sums->w2 = sums->w2i = sums->w2ii = 0;
+    return;
+  }
+
+  // per-row sums, in independent lanes so they vectorize without
+  // reassociating a single float accumulator
+  float sw[nlanes] = {0}, sw2[nlanes] = {0}, sw2i[nlanes] = {0},
+        sw2ii[nlanes] = {0};
+  float x[nlanes];
+  for (int l = 0; l < nlanes; l++) {
+    x[l] = l;
+  }
+  for (int i = 0; i < tophatwpad; i += nlanes) {
+    for (int l = 0; l < nlanes; l++) {
+      float w2 = w[i + l]*w[i + l];
+      sw[l] += w[i + l];
+      sw2[l] += w2;
+      sw2i[l] += w2*x[l];
+      sw2ii[l] += w2*x[l]*x[l];
+      x[l] += nlanes;
+    }
+  }
+  sums->w = sums->w2 = sums->w2i = sums->w2ii = 0;
+  for (int l = 0; l < nlanes; l++) {
+    sums->w += sw[l];
+    sums->w2 += sw2[l];
+    sums->w2i += sw2i[l];
+    sums->w2ii += sw2ii[l];
+  }
+
+  if (args.annotatedyuv) {
+    for (int i = 0; i < tophatw; i++) {
+      if (w[i] > 0) {
+        args.annotatedyuv[3*(i + uxsiz*j + 3)] = 255;
       }
     }
   }
+}
 
-  return accumbuf;
+static void TophatBand(void *arg, int band) {
+  const TophatArgs *args = reinterpret_cast<TophatArgs*>(arg);
+  int jend = std::min(uysiz, (band + 1) * args->rows);
+  for (int j = band * args->rows; j < jend; j++) {
+    TophatRow(*args, j);
+  }
 }
 
-bool TophatFilter(const DriverConfig &config, int32_t *accumbuf,
+bool TophatFilter(const DriverConfig &config, Workspace *ws,
     Vector3f *Bout, float *y_cout, Matrix4f *Rkout,
-    uint8_t *annotatedyuv) {
-  // horizontal cumsum
-  for (int j = 0; j < uysiz; j++) {
-    for (int i = 1; i < uxsiz; i++) {
-      accumbuf[3*(j*uxsiz + i)] += accumbuf[3*(j*uxsiz + i - 1)];
-      accumbuf[3*(j*uxsiz + i) + 1] += accumbuf[3*(j*uxsiz + i - 1) + 1];
-      accumbuf[3*(j*uxsiz + i) + 2] += accumbuf[3*(j*uxsiz + i - 1) + 2];
-    }
-  }
+    uint8_t *annotatedyuv, WorkerPool *pool, int rows) {
+  TophatArgs args;
+  args.ys = config.y_scale * 0.01;
+  args.us = config.u_scale * 0.01;
+  args.vs = config.v_scale * 0.01;
+  args.thresh = config.yellow_thresh;
+  args.ws = ws;
+  args.annotatedyuv = annotatedyuv;
+  args.rows = rows;
+  ParallelFor(pool, rows, TophatBand, &args);
 
-  // horizontal convolution w/ [-1, -1, 2, 2, -1, -1]
-  // horizontal convolution w/ [-1, -1, -1, 2, 2, 2, -1, -1, -1]
-  Matrix3f regXTX = Matrix3f::Zero();
-  Vector3f regXTy = Vector3f::Zero();
+  // the regression is on x = a y^2 + b y + c, with X = w (pv^2, pv, 1) and
+  // target w pu; pv is constant along a row and pu is linear in i, so each
+  // row only needs its RowSums. they're folded in here in row order, so the
+  // result doesn't depend on the banding or thread scheduling.
+  const double pu0 = pixel_scale_m * (ux0 + 3);
+  double S2 = 0, S2v = 0, S2vv = 0, S2vvv = 0, S2vvvv = 0;
+  double T = 0, Tv = 0, Tvv = 0;  // sums of w^2 pu (pv^2, pv, 1)
   double regyTy = 0;
   double regxsum = 0;
   double regwsum = 0;
   int regN = 0;
 
   for (int j = 0; j < uysiz; j++) {
-#if 0  // 3-wide
-    for (int i = 0; i < uxsiz-10; i++) {
-      int32_t yd =
-        -(accumbuf[3*(j*uxsiz + i + 10)] - accumbuf[3*(j*uxsiz + i)])
-        + 3*(accumbuf[3*(j*uxsiz + i + 6)] - accumbuf[3*(j*uxsiz + i + 3)]);
-      int32_t ud =
-        -(accumbuf[3*(j*uxsiz + i + 10) + 1] - accumbuf[3*(j*uxsiz + i) + 1])
-        + 3*(accumbuf[3*(j*uxsiz + i + 6) + 1] - accumbuf[3*(j*uxsiz + i + 3) + 1]);
-      int32_t vd =
-        -(accumbuf[3*(j*uxsiz + i + 10) + 2] - accumbuf[3*(j*uxsiz + i) + 2])
-        + 3*(accumbuf[3*(j*uxsiz + i + 6) + 2] - accumbuf[3*(j*uxsiz + i + 3) + 2]);
-#else  // 2-wide
-    for (int i = 0; i < uxsiz-7; i++) {
-      int32_t yd =
-        -(accumbuf[3*(j*uxsiz + i + 6)] - accumbuf[3*(j*uxsiz + i)])
-        + 3*(accumbuf[3*(j*uxsiz + i + 4)] - accumbuf[3*(j*uxsiz + i + 2)]);
-      int32_t ud =
-        -(accumbuf[3*(j*uxsiz + i + 6) + 1] - accumbuf[3*(j*uxsiz + i) + 1])
-        + 3*(accumbuf[3*(j*uxsiz + i + 4) + 1] - accumbuf[3*(j*uxsiz + i + 2) + 1]);
-      int32_t vd =
-        -(accumbuf[3*(j*uxsiz + i + 6) + 2] - accumbuf[3*(j*uxsiz + i) + 2])
-        + 3*(accumbuf[3*(j*uxsiz + i + 4) + 2] - accumbuf[3*(j*uxsiz + i + 2) + 2]);
-#endif
-
-      // detected = (0.25*hv[:, :, 0] - 2*hv[:, :, 1] + 0.5*hv[:, :, 2] - 30)
-      //int32_t detected = (yd >> 2) - (ud << 1) + (vd >> 1) - 60;
-      float detected = config.y_scale * yd * 0.01
-        + config.u_scale * ud * 0.01
-        + config.v_scale * vd * 0.01
-        - config.yellow_thresh;
-      if (detected > 0 && bucketcount[j*uxsiz + i] && bucketcount[j*uxsiz + i + 9]) {
-        annotatedyuv[3*(i + uxsiz*j + 3)] = 255;
-        // add x, y to linear regression
-        float pu = pixel_scale_m * (i + ux0 + 3),
-              pv = pixel_scale_m * (j + uy0);
-        float w = detected;  // use activation as regression weight
-        Vector3f regX(w*pv*pv, w*pv, w);
-        regxsum += w*pv;
-        regwsum += w;
-        regXTX.noalias() += regX * regX.transpose();
-        regXTy.noalias() += regX * w * pu;
-        regyTy += w * w * pu * pu;
-        regN += 1;
-      }
+    const RowSums &r = ws->rows[j];
+    if (r.n == 0) {
+      continue;
     }
+    double v = pixel_scale_m * (j + uy0);
+    // sum of w^2 pu and w^2 pu^2 over the row, pu = pixel_scale_m*i + pu0
+    double wpu = pixel_scale_m*r.w2i + pu0*r.w2;
+    double wpu2 = pixel_scale_m*pixel_scale_m*r.w2ii
+      + 2*pixel_scale_m*pu0*r.w2i + pu0*pu0*r.w2;
+    S2 += r.w2;
+    S2v += r.w2*v;
+    S2vv += r.w2*v*v;
+    S2vvv += r.w2*v*v*v;
+    S2vvvv += r.w2*v*v*v*v;
+    T += wpu;
+    Tv += wpu*v;
+    Tvv += wpu*v*v;
+    regyTy += wpu2;
+    regxsum += r.w*v;
+    regwsum += r.w;
+    regN += r.n;
   }
 
-  std::cout << "activations " << regN << "\n";
+  Matrix3f regXTX;
+  regXTX << S2vvvv, S2vvv, S2vv,
+            S2vvv, S2vv, S2v,
+            S2vv, S2v, S2;
+  Vector3f regXTy(Tvv, Tv, T);
 
   // not enough data, don't even try to do an update
   if (regN < 8) {
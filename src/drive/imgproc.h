@@ -1,9 +1,12 @@
 #ifndef DRIVE_IMGPROC_H_
 #define DRIVE_IMGPROC_H_
 
+#include <stdint.h>
 #include <Eigen/Dense>
 #include "drive/config.h"
 
+class WorkerPool;
+
 // maps saved, output is 111 x 56
 // uxrange (-57, 54) uyrange (2, 58) x0 -57 y0 2
 
@@ -14,13 +17,39 @@ namespace imgproc {
   static const float pixel_scale_m = 0.025;
   static const int ux0 = -57, uy0 = 2;
 
-  // Returns a statically allocated object; not thread-safe
-  int32_t *Reproject(const uint8_t *yuv);
+  // default rows per band; bands are the unit of work handed to a
+  // WorkerPool
+  static const int band_rows = 7;
+
+  // per-row tophat regression sums; w is the activation of each detection
+  // and i its column
+  struct RowSums {
+    float w, w2, w2i, w2ii;
+    int n;
+  };
+
+  // Caller-owned state for one frame. Nothing in imgproc is shared between
+  // calls, so separate workspaces can be processed concurrently, e.g. to
+  // overlap consecutive frames.
+  struct Workspace {
+    // planar birdseye image: uxsiz*uysiz Y values, then U, then V
+    int32_t planes[uxsiz * uysiz * 3];
+    RowSums rows[uysiz];
+  };
+
+  // Both of these split the image into bands of rows rows run on pool, or
+  // on the calling thread if pool is NULL; results don't depend on either.
+
+  // Fills ws->planes from a 640x480 YUV420 image
+  void Reproject(const uint8_t *yuv, Workspace *ws, WorkerPool *pool = NULL,
+      int rows = band_rows);
 
-  // TophatFilter destroys accumbuf
-  bool TophatFilter(const DriverConfig &config, int32_t *accumbuf,
+  // Fits x = a y^2 + b y + c to the yellow tophat activations in ws->planes
+  // and returns false if there weren't enough of them. annotatedyuv may be
+  // NULL.
+  bool TophatFilter(const DriverConfig &config, Workspace *ws,
       Eigen::Vector3f *Bout, float *y_cout, Eigen::Matrix4f *Rkout,
-      uint8_t *annotatedyuv);
+      uint8_t *annotatedyuv, WorkerPool *pool = NULL, int rows = band_rows);
 }  // namespace imgproc
 
 #endif  // DRIVE_IMGPROC_H_
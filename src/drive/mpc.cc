@@ -0,0 +1,171 @@
+#include <math.h>
+
+#include "drive/mpc.h"
+
+// cost weights, per second: squared offset (m) and heading error (sine),
+// squared lateral acceleration over the traction limit, squared speed
+// error and squared curvature offset
+const float W_YE = 10.0;
+const float W_PSI = 3.0;
+const float W_ALAT = 2.0;
+const float W_V = 1.0;
+const float W_DK = 0.1;
+
+// curvature offsets (1/m), fine near zero for tracking and coarse out to
+// where the car's steering runs out, and fractions of the reference speed
+static const float k1_offsets[] = {
+  0, -0.05, 0.05, -0.1, 0.1, -0.2, 0.2, -0.35, 0.35,
+  -0.55, 0.55, -0.8, 0.8, -1.2, 1.2
+};
+static const float k2_offsets[] = {0, -0.15, 0.15, -0.4, 0.4};
+static const float v_factors[] = {1.0, 0.85, 0.7};
+
+// the steering servo's limit, as in DriveController::GetControl
+const float K_MAX = 2.0;
+
+MPCController::MPCController() {
+  yaw_bw_ = -1;
+}
+
+void MPCController::UpdatePrimitives(const DriverConfig &config) {
+  if (config.yaw_bw == yaw_bw_) {
+    return;
+  }
+  yaw_bw_ = config.yaw_bw;
+  lag_ = expf(-2*M_PI*0.01*config.yaw_bw * DT);
+
+  // the curvature during step t is the response at its end
+  float d = 1;
+  for (int t = 0; t < HORIZON; t++) {
+    d *= lag_;
+    decay_[t] = d;
+  }
+  for (int j = 0; j < NSTEER; j++) {
+    float k1 = k1_offsets[j / NK2], k2 = k2_offsets[j % NK2];
+    float k = 0, effort = 0;
+    for (int t = 0; t < HORIZON; t++) {
+      k = lag_ * k + (1 - lag_) * (t < SWITCH_STEPS ? k1 : k2);
+      prim_k_[t][j] = k;
+      effort += k*k;
+    }
+    first_k_[j] = k1;
+    effort_[j] = W_DK * effort * DT;
+  }
+}
+
+void MPCController::Feedforward(float k0, const Reference &ref,
+    float *kff) const {
+  // commanding minus the track's curvature follows it (see LineCurvature)
+  float k = 0;
+  for (int t = 0; t < HORIZON; t++) {
+    k = lag_ * k - (1 - lag_) * ref.k[t];
+    kff[t] = k + k0 * decay_[t];
+  }
+}
+
+float MPCController::SpeedRollout(const DriverConfig &config, float v,
+    float factor, const Reference &ref, float *vt) const {
+  float bw = 2*M_PI*0.01*config.motor_bw;
+  float accel = config.accel_limit * 0.01, brake = config.brake_limit * 0.01;
+  float cost = 0;
+  for (int t = 0; t < HORIZON; t++) {
+    float dv = bw * (factor * ref.v[t] - v) * DT;
+    v += fminf(fmaxf(dv, -brake * DT), accel * DT);
+    if (v < 0) v = 0;
+    vt[t] = v;
+    cost += W_V * (v - ref.v[t]) * (v - ref.v[t]) * DT;
+  }
+  return cost;
+}
+
+// The inner loops run across primitives, with everything depending only on
+// the step hoisted out, so that they vectorize. Small angle updates of the
+// heading's cosine and sine stand in for sin/cos, and the first order
+// expansion of 1/(1 - k ye) for the division.
+void MPCController::Rollout(const DriverConfig &config, float ye0,
+    float Cp, float Sp, const float *vt, const Reference &ref,
+    const float *kff, const float (*k)[NSTEER], int n, float *cost) const {
+  float ye[NSTEER], c[NSTEER], s[NSTEER];
+  for (int j = 0; j < n; j++) {
+    ye[j] = ye0;
+    c[j] = Cp;
+    s[j] = Sp;
+  }
+  float alat = config.traction_limit * 0.01;
+  for (int t = 0; t < HORIZON; t++) {
+    const float v = vt[t], kr = ref.k[t], kf = kff[t];
+    const float *kt = k[t];
+    for (int j = 0; j < n; j++) {
+      float kj = kf + kt[j];
+      float sdot = v * c[j] * (1 + kr * ye[j]);
+      ye[j] += v * s[j] * DT;
+      float dpsi = -(kr * sdot + v * kj) * DT;
+      float cd = 1 - 0.5f * dpsi * dpsi;
+      float cn = c[j] * cd - s[j] * dpsi;
+      float sn = s[j] * cd + c[j] * dpsi;
+      c[j] = cn;
+      s[j] = sn;
+      float over = fabsf(v * v * kj) - alat;
+      float excess = 0.5f * (over + fabsf(over));  // max(over, 0)
+      cost[j] += (W_YE * ye[j] * ye[j] + W_PSI * sn * sn
+          + W_ALAT * excess * excess) * DT;
+    }
+  }
+}
+
+float MPCController::Plan(const DriverConfig &config, float ye, float Cp,
+    float Sp, float v, float k0, const Reference &ref,
+    float *k_out, float *v_out) {
+  UpdatePrimitives(config);
+
+  float kff[HORIZON];
+  Feedforward(k0, ref, kff);
+
+  float best = INFINITY;
+  int bestv = 0, bestj = 0;
+  for (int i = 0; i < NV; i++) {
+    float vt[HORIZON];
+    float cost[NSTEER];
+    float vcost = SpeedRollout(config, v, v_factors[i], ref, vt);
+    for (int j = 0; j < NSTEER; j++) {
+      cost[j] = vcost + effort_[j];
+    }
+    Rollout(config, ye, Cp, Sp, vt, ref, kff, prim_k_, NSTEER, cost);
+    for (int j = 0; j < NSTEER; j++) {
+      if (cost[j] < best) {
+        best = cost[j];
+        bestv = i;
+        bestj = j;
+      }
+    }
+  }
+
+  float k = -ref.k[0] + first_k_[bestj];
+  *k_out = fminf(fmaxf(k, -K_MAX), K_MAX);
+  *v_out = v_factors[bestv] * ref.v[0];
+  return best;
+}
+
+float MPCController::Cost(const DriverConfig &config, float ye, float Cp,
+    float Sp, float v, float k0, const Reference &ref, float k,
+    float v_target) {
+  UpdatePrimitives(config);
+
+  // hold k from k0, so the feedforward is just the initial response; the
+  // effort is the offset from the curvature which would follow the track
+  float follow[HORIZON], kff[HORIZON], hold[HORIZON][NSTEER];
+  Feedforward(k0, ref, follow);
+  float effort = 0;
+  for (int t = 0; t < HORIZON; t++) {
+    kff[t] = k0 * decay_[t];
+    hold[t][0] = k * (1 - decay_[t]);
+    float dk = kff[t] + hold[t][0] - follow[t];
+    effort += dk * dk;
+  }
+  float vt[HORIZON];
+  float cost = SpeedRollout(config, v,
+      ref.v[0] > 0 ? v_target / ref.v[0] : 1, ref, vt);
+  cost += W_DK * effort * DT;
+  Rollout(config, ye, Cp, Sp, vt, ref, kff, hold, 1, &cost);
+  return cost;
+}
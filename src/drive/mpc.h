@@ -0,0 +1,80 @@
+#ifndef DRIVE_MPC_H_
+#define DRIVE_MPC_H_
+
+#include "drive/config.h"
+
+// Sampling model predictive steering and speed control.
+//
+// Every frame, a fixed set of motion primitives is rolled out over a short
+// horizon against the track ahead, in the track's frame: y_e (m, positive
+// to the right of the track) and psi_e (heading relative to the track), as
+// used by DriveController::LineCurvature. The cheapest rollout's first
+// command is used, and the whole thing is done again next frame.
+//
+// A primitive is an offset from the curvature which would follow the
+// track exactly, held for SWITCH_STEPS and then changed to a second one,
+// combined with a target speed as a fraction of the reference speed. The
+// car's curvature lags the command at the yaw rate loop's bandwidth, which
+// is linear, so the lagged curvature of each primitive is precomputed and
+// only the feedforward along the track needs working out per frame.
+class MPCController {
+ public:
+  static const int HORIZON = 24;
+  static constexpr float DT = 1.0 / 30;
+
+  // the track ahead: its curvature (1/m, positive for clockwise turns, as
+  // TrajectoryTracker::GetTarget) and target speed (m/s) at each step,
+  // assuming the car goes at that speed
+  struct Reference {
+    float k[HORIZON];
+    float v[HORIZON];
+  };
+
+  MPCController();
+
+  // Cp and Sp are the cosine and sine of psi_e; k0 is the car's current
+  // curvature (1/m, positive to the left) and v its speed. returns the
+  // rollout cost, and the commanded curvature and target speed for this
+  // step
+  float Plan(const DriverConfig &config, float ye, float Cp, float Sp,
+      float v, float k0, const Reference &ref,
+      float *k_out, float *v_out);
+
+  // the cost of holding curvature k and target speed v_target for the
+  // whole horizon, to compare with other control laws
+  float Cost(const DriverConfig &config, float ye, float Cp, float Sp,
+      float v, float k0, const Reference &ref, float k, float v_target);
+
+ private:
+  // first and second curvature offsets, and speed factors
+  static const int NK1 = 15, NK2 = 5, NV = 3;
+  static const int NSTEER = NK1 * NK2;
+  static const int SWITCH_STEPS = 6;
+
+  // recompute the lagged primitives if the yaw rate bandwidth changed
+  void UpdatePrimitives(const DriverConfig &config);
+
+  // rollout costs of steering primitives with curvature kff[t] + k[t][j],
+  // j < n, at speeds vt[t], accumulated into cost[j]
+  void Rollout(const DriverConfig &config, float ye0, float Cp, float Sp,
+      const float *vt, const Reference &ref, const float *kff,
+      const float (*k)[NSTEER], int n, float *cost) const;
+
+  // the curvature the car would follow along the track with no offset,
+  // starting from k0
+  void Feedforward(float k0, const Reference &ref, float *kff) const;
+
+  // speeds vt over the horizon aiming for factor * the reference speed,
+  // returning the cost of their difference from the reference
+  float SpeedRollout(const DriverConfig &config, float v, float factor,
+      const Reference &ref, float *vt) const;
+
+  int16_t yaw_bw_;
+  float lag_;                      // per step, of the curvature response
+  float decay_[HORIZON];           // response to the initial curvature
+  float prim_k_[HORIZON][NSTEER];  // lagged curvature offsets
+  float first_k_[NSTEER];          // commanded offset for the first step
+  float effort_[NSTEER];           // cost of the offsets themselves
+};
+
+#endif  // DRIVE_MPC_H_
@@ -0,0 +1,62 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+
+#include "drive/config.h"
+#include "drive/mpc.h"
+
+// times MPCController::Plan on random states and tracks; mpc_replay
+// compares it with the steering law on recordings
+
+static double Now() {
+  timeval t;
+  gettimeofday(&t, NULL);
+  return t.tv_sec + t.tv_usec * 1e-6;
+}
+
+static float Uniform(float a, float b) {
+  return a + (b - a) * (rand() / static_cast<float>(RAND_MAX));
+}
+
+// a straight, then a turn starting somewhere in the horizon
+static void RandomReference(const DriverConfig &config,
+    MPCController::Reference *ref) {
+  float vmax = config.speed_limit * 0.01;
+  float alat = config.traction_limit * 0.01;
+  int turn = rand() % MPCController::HORIZON;
+  float k = Uniform(-2, 2);
+  for (int t = 0; t < MPCController::HORIZON; t++) {
+    ref->k[t] = t < turn ? 0 : k;
+    ref->v[t] = fminf(vmax, sqrtf(alat / fmaxf(fabsf(ref->k[t]), 1e-3)));
+  }
+}
+
+static int Benchmark(const DriverConfig &config) {
+  const int N = 20000;
+  MPCController mpc;
+  double sum = 0, max = 0;
+  int over = 0;
+  float k, v;
+  for (int i = 0; i < N; i++) {
+    MPCController::Reference ref;
+    RandomReference(config, &ref);
+    float psie = Uniform(-0.5, 0.5);
+    double t0 = Now();
+    mpc.Plan(config, Uniform(-0.5, 0.5), cosf(psie), sinf(psie),
+        Uniform(0.5, 4), Uniform(-1, 1), ref, &k, &v);
+    double dt = Now() - t0;
+    sum += dt;
+    if (dt > max) max = dt;
+    if (dt > 1e-3) over++;
+  }
+  printf("MPC plan: %d calls, avg %0.1fus, max %0.1fus, %d over 1ms\n",
+      N, sum * 1e6 / N, max * 1e6, over);
+  return 0;
+}
+
+int main() {
+  DriverConfig config;
+  config.Load();
+  return Benchmark(config);
+}
@@ -0,0 +1,172 @@
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "drive/config.h"
+#include "drive/controller.h"
+#include "drive/imgproc.h"
+#include "drive/mpc.h"
+#include "ekf.h"
+
+// Replays recordings through the centerline EKF as drive -c would, and
+// compares the MPC with DriveController::LineCurvature on every frame: how
+// far apart their curvatures are, and what each costs over the MPC's
+// horizon. mpc_bench times the MPC on its own.
+
+static double Now() {
+  timeval t;
+  gettimeofday(&t, NULL);
+  return t.tv_sec + t.tv_usec * 1e-6;
+}
+
+// as design/coneslam/recordreader.py
+const int HEADER_SIZE = 55;
+const int FRAME_SIZE = 640*480 + 2*320*240;
+
+struct ReplayStats {
+  int frames, detected;
+  double dk_sum, dk_max;
+  double law_cost, mpc_cost;
+  double plan_sum, plan_max;
+};
+
+static bool Replay(const DriverConfig &config, const char *fname,
+    ReplayStats *st) {
+  FILE *fp = fopen(fname, "rb");
+  if (!fp) {
+    perror(fname);
+    return false;
+  }
+
+  uint8_t *buf = new uint8_t[HEADER_SIZE + FRAME_SIZE];
+  imgproc::Workspace *ws = new imgproc::Workspace;
+  EKF ekf;
+  MPCController mpc;
+  uint32_t last_sec = 0, last_usec = 0;
+  uint16_t last_wheels[4];
+  bool first = true;
+
+  while (fread(buf, HEADER_SIZE + FRAME_SIZE, 1, fp) == 1) {
+    uint32_t sec, usec;
+    int8_t throttle, steering;
+    float gyro[3];
+    uint16_t wheels[4];
+    memcpy(&sec, buf + 4, 4);
+    memcpy(&usec, buf + 8, 4);
+    memcpy(&throttle, buf + 12, 1);
+    memcpy(&steering, buf + 13, 1);
+    memcpy(gyro, buf + 26, 12);
+    memcpy(wheels, buf + 39, 8);
+    uint8_t servo_pos = buf[38];
+
+    float dt = 1.0 / 30;
+    if (first) {
+      memcpy(last_wheels, wheels, sizeof(wheels));
+      first = false;
+    } else {
+      dt = (sec - last_sec) + (static_cast<int>(usec) -
+          static_cast<int>(last_usec)) * 1e-6;
+    }
+    last_sec = sec;
+    last_usec = usec;
+    float ds = 0;
+    for (int i = 0; i < 4; i++) {
+      ds += 0.25 * static_cast<uint16_t>(wheels[i] - last_wheels[i]);
+    }
+    memcpy(last_wheels, wheels, sizeof(wheels));
+
+    // the same as CenterlinePipeline, one frame at a time
+    Eigen::Vector3f B;
+    Eigen::Matrix4f Rk;
+    float y_c;
+    imgproc::Reproject(buf + HEADER_SIZE, ws);
+    bool detected = imgproc::TophatFilter(config, ws, &B, &y_c, &Rk, NULL);
+    ekf.Predict(dt, throttle / 127.0, steering / 127.0);
+    ekf.UpdateIMU(gyro[2]);
+    ekf.UpdateEncoders(ds / dt, servo_pos);
+    if (detected) {
+      detected = ekf.UpdateCenterline(B[0], B[1], B[2], y_c, Rk);
+    }
+    const EKF::State &x = ekf.GetState();
+    float v = x[0], ye = x[2], psie = x[3], kappa = x[4];
+    float Cp = cosf(psie), Sp = sinf(psie);
+
+    // as DriveController::GetControl does for the steering law
+    float vmax = config.speed_limit * 0.01;
+    float alat = config.traction_limit * 0.01;
+    MPCController::Reference ref;
+    float vr = vmax;
+    if (fabsf(kappa) * vmax * vmax > alat) {
+      vr = sqrtf(alat / fabsf(kappa));
+    }
+    for (int t = 0; t < MPCController::HORIZON; t++) {
+      ref.k[t] = kappa;
+      ref.v[t] = vr;
+    }
+    float k_law = DriveController::LineCurvature(config, ye, Cp, Sp, kappa);
+    float v_law = vmax;
+    if (fabsf(k_law) * vmax * vmax > alat) {
+      v_law = sqrtf(alat / fabsf(k_law));
+    }
+
+    float k0 = v > 0.5 ? gyro[2] / v : 0;
+    float k_mpc, v_mpc;
+    double t0 = Now();
+    float mpc_cost = mpc.Plan(config, ye, Cp, Sp, v, k0, ref,
+        &k_mpc, &v_mpc);
+    double tplan = Now() - t0;
+    float law_cost = mpc.Cost(config, ye, Cp, Sp, v, k0, ref, k_law, v_law);
+
+    printf("%d.%06d %d %f %f %f %f %f %f %f %f %f %f\n", sec, usec,
+        detected, v, ye, psie, kappa, k_law, v_law, law_cost,
+        k_mpc, v_mpc, mpc_cost);
+
+    st->frames++;
+    st->detected += detected;
+    double dk = fabs(k_mpc - k_law);
+    st->dk_sum += dk;
+    if (dk > st->dk_max) st->dk_max = dk;
+    st->law_cost += law_cost;
+    st->mpc_cost += mpc_cost;
+    st->plan_sum += tplan;
+    if (tplan > st->plan_max) st->plan_max = tplan;
+  }
+
+  fclose(fp);
+  delete ws;
+  delete[] buf;
+  return true;
+}
+
+int main(int argc, char *argv[]) {
+  DriverConfig config;
+  config.Load();
+
+  if (argc < 2) {
+    fprintf(stderr, "usage: %s <recording>...\n", argv[0]);
+    return 1;
+  }
+
+  ReplayStats st;
+  memset(&st, 0, sizeof(st));
+  printf("# t detected v ye psie kappa k_law v_law law_cost"
+      " k_mpc v_mpc mpc_cost\n");
+  for (int i = 1; i < argc; i++) {
+    if (!Replay(config, argv[i], &st)) {
+      return 1;
+    }
+  }
+  if (st.frames == 0) {
+    fprintf(stderr, "no frames\n");
+    return 1;
+  }
+  fprintf(stderr, "%d frames (%d with the line detected)\n"
+      "  |k_mpc - k_law| avg %0.3f max %0.3f 1/m\n"
+      "  horizon cost: law %0.4f, MPC %0.4f avg\n"
+      "  MPC plan avg %0.1fus, max %0.1fus\n",
+      st.frames, st.detected, st.dk_sum / st.frames, st.dk_max,
+      st.law_cost / st.frames, st.mpc_cost / st.frames,
+      st.plan_sum * 1e6 / st.frames, st.plan_max * 1e6);
+  return 0;
+}
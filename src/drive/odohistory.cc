@@ -0,0 +1,203 @@
+#include <math.h>
+#include <string.h>
+
+#include "drive/odohistory.h"
+
+const float V_SCALE = 0.02;  // meters per encoder tick, as in controller.cc
+
+// the Teensy times each encoder from one falling edge to the next, two
+// ticks, in us; the longest it can tell is 65535
+const float TICKS_PER_PERIOD = 2;
+const int MAX_PERIOD_US = 65535;
+
+OdometryHistory::OdometryHistory() {
+  pthread_mutex_init(&mutex_, NULL);
+  memset(history_, 0, sizeof(history_));
+  n_ = 0;
+  integrating_ = false;
+}
+
+OdometryHistory::~OdometryHistory() {
+  pthread_mutex_destroy(&mutex_);
+}
+
+void OdometryHistory::Add(const struct timespec &t, float ds, float dtheta,
+    float v) {
+  pthread_mutex_lock(&mutex_);
+  Odometry odo;
+  memset(&odo, 0, sizeof(odo));
+  if (n_ > 0) {
+    odo = Get(0);
+  }
+  float mid = odo.theta + 0.5 * dtheta;
+  odo.t = t;
+  odo.s += ds;
+  odo.x += ds * cos(mid);
+  odo.y += ds * sin(mid);
+  odo.theta += dtheta;
+  odo.v = v;
+  history_[n_ % SIZE] = odo;
+  // keep the index positive; any multiple of SIZE will do
+  n_ = n_ >= 2*SIZE ? n_ + 1 - SIZE : n_ + 1;
+  pthread_mutex_unlock(&mutex_);
+}
+
+void OdometryHistory::Integrate(const SensorState &s) {
+  if (!integrating_) {
+    integrating_ = true;
+    last_ = s;
+    for (int i = 0; i < 4; i++) {
+      last_tick_[i] = s.t;
+    }
+    Add(s.t, 0, 0);
+    return;
+  }
+  float dt = ElapsedSecs(last_.t, s.t);
+  if (dt <= 0) {
+    return;
+  }
+  float ds = 0, v = 0;
+  for (int i = 0; i < 4; i++) {
+    uint16_t delta = s.wheel_pos[i] - last_.wheel_pos[i];
+    ds += 0.25 * delta;
+    if (delta != 0) {
+      last_tick_[i] = s.t;
+    }
+    // the last period is a speed as of the last tick, rather than an
+    // average over however long we've been reading; but if it's been
+    // longer than a tick's worth since, we're slower than that
+    float speed = 0;
+    if (s.wheel_dt[i] > 0 && s.wheel_dt[i] < MAX_PERIOD_US) {
+      speed = TICKS_PER_PERIOD * 1e6 / s.wheel_dt[i];
+    }
+    float since = ElapsedSecs(last_tick_[i], s.t);
+    if (speed * since > 1) {
+      speed = 1 / since;
+    }
+    v += 0.25 * speed;
+  }
+  Add(s.t, ds, 0.5 * (last_.gyro[2] + s.gyro[2]) * dt, v);
+  last_ = s;
+}
+
+bool OdometryHistory::Empty() {
+  pthread_mutex_lock(&mutex_);
+  bool empty = n_ == 0;
+  pthread_mutex_unlock(&mutex_);
+  return empty;
+}
+
+void OdometryHistory::Latest(Odometry *odo) {
+  pthread_mutex_lock(&mutex_);
+  if (n_ > 0) {
+    *odo = Get(0);
+  } else {
+    memset(odo, 0, sizeof(*odo));
+  }
+  pthread_mutex_unlock(&mutex_);
+}
+
+bool OdometryHistory::At(const struct timespec &t, Odometry *odo) {
+  pthread_mutex_lock(&mutex_);
+  if (n_ == 0) {
+    pthread_mutex_unlock(&mutex_);
+    return false;
+  }
+  int n = n_ < SIZE ? n_ : SIZE;
+
+  const Odometry &latest = Get(0);
+  float ahead = ElapsedSecs(latest.t, t);
+  if (ahead >= 0) {
+    // extrapolate from the rates since the most recent sample at least
+    // RATE_WINDOW before the latest, or the oldest we have
+    int back = 1;
+    while (back < n - 1 &&
+        ElapsedSecs(Get(back).t, latest.t) < RATE_WINDOW) {
+      back++;
+    }
+    *odo = latest;
+    odo->t = t;
+    if (back < n) {
+      const Odometry &prev = Get(back);
+      float window = ElapsedSecs(prev.t, latest.t);
+      if (window > 0) {
+        float ds = (latest.s - prev.s) * ahead / window;
+        float dtheta = (latest.theta - prev.theta) * ahead / window;
+        float mid = latest.theta + 0.5 * dtheta;
+        odo->s += ds;
+        odo->x += ds * cos(mid);
+        odo->y += ds * sin(mid);
+        odo->theta += dtheta;
+      }
+    }
+    pthread_mutex_unlock(&mutex_);
+    return true;
+  }
+
+  // find the samples either side of t, newest first since that's where
+  // lookups usually land
+  int back = 1;
+  while (back < n && ElapsedSecs(Get(back).t, t) < 0) {
+    back++;
+  }
+  if (back == n) {
+    *odo = Get(n - 1);
+    pthread_mutex_unlock(&mutex_);
+    return true;
+  }
+  const Odometry &a = Get(back), &b = Get(back - 1);
+  float span = ElapsedSecs(a.t, b.t);
+  float f = span > 0 ? ElapsedSecs(a.t, t) / span : 1;
+  odo->t = t;
+  odo->s = a.s + f * (b.s - a.s);
+  odo->x = a.x + f * (b.x - a.x);
+  odo->y = a.y + f * (b.y - a.y);
+  odo->theta = a.theta + f * (b.theta - a.theta);
+  odo->v = a.v + f * (b.v - a.v);
+  pthread_mutex_unlock(&mutex_);
+  return true;
+}
+
+bool OdometryHistory::Between(const struct timespec &t0,
+    const struct timespec &t1, Motion *m) {
+  Odometry a, b;
+  if (!At(t0, &a) || !At(t1, &b)) {
+    return false;
+  }
+  m->dt = ElapsedSecs(t0, t1);
+  m->ds = b.s - a.s;
+  m->dtheta = b.theta - a.theta;
+  float C = cos(a.theta), S = sin(a.theta);
+  float dx = b.x - a.x, dy = b.y - a.y;
+  m->dx = C*dx + S*dy;
+  m->dy = -S*dx + C*dy;
+  return true;
+}
+
+void OdometryHistory::Propagate(const Odometry &from, const Odometry &to,
+    float *x, float *y, float *theta) {
+  // the odometry frame and the estimate's differ by a rotation and an
+  // offset; apply the motion between from and to in the estimate's
+  float dtheta = *theta - from.theta;
+  float C = cos(dtheta), S = sin(dtheta);
+  float dx = to.x - from.x, dy = to.y - from.y;
+  *x += C*dx - S*dy;
+  *y += S*dx + C*dy;
+  *theta += to.theta - from.theta;
+}
+
+void OdometryHistory::PropagateCenterline(const Odometry &from,
+    const Odometry &to, float kappa, float *y_e, float *psi_e) {
+  // one step of the EKF's motion model (design/ekf/model.py), with the
+  // distance and yaw from odometry; positive y_e is right of the line
+  float ds = (to.s - from.s) * V_SCALE;
+  float dtheta = to.theta - from.theta;
+  float denom = 1 - kappa * *y_e;
+  if (fabsf(denom) < 0.1) {
+    denom = denom < 0 ? -0.1 : 0.1;
+  }
+  float dpsi = dtheta + ds * kappa * cos(*psi_e) / denom;
+  float mid = *psi_e + 0.5 * dpsi;
+  *y_e -= ds * sin(mid);
+  *psi_e += dpsi;
+}
@@ -0,0 +1,108 @@
+#ifndef DRIVE_ODOHISTORY_H_
+#define DRIVE_ODOHISTORY_H_
+
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "drive/sensorstate.h"
+
+// dead reckoned pose, in the localizer's units (encoder ticks), and the
+// distance driven so far, as of CLOCK_MONOTONIC time t
+struct Odometry {
+  struct timespec t;
+  float s;
+  float x, y, theta;
+  float v;  // speed, ticks/s, from the encoders' tick periods
+};
+
+// how far we went between two times: the distance and heading change, and
+// the displacement in the car's frame at the start (x forward, y left)
+struct Motion {
+  float dt;
+  float ds, dtheta;
+  float dx, dy;
+};
+
+// The last few hundred milliseconds of odometry, integrated from every gyro
+// sample and encoder tick as they're read, so that an estimate made from a
+// camera frame can be carried forward from when the frame was exposed to
+// when the controls it leads to take effect, and the localizer can be told
+// exactly how far we went between frames. Safe to use from any thread.
+class OdometryHistory {
+ public:
+  OdometryHistory();
+  ~OdometryHistory();
+
+  // integrate ds ticks along our mean heading while turning dtheta radians,
+  // ending at time t, at speed v
+  void Add(const struct timespec &t, float ds, float dtheta, float v = 0);
+
+  // integrate the encoders and the gyro (trapezoidally) from the last
+  // reading to this one, and take the speed from the encoders' periods;
+  // readings go in from one thread at a time, in order, and one no newer
+  // than the last is skipped
+  void Integrate(const SensorState &s);
+
+  bool Empty();
+  void Latest(Odometry *odo);
+
+  // odometry at time t: interpolated between samples, the oldest sample
+  // before them, and extrapolated at the recent rate after the latest;
+  // false if there's nothing yet
+  bool At(const struct timespec &t, Odometry *odo);
+
+  // the motion from t0 to t1, by At(); false if there's nothing yet
+  bool Between(const struct timespec &t0, const struct timespec &t1,
+      Motion *m);
+
+  // carry a pose estimated at odometry from forward to odometry to
+  static void Propagate(const Odometry &from, const Odometry &to,
+      float *x, float *y, float *theta);
+
+  // the same for an offset y_e and heading psi_e relative to a line of
+  // curvature kappa (1/m), as in the centerline EKF
+  static void PropagateCenterline(const Odometry &from, const Odometry &to,
+      float kappa, float *y_e, float *psi_e);
+
+  // at the control loop's top rate, 256ms
+  static const int SIZE = 128;
+
+ private:
+  // rates to extrapolate with are taken over at least this long
+  static constexpr float RATE_WINDOW = 1.0 / 30;
+
+  const Odometry &Get(int back) const {
+    return history_[(n_ - 1 - back) % SIZE];
+  }
+
+  pthread_mutex_t mutex_;
+  Odometry history_[SIZE];
+  int n_;
+
+  // only touched by Integrate's thread
+  bool integrating_;
+  SensorState last_;
+  struct timespec last_tick_[4];  // when each encoder last moved
+};
+
+// seconds from t0 to t1
+static inline float ElapsedSecs(const struct timespec &t0,
+    const struct timespec &t1) {
+  return (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) * 1e-9;
+}
+
+// t plus us microseconds
+static inline struct timespec AddMicros(struct timespec t, int us) {
+  int64_t ns = t.tv_nsec + us * 1000LL;
+  t.tv_sec += ns / 1000000000;
+  ns %= 1000000000;
+  if (ns < 0) {
+    t.tv_sec--;
+    ns += 1000000000;
+  }
+  t.tv_nsec = ns;
+  return t;
+}
+
+#endif  // DRIVE_ODOHISTORY_H_
@@ -0,0 +1,160 @@
+#include <math.h>
+#include <stdio.h>
+
+#include "drive/odohistory.h"
+
+// feed a constant turn at 200Hz with synthetic timestamps, and check that
+// lookups between, before and after the samples land on the arc, and that
+// a stale estimate carried forward ends up where the car is; then
+// integrate raw sensor readings, and check the motion between two times
+// and the speed from the encoder periods
+
+const float SPEED = 100;  // ticks/s
+const float YAW_RATE = 1.0;
+const int HZ = 200;
+
+static void Arc(float t, float *x, float *y, float *theta) {
+  float r = SPEED / YAW_RATE;
+  *theta = YAW_RATE * t;
+  *x = r * sin(*theta);
+  *y = r * (1 - cos(*theta));
+}
+
+static struct timespec Time(float t) {
+  struct timespec ts = {1000, 0};
+  return AddMicros(ts, t * 1e6);
+}
+
+static int Check(const char *what, const Odometry &odo, float t) {
+  float x, y, theta;
+  Arc(t, &x, &y, &theta);
+  printf("%s t=%0.4f: (%0.3f, %0.3f, %0.4f) expected (%0.3f, %0.3f, "
+      "%0.4f)\n", what, t, odo.x, odo.y, odo.theta, x, y, theta);
+  if (hypotf(odo.x - x, odo.y - y) > 0.05 || fabsf(odo.theta - theta) > 1e-3
+      || fabsf(odo.s - SPEED * t) > 0.05) {
+    printf("FAIL: %s\n", what);
+    return 1;
+  }
+  return 0;
+}
+
+int main() {
+  OdometryHistory odometry;
+  int failures = 0;
+  Odometry odo;
+
+  if (odometry.At(Time(0), &odo)) {
+    printf("FAIL: lookup in an empty history\n");
+    failures++;
+  }
+
+  // two and a bit history lengths, so it's wrapped
+  int n = 2 * OdometryHistory::SIZE + 17;
+  odometry.Add(Time(0), 0, 0);
+  for (int i = 1; i <= n; i++) {
+    odometry.Add(Time(static_cast<float>(i) / HZ), SPEED / HZ,
+        YAW_RATE / HZ);
+  }
+  float tn = static_cast<float>(n) / HZ;
+
+  odometry.Latest(&odo);
+  failures += Check("latest", odo, tn);
+  odometry.At(Time(tn - 0.0125), &odo);
+  failures += Check("between samples", odo, tn - 0.0125);
+  odometry.At(Time(tn - 0.5123), &odo);
+  failures += Check("a while ago", odo, tn - 0.5123);
+  odometry.At(Time(tn + 0.03), &odo);
+  failures += Check("extrapolated", odo, tn + 0.03);
+
+  // older than we keep: the oldest sample
+  odometry.At(Time(0), &odo);
+  float oldest = static_cast<float>(n - OdometryHistory::SIZE + 1) / HZ;
+  failures += Check("too old", odo, oldest);
+
+  // an estimate of the pose at exposure, rotated and offset from the
+  // odometry frame, carried to 20ms from now
+  float texp = tn - 0.08, tact = tn + 0.02;
+  Odometry at, act;
+  odometry.At(Time(texp), &at);
+  odometry.At(Time(tact), &act);
+  float x0, y0, theta0, x1, y1, theta1;
+  Arc(texp, &x0, &y0, &theta0);
+  Arc(tact, &x1, &y1, &theta1);
+  // in the estimate's frame, the arc is rotated by 1 rad and offset
+  const float ROT = 1.0, OX = 30, OY = -20;
+  float C = cos(ROT), S = sin(ROT);
+  float x = OX + C*x0 - S*y0, y = OY + S*x0 + C*y0, theta = theta0 + ROT;
+  OdometryHistory::Propagate(at, act, &x, &y, &theta);
+  float ex = OX + C*x1 - S*y1, ey = OY + S*x1 + C*y1;
+  printf("propagated (%0.3f, %0.3f, %0.4f) expected (%0.3f, %0.3f, %0.4f)\n",
+      x, y, theta, ex, ey, theta1 + ROT);
+  if (hypotf(x - ex, y - ey) > 0.05 || fabsf(theta - theta1 - ROT) > 1e-3) {
+    printf("FAIL: propagate\n");
+    failures++;
+  }
+
+  // on a line curving at exactly our rate, heading holds still and the
+  // offset changes by the distance times its sine (kappa in 1/m, odometry
+  // in 2cm ticks)
+  float ye = 0.1, psie = 0.05;
+  float ds = SPEED * (tact - texp) * 0.02;
+  OdometryHistory::PropagateCenterline(at, act, -YAW_RATE / SPEED / 0.02,
+      &ye, &psie);
+  printf("centerline y_e %0.4f psi_e %0.4f\n", ye, psie);
+  if (fabsf(psie - 0.05) > 0.01 ||
+      fabsf(ye - (0.1 - ds * sin(0.05))) > 1e-3) {
+    printf("FAIL: centerline\n");
+    failures++;
+  }
+
+  // a yaw rate ramping up, which the gyro's trapezoid gets exactly, and
+  // the wheels ticking over at SPEED; then they stop
+  OdometryHistory integrated;
+  const float RAMP = 2.0;  // rad/s^2
+  SensorState s;
+  for (int i = 0; i <= HZ; i++) {
+    float t = static_cast<float>(i) / HZ;
+    s.t = Time(t);
+    s.gyro = Eigen::Vector3f(0, 0, RAMP * t);
+    for (int j = 0; j < 4; j++) {
+      s.wheel_pos[j] = SPEED * t;
+      s.wheel_dt[j] = 2e6 / SPEED;
+    }
+    integrated.Integrate(s);
+  }
+  Motion m;
+  integrated.Between(Time(0.45), Time(0.95), &m);
+  float expected_dtheta = 0.5 * RAMP * (0.95 * 0.95 - 0.45 * 0.45);
+  printf("between: ds %0.2f dtheta %0.4f (%0.2f, %0.2f) expected ds %0.2f "
+      "dtheta %0.4f\n", m.ds, m.dtheta, m.dx, m.dy, SPEED * 0.5,
+      expected_dtheta);
+  if (fabsf(m.dt - 0.5) > 1e-4 || fabsf(m.ds - SPEED * 0.5) > 1 ||
+      fabsf(m.dtheta - expected_dtheta) > 1e-4 ||
+      // a chord of the curve, turning left
+      hypotf(m.dx, m.dy) > m.ds || hypotf(m.dx, m.dy) < 0.95 * m.ds ||
+      m.dy <= 0) {
+    printf("FAIL: motion between\n");
+    failures++;
+  }
+  integrated.Latest(&odo);
+  printf("speed %0.1f ticks/s\n", odo.v);
+  if (fabsf(odo.v - SPEED) > 0.01 * SPEED) {
+    printf("FAIL: speed from encoder periods\n");
+    failures++;
+  }
+  // the last period hangs around after they stop, but the time since the
+  // last tick says we're slower than that
+  for (int i = 1; i <= HZ / 10; i++) {
+    s.t = Time(1 + static_cast<float>(i) / HZ);
+    integrated.Integrate(s);
+  }
+  integrated.Latest(&odo);
+  printf("stopped for 100ms: %0.1f ticks/s\n", odo.v);
+  if (odo.v > 10.5) {
+    printf("FAIL: speed after stopping\n");
+    failures++;
+  }
+
+  printf("%d failures\n", failures);
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,82 @@
+#include "drive/sensorstate.h"
+
+static float Seconds(const struct timespec &t0, const struct timespec &t1) {
+  return (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) * 1e-9;
+}
+
+SensorLog::SensorLog() {
+  for (int i = 0; i < SIZE; i++) {
+    slots_[i].seq = 0;
+  }
+  n_ = 0;
+}
+
+void SensorLog::Publish(const SensorState &s) {
+  uint32_t n = n_.load(std::memory_order_relaxed);
+  Slot *slot = &slots_[n % SIZE];
+  uint32_t seq = slot->seq.load(std::memory_order_relaxed);
+  slot->seq.store(seq + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  slot->state = s;
+  slot->seq.store(seq + 2, std::memory_order_release);
+  n_.store(n + 1, std::memory_order_release);
+}
+
+void SensorLog::Read(uint32_t n, SensorState *s) const {
+  const Slot &slot = slots_[n % SIZE];
+  for (;;) {
+    uint32_t seq = slot.seq.load(std::memory_order_acquire);
+    if (seq & 1) {
+      continue;  // mid-write; it won't be for long
+    }
+    *s = slot.state;
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (slot.seq.load(std::memory_order_relaxed) == seq) {
+      return;
+    }
+  }
+}
+
+bool SensorLog::Latest(SensorState *s) const {
+  uint32_t n = n_.load(std::memory_order_acquire);
+  if (n == 0) {
+    return false;
+  }
+  Read(n - 1, s);
+  return true;
+}
+
+bool SensorLog::At(const struct timespec &t, SensorState *s) const {
+  uint32_t n = n_.load(std::memory_order_acquire);
+  if (n == 0) {
+    return false;
+  }
+  // leave a slot spare, which the writer may be overwriting as we go
+  uint32_t count = n < SIZE - 1 ? n : SIZE - 1;
+  SensorState after;
+  Read(n - 1, &after);
+  if (Seconds(after.t, t) >= 0) {
+    *s = after;
+    return true;
+  }
+  for (uint32_t back = 1; back < count; back++) {
+    SensorState before;
+    Read(n - 1 - back, &before);
+    float span = Seconds(before.t, after.t);
+    if (span < 0) {
+      break;  // lapped by the writer; the rest is newer than we want
+    }
+    float dt = Seconds(before.t, t);
+    if (dt >= 0) {
+      float f = span > 0 ? dt / span : 0;
+      *s = before;
+      s->t = t;
+      s->accel = before.accel + f * (after.accel - before.accel);
+      s->gyro = before.gyro + f * (after.gyro - before.gyro);
+      return true;
+    }
+    after = before;
+  }
+  *s = after;
+  return true;
+}
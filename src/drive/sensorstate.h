@@ -0,0 +1,64 @@
+#ifndef DRIVE_SENSORSTATE_H_
+#define DRIVE_SENSORSTATE_H_
+
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include <Eigen/Dense>
+#include <atomic>
+
+// one reading of the car's sensors, as of CLOCK_MONOTONIC time t
+struct SensorState {
+  // nothing read yet, and the servo centered
+  SensorState(): accel(0, 0, 0), gyro(0, 0, 0), servo_pos(110) {
+    t.tv_sec = t.tv_nsec = 0;
+    memset(wheel_pos, 0, sizeof(wheel_pos));
+    memset(wheel_dt, 0, sizeof(wheel_dt));
+  }
+
+  struct timespec t;
+  Eigen::Vector3f accel, gyro;
+  uint8_t servo_pos;
+  uint16_t wheel_pos[4];
+  uint16_t wheel_dt[4];
+};
+
+// Hands SensorStates from the one thread which reads the sensors to any
+// number of readers, without locks, and keeps the last few so a reader can
+// ask for the state at a particular time. Each slot has a sequence count,
+// odd while the slot is being written; readers check it before and after
+// copying the slot, and copy it again if it changed (a seqlock), so they
+// never see half of one reading and half of the next.
+class SensorLog {
+ public:
+  SensorLog();
+
+  // only ever from one thread at a time
+  void Publish(const SensorState &s);
+
+  // false if nothing's been published yet
+  bool Latest(SensorState *s) const;
+
+  // the state at time t: accelerometer and gyro interpolated between the
+  // readings either side, encoders and servo from the one before; the
+  // latest if t is after it, and the oldest we have if t is before that
+  bool At(const struct timespec &t, SensorState *s) const;
+
+  // at the IMU's 200Hz, 320ms
+  static const int SIZE = 64;
+
+ private:
+  struct Slot {
+    std::atomic<uint32_t> seq;
+    SensorState state;
+  };
+
+  // a consistent copy of the reading published n-th
+  void Read(uint32_t n, SensorState *s) const;
+
+  Slot slots_[SIZE];
+  std::atomic<uint32_t> n_;  // how many have been published
+};
+
+#endif  // DRIVE_SENSORSTATE_H_
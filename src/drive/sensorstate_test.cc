@@ -0,0 +1,118 @@
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+
+#include "drive/sensorstate.h"
+
+// one thread publishes readings as fast as it can, with every field derived
+// from the same count, while others read them back and check no reading is
+// ever a mix of two; then check interpolation to a time between readings
+
+const int NREADERS = 3;
+const int NPUBLISH = 2000000;
+
+static SensorLog sensor_log;
+static volatile bool done = false;
+
+static void Fill(uint32_t i, SensorState *s) {
+  s->t.tv_sec = 1000 + i / 1000;
+  s->t.tv_nsec = (i % 1000) * 1000000;
+  s->accel = Eigen::Vector3f(i, i + 1, i + 2);
+  s->gyro = Eigen::Vector3f(-1.0f * i, 0, i * 0.5f);
+  s->servo_pos = i;
+  for (int j = 0; j < 4; j++) {
+    s->wheel_pos[j] = i + j;
+    s->wheel_dt[j] = i - j;
+  }
+}
+
+static bool Consistent(const SensorState &s) {
+  uint32_t i = (s.t.tv_sec - 1000) * 1000 + s.t.tv_nsec / 1000000;
+  SensorState expected;
+  Fill(i, &expected);
+  if (s.accel != expected.accel || s.gyro != expected.gyro ||
+      s.servo_pos != expected.servo_pos) {
+    return false;
+  }
+  for (int j = 0; j < 4; j++) {
+    if (s.wheel_pos[j] != expected.wheel_pos[j] ||
+        s.wheel_dt[j] != expected.wheel_dt[j]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static void* Reader(void *arg) {
+  int *torn = reinterpret_cast<int*>(arg);
+  int reads = 0;
+  while (!done) {
+    SensorState s;
+    if (sensor_log.Latest(&s)) {
+      if (!Consistent(s)) {
+        (*torn)++;
+      }
+      reads++;
+    }
+  }
+  printf("reader: %d reads\n", reads);
+  return NULL;
+}
+
+int main() {
+  int failures = 0;
+  SensorState s;
+  if (sensor_log.Latest(&s)) {
+    printf("FAIL: reading before anything was published\n");
+    failures++;
+  }
+
+  pthread_t readers[NREADERS];
+  int torn[NREADERS] = {0};
+  for (int i = 0; i < NREADERS; i++) {
+    pthread_create(&readers[i], NULL, Reader, &torn[i]);
+  }
+  for (int i = 0; i < NPUBLISH; i++) {
+    Fill(i, &s);
+    sensor_log.Publish(s);
+  }
+  done = true;
+  for (int i = 0; i < NREADERS; i++) {
+    pthread_join(readers[i], NULL);
+    if (torn[i]) {
+      printf("FAIL: reader %d saw %d torn readings\n", i, torn[i]);
+      failures++;
+    }
+  }
+
+  // readings every 1ms
+  SensorLog log;
+  for (int i = 0; i < 10; i++) {
+    Fill(i, &s);
+    log.Publish(s);
+  }
+  struct timespec t = {1000, 3250000};  // a quarter of the way from 3 to 4
+  log.At(t, &s);
+  printf("at 3.25ms: accel %f, gyro z %f, servo %d\n", s.accel[0],
+      s.gyro[2], s.servo_pos);
+  if (fabsf(s.accel[0] - 3.25) > 1e-4 || fabsf(s.gyro[2] - 1.625) > 1e-4 ||
+      s.servo_pos != 3 || s.t.tv_nsec != t.tv_nsec) {
+    printf("FAIL: interpolation\n");
+    failures++;
+  }
+  t.tv_nsec = 50000000;
+  log.At(t, &s);
+  if (s.servo_pos != 9) {
+    printf("FAIL: after the latest reading, got %d\n", s.servo_pos);
+    failures++;
+  }
+  t.tv_sec = 999;
+  log.At(t, &s);
+  if (s.servo_pos != 0) {
+    printf("FAIL: before the oldest reading, got %d\n", s.servo_pos);
+    failures++;
+  }
+
+  printf("%d failures\n", failures);
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,360 @@
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <atomic>
+
+#include "drive/telemetry.h"
+
+namespace telemetry {
+
+const Schema schemas[NTYPES] = {
+  {"control", false, 14, {
+    "k", "v", "target_v", "w", "target_w", "err_w", "ierr_w", "steering",
+    "Kp", "Ki", "err_v", "ierr_v", "throttle", "braking"}},
+  {"frame_slow", true, 2, {"what", "secs"}},
+  {"flush_queue", true, 1, {"queued"}},
+  {"control_timing", true, 5, {
+    "hz", "tick_avg_us", "tick_max_us", "overruns", "actuate_us"}},
+  {"latency", true, 4, {"what", "avg_ms", "max_ms", "frames"}},
+  {"imu_lost", true, 1, {"samples"}},
+  {"i2c_bus", true, 9, {"utilization", "transactions", "batches", "failures",
+    "actuate_avg_us", "actuate_max_us", "sense_avg_us", "sense_max_us",
+    "superseded"}},
+  {"track_pose", false, 5, {"x", "y", "theta", "sigma_xy", "multimodal"}},
+  {"centerline_timing", true, CENTERLINE_TIMING_FIELDS, {"frames", "reproject_avg_us",
+    "reproject_max_us", "filter_avg_us", "filter_max_us", "ekf_avg_us",
+    "ekf_max_us", "latency_avg_us", "latency_max_us", "overruns",
+    "dropped"}},
+};
+
+static const uint32_t MAGIC = 0x314d4c54;  // "TLM1"
+
+// per thread; at a few hundred records a second, this is seconds of slack
+// for the drain thread
+static const int RING_SIZE = 1024;
+static const int MAX_THREADS = 16;
+static const int DRAIN_US = 100000;
+
+struct Record {
+  uint64_t t_us;
+  int type;
+  float values[MAX_FIELDS];
+};
+
+// single producer (its thread), single consumer (the drain thread)
+struct Ring {
+  std::atomic<uint32_t> head, tail;
+  Record records[RING_SIZE];
+};
+
+static std::atomic<Ring*> rings_[MAX_THREADS];
+static std::atomic<int> nrings_(0);
+static std::atomic<int> dropped_(0);
+static std::atomic<bool> running_(false);
+static volatile bool done_;
+static pthread_t thread_;
+static FILE *log_;
+static thread_local Ring *ring_ = NULL;
+
+static void PutVarint(std::vector<uint8_t> *out, uint64_t x) {
+  while (x >= 0x80) {
+    out->push_back(x | 0x80);
+    x >>= 7;
+  }
+  out->push_back(x);
+}
+
+static bool GetVarint(const uint8_t **p, const uint8_t *end, uint64_t *x) {
+  *x = 0;
+  for (int shift = 0; *p < end && shift < 64; shift += 7) {
+    uint8_t b = *(*p)++;
+    *x |= static_cast<uint64_t>(b & 0x7f) << shift;
+    if (!(b & 0x80)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static uint64_t Zigzag(int64_t x) {
+  return (static_cast<uint64_t>(x) << 1) ^ (x >> 63);
+}
+
+static int64_t Unzigzag(uint64_t x) {
+  return static_cast<int64_t>(x >> 1) ^ -static_cast<int64_t>(x & 1);
+}
+
+static int32_t FloatBits(float f) {
+  int32_t i;
+  memcpy(&i, &f, 4);
+  return i;
+}
+
+static float BitsFloat(int32_t i) {
+  float f;
+  memcpy(&f, &i, 4);
+  return f;
+}
+
+static void WriteHeader(FILE *fp) {
+  uint32_t ntypes = NTYPES;
+  fwrite(&MAGIC, 4, 1, fp);
+  fwrite(&ntypes, 4, 1, fp);
+  for (int i = 0; i < NTYPES; i++) {
+    uint8_t nfields = schemas[i].nfields;
+    fwrite(&nfields, 1, 1, fp);
+    fwrite(schemas[i].name, strlen(schemas[i].name) + 1, 1, fp);
+    for (int j = 0; j < nfields; j++) {
+      fwrite(schemas[i].fields[j], strlen(schemas[i].fields[j]) + 1, 1, fp);
+    }
+  }
+}
+
+static void WriteBlock(FILE *fp, int type,
+    const std::vector<const Record*> &records) {
+  std::vector<uint8_t> data;
+  uint64_t t = 0;
+  for (size_t i = 0; i < records.size(); i++) {
+    PutVarint(&data, Zigzag(records[i]->t_us - t));
+    t = records[i]->t_us;
+  }
+  // successive values of a field mostly share sign and exponent, so the
+  // difference of their bits is small
+  for (int j = 0; j < schemas[type].nfields; j++) {
+    int32_t prev = 0;
+    for (size_t i = 0; i < records.size(); i++) {
+      int32_t bits = FloatBits(records[i]->values[j]);
+      PutVarint(&data, Zigzag(static_cast<int64_t>(bits) - prev));
+      prev = bits;
+    }
+  }
+  uint8_t type8 = type;
+  uint32_t n = records.size(), nbytes = data.size();
+  fwrite(&type8, 1, 1, fp);
+  fwrite(&n, 4, 1, fp);
+  fwrite(&nbytes, 4, 1, fp);
+  fwrite(&data[0], 1, nbytes, fp);
+}
+
+static void Echo(const Record &r) {
+  const Schema &s = schemas[r.type];
+  fprintf(stderr, "%s:", s.name);
+  for (int j = 0; j < s.nfields; j++) {
+    fprintf(stderr, " %s=%g", s.fields[j], r.values[j]);
+  }
+  fprintf(stderr, "\n");
+}
+
+// empty every ring, echoing and logging what was in them
+static void Drain() {
+  static std::vector<Record> records;
+  records.clear();
+  int n = nrings_.load();
+  if (n > MAX_THREADS) n = MAX_THREADS;
+  for (int i = 0; i < n; i++) {
+    Ring *ring = rings_[i].load(std::memory_order_acquire);
+    if (!ring) {
+      continue;
+    }
+    uint32_t tail = ring->tail.load(std::memory_order_relaxed);
+    uint32_t head = ring->head.load(std::memory_order_acquire);
+    for (; tail != head; tail++) {
+      records.push_back(ring->records[tail % RING_SIZE]);
+    }
+    ring->tail.store(tail, std::memory_order_release);
+  }
+
+  std::vector<const Record*> bytype[NTYPES];
+  for (size_t i = 0; i < records.size(); i++) {
+    const Record &r = records[i];
+    if (schemas[r.type].echo) {
+      Echo(r);
+    }
+    bytype[r.type].push_back(&r);
+  }
+  if (!log_) {
+    return;
+  }
+  for (int type = 0; type < NTYPES; type++) {
+    if (!bytype[type].empty()) {
+      WriteBlock(log_, type, bytype[type]);
+    }
+  }
+  fflush(log_);
+}
+
+static void* DrainThread(void *arg) {
+  while (!done_) {
+    usleep(DRAIN_US);
+    Drain();
+  }
+  return NULL;
+}
+
+bool Init(const char *fname) {
+  if (running_) {
+    return true;
+  }
+  log_ = NULL;
+  if (fname) {
+    log_ = fopen(fname, "wb");
+    if (!log_) {
+      perror(fname);
+      return false;
+    }
+    WriteHeader(log_);
+  }
+  done_ = false;
+  if (pthread_create(&thread_, NULL, DrainThread, NULL) != 0) {
+    perror("telemetry: pthread_create");
+    if (log_) {
+      fclose(log_);
+    }
+    return false;
+  }
+  running_ = true;
+  return true;
+}
+
+void Shutdown() {
+  if (!running_) {
+    return;
+  }
+  running_ = false;
+  done_ = true;
+  pthread_join(thread_, NULL);
+  Drain();
+  if (log_) {
+    fclose(log_);
+    log_ = NULL;
+  }
+  if (dropped_ > 0) {
+    fprintf(stderr, "telemetry: %d records dropped\n", dropped_.load());
+  }
+}
+
+void Log(Type type, const float *values) {
+  if (!running_.load(std::memory_order_relaxed)) {
+    return;
+  }
+  if (!ring_) {
+    int i = nrings_.fetch_add(1);
+    if (i >= MAX_THREADS) {
+      dropped_++;
+      return;
+    }
+    Ring *ring = new Ring;
+    ring->head = ring->tail = 0;
+    rings_[i].store(ring, std::memory_order_release);
+    ring_ = ring;
+  }
+  uint32_t head = ring_->head.load(std::memory_order_relaxed);
+  if (head - ring_->tail.load(std::memory_order_acquire) >= RING_SIZE) {
+    dropped_++;
+    return;
+  }
+  Record *r = &ring_->records[head % RING_SIZE];
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  r->t_us = t.tv_sec * 1000000ULL + t.tv_nsec / 1000;
+  r->type = type;
+  memcpy(r->values, values, schemas[type].nfields * sizeof(float));
+  ring_->head.store(head + 1, std::memory_order_release);
+}
+
+int Dropped() {
+  return dropped_;
+}
+
+Reader::Reader() {
+  fp_ = NULL;
+}
+
+Reader::~Reader() {
+  if (fp_) {
+    fclose(fp_);
+  }
+}
+
+static bool ReadString(FILE *fp, std::string *s) {
+  s->clear();
+  int c;
+  while ((c = fgetc(fp)) > 0) {
+    s->push_back(c);
+  }
+  return c == 0;
+}
+
+bool Reader::Open(const char *fname) {
+  fp_ = fopen(fname, "rb");
+  if (!fp_) {
+    perror(fname);
+    return false;
+  }
+  uint32_t magic, ntypes;
+  if (fread(&magic, 4, 1, fp_) != 1 || magic != MAGIC ||
+      fread(&ntypes, 4, 1, fp_) != 1 || ntypes > 255) {
+    fprintf(stderr, "%s: not a telemetry log\n", fname);
+    return false;
+  }
+  names_.resize(ntypes);
+  fields_.resize(ntypes);
+  for (uint32_t i = 0; i < ntypes; i++) {
+    uint8_t nfields;
+    if (fread(&nfields, 1, 1, fp_) != 1 || !ReadString(fp_, &names_[i])) {
+      fprintf(stderr, "%s: truncated header\n", fname);
+      return false;
+    }
+    fields_[i].resize(nfields);
+    for (int j = 0; j < nfields; j++) {
+      if (!ReadString(fp_, &fields_[i][j])) {
+        fprintf(stderr, "%s: truncated header\n", fname);
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+bool Reader::Next(int *type, std::vector<uint64_t> *t,
+    std::vector<float> *values) {
+  uint8_t type8;
+  uint32_t n, nbytes;
+  if (fread(&type8, 1, 1, fp_) != 1 || fread(&n, 4, 1, fp_) != 1 ||
+      fread(&nbytes, 4, 1, fp_) != 1 || type8 >= names_.size()) {
+    return false;
+  }
+  buf_.resize(nbytes);
+  if (fread(&buf_[0], 1, nbytes, fp_) != nbytes) {
+    return false;
+  }
+  *type = type8;
+  int nfields = fields_[type8].size();
+  t->resize(n);
+  values->resize(n * nfields);
+
+  const uint8_t *p = &buf_[0], *end = p + nbytes;
+  uint64_t x, prev_t = 0;
+  for (uint32_t i = 0; i < n; i++) {
+    if (!GetVarint(&p, end, &x)) {
+      return false;
+    }
+    prev_t += Unzigzag(x);
+    (*t)[i] = prev_t;
+  }
+  for (int j = 0; j < nfields; j++) {
+    int32_t prev = 0;
+    for (uint32_t i = 0; i < n; i++) {
+      if (!GetVarint(&p, end, &x)) {
+        return false;
+      }
+      prev = static_cast<int32_t>(prev + Unzigzag(x));
+      (*values)[i * nfields + j] = BitsFloat(prev);
+    }
+  }
+  return true;
+}
+
+}  // namespace telemetry
@@ -0,0 +1,95 @@
+#ifndef DRIVE_TELEMETRY_H_
+#define DRIVE_TELEMETRY_H_
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <string>
+#include <vector>
+
+// Binary telemetry for the real-time threads, which can't afford to format
+// text or block on a terminal. Log() copies a fixed-schema record of floats
+// into a lock-free ring belonging to the calling thread; a background
+// thread drains the rings into a columnar, delta-encoded log (decoded by
+// telemetry_dump), and prints the records meant for a person to stderr.
+//
+// Log file layout, little endian:
+//   "TLM1", uint32 ntypes, then per type: uint8 nfields, its name and its
+//     fields' names, NUL terminated
+//   blocks of one type's records: uint8 type, uint32 nrecords, uint32
+//     nbytes, then columns of zigzag varints: timestamps (us) as deltas,
+//     then each field's float bits as int32 deltas from the record before
+namespace telemetry {
+
+enum Type {
+  CONTROL,         // DriveController::GetControl, every control step
+  FRAME_SLOW,      // camera thread stalls
+  FLUSH_QUEUE,     // recorded frames waiting to be written out
+  CONTROL_TIMING,  // ControlLoop's periodic timing report
+  LATENCY,         // exposure to actuation, reported periodically
+  IMU_LOST,        // samples the IMU's FIFO overflowed
+  I2C_BUS,         // I2CBus utilization and latency, reported periodically
+  TRACK_POSE,      // TrackLocalizer's estimate, every centerline frame
+  CENTERLINE_TIMING,  // CenterlinePipeline's periodic timing report
+  NTYPES
+};
+
+// FRAME_SLOW's and LATENCY's "what"
+enum { SLOW_COPY, SLOW_ENQUEUE, SLOW_FRAME_GAP };
+enum { LATENCY_ACTUATION, LATENCY_POSE, LATENCY_CENTERLINE };
+
+const int MAX_FIELDS = 16;
+
+// for records which are filled in a field at a time, to size them by
+const int CENTERLINE_TIMING_FIELDS = 11;
+
+struct Schema {
+  const char *name;
+  bool echo;  // also printed to stderr
+  int nfields;
+  const char *fields[MAX_FIELDS];
+};
+
+extern const Schema schemas[NTYPES];
+
+// start the drain thread, and log to fname unless it's NULL
+bool Init(const char *fname);
+void Shutdown();
+
+// copies schemas[type].nfields values; never blocks, and drops the record
+// if this thread's ring is full or there's no drain thread
+void Log(Type type, const float *values);
+
+// records dropped so far
+int Dropped();
+
+// reads a log back, one block of records at a time
+class Reader {
+ public:
+  Reader();
+  ~Reader();
+
+  bool Open(const char *fname);
+
+  // the log's own schema, which needn't match this build's
+  int NumTypes() const { return names_.size(); }
+  const char *TypeName(int type) const { return names_[type].c_str(); }
+  int NumFields(int type) const { return fields_[type].size(); }
+  const char *FieldName(int type, int i) const {
+    return fields_[type][i].c_str();
+  }
+
+  // the next block's type, timestamps in us, and values record by record;
+  // false at the end of the log or if it's corrupt
+  bool Next(int *type, std::vector<uint64_t> *t, std::vector<float> *values);
+
+ private:
+  FILE *fp_;
+  std::vector<std::string> names_;
+  std::vector<std::vector<std::string> > fields_;
+  std::vector<uint8_t> buf_;
+};
+
+}  // namespace telemetry
+
+#endif  // DRIVE_TELEMETRY_H_
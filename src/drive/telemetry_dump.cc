@@ -0,0 +1,164 @@
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <string>
+#include <vector>
+
+#include "drive/telemetry.h"
+
+// Decodes a telemetry log written by drive -l: a summary of what's in it,
+// every record as text, or CSV.
+
+static void usage(const char *argv0) {
+  fprintf(stderr, "usage: %s [-s | -p | -c] [-t <type>] [-o <prefix>] <log>\n"
+      "  -s  summarize each record type (the default)\n"
+      "  -p  print every record\n"
+      "  -c  print CSV of the records of the type given with -t\n"
+      "  -t  only records of this type, e.g. control\n"
+      "  -o  write each type's records to <prefix><type>.csv\n", argv0);
+}
+
+struct TypeSummary {
+  int records, blocks;
+  uint64_t t0, t1;
+};
+
+int main(int argc, char *argv[]) {
+  enum { SUMMARY, PRINT, CSV } mode = SUMMARY;
+  const char *only = NULL, *prefix = NULL;
+  int opt;
+  while ((opt = getopt(argc, argv, "cpst:o:")) != -1) {
+    switch (opt) {
+      case 'c': mode = CSV; break;
+      case 'p': mode = PRINT; break;
+      case 's': mode = SUMMARY; break;
+      case 't': only = optarg; break;
+      case 'o': prefix = optarg; break;
+      default:
+        usage(argv[0]);
+        return 1;
+    }
+  }
+  if (optind != argc - 1) {
+    usage(argv[0]);
+    return 1;
+  }
+  if (prefix) {
+    mode = CSV;
+  } else if (mode == CSV && !only) {
+    fprintf(stderr, "CSV needs a type (-t), or a file per type (-o)\n");
+    return 1;
+  }
+
+  telemetry::Reader reader;
+  if (!reader.Open(argv[optind])) {
+    return 1;
+  }
+  int ntypes = reader.NumTypes();
+  int selected = -1;
+  if (only) {
+    for (int i = 0; i < ntypes; i++) {
+      if (!strcmp(reader.TypeName(i), only)) {
+        selected = i;
+      }
+    }
+    if (selected == -1) {
+      fprintf(stderr, "no record type %s in %s\n", only, argv[optind]);
+      return 1;
+    }
+  }
+
+  // times are printed relative to the first record, in seconds
+  std::vector<TypeSummary> summary(ntypes, TypeSummary());
+  std::vector<FILE*> out(ntypes, static_cast<FILE*>(NULL));
+  bool have_t0 = false;
+  uint64_t t0 = 0;
+  int type;
+  std::vector<uint64_t> t;
+  std::vector<float> values;
+  while (reader.Next(&type, &t, &values)) {
+    if (selected != -1 && type != selected) {
+      continue;
+    }
+    int nfields = reader.NumFields(type);
+    if (!have_t0 && !t.empty()) {
+      t0 = t[0];
+      have_t0 = true;
+    }
+
+    TypeSummary *s = &summary[type];
+    if (s->records == 0) {
+      s->t0 = t[0];
+    }
+    s->records += t.size();
+    s->blocks++;
+    s->t1 = t.back();
+
+    if (mode == SUMMARY) {
+      continue;
+    }
+    FILE *fp = out[type];
+    if (!fp) {
+      if (prefix) {
+        std::string fname = std::string(prefix) + reader.TypeName(type) +
+          ".csv";
+        fp = fopen(fname.c_str(), "w");
+        if (!fp) {
+          perror(fname.c_str());
+          return 1;
+        }
+      } else {
+        fp = stdout;
+      }
+      out[type] = fp;
+      if (mode == CSV) {
+        fprintf(fp, "t");
+        for (int j = 0; j < nfields; j++) {
+          fprintf(fp, ",%s", reader.FieldName(type, j));
+        }
+        fprintf(fp, "\n");
+      }
+    }
+    for (size_t i = 0; i < t.size(); i++) {
+      double secs = (static_cast<int64_t>(t[i] - t0)) * 1e-6;
+      const float *v = &values[i * nfields];
+      if (mode == CSV) {
+        fprintf(fp, "%0.6f", secs);
+        for (int j = 0; j < nfields; j++) {
+          fprintf(fp, ",%g", v[j]);
+        }
+      } else {
+        fprintf(fp, "%0.6f %s", secs, reader.TypeName(type));
+        for (int j = 0; j < nfields; j++) {
+          fprintf(fp, " %s=%g", reader.FieldName(type, j), v[j]);
+        }
+      }
+      fprintf(fp, "\n");
+    }
+  }
+
+  for (int i = 0; i < ntypes; i++) {
+    if (out[i] && out[i] != stdout) {
+      fclose(out[i]);
+    }
+  }
+  if (mode != SUMMARY) {
+    return 0;
+  }
+  for (int i = 0; i < ntypes; i++) {
+    const TypeSummary &s = summary[i];
+    if (s.records == 0) {
+      continue;
+    }
+    float span = (s.t1 - s.t0) * 1e-6;
+    printf("%-16s %8d records in %5d blocks over %8.2fs", reader.TypeName(i),
+        s.records, s.blocks, span);
+    if (span > 0) {
+      printf(" (%0.1f/s)", s.records / span);
+    }
+    printf("\n");
+  }
+  return 0;
+}
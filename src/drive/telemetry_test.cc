@@ -0,0 +1,145 @@
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "drive/telemetry.h"
+
+// log control records from a few threads at once, read them back, and
+// check every value survives, in order, and how well they compress
+
+const int NTHREADS = 4;
+const int NRECORDS = 2000;
+const char *LOGFILE = "telemetry_test.log";
+
+// something like a controller's state, drifting smoothly, tagged with the
+// thread which logged it
+static void Values(int thread, int i, float *v) {
+  v[0] = thread;
+  for (int j = 1; j < 13; j++) {
+    v[j] = sinf(0.01 * i + j) * j;
+  }
+  v[13] = i & 1;
+}
+
+static void* Producer(void *arg) {
+  int thread = reinterpret_cast<intptr_t>(arg);
+  for (int i = 0; i < NRECORDS; i++) {
+    float v[telemetry::MAX_FIELDS];
+    Values(thread, i, v);
+    telemetry::Log(telemetry::CONTROL, v);
+    if (i % 100 == 99) {
+      usleep(20000);  // slower than the drain thread, so nothing's dropped
+    }
+  }
+  return NULL;
+}
+
+int main() {
+  int failures = 0;
+  float v[telemetry::MAX_FIELDS] = {0};
+  telemetry::Log(telemetry::CONTROL, v);  // no drain thread; dropped
+
+  // every schema names exactly as many fields as it says it has
+  for (int i = 0; i < telemetry::NTYPES; i++) {
+    const telemetry::Schema &s = telemetry::schemas[i];
+    int named = 0;
+    while (named < telemetry::MAX_FIELDS && s.fields[named]) {
+      named++;
+    }
+    if (named != s.nfields) {
+      printf("FAIL: %s has %d fields, and names %d\n", s.name, s.nfields,
+          named);
+      failures++;
+    }
+  }
+  if (failures) {
+    return 1;  // the log header would be unreadable
+  }
+
+  if (!telemetry::Init(LOGFILE)) {
+    return 1;
+  }
+  pthread_t threads[NTHREADS];
+  for (int i = 0; i < NTHREADS; i++) {
+    pthread_create(&threads[i], NULL, Producer,
+        reinterpret_cast<void*>(static_cast<intptr_t>(i)));
+  }
+  for (int i = 0; i < NTHREADS; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  telemetry::Shutdown();
+  if (telemetry::Dropped() != 0) {
+    printf("FAIL: %d records dropped\n", telemetry::Dropped());
+    failures++;
+  }
+
+  telemetry::Reader reader;
+  if (!reader.Open(LOGFILE)) {
+    return 1;
+  }
+  if (reader.NumTypes() != telemetry::NTYPES ||
+      reader.NumFields(telemetry::CONTROL) != 14 ||
+      std::string(reader.FieldName(telemetry::CONTROL, 7)) != "steering") {
+    printf("FAIL: schema doesn't match\n");
+    failures++;
+  }
+
+  // each thread's records are in order
+  int next[NTHREADS] = {0};
+  uint64_t last_t[NTHREADS] = {0};
+  int nblocks = 0, mismatches = 0;
+  int type;
+  std::vector<uint64_t> t;
+  std::vector<float> values;
+  while (reader.Next(&type, &t, &values)) {
+    nblocks++;
+    if (type != telemetry::CONTROL) {
+      printf("FAIL: unexpected record type %d\n", type);
+      failures++;
+      continue;
+    }
+    for (size_t i = 0; i < t.size(); i++) {
+      const float *rec = &values[i * 14];
+      int thread = rec[0];
+      if (thread < 0 || thread >= NTHREADS || next[thread] >= NRECORDS) {
+        mismatches++;
+        continue;
+      }
+      Values(thread, next[thread]++, v);
+      for (int j = 0; j < 14; j++) {
+        if (rec[j] != v[j]) {
+          mismatches++;
+          break;
+        }
+      }
+      if (t[i] < last_t[thread]) {
+        printf("FAIL: timestamps out of order\n");
+        failures++;
+      }
+      last_t[thread] = t[i];
+    }
+  }
+  for (int i = 0; i < NTHREADS; i++) {
+    if (next[i] != NRECORDS) {
+      printf("FAIL: thread %d: %d of %d records\n", i, next[i], NRECORDS);
+      failures++;
+    }
+  }
+  if (mismatches) {
+    printf("FAIL: %d records don't match\n", mismatches);
+    failures++;
+  }
+
+  struct stat st;
+  stat(LOGFILE, &st);
+  int raw = NTHREADS * NRECORDS * (8 + 14 * 4);
+  printf("%d records in %d blocks: %d bytes, %0.1f%% of %d raw\n",
+      NTHREADS * NRECORDS, nblocks, static_cast<int>(st.st_size),
+      100.0 * st.st_size / raw, raw);
+  unlink(LOGFILE);
+
+  printf("%d failures\n", failures);
+  return failures ? 1 : 0;
+}
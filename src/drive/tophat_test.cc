@@ -0,0 +1,294 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <iostream>
+#include <Eigen/Dense>
+#include "drive/config.h"
+#include "drive/imgproc.h"
+#include "util/workerpool.h"
+
+using Eigen::Matrix3f;
+using Eigen::Matrix4f;
+using Eigen::Vector3f;
+using imgproc::pixel_scale_m;
+using imgproc::ux0;
+using imgproc::uxsiz;
+using imgproc::uy0;
+using imgproc::uysiz;
+
+// draw yellow lane lines onto a birdseye image, and check that TophatFilter
+// fits them as the cumsum-based filter it replaced did; then check that
+// Reproject and TophatFilter give bit-identical results however they're
+// split into bands and run on a WorkerPool
+
+static const int N = uxsiz * uysiz;
+
+// generated by tools/mapgen, as in imgproc.cc
+static const float bucketcount[N] = {
+#include "bucketcount.txt"
+};
+
+// relative to the largest element of the reference
+const float B_TOL = 1e-3;
+const float RK_TOL = 1e-2;
+const float YC_TOL = 1e-4;  // meters
+
+// TophatFilter as it was before the planar layout and per-row sums: a
+// horizontal cumsum over an interleaved YUV accumbuf, then each activation
+// folded into the regression in turn. it read past the end of bucketcount
+// on the last row; that's treated as unmapped here, as TophatFilter does
+static bool RefTophatFilter(const DriverConfig &config, int32_t *accumbuf,
+    Vector3f *Bout, float *y_cout, Matrix4f *Rkout) {
+  // horizontal cumsum
+  for (int j = 0; j < uysiz; j++) {
+    for (int i = 1; i < uxsiz; i++) {
+      accumbuf[3*(j*uxsiz + i)] += accumbuf[3*(j*uxsiz + i - 1)];
+      accumbuf[3*(j*uxsiz + i) + 1] += accumbuf[3*(j*uxsiz + i - 1) + 1];
+      accumbuf[3*(j*uxsiz + i) + 2] += accumbuf[3*(j*uxsiz + i - 1) + 2];
+    }
+  }
+
+  // horizontal convolution w/ [-1, -1, 2, 2, -1, -1]
+  Matrix3f regXTX = Matrix3f::Zero();
+  Vector3f regXTy = Vector3f::Zero();
+  double regyTy = 0;
+  double regxsum = 0;
+  double regwsum = 0;
+  int regN = 0;
+
+  for (int j = 0; j < uysiz; j++) {
+    for (int i = 0; i < uxsiz-7; i++) {
+      int32_t yd =
+        -(accumbuf[3*(j*uxsiz + i + 6)] - accumbuf[3*(j*uxsiz + i)])
+        + 3*(accumbuf[3*(j*uxsiz + i + 4)] - accumbuf[3*(j*uxsiz + i + 2)]);
+      int32_t ud =
+        -(accumbuf[3*(j*uxsiz + i + 6) + 1] - accumbuf[3*(j*uxsiz + i) + 1])
+        + 3*(accumbuf[3*(j*uxsiz + i + 4) + 1]
+            - accumbuf[3*(j*uxsiz + i + 2) + 1]);
+      int32_t vd =
+        -(accumbuf[3*(j*uxsiz + i + 6) + 2] - accumbuf[3*(j*uxsiz + i) + 2])
+        + 3*(accumbuf[3*(j*uxsiz + i + 4) + 2]
+            - accumbuf[3*(j*uxsiz + i + 2) + 2]);
+
+      float detected = config.y_scale * yd * 0.01
+        + config.u_scale * ud * 0.01
+        + config.v_scale * vd * 0.01
+        - config.yellow_thresh;
+      int k = j*uxsiz + i;
+      if (detected > 0 && bucketcount[k] && k + 9 < N && bucketcount[k + 9]) {
+        // add x, y to linear regression
+        float pu = pixel_scale_m * (i + ux0 + 3),
+              pv = pixel_scale_m * (j + uy0);
+        float w = detected;  // use activation as regression weight
+        Vector3f regX(w*pv*pv, w*pv, w);
+        regxsum += w*pv;
+        regwsum += w;
+        regXTX.noalias() += regX * regX.transpose();
+        regXTy.noalias() += regX * w * pu;
+        regyTy += w * w * pu * pu;
+        regN += 1;
+      }
+    }
+  }
+
+  // not enough data, don't even try to do an update
+  if (regN < 8) {
+    return false;
+  }
+
+  Matrix3f XTXinv = regXTX.inverse();
+  Vector3f B = XTXinv * regXTy;
+  *Bout = B;
+
+  float r2 = B.dot(regXTX * B) - 2*B.dot(regXTy) + regyTy;
+
+  *y_cout = regxsum / regwsum;
+
+  if (isnanf(r2)) {
+    return false;
+  }
+
+  (*Rkout).topLeftCorner(3, 3) = XTXinv * r2;
+  (*Rkout)(3, 3) = regXTX(1, 1) / regwsum - *y_cout;
+  (*Rkout) /= regN;
+  return true;
+}
+
+struct Lane {
+  float a, b, c;  // x = a y^2 + b y + c, in meters
+  float width;  // in pixels
+};
+
+// gray road with a little noise, and a yellow line along each lane whose
+// intensity falls off linearly from its center, so the line lands between
+// pixels and the activations vary along it
+static void DrawFrame(const Lane *lanes, int nlanes,
+    imgproc::Workspace *ws) {
+  int32_t *py = ws->planes, *pu = py + N, *pv = pu + N;
+  for (int j = 0; j < uysiz; j++) {
+    float y = pixel_scale_m * (j + uy0);
+    for (int i = 0; i < uxsiz; i++) {
+      float yellow = 0;
+      for (int l = 0; l < nlanes; l++) {
+        const Lane &L = lanes[l];
+        float x = L.a*y*y + L.b*y + L.c;
+        float d = fabs(i + ux0 - x / pixel_scale_m);
+        yellow = std::max(yellow, std::min(1.0f, 1 + L.width/2 - d));
+      }
+      int k = j*uxsiz + i;
+      py[k] = 80 + 120*yellow + rand() % 9 - 4;
+      pu[k] = 128 - 90*yellow + rand() % 5 - 2;
+      pv[k] = 128 + 30*yellow + rand() % 5 - 2;
+    }
+  }
+}
+
+static float MaxAbs(const float *x, int n) {
+  float m = 0;
+  for (int i = 0; i < n; i++) {
+    m = std::max(m, fabsf(x[i]));
+  }
+  return m;
+}
+
+static float MaxDiff(const float *x, const float *y, int n) {
+  float m = 0;
+  for (int i = 0; i < n; i++) {
+    m = std::max(m, fabsf(x[i] - y[i]));
+  }
+  return m;
+}
+
+static imgproc::Workspace ws, ws1;
+static int32_t accumbuf[N * 3];
+static uint8_t yuv[640*480 + 2*320*240];
+
+// returns the number of failed checks
+static int Check(const char *name, const Lane *lanes, int nlanes) {
+  DriverConfig config;
+  DrawFrame(lanes, nlanes, &ws);
+  for (int k = 0; k < N; k++) {
+    for (int c = 0; c < 3; c++) {
+      accumbuf[3*k + c] = ws.planes[c*N + k];
+    }
+  }
+
+  Vector3f B, Bref;
+  float y_c, y_cref;
+  Matrix4f Rk = Matrix4f::Zero(), Rkref = Matrix4f::Zero();
+  bool ok = imgproc::TophatFilter(config, &ws, &B, &y_c, &Rk, NULL);
+  bool okref = RefTophatFilter(config, accumbuf, &Bref, &y_cref, &Rkref);
+  if (ok != okref) {
+    printf("FAIL %s: TophatFilter returned %d, reference %d\n", name, ok,
+        okref);
+    return 1;
+  }
+  if (!ok) {
+    printf("%s: no fit, as with the reference\n", name);
+    return 0;
+  }
+
+  float dB = MaxDiff(B.data(), Bref.data(), 3);
+  float dRk = MaxDiff(Rk.data(), Rkref.data(), 16);
+  float dyc = fabsf(y_c - y_cref);
+  printf("%s: B %f %f %f (ref %f %f %f), y_c %f (ref %f)\n", name,
+      B[0], B[1], B[2], Bref[0], Bref[1], Bref[2], y_c, y_cref);
+  printf("  B off by %g, y_c by %g, Rk by %g\n", dB, dyc, dRk);
+
+  int failures = 0;
+  if (dB > B_TOL * MaxAbs(Bref.data(), 3)) {
+    printf("FAIL %s: B differs from the reference\n", name);
+    failures++;
+  }
+  if (dyc > YC_TOL) {
+    printf("FAIL %s: y_c differs from the reference\n", name);
+    failures++;
+  }
+  if (dRk > RK_TOL * MaxAbs(Rkref.data(), 16)) {
+    printf("FAIL %s: Rk differs from the reference\n", name);
+    std::cout << "Rk\n" << Rk << "\nreference\n" << Rkref << "\n";
+    failures++;
+  }
+  return failures;
+}
+
+// returns the number of failed checks
+static int CheckBanding(const Lane *lanes, int nlanes) {
+  DriverConfig config;
+  const int threads[] = {1, 2, 4};
+  const int rows[] = {1, 3, imgproc::band_rows, 8, 20, uysiz};
+  WorkerPool *pools[3];
+  for (int p = 0; p < 3; p++) {
+    pools[p] = new WorkerPool(threads[p]);
+  }
+
+  // Reproject a random frame serially, in the default bands, then every
+  // other way
+  for (size_t k = 0; k < sizeof(yuv); k++) {
+    yuv[k] = rand();
+  }
+  imgproc::Reproject(yuv, &ws, NULL);
+  int failures = 0;
+  for (int p = 0; p < 3; p++) {
+    for (int r = 0; r < 6; r++) {
+      memset(ws1.planes, 0xff, sizeof(ws1.planes));
+      imgproc::Reproject(yuv, &ws1, pools[p], rows[r]);
+      if (memcmp(ws.planes, ws1.planes, sizeof(ws.planes))) {
+        printf("FAIL: Reproject differs with %d threads, %d rows per band\n",
+            threads[p], rows[r]);
+        failures++;
+      }
+    }
+  }
+
+  // and the same for TophatFilter, on lane lines
+  DrawFrame(lanes, nlanes, &ws);
+  memcpy(ws1.planes, ws.planes, sizeof(ws.planes));
+  Vector3f B, B1;
+  float y_c, y_c1;
+  Matrix4f Rk = Matrix4f::Zero(), Rk1;
+  imgproc::TophatFilter(config, &ws, &B, &y_c, &Rk, NULL);
+  for (int p = 0; p < 3; p++) {
+    for (int r = 0; r < 6; r++) {
+      memset(ws1.rows, 0xff, sizeof(ws1.rows));
+      Rk1 = Matrix4f::Zero();
+      imgproc::TophatFilter(config, &ws1, &B1, &y_c1, &Rk1, NULL, pools[p],
+          rows[r]);
+      if (memcmp(ws.rows, ws1.rows, sizeof(ws.rows))
+          || memcmp(B.data(), B1.data(), sizeof(float) * 3)
+          || memcmp(&y_c, &y_c1, sizeof(y_c))
+          || memcmp(Rk.data(), Rk1.data(), sizeof(float) * 16)) {
+        printf("FAIL: TophatFilter differs with %d threads, %d rows per "
+            "band\n", threads[p], rows[r]);
+        failures++;
+      }
+    }
+  }
+  printf("banding: %d mismatches\n", failures);
+
+  for (int p = 0; p < 3; p++) {
+    delete pools[p];
+  }
+  return failures;
+}
+
+int main() {
+  srand(1);
+  int failures = 0;
+
+  const Lane straight[] = {{0, 0, 0.1, 2}};
+  failures += Check("straight", straight, 1);
+  const Lane left[] = {{0.4, -0.2, -0.15, 2}};
+  failures += Check("curving left", left, 1);
+  const Lane right[] = {{-0.5, 0.3, 0.2, 3}};
+  failures += Check("curving right", right, 1);
+  const Lane both[] = {{0.2, 0, -0.5, 2}, {0.2, 0, 0.5, 2}};
+  failures += Check("two lines", both, 2);
+  failures += Check("no lines", NULL, 0);
+
+  failures += CheckBanding(both, 2);
+
+  return failures ? 1 : 0;
+}
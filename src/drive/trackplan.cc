@@ -0,0 +1,226 @@
+#include <math.h>
+#include <stdio.h>
+
+#include "drive/trackplan.h"
+#include "util/workerpool.h"
+
+TrackPlanner::Limits::Limits() {
+  vmax = 4.0;
+  alat = 4.0;
+  accel = 2.0;
+  brake = 3.0;
+  meters_per_unit = 0.02;  // wheel encoder ticks
+  rmin = 0.3;
+  rmax = 2.0;
+  clearance = 0.25;
+}
+
+TrackPlanner::TrackPlanner(WorkerPool *pool) {
+  pool_ = pool;
+  clearance_ = 0;
+  sweeps_ = 0;
+}
+
+bool TrackPlanner::LoadCones(const char *fname) {
+  FILE *fp = fopen(fname, "r");
+  if (!fp) {
+    perror(fname);
+    return false;
+  }
+
+  int n;
+  if (fscanf(fp, "%d\n", &n) != 1 || n < 0) {
+    fprintf(stderr, "failed loading %s\n", fname);
+    fclose(fp);
+    return false;
+  }
+  std::vector<float> xy(2*n);
+  for (int i = 0; i < n; i++) {
+    if (fscanf(fp, "%f %f\n", &xy[2*i], &xy[2*i + 1]) != 2) {
+      fprintf(stderr, "failed to load cone %d\n", i);
+      fclose(fp);
+      return false;
+    }
+  }
+  fclose(fp);
+
+  SetCones(&xy[0], n);
+  return true;
+}
+
+void TrackPlanner::SetCones(const float *xy, int n) {
+  cx_.resize(n);
+  cy_.resize(n);
+  dir_.resize(n);
+  for (int i = 0; i < n; i++) {
+    cx_[i] = xy[2*i];
+    cy_[i] = xy[2*i + 1];
+  }
+  // go clockwise around the cones where the track turns right, which
+  // trackplan.py writes as a positive radius
+  for (int i = 0; i < n; i++) {
+    int p = (i + n - 1) % n, q = (i + 1) % n;
+    float ax = cx_[i] - cx_[p], ay = cy_[i] - cy_[p];
+    float bx = cx_[q] - cx_[i], by = cy_[q] - cy_[i];
+    dir_[i] = ax*by - ay*bx > 0 ? -1 : 1;
+  }
+}
+
+static float SegmentDist(float x0, float y0, float x1, float y1,
+    float x, float y) {
+  float dx = x1 - x0, dy = y1 - y0;
+  float d2 = dx*dx + dy*dy;
+  float t = d2 > 0 ? ((x - x0)*dx + (y - y0)*dy) / d2 : 0;
+  t = fminf(fmaxf(t, 0), 1);
+  float ex = x0 + t*dx - x, ey = y0 + t*dy - y;
+  return sqrtf(ex*ex + ey*ey);
+}
+
+bool TrackPlanner::BuildTrack(const std::vector<float> &r,
+    std::vector<TrajectoryPoint> *pts) const {
+  int n = cx_.size();
+  pts->resize(n);
+  for (int i = 0; i < n; i++) {
+    TrajectoryPoint &p = (*pts)[i];
+    p.x = cx_[i];
+    p.y = cy_[i];
+    p.r = dir_[i] * r[i];
+  }
+  for (int i = 0; i < n; i++) {
+    int j = (i + 1) % n;
+    TrajectoryPoint &p = (*pts)[i];
+    const TrajectoryPoint &q = (*pts)[j];
+    float dx = q.x - p.x, dy = q.y - p.y;
+    float L = sqrtf(dx*dx + dy*dy);
+    if (L == 0) {
+      return false;
+    }
+    float S = (q.r - p.r) / L;
+    if (!(fabsf(S) < 1)) {
+      return false;  // one turn contains the other; no tangent line
+    }
+    float C = sqrtf(1 - S*S);
+    dx /= L;
+    dy /= L;
+    p.nx = -dx*S - dy*C;
+    p.ny = dx*C - dy*S;
+    p.lx0 = p.x + p.nx * p.r;
+    p.ly0 = p.y + p.ny * p.r;
+    p.lx1 = q.x + p.nx * q.r;
+    p.ly1 = q.y + p.ny * q.r;
+
+    for (int k = 0; k < n; k++) {
+      if (k != i && k != j &&
+          SegmentDist(p.lx0, p.ly0, p.lx1, p.ly1, cx_[k], cy_[k])
+          < clearance_) {
+        return false;
+      }
+    }
+  }
+  // a tangent line which doubles back means the turns on either side of it
+  // wrap all the way around their cones
+  for (int i = 0; i < n; i++) {
+    const TrajectoryPoint &a = (*pts)[(i + n - 1) % n], &b = (*pts)[i];
+    float ax = a.lx1 - a.lx0, ay = a.ly1 - a.ly0;
+    float bx = b.lx1 - b.lx0, by = b.ly1 - b.ly0;
+    float cx = cx_[(i + 1) % n] - cx_[i], cy = cy_[(i + 1) % n] - cy_[i];
+    if (bx*cx + by*cy <= 0) {
+      return false;
+    }
+    // the turn from a's line onto b's should go the same way around the
+    // cone as the track does, unless it's less than a right angle anyway
+    float turn = atan2f(ax*by - ay*bx, ax*bx + ay*by);
+    if (turn * dir_[i] > M_PI/2) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void TrackPlanner::Evaluate(Candidate *c) const {
+  std::vector<TrajectoryPoint> pts;
+  c->laptime = INFINITY;
+  if (!BuildTrack(c->r, &pts)) {
+    return;
+  }
+  TrajectoryTracker track;
+  track.SetTrack(&pts[0], pts.size());
+  track.BuildSpeedProfile(limits_.vmax, limits_.alat, limits_.accel,
+      limits_.brake, limits_.meters_per_unit);
+  if (track.HasSpeedProfile()) {
+    c->laptime = track.GetLapTime();
+  }
+}
+
+void TrackPlanner::EvalTask(void *arg, int task) {
+  TrackPlanner *self = reinterpret_cast<TrackPlanner*>(arg);
+  self->Evaluate(&self->candidates_[task]);
+}
+
+bool TrackPlanner::Plan(const Limits &limits, int max_sweeps) {
+  limits_ = limits;
+  int n = cx_.size();
+  sweeps_ = 0;
+  if (n < 3) {
+    fprintf(stderr, "TrackPlanner: need at least 3 cones, have %d\n", n);
+    return false;
+  }
+  float rmin = limits.rmin / limits.meters_per_unit;
+  float rmax = limits.rmax / limits.meters_per_unit;
+  clearance_ = limits.clearance / limits.meters_per_unit;
+
+  // start midway and shrink until everything fits
+  Candidate best;
+  best.r.assign(n, 0.5 * (rmin + rmax));
+  Evaluate(&best);
+  for (int k = 0; k < 20 && isinf(best.laptime); k++) {
+    for (int i = 0; i < n; i++) {
+      best.r[i] = fmaxf(rmin, best.r[i] * 0.7);
+    }
+    Evaluate(&best);
+  }
+  if (isinf(best.laptime)) {
+    fprintf(stderr, "TrackPlanner: no feasible track; cones too close?\n");
+    return false;
+  }
+
+  // candidate 2i grows radius i by step and 2i+1 shrinks it; the best is
+  // picked in index order so the result doesn't depend on the thread count
+  float step = 1.5;
+  candidates_.resize(2*n);
+  for (; sweeps_ < max_sweeps && step > 1.01; sweeps_++) {
+    for (int i = 0; i < n; i++) {
+      candidates_[2*i].r = best.r;
+      candidates_[2*i].r[i] = fminf(rmax, best.r[i] * step);
+      candidates_[2*i + 1].r = best.r;
+      candidates_[2*i + 1].r[i] = fmaxf(rmin, best.r[i] / step);
+    }
+    if (pool_) {
+      pool_->Run(EvalTask, this, 2*n);
+    } else {
+      for (int k = 0; k < 2*n; k++) {
+        EvalTask(this, k);
+      }
+    }
+    int bestk = -1;
+    float bestt = best.laptime;
+    for (int k = 0; k < 2*n; k++) {
+      if (candidates_[k].laptime < bestt) {
+        bestk = k;
+        bestt = candidates_[k].laptime;
+      }
+    }
+    if (bestk == -1) {
+      step = sqrtf(step);
+    } else {
+      best = candidates_[bestk];
+    }
+  }
+
+  std::vector<TrajectoryPoint> pts;
+  BuildTrack(best.r, &pts);
+  track_.SetTrack(&pts[0], n);
+  track_.BuildSpeedProfile(limits.vmax, limits.alat, limits.accel,
+      limits.brake, limits.meters_per_unit);
+  return true;
+}
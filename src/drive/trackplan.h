@@ -0,0 +1,69 @@
+#ifndef DRIVE_TRACKPLAN_H_
+#define DRIVE_TRACKPLAN_H_
+
+#include <vector>
+
+#include "drive/trajtrack.h"
+
+class WorkerPool;
+
+// Plans a racing line around a set of apex cones: the car goes around each
+// cone in turn on a circle, joined to the next by a tangent line, and the
+// radii are chosen to minimize the lap time of the resulting speed profile.
+// This replaces design/trackplan/trackplan.py, so the track can be
+// replanned on the car when the cone map changes.
+class TrackPlanner {
+ public:
+  // speeds and accelerations in m/s and m/s^2; distances in meters
+  struct Limits {
+    float vmax, alat, accel, brake;
+    float meters_per_unit;  // of the cone coordinates
+    float rmin, rmax;       // turn radius around each cone
+    float clearance;        // lines stay this far from the other cones
+
+    Limits();
+  };
+
+  explicit TrackPlanner(WorkerPool *pool = NULL);
+
+  // cones in driving order, as "n" then n lines of "x y" (lm.txt)
+  bool LoadCones(const char *fname);
+  void SetCones(const float *xy, int n);
+
+  // coordinate descent on the turn radii, starting from midway between
+  // rmin and rmax (or smaller, if that doesn't fit); each sweep tries
+  // growing and shrinking every radius in parallel and keeps the best.
+  // returns false if no feasible track was found
+  bool Plan(const Limits &limits, int max_sweeps = 100);
+
+  // the planned track, with its speed profile
+  const TrajectoryTracker &GetTrack() const { return track_; }
+  float GetLapTime() const { return track_.GetLapTime(); }
+  int GetSweeps() const { return sweeps_; }
+
+ private:
+  struct Candidate {
+    std::vector<float> r;  // radius magnitudes, track units
+    float laptime;         // infinite if infeasible
+  };
+
+  static void EvalTask(void *arg, int task);
+
+  // tangent lines between consecutive turns, as trackplan.py's trackexport;
+  // false if two turns overlap or a line passes too close to a cone
+  bool BuildTrack(const std::vector<float> &r,
+      std::vector<TrajectoryPoint> *pts) const;
+  void Evaluate(Candidate *c) const;
+
+  WorkerPool *pool_;
+  std::vector<float> cx_, cy_;
+  std::vector<float> dir_;  // +1 where the track turns clockwise
+
+  Limits limits_;
+  float clearance_;  // in track units
+  std::vector<Candidate> candidates_;
+  TrajectoryTracker track_;
+  int sweeps_;
+};
+
+#endif  // DRIVE_TRACKPLAN_H_
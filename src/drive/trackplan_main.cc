@@ -0,0 +1,90 @@
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+
+#include "drive/trackplan.h"
+#include "util/workerpool.h"
+
+// plan a track around the cones in lm.txt and write it for the controller
+
+int main(int argc, char *argv[]) {
+  TrackPlanner::Limits limits;
+  const char *outname = "track.bin";
+  bool text = false;
+  int nthreads = 4;
+  int opt;
+  while ((opt = getopt(argc, argv, "v:a:A:b:r:R:c:m:j:o:t")) != -1) {
+    switch (opt) {
+      case 'v': limits.vmax = atof(optarg); break;
+      case 'a': limits.alat = atof(optarg); break;
+      case 'A': limits.accel = atof(optarg); break;
+      case 'b': limits.brake = atof(optarg); break;
+      case 'r': limits.rmin = atof(optarg); break;
+      case 'R': limits.rmax = atof(optarg); break;
+      case 'c': limits.clearance = atof(optarg); break;
+      case 'm': limits.meters_per_unit = atof(optarg); break;
+      case 'j': nthreads = atoi(optarg); break;
+      case 'o': outname = optarg; break;
+      case 't': text = true; break;
+      default:
+        fprintf(stderr, "usage: %s [options] [lm.txt]\n"
+            "  -v <m/s>    max speed (%g)\n"
+            "  -a <m/s^2>  max lateral acceleration (%g)\n"
+            "  -A <m/s^2>  max acceleration (%g)\n"
+            "  -b <m/s^2>  max braking (%g)\n"
+            "  -r <m>      min turn radius (%g)\n"
+            "  -R <m>      max turn radius (%g)\n"
+            "  -c <m>      clearance between lines and cones (%g)\n"
+            "  -m <m>      meters per map unit (%g)\n"
+            "  -j <n>      threads (%d)\n"
+            "  -o <file>   output (%s)\n"
+            "  -t          write text, as trackplan.py did\n",
+            argv[0], limits.vmax, limits.alat, limits.accel, limits.brake,
+            limits.rmin, limits.rmax, limits.clearance,
+            limits.meters_per_unit, nthreads, outname);
+        return 1;
+    }
+  }
+  const char *conename = optind < argc ? argv[optind] : "lm.txt";
+
+  TrackPlanner planner(nthreads > 1 ? new WorkerPool(nthreads) : NULL);
+  if (!planner.LoadCones(conename)) {
+    return 1;
+  }
+
+  timeval t0, t1;
+  gettimeofday(&t0, NULL);
+  if (!planner.Plan(limits)) {
+    return 1;
+  }
+  gettimeofday(&t1, NULL);
+
+  const TrajectoryTracker &track = planner.GetTrack();
+  const TrajectoryPoint *pts = track.GetPoints();
+  fprintf(stderr, "planned in %d sweeps, %0.1fms: lap %0.3fs, %0.2fm\n",
+      planner.GetSweeps(),
+      (t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_usec - t0.tv_usec) * 1e-3,
+      planner.GetLapTime(), track.GetTrackLength() * limits.meters_per_unit);
+  for (int i = 0; i < track.NumPoints(); i++) {
+    fprintf(stderr, "  cone %d (%g, %g) r %0.2fm\n", i, pts[i].x, pts[i].y,
+        pts[i].r * limits.meters_per_unit);
+  }
+
+  if (!text) {
+    return track.SaveTrack(outname) ? 0 : 1;
+  }
+  FILE *fp = fopen(outname, "w");
+  if (!fp) {
+    perror(outname);
+    return 1;
+  }
+  fprintf(fp, "%d\n", track.NumPoints());
+  for (int i = 0; i < track.NumPoints(); i++) {
+    const TrajectoryPoint &p = pts[i];
+    fprintf(fp, "%.9g %.9g %.9g %.9g %.9g %.9g %.9g %.9g %.9g\n",
+        p.x, p.y, p.r, p.lx0, p.ly0, p.lx1, p.ly1, p.nx, p.ny);
+  }
+  fclose(fp);
+  return 0;
+}
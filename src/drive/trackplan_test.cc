@@ -0,0 +1,134 @@
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+#include "drive/trackplan.h"
+#include "util/workerpool.h"
+
+// plan a track around a small course, and check that it's feasible, no
+// slower than fixed radii, the same with and without a WorkerPool, and
+// survives a round trip through the binary track format
+
+static double Now() {
+  timeval t;
+  gettimeofday(&t, NULL);
+  return t.tv_sec + t.tv_usec * 1e-6;
+}
+
+// counterclockwise around the outside, with one right hand bend (cone 4)
+const int NCONES = 7;
+static const float cones[NCONES * 2] = {
+  0, 0,
+  400, -50,
+  700, 0,
+  750, 300,
+  450, 250,
+  200, 400,
+  -100, 250,
+};
+
+static float SegDist(const TrajectoryPoint &p, float x, float y) {
+  float dx = p.lx1 - p.lx0, dy = p.ly1 - p.ly0;
+  float t = ((x - p.lx0)*dx + (y - p.ly0)*dy) / (dx*dx + dy*dy);
+  t = fminf(fmaxf(t, 0), 1);
+  return hypotf(p.lx0 + t*dx - x, p.ly0 + t*dy - y);
+}
+
+// lap time with every radius fixed at r meters
+static float FixedLapTime(const TrackPlanner::Limits &lim, float r) {
+  TrackPlanner::Limits fixed = lim;
+  fixed.rmin = fixed.rmax = r;
+  TrackPlanner planner;
+  planner.SetCones(cones, NCONES);
+  if (!planner.Plan(fixed, 0)) {
+    return INFINITY;
+  }
+  return planner.GetLapTime();
+}
+
+int main() {
+  TrackPlanner::Limits lim;
+  int failures = 0;
+
+  TrackPlanner serial;
+  serial.SetCones(cones, NCONES);
+  double t0 = Now();
+  if (!serial.Plan(lim)) {
+    printf("FAIL: no track planned\n");
+    return 1;
+  }
+  double t1 = Now();
+  const TrajectoryTracker &track = serial.GetTrack();
+  const TrajectoryPoint *pts = track.GetPoints();
+  printf("planned in %d sweeps, %0.2fms: lap %0.3fs, %0.2fm\n",
+      serial.GetSweeps(), (t1 - t0) * 1e3, serial.GetLapTime(),
+      track.GetTrackLength() * lim.meters_per_unit);
+
+  for (int i = 0; i < NCONES; i++) {
+    float r = fabsf(pts[i].r) * lim.meters_per_unit;
+    int dir = i == 4 ? 1 : -1;
+    printf("  cone %d r %0.3fm\n", i, r);
+    if ((pts[i].r > 0 ? 1 : -1) != dir) {
+      printf("FAIL: cone %d goes the wrong way around\n", i);
+      failures++;
+    }
+    if (r < lim.rmin - 1e-4 || r > lim.rmax + 1e-4) {
+      printf("FAIL: cone %d radius %f out of range\n", i, r);
+      failures++;
+    }
+    for (int k = 0; k < NCONES; k++) {
+      if (k == i || k == (i + 1) % NCONES) continue;
+      float d = SegDist(pts[i], cones[2*k], cones[2*k + 1]);
+      if (d * lim.meters_per_unit < lim.clearance - 1e-4) {
+        printf("FAIL: line %d passes %fm from cone %d\n", i,
+            d * lim.meters_per_unit, k);
+        failures++;
+      }
+    }
+  }
+
+  static const float fixed_r[] = {0.3, 0.6, 1.0, 1.5, 2.0};
+  for (size_t j = 0; j < sizeof(fixed_r) / sizeof(fixed_r[0]); j++) {
+    float t = FixedLapTime(lim, fixed_r[j]);
+    printf("  fixed r %0.1fm: lap %0.3fs\n", fixed_r[j], t);
+    if (t < serial.GetLapTime()) {
+      printf("FAIL: planned track slower than fixed radius %0.1f\n",
+          fixed_r[j]);
+      failures++;
+    }
+  }
+
+  WorkerPool pool(4);
+  TrackPlanner parallel(&pool);
+  parallel.SetCones(cones, NCONES);
+  t0 = Now();
+  parallel.Plan(lim);
+  t1 = Now();
+  printf("parallel: %0.2fms\n", (t1 - t0) * 1e3);
+  if (parallel.GetTrack().NumPoints() != NCONES ||
+      memcmp(parallel.GetTrack().GetPoints(), pts,
+        NCONES * sizeof(TrajectoryPoint)) != 0) {
+    printf("FAIL: parallel plan differs\n");
+    failures++;
+  }
+
+  const char *fname = "/tmp/trackplan_test.bin";
+  TrajectoryTracker loaded;
+  if (!track.SaveTrack(fname) || !loaded.LoadTrack(fname)) {
+    printf("FAIL: binary round trip\n");
+    return 1;
+  }
+  if (loaded.NumPoints() != NCONES ||
+      memcmp(loaded.GetPoints(), pts, NCONES * sizeof(TrajectoryPoint)) != 0) {
+    printf("FAIL: binary track differs\n");
+    failures++;
+  }
+  if (fabsf(loaded.GetTrackLength() - track.GetTrackLength()) > 1e-3) {
+    printf("FAIL: track length %f, expected %f\n",
+        loaded.GetTrackLength(), track.GetTrackLength());
+    failures++;
+  }
+
+  printf("%d failures\n", failures);
+  return failures ? 1 : 0;
+}
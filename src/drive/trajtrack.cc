@@ -1,61 +1,378 @@
 #include <math.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <string.h>
+#include <vector>
 #include "drive/trajtrack.h"
 
+// speed profile resolution, in meters
+const float PROFILE_DS_M = 0.05;
+
 TrajectoryTracker::TrajectoryTracker() {
   n_pts_ = 0;
   pts_ = NULL;
+  grid_w_ = grid_h_ = 0;
+  grid_start_ = NULL;
+  grid_segs_ = NULL;
+  cache_valid_ = false;
+  turn_s_ = line_s_ = turn_angle_ = turn_dir_ = NULL;
+  track_len_ = 0;
+  profile_ = NULL;
+  profile_n_ = 0;
 }
 
 TrajectoryTracker::~TrajectoryTracker() {
   delete[] pts_;
+  delete[] grid_start_;
+  delete[] grid_segs_;
+  delete[] turn_s_;
+  delete[] line_s_;
+  delete[] turn_angle_;
+  delete[] turn_dir_;
+  delete[] profile_;
 }
 
+// binary tracks start with this, then the number of waypoints and the
+// TrajectoryPoints themselves, as written by SaveTrack
+static const uint32_t TRACK_MAGIC = 0x314b5254;  // "TRK1"
+
 bool TrajectoryTracker::LoadTrack(const char *fname) {
-  if (pts_ != NULL) {
-    delete[] pts_;
-  }
+  Clear();
 
-  FILE *fp = fopen(fname, "r");
+  FILE *fp = fopen(fname, "rb");
   if (!fp) {
     perror(fname);
     return false;
   }
 
-  if (fscanf(fp, "%d\n", &n_pts_) != 1) {
-    fprintf(stderr, "failed loading %s\n", fname);
-    fclose(fp);
-    n_pts_ = 0;
-    return false;
-  }
-
-  pts_ = new TrajectoryPoint[n_pts_];
-  for (int i = 0; i < n_pts_; i++) {
-    if (fscanf(fp, "%f %f %f %f %f %f %f %f %f\n",
-        &pts_[i].x, &pts_[i].y, &pts_[i].r,
-        &pts_[i].lx0, &pts_[i].ly0,
-        &pts_[i].lx1, &pts_[i].ly1,
-        &pts_[i].nx, &pts_[i].ny) != 9) {
-      fprintf(stderr, "failed to load waypoint %d\n", i);
+  uint32_t magic = 0;
+  int32_t n;
+  if (fread(&magic, sizeof(magic), 1, fp) == 1 && magic == TRACK_MAGIC) {
+    if (fread(&n, sizeof(n), 1, fp) != 1 || n <= 0) {
+      fprintf(stderr, "failed loading %s\n", fname);
+      fclose(fp);
+      return false;
+    }
+    pts_ = new TrajectoryPoint[n];
+    if (fread(pts_, sizeof(TrajectoryPoint), n, fp) != static_cast<size_t>(n)) {
+      fprintf(stderr, "%s: truncated track\n", fname);
+      fclose(fp);
+      Clear();
+      return false;
+    }
+    n_pts_ = n;
+  } else {
+    // text, as written by design/trackplan/trackplan.py
+    rewind(fp);
+    if (fscanf(fp, "%d\n", &n_pts_) != 1) {
+      fprintf(stderr, "failed loading %s\n", fname);
       fclose(fp);
       n_pts_ = 0;
-      delete[] pts_;
       return false;
     }
+
+    pts_ = new TrajectoryPoint[n_pts_];
+    for (int i = 0; i < n_pts_; i++) {
+      if (fscanf(fp, "%f %f %f %f %f %f %f %f %f\n",
+          &pts_[i].x, &pts_[i].y, &pts_[i].r,
+          &pts_[i].lx0, &pts_[i].ly0,
+          &pts_[i].lx1, &pts_[i].ly1,
+          &pts_[i].nx, &pts_[i].ny) != 9) {
+        fprintf(stderr, "failed to load waypoint %d\n", i);
+        fclose(fp);
+        Clear();
+        return false;
+      }
+    }
   }
 
   fprintf(stderr, "*** loaded %d waypoints\n", n_pts_);
 
   fclose(fp);
+  BuildGrid();
+  MeasureTrack();
+  return true;
+}
+
+bool TrajectoryTracker::SaveTrack(const char *fname) const {
+  FILE *fp = fopen(fname, "wb");
+  if (!fp) {
+    perror(fname);
+    return false;
+  }
+  int32_t n = n_pts_;
+  bool ok = fwrite(&TRACK_MAGIC, sizeof(TRACK_MAGIC), 1, fp) == 1
+    && fwrite(&n, sizeof(n), 1, fp) == 1
+    && fwrite(pts_, sizeof(TrajectoryPoint), n, fp) == static_cast<size_t>(n);
+  if (fclose(fp) != 0 || !ok) {
+    perror(fname);
+    return false;
+  }
   return true;
 }
 
+void TrajectoryTracker::SetTrack(const TrajectoryPoint *pts, int n) {
+  Clear();
+  pts_ = new TrajectoryPoint[n];
+  memcpy(pts_, pts, n * sizeof(TrajectoryPoint));
+  n_pts_ = n;
+  MeasureTrack();
+}
+
+void TrajectoryTracker::Clear() {
+  delete[] pts_;
+  pts_ = NULL;
+  n_pts_ = 0;
+  cache_valid_ = false;
+  delete[] profile_;
+  profile_ = NULL;
+  profile_n_ = 0;
+  // SetTrack leaves the grid to be built on the first lookup, so planning
+  // (which only needs the speed profile) doesn't pay for it
+  delete[] grid_start_;
+  delete[] grid_segs_;
+  grid_start_ = NULL;
+  grid_segs_ = NULL;
+  grid_w_ = grid_h_ = 0;
+}
+
 static float clip(float x, float a, float b) {
   if (x < a) return a;
   if (x > b) return b;
   return x;
 }
 
+// squared distance from x, y to the line segment leaving waypoint i, and
+// the closest point on it
+float TrajectoryTracker::SegmentDist(int i, float x, float y, float *t,
+    float *px, float *py) const {
+  const TrajectoryPoint &p = pts_[i];
+  // project x, y onto (p.lx0, p.ly0)..(p.lx1, p.ly1)
+  float dpx = p.lx1 - p.lx0;
+  float dpy = p.ly1 - p.ly0;
+  float tnum = dpx*(x - p.lx0) + dpy*(y - p.ly0);
+  float tden = dpx*dpx + dpy*dpy;
+
+  *t = clip(tnum / tden, 0, 1);
+  *px = p.lx0*(1-*t) + p.lx1*(*t);
+  *py = p.ly0*(1-*t) + p.ly1*(*t);
+  return (*px - x)*(*px - x) + (*py - y)*(*py - y);
+}
+
+// Rasterize the segments over the track's bounding box. A segment is
+// stored for a cell if it could be the closest one to any point in the
+// cell: its distance from the cell center, less the cell's half-diagonal,
+// is no more than the smallest worst-case distance of any segment over
+// the cell (attained at a corner, as distance to a segment is convex).
+// Segments go in ascending order so ties break exactly as in a full scan.
+void TrajectoryTracker::BuildGrid() {
+  delete[] grid_start_;
+  delete[] grid_segs_;
+  grid_start_ = NULL;
+  grid_segs_ = NULL;
+  grid_w_ = grid_h_ = 0;
+  if (n_pts_ == 0) {
+    return;
+  }
+
+  float xmin = pts_[0].lx0, xmax = xmin, ymin = pts_[0].ly0, ymax = ymin;
+  for (int i = 0; i < n_pts_; i++) {
+    const TrajectoryPoint &p = pts_[i];
+    xmin = fminf(xmin, fminf(p.lx0, p.lx1));
+    xmax = fmaxf(xmax, fmaxf(p.lx0, p.lx1));
+    ymin = fminf(ymin, fminf(p.ly0, p.ly1));
+    ymax = fmaxf(ymax, fmaxf(p.ly0, p.ly1));
+  }
+  // leave room to wander off the outside of the track
+  float margin = 0.25 * fmaxf(xmax - xmin, ymax - ymin);
+  xmin -= margin;
+  xmax += margin;
+  ymin -= margin;
+  ymax += margin;
+  grid_scale_ = GRID_DIM / fmaxf(xmax - xmin, ymax - ymin);
+  grid_x0_ = xmin;
+  grid_y0_ = ymin;
+  grid_w_ = ceilf((xmax - xmin) * grid_scale_);
+  grid_h_ = ceilf((ymax - ymin) * grid_scale_);
+  if (grid_w_ < 1) grid_w_ = 1;
+  if (grid_h_ < 1) grid_h_ = 1;
+
+  float cell = 1.0 / grid_scale_;
+  float halfdiag = 0.5 * sqrtf(2) * cell;
+  std::vector<int> segs;
+  std::vector<float> lower(n_pts_);
+  grid_start_ = new int[grid_w_ * grid_h_ + 1];
+  for (int j = 0; j < grid_h_; j++) {
+    for (int i = 0; i < grid_w_; i++) {
+      float cx = grid_x0_ + (i + 0.5) * cell;
+      float cy = grid_y0_ + (j + 0.5) * cell;
+      float upper = 1e30;
+      for (int k = 0; k < n_pts_; k++) {
+        float t, px, py;
+        float dmax = 0;
+        for (int c = 0; c < 4; c++) {
+          float x = cx + ((c & 1) ? 0.5 : -0.5) * cell;
+          float y = cy + ((c & 2) ? 0.5 : -0.5) * cell;
+          dmax = fmaxf(dmax, sqrtf(SegmentDist(k, x, y, &t, &px, &py)));
+        }
+        upper = fminf(upper, dmax);
+        lower[k] = sqrtf(SegmentDist(k, cx, cy, &t, &px, &py)) - halfdiag;
+      }
+      grid_start_[j*grid_w_ + i] = segs.size();
+      for (int k = 0; k < n_pts_; k++) {
+        // pad for float rounding in the distances
+        if (lower[k] <= upper * 1.0001 + 1e-6) {
+          segs.push_back(k);
+        }
+      }
+    }
+  }
+  grid_start_[grid_w_ * grid_h_] = segs.size();
+  grid_segs_ = new int[segs.size()];
+  for (size_t k = 0; k < segs.size(); k++) {
+    grid_segs_[k] = segs[k];
+  }
+
+  fprintf(stderr, "*** track grid %dx%d, %0.1f segments/cell\n",
+      grid_w_, grid_h_, static_cast<float>(segs.size()) / (grid_w_*grid_h_));
+}
+
+static float WrapAngle(float a) {
+  a = fmodf(a, 2*M_PI);
+  return a < 0 ? a + 2*M_PI : a;
+}
+
+// Each waypoint i is a turn, entered where line i-1 ends and left where
+// line i starts, then line i. Lay them out end to end by arc length
+// starting from turn 0. The direction of each turn is taken from the
+// line coming into it rather than the sign of r.
+void TrajectoryTracker::MeasureTrack() {
+  delete[] turn_s_;
+  delete[] line_s_;
+  delete[] turn_angle_;
+  delete[] turn_dir_;
+  turn_s_ = new float[n_pts_];
+  line_s_ = new float[n_pts_];
+  turn_angle_ = new float[n_pts_];
+  turn_dir_ = new float[n_pts_];
+
+  float s = 0;
+  for (int i = 0; i < n_pts_; i++) {
+    const TrajectoryPoint &prev = pts_[(i + n_pts_ - 1) % n_pts_];
+    const TrajectoryPoint &p = pts_[i];
+    float rx = prev.lx1 - p.x, ry = prev.ly1 - p.y;
+    float dx = prev.lx1 - prev.lx0, dy = prev.ly1 - prev.ly0;
+    turn_dir_[i] = rx*dy - ry*dx > 0 ? 1 : -1;
+    float ain = atan2f(ry, rx);
+    float aout = atan2f(p.ly0 - p.y, p.lx0 - p.x);
+    turn_angle_[i] = WrapAngle(turn_dir_[i] * (aout - ain));
+
+    turn_s_[i] = s;
+    s += fabsf(p.r) * turn_angle_[i];
+    line_s_[i] = s;
+    s += sqrtf((p.lx1 - p.lx0)*(p.lx1 - p.lx0)
+        + (p.ly1 - p.ly0)*(p.ly1 - p.ly0));
+  }
+  track_len_ = s;
+}
+
+void TrajectoryTracker::BuildSpeedProfile(float vmax, float alat,
+    float accel, float brake, float meters_per_unit) {
+  delete[] profile_;
+  profile_ = NULL;
+  if (n_pts_ == 0 || track_len_ <= 0) {
+    return;
+  }
+
+  profile_ds_ = PROFILE_DS_M / meters_per_unit;
+  profile_n_ = ceilf(track_len_ / profile_ds_);
+  profile_ds_ = track_len_ / profile_n_;
+  profile_ = new float[profile_n_];
+  float ds_m = profile_ds_ * meters_per_unit;
+  profile_ds_m_ = ds_m;
+
+  // the profile is kept as v^2, which is linear in distance under
+  // constant acceleration, so interpolating it respects the limits too
+
+  // lateral limit: v^2 kappa <= alat on turns, applied to every sample
+  // within one of a turn so it holds anywhere we interpolate to on it
+  for (int j = 0; j < profile_n_; j++) {
+    profile_[j] = vmax*vmax;
+  }
+  for (int i = 0; i < n_pts_; i++) {
+    float k = 1.0 / (fabsf(pts_[i].r) * meters_per_unit);
+    float v2 = fminf(vmax*vmax, alat / k);
+    int j0 = floorf(turn_s_[i] / profile_ds_ - 0.5);
+    int j1 = ceilf(line_s_[i] / profile_ds_ - 0.5);
+    for (int j = j0; j <= j1; j++) {
+      float &pj = profile_[(j + profile_n_) % profile_n_];
+      pj = fminf(pj, v2);
+    }
+  }
+
+  // braking zones, then acceleration limits; two passes each, since a
+  // limit near the start or end of the lap carries around
+  for (int j = 2*profile_n_ - 2; j >= 0; j--) {
+    float &v2 = profile_[j % profile_n_];
+    v2 = fminf(v2, profile_[(j + 1) % profile_n_] + 2*brake*ds_m);
+  }
+  for (int j = 1; j < 2*profile_n_; j++) {
+    float &v2 = profile_[j % profile_n_];
+    v2 = fminf(v2, profile_[(j - 1) % profile_n_] + 2*accel*ds_m);
+  }
+}
+
+float TrajectoryTracker::GetLapTime() const {
+  if (!profile_) {
+    return 0;
+  }
+  float t = 0;
+  for (int j = 0; j < profile_n_; j++) {
+    t += profile_ds_m_ / sqrtf(profile_[j]);
+  }
+  return t;
+}
+
+float TrajectoryTracker::GetProfileSpeed(float s) const {
+  // samples are at the middle of each interval
+  float f = s / profile_ds_ - 0.5;
+  f -= profile_n_ * floorf(f / profile_n_);
+  int j = f;
+  if (j >= profile_n_) {  // rounding
+    j = profile_n_ - 1;
+  }
+  f -= j;
+  return sqrtf(profile_[j] * (1 - f) + profile_[(j + 1) % profile_n_] * f);
+}
+
+float TrajectoryTracker::GetCurvature(float s) const {
+  if (n_pts_ == 0) {
+    return 0;
+  }
+  s -= track_len_ * floorf(s / track_len_);
+  // last turn starting at or before s
+  int lo = 0, hi = n_pts_;
+  while (hi - lo > 1) {
+    int mid = (lo + hi) / 2;
+    if (turn_s_[mid] <= s) {
+      lo = mid;
+    } else {
+      hi = mid;
+    }
+  }
+  return s < line_s_[lo] ? 1.0 / pts_[lo].r : 0;
+}
+
+float TrajectoryTracker::GetArcLength(float x, float y) {
+  Lookup(x, y);
+  return cache_s_;
+}
+
+float TrajectoryTracker::GetTargetSpeed(float x, float y) {
+  Lookup(x, y);
+  return GetProfileSpeed(cache_s_);
+}
+
 bool TrajectoryTracker::GetTarget(float x, float y,
     float *closestx, float *closesty,
     float *normx, float *normy,
@@ -66,55 +383,89 @@ bool TrajectoryTracker::GetTarget(float x, float y,
     return false;
   }
 
-  int mini = 0;
-  float mind = 1e12;
-  float minx, miny, mint;
+  Lookup(x, y);
+  *closestx = cache_cx_;
+  *closesty = cache_cy_;
+  *normx = cache_nx_;
+  *normy = cache_ny_;
+  *kappa = cache_k_;
+  *lineposition = cache_t_;
+  return true;
+}
 
-  for (int i = 0; i < n_pts_; i++) {
-    const TrajectoryPoint &p = pts_[i];
-    // project x, y onto (p.lx0, p.ly0)..(p.lx1, p.ly1)
-    float dpx = p.lx1 - p.lx0;
-    float dpy = p.ly1 - p.ly0;
-    float tnum = dpx*(x - p.lx0) + dpy*(y - p.ly0);
-    float tden = dpx*dpx + dpy*dpy;
-
-    float t = clip(tnum / tden, 0, 1);
-    float px = p.lx0*(1-t) + p.lx1*t;
-    float py = p.ly0*(1-t) + p.ly1*t;
-    float dist = (px - x)*(px - x) + (py - y)*(py - y);
-    if (dist < mind) {
-      mind = dist;
-      mint = t;
-      mini = i;
-      minx = px;
-      miny = py;
-    }
+// find the closest point on the track to x, y, unless it's the last pose
+// we were asked about
+void TrajectoryTracker::Lookup(float x, float y) {
+  if (!grid_start_) {
+    BuildGrid();
   }
+  if (!cache_valid_ || x != cache_x_ || y != cache_y_) {
+    // only the segments stored in our grid cell can be closest; off the
+    // grid, check them all
+    const int *segs = NULL;
+    int nsegs = n_pts_;
+    int gi = floorf((x - grid_x0_) * grid_scale_);
+    int gj = floorf((y - grid_y0_) * grid_scale_);
+    if (gi >= 0 && gi < grid_w_ && gj >= 0 && gj < grid_h_) {
+      int cell = gj*grid_w_ + gi;
+      segs = grid_segs_ + grid_start_[cell];
+      nsegs = grid_start_[cell + 1] - grid_start_[cell];
+    }
 
-  if (mint == 1) {  // on next circle; just advance i
-    mint = 0;
-    mini = (mini+1) % n_pts_;
-  }
-
-  const TrajectoryPoint &p = pts_[mini];
-  if (mint == 0) {  // on circle
-    // recompute closest x, y from circle
-    float dpx = x - p.x;
-    float dpy = y - p.y;
-    float norm = sqrt(dpx*dpx + dpy*dpy);
-    *closestx = p.x + fabs(p.r) * dpx / norm;
-    *closesty = p.y + fabs(p.r) * dpy / norm;
-    *normx = -dpx * copysignf(1.0, p.r) / norm;
-    *normy = -dpy * copysignf(1.0, p.r) / norm;
-    *kappa = 1.0 / p.r;
-    *lineposition = 0;
-  } else {  // on line segment
-    *closestx = minx;
-    *closesty = miny;
-    *normx = -p.nx;  // i guess i put these in backwards
-    *normy = -p.ny;
-    *kappa = 0;
-    *lineposition = mint;
+    int mini = 0;
+    float mind = 1e12;
+    float minx = 0, miny = 0, mint = 0;
+    for (int k = 0; k < nsegs; k++) {
+      int i = segs ? segs[k] : k;
+      float t, px, py;
+      float dist = SegmentDist(i, x, y, &t, &px, &py);
+      if (dist < mind) {
+        mind = dist;
+        mint = t;
+        mini = i;
+        minx = px;
+        miny = py;
+      }
+    }
+
+    if (mint == 1) {  // on next circle; just advance i
+      mint = 0;
+      mini = (mini+1) % n_pts_;
+    }
+
+    const TrajectoryPoint &p = pts_[mini];
+    if (mint == 0) {  // on circle
+      // recompute closest x, y from circle
+      float dpx = x - p.x;
+      float dpy = y - p.y;
+      float norm = sqrt(dpx*dpx + dpy*dpy);
+      cache_cx_ = p.x + fabs(p.r) * dpx / norm;
+      cache_cy_ = p.y + fabs(p.r) * dpy / norm;
+      cache_nx_ = -dpx * copysignf(1.0, p.r) / norm;
+      cache_ny_ = -dpy * copysignf(1.0, p.r) / norm;
+      cache_k_ = 1.0 / p.r;
+      cache_t_ = 0;
+      // how far around the turn we are; off the arc, snap to whichever
+      // end is nearer
+      float a = WrapAngle(turn_dir_[mini] * (atan2f(dpy, dpx)
+            - atan2f(pts_[(mini + n_pts_ - 1) % n_pts_].ly1 - p.y,
+                     pts_[(mini + n_pts_ - 1) % n_pts_].lx1 - p.x)));
+      if (a > turn_angle_[mini]) {
+        a = a > M_PI + 0.5*turn_angle_[mini] ? 0 : turn_angle_[mini];
+      }
+      cache_s_ = turn_s_[mini] + fabsf(p.r) * a;
+    } else {  // on line segment
+      cache_cx_ = minx;
+      cache_cy_ = miny;
+      cache_nx_ = -p.nx;  // i guess i put these in backwards
+      cache_ny_ = -p.ny;
+      cache_k_ = 0;
+      cache_t_ = mint;
+      cache_s_ = line_s_[mini] + mint * (turn_s_[(mini + 1) % n_pts_]
+          + (mini == n_pts_ - 1 ? track_len_ : 0) - line_s_[mini]);
+    }
+    cache_x_ = x;
+    cache_y_ = y;
+    cache_valid_ = true;
   }
-  return true;
 }
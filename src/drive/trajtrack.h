@@ -15,18 +15,86 @@ class TrajectoryTracker {
   TrajectoryTracker();
   ~TrajectoryTracker();
 
+  // loads either the text format written by design/trackplan/trackplan.py
+  // or the binary one written by SaveTrack
   bool LoadTrack(const char *fname);
+  bool SaveTrack(const char *fname) const;
 
-  // lineposition is 0..1; can be used to slow down before the next turn
+  void SetTrack(const TrajectoryPoint *pts, int n);
+  int NumPoints() const { return n_pts_; }
+  const TrajectoryPoint *GetPoints() const { return pts_; }
+
+  // lineposition is 0..1; can be used to slow down before the next turn.
+  // the last query is cached, so asking again for the same pose is free
   bool GetTarget(float x, float y,
       float *closestx, float *closesty,
       float *normx, float *normy,
       float *kappa,
       float *lineposition);
 
+  // Precompute the target speed along the track: the fastest profile which
+  // stays under vmax (m/s) and lateral acceleration alat, and which can be
+  // reached accelerating at up to accel and braking at up to brake (m/s^2),
+  // wrapping around the lap. Track coordinates are meters_per_unit meters.
+  void BuildSpeedProfile(float vmax, float alat, float accel, float brake,
+      float meters_per_unit);
+
+  bool HasSpeedProfile() const { return profile_ != NULL; }
+
+  // target speed at the point on the track closest to x, y
+  float GetTargetSpeed(float x, float y);
+
+  // arc length (track units) from the start of the first turn to the point
+  // on the track closest to x, y
+  float GetArcLength(float x, float y);
+
+  // target speed and track curvature (as GetTarget's kappa) at arc length
+  // s, and the length of a lap
+  float GetProfileSpeed(float s) const;
+  float GetCurvature(float s) const;
+  float GetTrackLength() const { return track_len_; }
+
+  // seconds to drive one lap at the speed profile
+  float GetLapTime() const;
+
  private:
+  // the lookup grid is GRID_DIM cells along the longer side of the track's
+  // bounding box
+  static const int GRID_DIM = 64;
+
+  void Clear();
+  void BuildGrid();
+  void MeasureTrack();
+  void Lookup(float x, float y);
+  float SegmentDist(int i, float x, float y, float *t,
+      float *px, float *py) const;
+
   int n_pts_;
   TrajectoryPoint *pts_;
+
+  // for each grid cell, the segments which can be closest to some point in
+  // it, as index ranges into grid_segs_
+  float grid_x0_, grid_y0_, grid_scale_;  // cells per unit
+  int grid_w_, grid_h_;
+  int *grid_start_;
+  int *grid_segs_;
+
+  // the last GetTarget query and its result
+  bool cache_valid_;
+  float cache_x_, cache_y_;
+  float cache_cx_, cache_cy_, cache_nx_, cache_ny_, cache_k_, cache_t_;
+  float cache_s_;  // arc length along the track
+
+  // arc length to the start of each turn and of the line leaving it, the
+  // angle swept by each turn, and its direction (+1 counterclockwise)
+  float *turn_s_, *line_s_;
+  float *turn_angle_, *turn_dir_;
+  float track_len_;
+
+  // squared target speed every profile_ds_ track units
+  float *profile_;
+  int profile_n_;
+  float profile_ds_, profile_ds_m_;
 };
 
 #endif  // DRIVE_TRAJTRACK_H_
@@ -0,0 +1,186 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+#include "drive/trajtrack.h"
+
+// build a closed track of turns joined by straight lines, then check
+// GetTarget against a scan of every segment at random points on and around
+// it, and check the speed profile and curvature along it
+
+const int NPTS = 40;
+
+static double Now() {
+  timeval t;
+  gettimeofday(&t, NULL);
+  return t.tv_sec + t.tv_usec * 1e-6;
+}
+
+static TrajectoryPoint pts[NPTS];
+
+static void MakeTrack(const char *fname) {
+  for (int i = 0; i < NPTS; i++) {
+    float a = 2 * M_PI * i / NPTS;
+    pts[i].x = 600 * cos(a) + 30 * cos(3 * a);
+    pts[i].y = 300 * sin(a);
+    pts[i].r = -25 - 10 * cos(2 * a);  // counterclockwise
+  }
+  // lines tangent to consecutive turns, as in trackplan.py's trackexport
+  for (int i = 0; i < NPTS; i++) {
+    TrajectoryPoint &p = pts[i], &q = pts[(i + 1) % NPTS];
+    float dx = q.x - p.x, dy = q.y - p.y;
+    float L = sqrt(dx*dx + dy*dy);
+    float S = (q.r - p.r) / L, C = sqrt(1 - S*S);
+    dx /= L;
+    dy /= L;
+    p.nx = -dx*S - dy*C;
+    p.ny = dx*C - dy*S;
+    p.lx0 = p.x + p.nx * p.r;
+    p.ly0 = p.y + p.ny * p.r;
+    p.lx1 = q.x + p.nx * q.r;
+    p.ly1 = q.y + p.ny * q.r;
+  }
+  FILE *fp = fopen(fname, "w");
+  fprintf(fp, "%d\n", NPTS);
+  for (int i = 0; i < NPTS; i++) {
+    const TrajectoryPoint &p = pts[i];
+    fprintf(fp, "%.9g %.9g %.9g %.9g %.9g %.9g %.9g %.9g %.9g\n",
+        p.x, p.y, p.r, p.lx0, p.ly0, p.lx1, p.ly1, p.nx, p.ny);
+  }
+  fclose(fp);
+}
+
+// the original GetTarget scan, closest segment only
+static int ScanClosest(float x, float y, float *tout) {
+  int mini = 0;
+  float mind = 1e12, mint = 0;
+  for (int i = 0; i < NPTS; i++) {
+    const TrajectoryPoint &p = pts[i];
+    float dpx = p.lx1 - p.lx0;
+    float dpy = p.ly1 - p.ly0;
+    float tnum = dpx*(x - p.lx0) + dpy*(y - p.ly0);
+    float tden = dpx*dpx + dpy*dpy;
+    float t = tnum / tden;
+    if (t < 0) t = 0;
+    if (t > 1) t = 1;
+    float px = p.lx0*(1-t) + p.lx1*t;
+    float py = p.ly0*(1-t) + p.ly1*t;
+    float dist = (px - x)*(px - x) + (py - y)*(py - y);
+    if (dist < mind) {
+      mind = dist;
+      mint = t;
+      mini = i;
+    }
+  }
+  if (mint == 1) {
+    mint = 0;
+    mini = (mini + 1) % NPTS;
+  }
+  *tout = mint;
+  return mini;
+}
+
+int main() {
+  const char *fname = "/tmp/trajtrack_test.txt";
+  MakeTrack(fname);
+
+  TrajectoryTracker track;
+  if (!track.LoadTrack(fname)) {
+    return 1;
+  }
+
+  // the bounding box is about 1300x700; sample well past it too
+  const int NQ = 100000;
+  int mismatches = 0;
+  srand48(1);
+  for (int q = 0; q < NQ; q++) {
+    float x = (drand48() - 0.5) * 2400, y = (drand48() - 0.5) * 1600;
+    float cx, cy, nx, ny, k, t;
+    track.GetTarget(x, y, &cx, &cy, &nx, &ny, &k, &t);
+    float tref;
+    int i = ScanClosest(x, y, &tref);
+    // on a turn, kappa identifies the waypoint; on a line, the closest
+    // point does
+    bool ok;
+    if (tref == 0) {
+      ok = t == 0 && k == 1.0f / pts[i].r;
+    } else {
+      const TrajectoryPoint &p = pts[i];
+      ok = t == tref && cx == p.lx0*(1-tref) + p.lx1*tref
+        && cy == p.ly0*(1-tref) + p.ly1*tref;
+    }
+    if (!ok && mismatches++ < 10) {
+      fprintf(stderr, "mismatch at %f %f: waypoint %d t %f, got t %f k %f\n",
+          x, y, i, tref, t, k);
+    }
+  }
+  printf("%d/%d lookups differ from a full scan\n", mismatches, NQ);
+
+  // timing along a path on the track, querying each pose twice as
+  // drive.cc does
+  float cx, cy, nx, ny, k, t;
+  double t0 = Now();
+  for (int q = 0; q < NQ; q++) {
+    float a = 2 * M_PI * q / NQ;
+    float x = 620 * cos(a), y = 320 * sin(a);
+    track.GetTarget(x, y, &cx, &cy, &nx, &ny, &k, &t);
+    track.GetTarget(x, y, &cx, &cy, &nx, &ny, &k, &t);
+  }
+  double t1 = Now();
+  for (int q = 0; q < NQ; q++) {
+    float a = 2 * M_PI * q / NQ;
+    float x = 620 * cos(a), y = 320 * sin(a);
+    ScanClosest(x, y, &t);
+    ScanClosest(x, y, &t);
+  }
+  double t2 = Now();
+  printf("grid %0.3f us/frame, full scan %0.3f us/frame\n",
+      (t1 - t0) * 1e6 / NQ, (t2 - t1) * 1e6 / NQ);
+
+  // speed profile, with track units of 2cm: check the lateral limit in the
+  // middle of each turn, and that the profile is drivable everywhere
+  const float VMAX = 6, ALAT = 4, ACCEL = 2, BRAKE = 3, MPU = 0.02;
+  track.BuildSpeedProfile(VMAX, ALAT, ACCEL, BRAKE, MPU);
+  int violations = 0;
+  for (int i = 0; i < NPTS; i++) {
+    const TrajectoryPoint &p = pts[i];
+    float a = atan2(p.ly0 - p.y, p.lx0 - p.x)
+      - atan2(pts[(i + NPTS - 1) % NPTS].ly1 - p.y,
+              pts[(i + NPTS - 1) % NPTS].lx1 - p.x);
+    a = remainder(a, 2 * M_PI);
+    float mx = p.x + fabs(p.r) * cos(atan2(p.ly0 - p.y, p.lx0 - p.x) - 0.5*a);
+    float my = p.y + fabs(p.r) * sin(atan2(p.ly0 - p.y, p.lx0 - p.x) - 0.5*a);
+    float v = track.GetTargetSpeed(mx, my);
+    if (v > sqrt(ALAT * fabs(p.r) * MPU) * 1.01) {
+      fprintf(stderr, "turn %d: %f m/s over lateral limit %f\n",
+          i, v, sqrt(ALAT * fabs(p.r) * MPU));
+      violations++;
+    }
+    // and the curvature there, and halfway along the next line
+    float s = track.GetArcLength(mx, my);
+    float sl = track.GetArcLength(0.5 * (p.lx0 + p.lx1),
+        0.5 * (p.ly0 + p.ly1));
+    if (track.GetCurvature(s) != 1.0f / p.r || track.GetCurvature(sl) != 0) {
+      fprintf(stderr, "turn %d: curvature %f, %f on the line\n", i,
+          track.GetCurvature(s), track.GetCurvature(sl));
+      violations++;
+    }
+  }
+  float len = track.GetTrackLength(), ds = 1;
+  float vmin = VMAX, vmax = 0;
+  for (float s = 0; s < len; s += ds) {
+    float v0 = track.GetProfileSpeed(s), v1 = track.GetProfileSpeed(s + ds);
+    vmin = fminf(vmin, v0);
+    vmax = fmaxf(vmax, v0);
+    float dv2 = (v1*v1 - v0*v0) / (2 * ds * MPU);
+    if (dv2 > ACCEL * 1.01 || dv2 < -BRAKE * 1.01 || v0 > VMAX) {
+      if (violations++ < 10) {
+        fprintf(stderr, "s=%f: %f -> %f m/s (%f)\n", s, v0, v1, dv2);
+      }
+    }
+  }
+  printf("%0.1fm lap, speed %0.2f..%0.2f m/s, %d violations\n",
+      len * MPU, vmin, vmax, violations);
+
+  return mismatches == 0 && violations == 0 ? 0 : 1;
+}
@@ -23,12 +23,38 @@ void Camera::ControlCallback(
   mmal_buffer_header_release(buffer);
 }
 
+// buffer->pts is on the VideoCore's clock, so compare it with that clock now
+// to see how long ago the frame was taken; if either is unavailable, assume
+// just now
+void Camera::ExposureTime(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer,
+                          struct timespec *t) {
+  clock_gettime(CLOCK_MONOTONIC, t);
+  uint64_t stc;
+  if (buffer->pts == MMAL_TIME_UNKNOWN ||
+      mmal_port_parameter_get_uint64(port, MMAL_PARAMETER_SYSTEM_TIME, &stc)
+      != MMAL_SUCCESS) {
+    return;
+  }
+  int64_t age_us = static_cast<int64_t>(stc) - buffer->pts;
+  if (age_us < 0 || age_us > 1000000) {
+    return;
+  }
+  int64_t ns = t->tv_nsec - age_us * 1000;
+  while (ns < 0) {
+    t->tv_sec--;
+    ns += 1000000000;
+  }
+  t->tv_nsec = ns;
+}
+
 void Camera::BufferCallback(MMAL_PORT_T *port,
                             MMAL_BUFFER_HEADER_T *buffer) {
   if (buffer->length) {
     if (receiver_ != NULL) {
+      struct timespec exposure;
+      ExposureTime(port, buffer, &exposure);
       mmal_buffer_header_mem_lock(buffer);
-      receiver_->OnFrame(buffer->data, buffer->length);
+      receiver_->OnFrame(buffer->data, buffer->length, exposure);
       mmal_buffer_header_mem_unlock(buffer);
     }
   }
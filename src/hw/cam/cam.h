@@ -3,11 +3,14 @@
 
 #include <stdint.h>
 #include <stdlib.h>
+#include <time.h>
 
 class CameraReceiver {
  public:
   virtual ~CameraReceiver();
-  virtual void OnFrame(uint8_t *buf, size_t len)=0;
+  // exposure is when the frame was captured, on CLOCK_MONOTONIC
+  virtual void OnFrame(uint8_t *buf, size_t len,
+      const struct timespec &exposure)=0;
 };
 
 struct MMAL_BUFFER_HEADER_T;
@@ -29,6 +32,8 @@ class Camera {
 
   static void ControlCallback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer);
   static void BufferCallback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer);
+  static void ExposureTime(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer,
+                           struct timespec *t);
 };
 
 #endif  // HW_CAM_CAM_H_
@@ -32,7 +32,8 @@ class Recorder: public CameraReceiver {
     if (output_file_) fclose(output_file_);
   }
 
-  void OnFrame(uint8_t *buf, size_t length) {
+  void OnFrame(uint8_t *buf, size_t length,
+      const struct timespec &exposure) {
     struct timeval t;
     gettimeofday(&t, NULL);
     fwrite(&t.tv_sec, sizeof(t.tv_sec), 1, output_file_);
@@ -1,6 +1,8 @@
-#include "hw/car/teensy.h"
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
 
-static const int TEENSY_ADDRESS = 118;
+#include "hw/car/teensy.h"
 
 static const int ADDR_CONTROL = 0x00;
 // 00 - bit 0: teensy LED
@@ -33,28 +35,40 @@ static const int ADDR_ENCODER_PERIOD = 0x10;
 // 15 - encoder #3 period (high)
 // 16 - encoder #4 period (low)
 // 17 - encoder #4 period (high)
-static const int NUM_ADDRS = 0x18;
 
 Teensy::Teensy(const I2C &i2cbus) : i2c_(i2cbus) {}
 
 bool Teensy::Init() {
-  return i2c_.Write(TEENSY_ADDRESS, 0x00, 0);
+  return i2c_.Write(ADDRESS, 0x00, 0);
 }
 
 bool Teensy::SetControls(uint8_t led, int8_t esc, int8_t servo) {
-  uint8_t buf[3] = {led, esc, servo};
-  return i2c_.Write(TEENSY_ADDRESS, 0, 3, buf);
+  uint8_t buf[CONTROLS_LEN];
+  EncodeControls(led, esc, servo, buf);
+  return i2c_.Write(ADDRESS, CONTROLS_REG, CONTROLS_LEN, buf);
+}
+
+void Teensy::EncodeControls(uint8_t led, int8_t esc, int8_t servo,
+    uint8_t *buf) {
+  buf[ADDR_CONTROL] = led;
+  buf[ADDR_PWM] = esc;
+  buf[ADDR_PWM + 1] = servo;
 }
 
 bool Teensy::GetFeedback(uint8_t *servo, uint16_t *encoder_pos,
     uint16_t *encoder_dt) {
   // Because the Arduino Wire API is super crappy,
   // we have to read the entire block
-  uint8_t buf[NUM_ADDRS];
-  if (!i2c_.Read(TEENSY_ADDRESS, 0, NUM_ADDRS, buf)) {
+  uint8_t buf[FEEDBACK_LEN];
+  if (!i2c_.Read(ADDRESS, 0, FEEDBACK_LEN, buf)) {
     return false;
   }
+  DecodeFeedback(buf, servo, encoder_pos, encoder_dt);
+  return true;
+}
 
+void Teensy::DecodeFeedback(const uint8_t *buf, uint8_t *servo,
+    uint16_t *encoder_pos, uint16_t *encoder_dt) {
   *servo = buf[ADDR_SRV];
   for (int i = 0; i < 4; i++) {
     encoder_pos[i] = buf[ADDR_ENCODER_COUNT + 2*i]
@@ -65,6 +79,250 @@ bool Teensy::GetFeedback(uint8_t *servo, uint16_t *encoder_pos,
     encoder_dt[i] = buf[ADDR_ENCODER_PERIOD + 2*i]
       + (buf[ADDR_ENCODER_PERIOD + 1 + 2*i] << 8);
   }
+}
+
+using teensyproto::Get16;
+using teensyproto::Get32;
+using teensyproto::Put32;
+
+TeensyStream::TeensyStream() {
+  tx_seq_ = 0;
+  rx_seq_ = -1;
+  frames_ = lost_frames_ = dropped_edges_ = 0;
+  have_us_ = false;
+  last_us_ = 0;
+  have_servo_ = have_counts_ = false;
+  servo_us_ = 0;
+  servo_adc_ = 0;
+  for (int i = 0; i < 4; i++) {
+    counts_[i] = 0;
+  }
+  next_token_ = 1;
+  for (int i = 0; i < MAX_REQUESTS; i++) {
+    request_token_[i] = 0;
+    request_ns_[i] = 0;
+  }
+  have_window_ = false;
+  window_ns_ = 0;
+  npoints_ = 0;
+  synced_ = false;
+  ns_per_us_ = 1000;
+}
+
+void TeensyStream::Feed(const uint8_t *data, int len, int64_t host_ns) {
+  parser_.Push(data, len);
+  while (parser_.Next()) {
+    frames_++;
+    if (rx_seq_ >= 0) {
+      lost_frames_ += static_cast<uint8_t>(parser_.seq() - rx_seq_ - 1);
+    }
+    rx_seq_ = parser_.seq();
+    switch (parser_.type()) {
+      case teensyproto::SENSORS:
+        OnSensors(parser_.payload(), parser_.len());
+        break;
+      case teensyproto::SYNC_REPLY:
+        OnSyncReply(parser_.payload(), parser_.len(), host_ns);
+        break;
+    }
+  }
+}
+
+int TeensyStream::EncodeControls(uint8_t led, int8_t esc, int8_t servo,
+    uint8_t *buf) {
+  uint8_t payload[3] = {
+    led, static_cast<uint8_t>(esc), static_cast<uint8_t>(servo)
+  };
+  return teensyproto::EncodeFrame(teensyproto::CONTROLS, tx_seq_++, payload,
+      sizeof(payload), buf);
+}
+
+int TeensyStream::EncodeSyncRequest(int64_t host_ns, uint8_t *buf) {
+  uint32_t token = next_token_++;
+  int i = token % MAX_REQUESTS;
+  request_token_[i] = token;
+  request_ns_[i] = host_ns;
+  uint8_t payload[4];
+  Put32(payload, token);
+  return teensyproto::EncodeFrame(teensyproto::SYNC_REQUEST, tx_seq_++,
+      payload, sizeof(payload), buf);
+}
+
+int64_t TeensyStream::Unwrap(uint32_t us) {
+  if (!have_us_) {
+    have_us_ = true;
+    last_us_ = us;
+    return us;
+  }
+  int64_t t = last_us_ + static_cast<int32_t>(us -
+      static_cast<uint32_t>(last_us_));
+  if (t > last_us_) {
+    last_us_ = t;
+  }
+  return t;
+}
+
+void TeensyStream::OnSensors(const uint8_t *p, int len) {
+  using teensyproto::EDGE_LEN;
+  using teensyproto::SERVO_LEN;
+  using teensyproto::SENSORS_HEADER_LEN;
+  if (len < SENSORS_HEADER_LEN) {
+    return;
+  }
+  int nedges = p[12], nservo = p[13];
+  if (len != SENSORS_HEADER_LEN + nedges * EDGE_LEN + nservo * SERVO_LEN) {
+    return;
+  }
+  Unwrap(Get32(p));
+  for (int i = 0; i < 4; i++) {
+    counts_[i] = Get16(p + 4 + 2*i);
+  }
+  have_counts_ = true;
 
+  const uint8_t *e = p + SENSORS_HEADER_LEN;
+  for (int i = 0; i < nedges; i++, e += EDGE_LEN) {
+    RawEdge edge;
+    edge.encoder = e[0] & 3;
+    edge.rising = e[0] & teensyproto::EDGE_RISING;
+    edge.count = Get16(e + 1);
+    edge.t_us = Unwrap(Get32(e + 3));
+    if (edges_.size() == EDGE_QUEUE) {
+      edges_.pop_front();
+      dropped_edges_++;
+    }
+    edges_.push_back(edge);
+  }
+  const uint8_t *s = e;
+  for (int i = 0; i < nservo; i++, s += SERVO_LEN) {
+    servo_us_ = Unwrap(Get32(s));
+    servo_adc_ = Get16(s + 4);
+    have_servo_ = true;
+  }
+}
+
+void TeensyStream::OnSyncReply(const uint8_t *p, int len, int64_t host_ns) {
+  if (len != 12) {
+    return;
+  }
+  uint32_t token = Get32(p);
+  int i = token % MAX_REQUESTS;
+  if (request_token_[i] != token) {
+    return;  // too old, or not ours
+  }
+  request_token_[i] = 0;
+  int64_t rx_us = Unwrap(Get32(p + 4));
+  int64_t tx_us = Unwrap(Get32(p + 8));
+
+  // carried to the window's start along the current drift estimate
+  if (have_window_ && host_ns - window_ns_ >= SYNC_WINDOW_MS * 1000000LL) {
+    if (npoints_ == SYNC_POINTS) {
+      memmove(points_, points_ + 1, sizeof(points_[0]) * (SYNC_POINTS - 1));
+      npoints_--;
+    }
+    points_[npoints_++] = window_;
+    have_window_ = false;
+  }
+  if (!have_window_) {
+    have_window_ = true;
+    window_ns_ = host_ns;
+    window_.t_us = rx_us;
+    window_.lo_ns = INT64_MIN;
+    window_.hi_ns = INT64_MAX;
+  }
+  int64_t lo = request_ns_[i] + llrint((window_.t_us - rx_us) * ns_per_us_);
+  int64_t hi = host_ns + llrint((window_.t_us - tx_us) * ns_per_us_);
+  window_.lo_ns = lo > window_.lo_ns ? lo : window_.lo_ns;
+  window_.hi_ns = hi < window_.hi_ns ? hi : window_.hi_ns;
+  if (window_.lo_ns > window_.hi_ns) {
+    // only if the drift estimate's badly off; start the window over
+    window_.lo_ns = lo;
+    window_.hi_ns = hi;
+  }
+  Fit();
+}
+
+void TeensyStream::Fit() {
+  // the drift, by least squares through the windows' points, once they
+  // span long enough to tell it from their uncertainty
+  ns_per_us_ = 1000;
+  if (npoints_ >= 2 &&
+      points_[npoints_ - 1].t_us - points_[0].t_us >= 2000000) {
+    double mt = 0, mh = 0;
+    for (int i = 0; i < npoints_; i++) {
+      mt += points_[i].t_us - points_[0].t_us;
+      mh += points_[i].host_ns() - points_[0].host_ns();
+    }
+    mt /= npoints_;
+    mh /= npoints_;
+    double stt = 0, sth = 0;
+    for (int i = 0; i < npoints_; i++) {
+      double dt = points_[i].t_us - points_[0].t_us - mt;
+      double dh = points_[i].host_ns() - points_[0].host_ns() - mh;
+      stt += dt * dt;
+      sth += dt * dh;
+    }
+    ns_per_us_ = sth / stt;
+  }
+
+  // and the offset from the current window, once it's narrowed down past
+  // the last one
+  anchor_ = window_;
+  if (npoints_ > 0) {
+    const SyncPoint &last = points_[npoints_ - 1];
+    if (last.hi_ns - last.lo_ns < window_.hi_ns - window_.lo_ns) {
+      anchor_ = last;
+    }
+  }
+  synced_ = true;
+}
+
+int64_t TeensyStream::ToHostNs(int64_t teensy_us) const {
+  return anchor_.host_ns() +
+    llrint((teensy_us - anchor_.t_us) * ns_per_us_);
+}
+
+int TeensyStream::ReadEdges(Edge *edges, int max) {
+  if (!synced_) {
+    return 0;
+  }
+  int n = 0;
+  while (n < max && !edges_.empty()) {
+    const RawEdge &e = edges_.front();
+    edges[n].t_ns = ToHostNs(e.t_us);
+    edges[n].encoder = e.encoder;
+    edges[n].rising = e.rising;
+    edges[n].count = e.count;
+    edges_.pop_front();
+    n++;
+  }
+  return n;
+}
+
+bool TeensyStream::LatestServo(int64_t *t_ns, uint16_t *adc) const {
+  if (!have_servo_ || !synced_) {
+    return false;
+  }
+  *t_ns = ToHostNs(servo_us_);
+  *adc = servo_adc_;
   return true;
 }
+
+bool TeensyStream::Counts(uint16_t *counts) const {
+  if (!have_counts_) {
+    return false;
+  }
+  for (int i = 0; i < 4; i++) {
+    counts[i] = counts_[i];
+  }
+  return true;
+}
+
+void TeensyStream::GetStats(Stats *stats) const {
+  stats->frames = frames_;
+  stats->crc_errors = parser_.CrcErrors();
+  stats->skipped_bytes = parser_.Skipped();
+  stats->lost_frames = lost_frames_;
+  stats->dropped_edges = dropped_edges_;
+  stats->sync_error_us = synced_ ? (anchor_.hi_ns - anchor_.lo_ns) / 2000 : 0;
+  stats->drift_ppm = (1000 / ns_per_us_ - 1) * 1e6;
+}
@@ -1,6 +1,11 @@
 #ifndef HW_CAR_TEENSY_H_
 #define HW_CAR_TEENSY_H_
 
+#include <stdint.h>
+
+#include <deque>
+
+#include "hw/car/teensyproto.h"
 #include "hw/gpio/i2c.h"
 
 // i2c-connected teensy running a program to write to servo / ESC, read from
@@ -16,9 +21,129 @@ class Teensy {
   bool GetFeedback(uint8_t *servo, uint16_t *encoder_pos,
       uint16_t *encoder_dt);
 
+  // the block GetFeedback reads, for reading it some other way, e.g. by
+  // polling it on an I2CBus
+  static const uint8_t ADDRESS = 118;
+  static const int FEEDBACK_LEN = 0x18;
+  static void DecodeFeedback(const uint8_t *buf, uint8_t *servo,
+      uint16_t *encoder_pos, uint16_t *encoder_dt);
+  // and the block SetControls writes, to post to an I2CBus mailbox
+  static const uint8_t CONTROLS_REG = 0;
+  static const int CONTROLS_LEN = 3;
+  static void EncodeControls(uint8_t led, int8_t esc, int8_t servo,
+      uint8_t *buf);
+
  private:
   const I2C &i2c_;
 };
 
+// The host's side of the v2 protocol (hw/car/teensyproto.h), where the
+// teensy streams every encoder edge and servo sample, timestamped: decodes
+// the stream, and maps the teensy's clock onto CLOCK_MONOTONIC to time
+// them by. The mapping comes from clock sync exchanges: a request can't
+// arrive before it's sent, nor its reply after it's received, so each
+// bounds when the teensy's clock read what it did, from both sides. The
+// tightest bounds over each SYNC_WINDOW_MS pin down a point on the
+// mapping, the quickest trip each way needn't be in the same exchange,
+// and a fit through the last SYNC_POINTS of those tracks the drift
+// between the two clocks.
+//
+// It does no I/O itself, so it can run against an emulated teensy: Feed()
+// it what's read off the serial port, and send what the Encode calls
+// produce.
+class TeensyStream {
+ public:
+  TeensyStream();
+
+  // bytes from the teensy, read at host_ns (CLOCK_MONOTONIC)
+  void Feed(const uint8_t *data, int len, int64_t host_ns);
+
+  // frames for the teensy, returning their length (teensyproto::MAX_FRAME
+  // bytes will do); a sync request has to go out at host_ns
+  int EncodeControls(uint8_t led, int8_t esc, int8_t servo, uint8_t *buf);
+  int EncodeSyncRequest(int64_t host_ns, uint8_t *buf);
+
+  struct Edge {
+    int64_t t_ns;  // host time
+    uint8_t encoder;
+    bool rising;
+    uint16_t count;  // the encoder's count, this edge included
+  };
+  // edges in the order they happened, once the clocks are synced
+  int ReadEdges(Edge *edges, int max);
+  // the latest servo sample, and encoder counts as of the latest frame;
+  // false until there's been one
+  bool LatestServo(int64_t *t_ns, uint16_t *adc) const;
+  bool Counts(uint16_t *counts) const;
+
+  bool Synced() const { return synced_; }
+  // an unwrapped teensy timestamp in host time
+  int64_t ToHostNs(int64_t teensy_us) const;
+
+  struct Stats {
+    int frames, crc_errors, skipped_bytes, lost_frames, dropped_edges;
+    int sync_error_us;  // how far the mapping could be out
+    float drift_ppm;  // how much faster the teensy's clock runs
+  };
+  void GetStats(Stats *stats) const;
+
+  static const int EDGE_QUEUE = 1024;
+  static const int SYNC_WINDOW_MS = 1000;
+  static const int SYNC_POINTS = 8;
+
+ private:
+  // the host time the teensy's clock read t_us, within lo_ns..hi_ns
+  struct SyncPoint {
+    int64_t t_us, lo_ns, hi_ns;
+    int64_t host_ns() const { return (lo_ns + hi_ns) / 2; }
+  };
+
+  // micros() extended past its wrap, from the last one seen
+  int64_t Unwrap(uint32_t us);
+  void OnSensors(const uint8_t *p, int len);
+  void OnSyncReply(const uint8_t *p, int len, int64_t host_ns);
+  void Fit();
+
+  teensyproto::FrameParser parser_;
+  uint8_t tx_seq_;
+  int rx_seq_;  // -1 until there's been a frame
+  int frames_, lost_frames_, dropped_edges_;
+
+  bool have_us_;
+  int64_t last_us_;
+
+  // edges waiting to be read, still on the teensy's clock
+  struct RawEdge {
+    int64_t t_us;
+    uint8_t encoder;
+    bool rising;
+    uint16_t count;
+  };
+  std::deque<RawEdge> edges_;
+
+  bool have_servo_, have_counts_;
+  int64_t servo_us_;
+  uint16_t servo_adc_;
+  uint16_t counts_[4];
+
+  // sync requests awaiting replies
+  static const int MAX_REQUESTS = 4;
+  uint32_t next_token_;
+  uint32_t request_token_[MAX_REQUESTS];
+  int64_t request_ns_[MAX_REQUESTS];
+
+  // the current window's bounds, and the windows' before
+  bool have_window_;
+  int64_t window_ns_;
+  SyncPoint window_;
+  SyncPoint points_[SYNC_POINTS];
+  int npoints_;
+
+  // host_ns = anchor_.host_ns + (t_us - anchor_.t_us) * ns_per_us_
+  bool synced_;
+  SyncPoint anchor_;
+  double ns_per_us_;
+};
+
 #endif  // HW_CAR_TEENSY_H_
 
@@ -0,0 +1,157 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "hw/car/teensy.h"
+#include "hw/car/teensyemu.h"
+
+// run TeensyStream against the emulated v2 firmware, over a jittery link
+// and a teensy clock that drifts and wraps partway through, and check
+// every edge comes out once, in order, timed to when it happened; and that
+// when frames are damaged or lost, it notices, and the edges in the
+// frames around them are still right
+
+struct Scenario {
+  const char *name;
+  int corrupt_ms;  // damage a frame this often
+  int drop_ms;     // lose one this often
+};
+
+static const int64_t MS = 1000000;
+
+static int Run(const Scenario &sc) {
+  // 50ppm fast and wrapping 5s in; a USB frame's worth of jitter
+  TeensyEmu emu(50, 0xffffffffu - 5000000, 200, 1000);
+  TeensyStream host;
+  // one wheel quick enough to wrap its count and fill frames with edges
+  const float rates[4] = {300, 310, 0, 4000};
+  for (int i = 0; i < 4; i++) {
+    emu.SetWheelRate(i, rates[i]);
+  }
+  emu.SetServo(517);
+
+  int failures = 0;
+  int seen[4] = {0, 0, 0, 0};
+  int gaps = 0, checked = 0;
+  int64_t max_err = 0;
+  const int64_t STEP = MS / 20, WARMUP = 3000 * MS, END = 20000 * MS;
+  for (int64_t t = 0; t < END; t += STEP) {
+    emu.Run(t);
+    uint8_t buf[1024];
+    int n = emu.Read(buf, sizeof(buf), t);
+    host.Feed(buf, n, t);
+
+    uint8_t out[teensyproto::MAX_FRAME];
+    if (t % (100 * MS) == 0) {
+      emu.Write(out, host.EncodeSyncRequest(t, out), t);
+    }
+    if (t % (10 * MS) == 0) {
+      emu.Write(out, host.EncodeControls(1, t / (10 * MS) % 100, -20, out),
+          t);
+    }
+    if (sc.corrupt_ms && t % (sc.corrupt_ms * MS) == 0) {
+      emu.CorruptNextFrame();
+    }
+    if (sc.drop_ms && t % (sc.drop_ms * MS) == 0) {
+      emu.DropNextFrame();
+    }
+
+    TeensyStream::Edge edges[256];
+    n = host.ReadEdges(edges, 256);
+    for (int i = 0; i < n; i++) {
+      const TeensyStream::Edge &e = edges[i];
+      // the edge's number, from its 16 bit count
+      int k = seen[e.encoder] + static_cast<uint16_t>(
+          e.count - static_cast<uint16_t>(seen[e.encoder]));
+      if (k != seen[e.encoder] + 1) {
+        if (k <= seen[e.encoder]) {
+          printf("FAIL: %s: encoder %d edge %d after %d\n", sc.name,
+              e.encoder, k, seen[e.encoder]);
+          failures++;
+        }
+        gaps++;
+      }
+      seen[e.encoder] = k;
+      if (e.rising != (k & 1)) {
+        printf("FAIL: %s: encoder %d edge %d the wrong way\n", sc.name,
+            e.encoder, k);
+        failures++;
+      }
+      if (t < WARMUP) {
+        continue;
+      }
+      int64_t err = llabs(e.t_ns - emu.EdgeTime(e.encoder, k));
+      max_err = err > max_err ? err : max_err;
+      checked++;
+    }
+  }
+
+  TeensyStream::Stats stats;
+  host.GetStats(&stats);
+  printf("%s: %d frames, %d edges checked, within %0.1fus; %d crc errors, "
+      "%d lost frames, %d gaps; drift %0.1fppm, sync to %dus\n", sc.name,
+      stats.frames, checked, max_err * 1e-3, stats.crc_errors,
+      stats.lost_frames, gaps, stats.drift_ppm, stats.sync_error_us);
+
+  // the link's jitter is up to 1ms each way; the quickest trip each way
+  // over a second's exchanges bound it to within a small part of that
+  if (max_err > 150000) {
+    printf("FAIL: %s: edges timed out by %0.1fus\n", sc.name,
+        max_err * 1e-3);
+    failures++;
+  }
+  if (fabsf(stats.drift_ppm - 50) > 5) {
+    printf("FAIL: %s: drift off\n", sc.name);
+    failures++;
+  }
+  for (int i = 0; i < 4; i++) {
+    // all but what's still in flight
+    if (seen[i] < emu.Edges(i) - rates[i] * 0.01) {
+      printf("FAIL: %s: encoder %d: %d edges of %d\n", sc.name, i, seen[i],
+          emu.Edges(i));
+      failures++;
+    }
+  }
+  uint16_t counts[4];
+  int64_t servo_t;
+  uint16_t adc;
+  if (!host.Counts(counts) ||
+      static_cast<uint16_t>(emu.Edges(3) - counts[3]) > rates[3] * 0.01 ||
+      !host.LatestServo(&servo_t, &adc) || adc != 517) {
+    printf("FAIL: %s: counts or servo wrong\n", sc.name);
+    failures++;
+  }
+  if (emu.led() != 1 || emu.esc() != 99 || emu.servo() != -20) {
+    printf("FAIL: %s: controls %d %d %d\n", sc.name, emu.led(), emu.esc(),
+        emu.servo());
+    failures++;
+  }
+  bool faults = sc.corrupt_ms || sc.drop_ms;
+  if (!faults && (stats.crc_errors || stats.lost_frames || gaps)) {
+    printf("FAIL: %s: lost data on a clean link\n", sc.name);
+    failures++;
+  }
+  if (sc.corrupt_ms && stats.crc_errors == 0) {
+    printf("FAIL: %s: corrupt frames went unnoticed\n", sc.name);
+    failures++;
+  }
+  if (faults && (stats.lost_frames == 0 || gaps == 0)) {
+    printf("FAIL: %s: lost frames went unnoticed\n", sc.name);
+    failures++;
+  }
+  return failures;
+}
+
+int main() {
+  const Scenario scenarios[] = {
+    {"clean", 0, 0},
+    {"damaged", 370, 0},
+    {"lossy", 0, 530},
+  };
+  int failures = 0;
+  for (size_t i = 0; i < sizeof(scenarios) / sizeof(scenarios[0]); i++) {
+    failures += Run(scenarios[i]);
+  }
+  printf("%d failures\n", failures);
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,199 @@
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hw/car/teensyemu.h"
+
+using teensyproto::Put16;
+using teensyproto::Put32;
+
+TeensyEmu::TeensyEmu(double ppm, uint32_t start_us, int link_us,
+    int jitter_us)
+  : ppm_(ppm), start_us_(start_us), link_us_(link_us), jitter_us_(jitter_us),
+    seed_(1), now_ns_(0), servo_adc_(0), ring_head_(0), ring_tail_(0),
+    nservo_(0), tx_seq_(0), led_(0), esc_(0), servo_(0),
+    last_to_host_ns_(0), last_to_teensy_ns_(0), corrupt_next_(false),
+    drop_next_(false) {
+  for (int i = 0; i < 4; i++) {
+    wheel_period_ns_[i] = 0;
+    next_edge_ns_[i] = -1;
+    level_[i] = false;
+    counts_[i] = 0;
+  }
+  last_servo_us_ = last_packet_us_ = Micros(0);
+}
+
+uint32_t TeensyEmu::Micros(int64_t host_ns) const {
+  return start_us_ + static_cast<uint32_t>(static_cast<int64_t>(
+        floor(host_ns * (1 + ppm_ * 1e-6) / 1000)));
+}
+
+void TeensyEmu::SetWheelRate(int encoder, float edges_per_sec) {
+  wheel_period_ns_[encoder] = edges_per_sec > 0 ? 1e9 / edges_per_sec : 0;
+  next_edge_ns_[encoder] = edges_per_sec > 0 ?
+    now_ns_ + wheel_period_ns_[encoder] : -1;
+}
+
+void TeensyEmu::Run(int64_t now_ns) {
+  while (now_ns_ < now_ns) {
+    int64_t next = now_ns_ + LOOP_US * 1000;
+    // edges interrupt whenever they happen, in order
+    for (;;) {
+      int e = -1;
+      for (int i = 0; i < 4; i++) {
+        if (next_edge_ns_[i] >= 0 && next_edge_ns_[i] <= next &&
+            (e == -1 || next_edge_ns_[i] < next_edge_ns_[e])) {
+          e = i;
+        }
+      }
+      if (e == -1) {
+        break;
+      }
+      OnEdge(e, next_edge_ns_[e]);
+      next_edge_ns_[e] += wheel_period_ns_[e];
+    }
+    while (!to_teensy_.empty() && to_teensy_.front().first <= next) {
+      rx_.Push(&to_teensy_.front().second, 1);
+      to_teensy_.pop_front();
+    }
+    now_ns_ = next;
+    Loop(now_ns_);
+  }
+}
+
+void TeensyEmu::OnEdge(int encoder, int64_t host_ns) {
+  edge_ns_[encoder].push_back(host_ns);
+  level_[encoder] = !level_[encoder];
+  counts_[encoder]++;
+  // if loop() has fallen that far behind, the edge still counts, but its
+  // time is lost
+  if (ring_head_ - ring_tail_ < EDGE_RING) {
+    EdgeEvent *ev = &ring_[ring_head_ % EDGE_RING];
+    ev->which = encoder | (level_[encoder] ? teensyproto::EDGE_RISING : 0);
+    ev->count = counts_[encoder];
+    ev->t_us = Micros(host_ns);
+    ring_head_++;
+  }
+}
+
+void TeensyEmu::Loop(int64_t host_ns) {
+  using teensyproto::MAX_EDGES;
+  using teensyproto::MAX_SERVO;
+  using teensyproto::SERVO_LEN;
+  uint32_t now = Micros(host_ns);
+
+  while (rx_.Next()) {
+    const uint8_t *p = rx_.payload();
+    if (rx_.type() == teensyproto::CONTROLS && rx_.len() == 3) {
+      led_ = p[0];
+      esc_ = p[1];
+      servo_ = p[2];
+    } else if (rx_.type() == teensyproto::SYNC_REQUEST && rx_.len() == 4) {
+      uint8_t reply[12];
+      memcpy(reply, p, 4);
+      Put32(reply + 4, now);
+      // the time it takes to turn the reply round, which the host has to
+      // allow for
+      Put32(reply + 8, Micros(host_ns + 15000));
+      Send(teensyproto::SYNC_REPLY, reply, sizeof(reply));
+    }
+  }
+
+  if (now - last_servo_us_ >= static_cast<uint32_t>(
+        teensyproto::SERVO_SAMPLE_US)) {
+    last_servo_us_ += teensyproto::SERVO_SAMPLE_US;
+    if (nservo_ < MAX_SERVO) {
+      Put32(servo_samples_ + nservo_ * SERVO_LEN, now);
+      Put16(servo_samples_ + nservo_ * SERVO_LEN + 4, servo_adc_);
+      nservo_++;
+    }
+  }
+
+  if (now - last_packet_us_ >= static_cast<uint32_t>(teensyproto::PACKET_US)
+      || ring_head_ - ring_tail_ >= static_cast<unsigned>(MAX_EDGES)
+      || nservo_ == MAX_SERVO) {
+    SendSensors(now);
+  }
+}
+
+void TeensyEmu::SendSensors(uint32_t now) {
+  using teensyproto::EDGE_LEN;
+  using teensyproto::SERVO_LEN;
+  uint8_t p[teensyproto::MAX_PAYLOAD];
+  Put32(p, now);
+  for (int i = 0; i < 4; i++) {
+    Put16(p + 4 + 2*i, counts_[i]);
+  }
+  uint8_t *e = p + teensyproto::SENSORS_HEADER_LEN;
+  int nedges = 0;
+  while (ring_tail_ != ring_head_ && nedges < teensyproto::MAX_EDGES) {
+    const EdgeEvent &ev = ring_[ring_tail_ % EDGE_RING];
+    e[0] = ev.which;
+    Put16(e + 1, ev.count);
+    Put32(e + 3, ev.t_us);
+    e += EDGE_LEN;
+    ring_tail_++;
+    nedges++;
+  }
+  memcpy(e, servo_samples_, nservo_ * SERVO_LEN);
+  p[12] = nedges;
+  p[13] = nservo_;
+  int len = teensyproto::SENSORS_HEADER_LEN + nedges * EDGE_LEN +
+    nservo_ * SERVO_LEN;
+  nservo_ = 0;
+  last_packet_us_ = now;
+  Send(teensyproto::SENSORS, p, len);
+}
+
+void TeensyEmu::Send(uint8_t type, const uint8_t *payload, int len) {
+  uint8_t frame[teensyproto::MAX_FRAME];
+  int n = teensyproto::EncodeFrame(type, tx_seq_++, payload, len, frame);
+  if (drop_next_) {
+    drop_next_ = false;
+    return;
+  }
+  if (corrupt_next_) {
+    corrupt_next_ = false;
+    frame[rand_r(&seed_) % n] ^= 1 << (rand_r(&seed_) % 8);
+  }
+  int64_t t = LinkTime(now_ns_, &last_to_host_ns_);
+  for (int i = 0; i < n; i++) {
+    to_host_.push_back(std::make_pair(t, frame[i]));
+  }
+}
+
+int64_t TeensyEmu::LinkTime(int64_t sent_ns, int64_t *last_ns) {
+  int64_t t = sent_ns + link_us_ * 1000LL;
+  if (jitter_us_ > 0) {
+    t += rand_r(&seed_) % (jitter_us_ * 1000);
+  }
+  // the link doesn't reorder
+  if (t < *last_ns) {
+    t = *last_ns;
+  }
+  *last_ns = t;
+  return t;
+}
+
+void TeensyEmu::Write(const uint8_t *data, int len, int64_t now_ns) {
+  int64_t t = LinkTime(now_ns, &last_to_teensy_ns_);
+  for (int i = 0; i < len; i++) {
+    to_teensy_.push_back(std::make_pair(t, data[i]));
+  }
+}
+
+int TeensyEmu::Read(uint8_t *buf, int max, int64_t now_ns) {
+  int n = 0;
+  while (n < max && !to_host_.empty() && to_host_.front().first <= now_ns) {
+    buf[n++] = to_host_.front().second;
+    to_host_.pop_front();
+  }
+  return n;
+}
+
+int64_t TeensyEmu::EdgeTime(int encoder, int n) const {
+  if (n < 1 || n > static_cast<int>(edge_ns_[encoder].size())) {
+    return -1;
+  }
+  return edge_ns_[encoder][n - 1];
+}
@@ -0,0 +1,97 @@
+#ifndef HW_CAR_TEENSYEMU_H_
+#define HW_CAR_TEENSYEMU_H_
+
+#include <stdint.h>
+
+#include <deque>
+#include <utility>
+#include <vector>
+
+#include "hw/car/teensyproto.h"
+
+// The v2 firmware (arduino/cycloid2) emulated on simulated time, so
+// TeensyStream can be tested without a car: wheels tick at set rates
+// into the encoder interrupt handler, loop() samples the servo and sends
+// frames as the firmware does, on a clock of its own that drifts, and a
+// serial link in between delays, jitters, and on request damages what
+// crosses it. The host time of every edge is kept, to check against.
+class TeensyEmu {
+ public:
+  // its clock runs ppm fast and reads start_us at host time 0; the link
+  // takes link_us plus up to jitter_us each way
+  TeensyEmu(double ppm, uint32_t start_us, int link_us, int jitter_us);
+
+  void SetWheelRate(int encoder, float edges_per_sec);
+  void SetServo(uint16_t adc) { servo_adc_ = adc; }
+
+  // run the firmware up to host time now_ns
+  void Run(int64_t now_ns);
+
+  // the host's end of the serial link
+  void Write(const uint8_t *data, int len, int64_t now_ns);
+  int Read(uint8_t *buf, int max, int64_t now_ns);
+
+  // the next frame it sends gets a bit flipped, or is lost
+  void CorruptNextFrame() { corrupt_next_ = true; }
+  void DropNextFrame() { drop_next_ = true; }
+
+  // when encoder's nth edge happened (the first is 1), or -1 if it hasn't
+  int64_t EdgeTime(int encoder, int n) const;
+  int Edges(int encoder) const { return edge_ns_[encoder].size(); }
+
+  // what the host last set
+  uint8_t led() const { return led_; }
+  int8_t esc() const { return esc_; }
+  int8_t servo() const { return servo_; }
+
+  // the firmware's edge buffer, and how often loop() comes round
+  static const int EDGE_RING = 64;
+  static const int LOOP_US = 20;
+
+ private:
+  uint32_t Micros(int64_t host_ns) const;
+  // the encoder pin change interrupt
+  void OnEdge(int encoder, int64_t host_ns);
+  // one time round loop()
+  void Loop(int64_t host_ns);
+  void SendSensors(uint32_t now);
+  void Send(uint8_t type, const uint8_t *payload, int len);
+  // a byte's arrival time at the other end of the link, in order
+  int64_t LinkTime(int64_t sent_ns, int64_t *last_ns);
+
+  double ppm_;
+  uint32_t start_us_;
+  int link_us_, jitter_us_;
+  unsigned seed_;
+  int64_t now_ns_;  // how far it's run
+
+  // wheels
+  int64_t wheel_period_ns_[4], next_edge_ns_[4];
+  std::vector<int64_t> edge_ns_[4];
+  uint16_t servo_adc_;
+
+  // the firmware's state
+  struct EdgeEvent {
+    uint8_t which;
+    uint16_t count;
+    uint32_t t_us;
+  };
+  EdgeEvent ring_[EDGE_RING];
+  unsigned ring_head_, ring_tail_;
+  bool level_[4];
+  uint16_t counts_[4];
+  uint8_t servo_samples_[teensyproto::MAX_SERVO * teensyproto::SERVO_LEN];
+  int nservo_;
+  uint32_t last_servo_us_, last_packet_us_;
+  uint8_t tx_seq_;
+  teensyproto::FrameParser rx_;
+  uint8_t led_;
+  int8_t esc_, servo_;
+
+  // the link, (arrival time, byte) each way
+  std::deque<std::pair<int64_t, uint8_t> > to_host_, to_teensy_;
+  int64_t last_to_host_ns_, last_to_teensy_ns_;
+  bool corrupt_next_, drop_next_;
+};
+
+#endif  // HW_CAR_TEENSYEMU_H_
@@ -0,0 +1,82 @@
+#include <string.h>
+
+#include "hw/car/teensyproto.h"
+
+namespace teensyproto {
+
+uint16_t Crc16(const uint8_t *data, int len) {
+  uint16_t crc = 0xffff;
+  for (int i = 0; i < len; i++) {
+    crc ^= data[i] << 8;
+    for (int j = 0; j < 8; j++) {
+      crc = crc & 0x8000 ? (crc << 1) ^ 0x1021 : crc << 1;
+    }
+  }
+  return crc;
+}
+
+int EncodeFrame(uint8_t type, uint8_t seq, const uint8_t *payload, int len,
+    uint8_t *out) {
+  out[0] = SYNC0;
+  out[1] = SYNC1;
+  out[2] = type;
+  out[3] = seq;
+  out[4] = len;
+  memcpy(out + HEADER_LEN, payload, len);
+  Put16(out + HEADER_LEN + len, Crc16(out + 2, 3 + len));
+  return HEADER_LEN + len + CRC_LEN;
+}
+
+FrameParser::FrameParser() : start_(0), crc_errors_(0), skipped_(0) {
+  memset(frame_, 0, sizeof(frame_));
+}
+
+void FrameParser::Push(const uint8_t *data, int len) {
+  // make room by dropping what's been parsed, once it's most of the buffer
+  if (start_ > 0 && start_ >= buf_.size() / 2) {
+    buf_.erase(buf_.begin(), buf_.begin() + start_);
+    start_ = 0;
+  }
+  buf_.insert(buf_.end(), data, data + len);
+}
+
+bool FrameParser::Next() {
+  for (;;) {
+    size_t avail = buf_.size() - start_;
+    if (avail == 0) {
+      return false;
+    }
+    const uint8_t *b = &buf_[start_];
+    if (b[0] != SYNC0 || (avail >= 2 && b[1] != SYNC1)) {
+      start_++;
+      skipped_++;
+      continue;
+    }
+    if (avail < static_cast<size_t>(HEADER_LEN)) {
+      return false;
+    }
+    int len = b[4];
+    if (len > MAX_PAYLOAD) {
+      start_++;
+      skipped_++;
+      continue;
+    }
+    size_t frame_len = HEADER_LEN + len + CRC_LEN;
+    if (avail < frame_len) {
+      return false;
+    }
+    if (Get16(b + HEADER_LEN + len) != Crc16(b + 2, 3 + len)) {
+      // not a frame after all, or a damaged one; either way, look for the
+      // next sync from just past this one
+      crc_errors_++;
+      start_++;
+      skipped_++;
+      continue;
+    }
+    memcpy(frame_, b, frame_len);
+    start_ += frame_len;
+    return true;
+  }
+}
+
+}  // namespace teensyproto
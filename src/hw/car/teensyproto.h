@@ -0,0 +1,123 @@
+#ifndef HW_CAR_TEENSYPROTO_H_
+#define HW_CAR_TEENSYPROTO_H_
+
+#include <stdint.h>
+
+#include <vector>
+
+// The v2 host/teensy protocol, streamed over the teensy's USB serial
+// rather than polled over I2C (arduino/cycloid2 is the firmware's side,
+// and has to be kept in step with this). Each direction is a stream of
+// frames:
+//
+//   0xc5 0x1d          sync
+//   uint8 type
+//   uint8 seq          counts up per frame, per direction, to spot losses
+//   uint8 len          payload bytes, up to MAX_PAYLOAD
+//   payload
+//   uint16 crc         CRC-16/CCITT-FALSE of type through payload
+//
+// all little endian; a receiver hunts for the sync bytes, and drops a
+// frame whose CRC doesn't match. Times are the teensy's micros(), which
+// wraps every 71 minutes.
+//
+// teensy to host:
+//   SENSORS, every PACKET_US or sooner when edges pile up
+//     uint32 t_us        when it was sent
+//     uint16 count[4]    each encoder's edge count as of t_us
+//     uint8 nedges, nservo
+//     nedges x {uint8 encoder | EDGE_RISING, uint16 count after the edge,
+//               uint32 t_us}
+//     nservo x {uint32 t_us, uint16 adc (10 bits)}
+//   SYNC_REPLY, as soon as a SYNC_REQUEST comes in
+//     uint32 token       the request's
+//     uint32 rx_us, tx_us  when the request came in, and the reply went out
+//
+// host to teensy:
+//   CONTROLS             uint8 led, int8 esc, int8 servo
+//   SYNC_REQUEST         uint32 token
+
+namespace teensyproto {
+
+const uint8_t SYNC0 = 0xc5, SYNC1 = 0x1d;
+const int HEADER_LEN = 5;  // sync, type, seq, len
+const int CRC_LEN = 2;
+const int MAX_PAYLOAD = 250;
+const int MAX_FRAME = HEADER_LEN + MAX_PAYLOAD + CRC_LEN;
+
+enum Type {
+  SENSORS = 0x01,
+  SYNC_REPLY = 0x02,
+  CONTROLS = 0x81,
+  SYNC_REQUEST = 0x82,
+};
+
+const int SENSORS_HEADER_LEN = 14;
+const int EDGE_LEN = 7;
+const int SERVO_LEN = 6;
+const uint8_t EDGE_RISING = 0x80;
+// what the firmware packs into one SENSORS frame, and how often it sends
+// one regardless
+const int MAX_EDGES = 24;
+const int MAX_SERVO = 8;
+const int PACKET_US = 5000;
+const int SERVO_SAMPLE_US = 1000;
+
+uint16_t Crc16(const uint8_t *data, int len);
+
+// writes a whole frame to out (MAX_FRAME bytes will do), returning its
+// length
+int EncodeFrame(uint8_t type, uint8_t seq, const uint8_t *payload, int len,
+    uint8_t *out);
+
+static inline void Put16(uint8_t *p, uint16_t x) {
+  p[0] = x;
+  p[1] = x >> 8;
+}
+
+static inline void Put32(uint8_t *p, uint32_t x) {
+  p[0] = x;
+  p[1] = x >> 8;
+  p[2] = x >> 16;
+  p[3] = x >> 24;
+}
+
+static inline uint16_t Get16(const uint8_t *p) {
+  return p[0] | (p[1] << 8);
+}
+
+static inline uint32_t Get32(const uint8_t *p) {
+  return p[0] | (p[1] << 8) | (p[2] << 16) |
+    (static_cast<uint32_t>(p[3]) << 24);
+}
+
+// pulls frames out of a byte stream, resynchronizing after garbage or a
+// corrupt frame, including one whose bogus length swallowed good frames
+class FrameParser {
+ public:
+  FrameParser();
+
+  // bytes as they arrive, however they're split up
+  void Push(const uint8_t *data, int len);
+  // the next good frame, which stays valid until the next call; false when
+  // there's no whole one yet
+  bool Next();
+
+  uint8_t type() const { return frame_[2]; }
+  uint8_t seq() const { return frame_[3]; }
+  int len() const { return frame_[4]; }
+  const uint8_t *payload() const { return frame_ + HEADER_LEN; }
+
+  int CrcErrors() const { return crc_errors_; }
+  int Skipped() const { return skipped_; }  // bytes outside any frame
+
+ private:
+  std::vector<uint8_t> buf_;
+  size_t start_;
+  uint8_t frame_[MAX_FRAME];
+  int crc_errors_, skipped_;
+};
+
+}  // namespace teensyproto
+
+#endif  // HW_CAR_TEENSYPROTO_H_
@@ -0,0 +1,81 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/gpio.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#include "hw/gpio/gpioedge.h"
+
+static const char GPIO_CHIP[] = "/dev/gpiochip0";
+
+static int64_t Nanos(clockid_t clock) {
+  struct timespec t;
+  clock_gettime(clock, &t);
+  return t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+
+bool GPIOEdge::Open(int line) {
+  int chip = open(GPIO_CHIP, O_RDONLY);
+  if (chip == -1) {
+    perror(GPIO_CHIP);
+    return false;
+  }
+  struct gpioevent_request req;
+  memset(&req, 0, sizeof(req));
+  req.lineoffset = line;
+  req.handleflags = GPIOHANDLE_REQUEST_INPUT;
+  req.eventflags = GPIOEVENT_REQUEST_RISING_EDGE;
+  snprintf(req.consumer_label, sizeof(req.consumer_label), "cycloid");
+  if (ioctl(chip, GPIO_GET_LINEEVENT_IOCTL, &req) < 0) {
+    perror("GPIO_GET_LINEEVENT_IOCTL");
+    close(chip);
+    return false;
+  }
+  close(chip);
+  fd_ = req.fd;
+  fcntl(fd_, F_SETFL, fcntl(fd_, F_GETFL) | O_NONBLOCK);
+  return true;
+}
+
+void GPIOEdge::Close() {
+  if (fd_ != -1) {
+    close(fd_);
+    fd_ = -1;
+  }
+}
+
+bool GPIOEdge::Wait(int timeout_ms) {
+  struct pollfd p;
+  p.fd = fd_;
+  p.events = POLLIN;
+  return poll(&p, 1, timeout_ms) == 1 && (p.revents & POLLIN);
+}
+
+int GPIOEdge::Read(struct timespec *t, int max) {
+  // kernels before 5.7 stamp events with CLOCK_REALTIME, later ones with
+  // CLOCK_MONOTONIC; the clocks are decades apart, so whichever an edge is
+  // nearer to is the one it was stamped with
+  int64_t mono = Nanos(CLOCK_MONOTONIC);
+  int64_t offset = Nanos(CLOCK_REALTIME) - mono;
+  int n = 0;
+  while (n < max) {
+    struct gpioevent_data ev;
+    if (read(fd_, &ev, sizeof(ev)) != sizeof(ev)) {
+      if (errno != EAGAIN) {
+        perror("gpio event read");
+      }
+      break;
+    }
+    int64_t ns = ev.timestamp;
+    if (ns - mono > offset / 2) {
+      ns -= offset;
+    }
+    t[n].tv_sec = ns / 1000000000LL;
+    t[n].tv_nsec = ns % 1000000000LL;
+    n++;
+  }
+  return n;
+}
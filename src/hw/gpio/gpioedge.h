@@ -0,0 +1,32 @@
+#ifndef HW_GPIO_GPIOEDGE_H_
+#define HW_GPIO_GPIOEDGE_H_
+
+#include <stdint.h>
+#include <time.h>
+
+// Rising edges on one GPIO line, through the gpio character device, each
+// timestamped by the kernel when the interrupt came in rather than when we
+// got around to reading it. The kernel queues the last few, so none are
+// missed between reads. Virtual so a simulated device can supply its own.
+class GPIOEdge {
+ public:
+  GPIOEdge() : fd_(-1) {}
+  virtual ~GPIOEdge() { Close(); }
+
+  // line is the BCM GPIO number on the Pi's main gpiochip
+  bool Open(int line);
+  void Close();
+
+  // wait up to timeout_ms for an edge to be ready to Read; false if none
+  // came
+  virtual bool Wait(int timeout_ms);
+
+  // up to max of the edges which have come in, oldest first, as
+  // CLOCK_MONOTONIC times; never blocks, and returns 0 if there are none
+  virtual int Read(struct timespec *t, int max);
+
+ private:
+  int fd_;
+};
+
+#endif  // HW_GPIO_GPIOEDGE_H_
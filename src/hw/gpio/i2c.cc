@@ -92,3 +92,14 @@ bool I2C::Read(uint8_t addr, uint8_t reg, int len, uint8_t *outbuf) const {
 
   return true;
 }
+
+bool I2C::Transfer(struct i2c_msg *msgs, int n) const {
+  struct i2c_rdwr_ioctl_data packets;
+  packets.msgs      = msgs;
+  packets.nmsgs     = n;
+  if (ioctl(fd_, I2C_RDWR, &packets) < 0) {
+    perror("i2c_transfer");
+    return false;
+  }
+  return true;
+}
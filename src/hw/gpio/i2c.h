@@ -3,16 +3,24 @@
 
 #include <stdint.h>
 
+struct i2c_msg;
+
+// the transfers are virtual so a simulated device can stand in for the bus
 class I2C {
  public:
-  ~I2C() { Close(); }
+  I2C() : fd_(-1) {}
+  virtual ~I2C() { Close(); }
 
   bool Open();
   void Close();
 
-  bool Write(uint8_t addr, uint8_t reg, uint8_t value) const;
-  bool Write(uint8_t addr, uint8_t reg, int len, const uint8_t *buf) const;
-  bool Read(uint8_t addr, uint8_t reg, int len, uint8_t *outbuf) const;
+  virtual bool Write(uint8_t addr, uint8_t reg, uint8_t value) const;
+  virtual bool Write(uint8_t addr, uint8_t reg, int len,
+      const uint8_t *buf) const;
+  virtual bool Read(uint8_t addr, uint8_t reg, int len,
+      uint8_t *outbuf) const;
+  // several messages, each to any address, in one I2C_RDWR ioctl
+  virtual bool Transfer(struct i2c_msg *msgs, int n) const;
 
  private:
   int fd_;
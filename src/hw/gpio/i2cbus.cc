@@ -0,0 +1,441 @@
+#include <linux/i2c.h>
+#include <sched.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "hw/gpio/i2cbus.h"
+
+static int64_t Nanos() {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+
+static void ToTimespec(int64_t ns, struct timespec *t) {
+  t->tv_sec = ns / 1000000000LL;
+  t->tv_nsec = ns % 1000000000LL;
+}
+
+I2CBus::I2CBus(const I2C &dev) : dev_(dev) {
+  running_ = false;
+  done_ = false;
+  pthread_mutex_init(&mutex_, NULL);
+  // poll deadlines are on CLOCK_MONOTONIC
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&work_cond_, &attr);
+  pthread_condattr_destroy(&attr);
+  pthread_cond_init(&done_cond_, NULL);
+  npolls_ = 0;
+  nmailboxes_ = 0;
+  memset(alone_, 0, sizeof(alone_));
+  stats_ns_ = Nanos();
+  busy_ns_ = 0;
+  transactions_ = batches_ = failures_ = superseded_ = 0;
+  for (int p = 0; p < NPRIORITIES; p++) {
+    latency_sum_ns_[p] = latency_max_ns_[p] = 0;
+    latency_n_[p] = 0;
+  }
+}
+
+I2CBus::~I2CBus() {
+  Stop();
+  pthread_cond_destroy(&done_cond_);
+  pthread_cond_destroy(&work_cond_);
+  pthread_mutex_destroy(&mutex_);
+}
+
+bool I2CBus::Start() {
+  pthread_mutex_lock(&mutex_);
+  done_ = false;
+  running_ = pthread_create(&thread_, NULL, thread_entry, this) == 0;
+  pthread_mutex_unlock(&mutex_);
+  if (!running_) {
+    perror("I2CBus: pthread_create");
+    return false;
+  }
+  // the control thread waits on us, so we go ahead of it
+  struct sched_param param;
+  param.sched_priority = 11;
+  pthread_setschedparam(thread_, SCHED_FIFO, &param);
+  return true;
+}
+
+void I2CBus::Stop() {
+  pthread_mutex_lock(&mutex_);
+  if (!running_) {
+    pthread_mutex_unlock(&mutex_);
+    return;
+  }
+  done_ = true;
+  pthread_cond_signal(&work_cond_);
+  pthread_mutex_unlock(&mutex_);
+  pthread_join(thread_, NULL);
+
+  // nobody's left to do whatever's still queued
+  pthread_mutex_lock(&mutex_);
+  running_ = false;
+  for (int p = 0; p < NPRIORITIES; p++) {
+    for (size_t i = 0; i < queue_[p].size(); i++) {
+      queue_[p][i]->status = I2CTransaction::FAILED;
+    }
+    queue_[p].clear();
+  }
+  pthread_cond_broadcast(&done_cond_);
+  pthread_mutex_unlock(&mutex_);
+}
+
+void* I2CBus::thread_entry(void *arg) {
+  reinterpret_cast<I2CBus*>(arg)->Run();
+  return NULL;
+}
+
+bool I2CBus::Submit(I2CTransaction *t, Priority prio) {
+  if (t->len <= 0 || (t->write && t->len > MAX_WRITE)) {
+    return false;
+  }
+  pthread_mutex_lock(&mutex_);
+  if (!running_ || done_) {
+    pthread_mutex_unlock(&mutex_);
+    return false;
+  }
+  t->status = I2CTransaction::PENDING;
+  t->submit_ns = Nanos();
+  queue_[prio].push_back(t);
+  pthread_cond_signal(&work_cond_);
+  pthread_mutex_unlock(&mutex_);
+  return true;
+}
+
+bool I2CBus::Wait(I2CTransaction *t) {
+  pthread_mutex_lock(&mutex_);
+  while (t->status == I2CTransaction::PENDING) {
+    pthread_cond_wait(&done_cond_, &mutex_);
+  }
+  pthread_mutex_unlock(&mutex_);
+  return t->status == I2CTransaction::OK;
+}
+
+int I2CBus::AddPoll(uint8_t addr, uint8_t reg, int len, int hz) {
+  if (len <= 0 || len > MAX_POLL_LEN) {
+    return -1;
+  }
+  pthread_mutex_lock(&mutex_);
+  if (npolls_ == MAX_POLLS) {
+    pthread_mutex_unlock(&mutex_);
+    return -1;
+  }
+  int id = npolls_++;
+  Poll *p = &polls_[id];
+  p->t.addr = addr;
+  p->t.reg = reg;
+  p->t.write = false;
+  p->t.len = len;
+  p->t.buf = p->buf;
+  p->period_ns = 0;
+  p->have_latest = false;
+  pthread_mutex_unlock(&mutex_);
+  SetPollRate(id, hz);
+  return id;
+}
+
+void I2CBus::SetPollRate(int id, int hz) {
+  pthread_mutex_lock(&mutex_);
+  Poll *p = &polls_[id];
+  p->period_ns = hz > 0 ? 1000000000LL / hz : 0;
+  p->next_ns = Nanos();
+  pthread_cond_signal(&work_cond_);
+  pthread_mutex_unlock(&mutex_);
+}
+
+bool I2CBus::GetPoll(int id, uint8_t *buf, struct timespec *t) {
+  pthread_mutex_lock(&mutex_);
+  const Poll &p = polls_[id];
+  bool have = p.have_latest;
+  if (have) {
+    memcpy(buf, p.latest, p.t.len);
+    if (t) {
+      *t = p.latest_t;
+    }
+  }
+  pthread_mutex_unlock(&mutex_);
+  return have;
+}
+
+int I2CBus::AddMailbox(uint8_t addr, uint8_t reg, int len) {
+  if (len <= 0 || len > MAX_WRITE) {
+    return -1;
+  }
+  pthread_mutex_lock(&mutex_);
+  if (nmailboxes_ == MAX_MAILBOXES) {
+    pthread_mutex_unlock(&mutex_);
+    return -1;
+  }
+  int id = nmailboxes_++;
+  Mailbox *m = &mailboxes_[id];
+  m->t.addr = addr;
+  m->t.reg = reg;
+  m->t.write = true;
+  m->t.len = len;
+  m->t.buf = m->sending;
+  m->posted = false;
+  m->have_sent = false;
+  pthread_mutex_unlock(&mutex_);
+  return id;
+}
+
+void I2CBus::Post(int id, const uint8_t *data, const struct timespec &t) {
+  pthread_mutex_lock(&mutex_);
+  Mailbox *m = &mailboxes_[id];
+  if (m->posted) {
+    superseded_++;
+  }
+  memcpy(m->command, data, m->t.len);
+  m->command_ns = t.tv_sec * 1000000000LL + t.tv_nsec;
+  m->posted = true;
+  pthread_cond_signal(&work_cond_);
+  pthread_mutex_unlock(&mutex_);
+}
+
+bool I2CBus::LastSent(int id, struct timespec *cmd_t,
+    struct timespec *sent_t) {
+  pthread_mutex_lock(&mutex_);
+  const Mailbox &m = mailboxes_[id];
+  bool have = m.have_sent;
+  if (have) {
+    *cmd_t = m.sent_cmd_t;
+    *sent_t = m.sent_t;
+  }
+  pthread_mutex_unlock(&mutex_);
+  return have;
+}
+
+void I2CBus::TakeStats(Stats *stats) {
+  pthread_mutex_lock(&mutex_);
+  int64_t now = Nanos();
+  stats->utilization = now > stats_ns_ ?
+    static_cast<float>(busy_ns_) / (now - stats_ns_) : 0;
+  stats->transactions = transactions_;
+  stats->batches = batches_;
+  stats->failures = failures_;
+  stats->superseded = superseded_;
+  for (int p = 0; p < NPRIORITIES; p++) {
+    stats->avg_latency_us[p] = latency_n_[p] ?
+      latency_sum_ns_[p] * 1e-3 / latency_n_[p] : 0;
+    stats->max_latency_us[p] = latency_max_ns_[p] * 1e-3;
+    latency_sum_ns_[p] = latency_max_ns_[p] = 0;
+    latency_n_[p] = 0;
+  }
+  stats_ns_ = now;
+  busy_ns_ = 0;
+  transactions_ = batches_ = failures_ = superseded_ = 0;
+  pthread_mutex_unlock(&mutex_);
+}
+
+void I2CBus::Run() {
+  pthread_mutex_lock(&mutex_);
+  while (!done_) {
+    int64_t wait_ns;
+    if (!Gather(Nanos(), &wait_ns)) {
+      if (wait_ns < 0) {
+        pthread_cond_wait(&work_cond_, &mutex_);
+      } else {
+        struct timespec deadline;
+        ToTimespec(Nanos() + wait_ns, &deadline);
+        pthread_cond_timedwait(&work_cond_, &mutex_, &deadline);
+      }
+      continue;
+    }
+    pthread_mutex_unlock(&mutex_);
+    int64_t start = Nanos();
+    bool ok = Execute();
+    int64_t end = Nanos();
+    pthread_mutex_lock(&mutex_);
+    busy_ns_ += end - start;
+    Finish(ok, end);
+    pthread_cond_broadcast(&done_cond_);
+  }
+  pthread_mutex_unlock(&mutex_);
+}
+
+bool I2CBus::Gather(int64_t now, int64_t *wait_ns) {
+  nbatch_ = nmsgs_ = nbytes_ = 0;
+  solo_ = false;
+
+  // the latest commands, actuator writes in order, then polls that are
+  // due, then sensor reads
+  for (int i = 0; i < nmailboxes_; i++) {
+    Mailbox *m = &mailboxes_[i];
+    if (!m->posted || !Fits(&m->t)) {
+      continue;
+    }
+    memcpy(m->sending, m->command, m->t.len);
+    m->t.submit_ns = m->command_ns;
+    m->t.status = I2CTransaction::PENDING;
+    m->posted = false;
+    Add(&m->t, MAILBOX + i);
+  }
+  std::deque<I2CTransaction*> &actuate = queue_[ACTUATE];
+  while (!actuate.empty() && Fits(actuate.front())) {
+    Add(actuate.front(), ACTUATE);
+    actuate.pop_front();
+  }
+  bool full = !actuate.empty();
+
+  *wait_ns = -1;
+  for (int i = 0; i < npolls_; i++) {
+    Poll *p = &polls_[i];
+    if (p->period_ns == 0) {
+      continue;
+    }
+    if (p->next_ns > now) {
+      if (*wait_ns < 0 || p->next_ns - now < *wait_ns) {
+        *wait_ns = p->next_ns - now;
+      }
+      continue;
+    }
+    if (full || !Fits(&p->t)) {
+      continue;
+    }
+    Add(&p->t, POLL + i);
+    // if we've fallen behind, don't make up for it in a burst
+    p->next_ns += p->period_ns;
+    if (p->next_ns <= now) {
+      p->next_ns = now + p->period_ns;
+    }
+  }
+
+  std::deque<I2CTransaction*> &sense = queue_[SENSE];
+  while (!full && !sense.empty() && Fits(sense.front())) {
+    Add(sense.front(), SENSE);
+    sense.pop_front();
+  }
+  return nbatch_ > 0;
+}
+
+bool I2CBus::Fits(const I2CTransaction *t) const {
+  if (nbatch_ == 0) {
+    return true;
+  }
+  return !solo_ && !alone_[t->addr & 0x7f] &&
+    nmsgs_ + (t->write ? 1 : 2) <= MAX_MSGS &&
+    nbytes_ + t->len <= BATCH_BYTES;
+}
+
+void I2CBus::Add(I2CTransaction *t, int prio) {
+  batch_[nbatch_] = t;
+  prio_[nbatch_] = prio;
+  nbatch_++;
+  nmsgs_ += t->write ? 1 : 2;
+  nbytes_ += t->len;
+  // the Pi's controller (i2c-bcm2835) only takes a read as the last
+  // message of a transfer, and refuses the whole transfer otherwise
+  solo_ = alone_[t->addr & 0x7f] || !t->write;
+}
+
+bool I2CBus::Execute() {
+  struct i2c_msg msgs[MAX_MSGS];
+  uint8_t out[MAX_MSGS][1 + MAX_WRITE];
+  int nmsgs = 0;
+  for (int i = 0; i < nbatch_; i++) {
+    I2CTransaction *t = batch_[i];
+    struct i2c_msg *m = &msgs[nmsgs++];
+    m->addr = t->addr;
+    m->flags = 0;
+    if (t->write) {
+      // the register goes in the same message, ahead of the data
+      out[i][0] = t->reg;
+      memcpy(out[i] + 1, t->buf, t->len);
+      m->len = 1 + t->len;
+      m->buf = out[i];
+      continue;
+    }
+    m->len = 1;
+    m->buf = &t->reg;
+    m = &msgs[nmsgs++];
+    m->addr = t->addr;
+    m->flags = I2C_M_RD;
+    m->len = t->len;
+    m->buf = t->buf;
+  }
+  return dev_.Transfer(msgs, nmsgs);
+}
+
+void I2CBus::Finish(bool ok, int64_t now) {
+  batches_++;
+  for (int i = 0; i < nbatch_; i++) {
+    I2CTransaction *t = batch_[i];
+    int prio = prio_[i];
+    t->done_ns = now;
+    transactions_++;
+    if (!ok) {
+      failures_++;
+    }
+    // on its own, it's the one that failed; in a batch, it may be
+    if (ok || nbatch_ > 1) {
+      alone_[t->addr & 0x7f] = !ok;
+    }
+    if (prio >= MAILBOX) {
+      // a failed command isn't retried; there'll be a newer one soon
+      Mailbox *m = &mailboxes_[prio - MAILBOX];
+      if (ok) {
+        ToTimespec(t->submit_ns, &m->sent_cmd_t);
+        ToTimespec(now, &m->sent_t);
+        m->have_sent = true;
+      }
+      prio = ACTUATE;
+    } else if (prio >= POLL) {
+      Poll *p = &polls_[prio - POLL];
+      if (ok) {
+        memcpy(p->latest, p->buf, t->len);
+        ToTimespec(now, &p->latest_t);
+        p->have_latest = true;
+      }
+    }
+    if (prio < NPRIORITIES) {
+      int64_t latency = now - t->submit_ns;
+      latency_sum_ns_[prio] += latency;
+      if (latency > latency_max_ns_[prio]) {
+        latency_max_ns_[prio] = latency;
+      }
+      latency_n_[prio]++;
+    }
+    // last, as whoever submitted it may be watching and then reuse it
+    t->status = ok ? I2CTransaction::OK : I2CTransaction::FAILED;
+  }
+}
+
+bool I2CBus::Sync(uint8_t addr, uint8_t reg, bool write, int len,
+    uint8_t *buf, Priority prio) const {
+  if (len <= 0 || (write && len > MAX_WRITE)) {
+    return false;
+  }
+  I2CTransaction t;
+  t.addr = addr;
+  t.reg = reg;
+  t.write = write;
+  t.len = len;
+  t.buf = buf;
+  I2CBus *bus = const_cast<I2CBus*>(this);
+  if (bus->Submit(&t, prio)) {
+    return bus->Wait(&t);
+  }
+  // until it's started, straight to the device
+  return write ? dev_.Write(addr, reg, len, buf) :
+    dev_.Read(addr, reg, len, buf);
+}
+
+bool I2CBus::Write(uint8_t addr, uint8_t reg, uint8_t value) const {
+  return Sync(addr, reg, true, 1, &value, ACTUATE);
+}
+
+bool I2CBus::Write(uint8_t addr, uint8_t reg, int len,
+    const uint8_t *buf) const {
+  return Sync(addr, reg, true, len, const_cast<uint8_t*>(buf), ACTUATE);
+}
+
+bool I2CBus::Read(uint8_t addr, uint8_t reg, int len,
+    uint8_t *outbuf) const {
+  return Sync(addr, reg, false, len, outbuf, SENSE);
+}
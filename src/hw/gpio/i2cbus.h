@@ -0,0 +1,177 @@
+#ifndef HW_GPIO_I2CBUS_H_
+#define HW_GPIO_I2CBUS_H_
+
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <atomic>
+#include <deque>
+
+#include "hw/gpio/i2c.h"
+
+// one register write or read on an I2CBus; whoever submits it owns it, and
+// buf, until it's no longer PENDING
+struct I2CTransaction {
+  enum Status { IDLE, PENDING, OK, FAILED };
+
+  I2CTransaction()
+    : addr(0), reg(0), write(false), len(0), buf(NULL), status(IDLE),
+      submit_ns(0), done_ns(0) {}
+
+  uint8_t addr, reg;
+  bool write;
+  int len;
+  uint8_t *buf;  // what to write (up to I2CBus::MAX_WRITE), or read into
+
+  std::atomic<int> status;
+  int64_t submit_ns, done_ns;  // CLOCK_MONOTONIC
+};
+
+// Owns an I2C bus from a thread of its own, so the control thread, the
+// camera thread and the main loop stop contending for it transfer by
+// transfer. Transactions queue at one of two priorities, actuator writes
+// ahead of sensor reads, and what's waiting goes out together in one
+// I2C_RDWR ioctl, highest priority first, up to and including the first
+// read, which has to be a transfer's last message. Devices can be polled on a
+// schedule, each at its own rate, keeping the latest reading for whoever
+// wants it. Actuator commands can be left in a mailbox instead, where a
+// newer one replaces any the bus hasn't got to yet, and which goes out
+// ahead of everything.
+//
+// It's an I2C itself: the synchronous calls submit a transaction, writes
+// at ACTUATE and reads at SENSE, and wait for it, so the existing drivers
+// share the bus without knowing.
+class I2CBus : public I2C {
+ public:
+  enum Priority { ACTUATE, SENSE, NPRIORITIES };
+
+  explicit I2CBus(const I2C &dev);
+  ~I2CBus();
+
+  bool Start();
+  void Stop();
+
+  // queue t without waiting for it; false if it can't be
+  bool Submit(I2CTransaction *t, Priority prio);
+  // and then wait; true if it went through
+  bool Wait(I2CTransaction *t);
+
+  // read len bytes from reg on addr at hz (0 for paused); returns an id for
+  // the other two, or -1 if there's no room
+  int AddPoll(uint8_t addr, uint8_t reg, int len, int hz);
+  void SetPollRate(int id, int hz);
+  // the latest reading and when it finished; false until there's one
+  bool GetPoll(int id, uint8_t *buf, struct timespec *t);
+
+  // a register block to write len bytes of commands to; returns an id for
+  // the other two, or -1 if there's no room
+  int AddMailbox(uint8_t addr, uint8_t reg, int len);
+  // leave a command, timestamped t, for the bus thread; never waits on the
+  // bus
+  void Post(int id, const uint8_t *data, const struct timespec &t);
+  // the timestamp of the latest command to go out, and when it finished;
+  // false until one has
+  bool LastSent(int id, struct timespec *cmd_t, struct timespec *sent_t);
+
+  struct Stats {
+    float utilization;  // fraction of the time spent in transfers
+    int transactions, batches, failures;
+    // submission (a posted command's timestamp) to completion
+    float avg_latency_us[NPRIORITIES], max_latency_us[NPRIORITIES];
+    int superseded;  // posted commands replaced before they went out
+  };
+  // since the last call
+  void TakeStats(Stats *stats);
+
+  virtual bool Write(uint8_t addr, uint8_t reg, uint8_t value) const;
+  virtual bool Write(uint8_t addr, uint8_t reg, int len,
+      const uint8_t *buf) const;
+  virtual bool Read(uint8_t addr, uint8_t reg, int len,
+      uint8_t *outbuf) const;
+  // only the bus thread puts messages on the bus directly
+  virtual bool Transfer(struct i2c_msg *msgs, int n) const { return false; }
+
+  static const int MAX_WRITE = 32;
+  static const int MAX_POLLS = 8;
+  static const int MAX_POLL_LEN = 32;
+  static const int MAX_MAILBOXES = 4;
+  // I2C_RDWR_IOCTL_MAX_MSGS; a read is two messages, a write one
+  static const int MAX_MSGS = 42;
+  // past the first transaction, a batch stops growing at this many bytes,
+  // about 3ms at 400kHz, so an actuator write never waits much longer
+  static const int BATCH_BYTES = 128;
+
+ private:
+  struct Poll {
+    I2CTransaction t;
+    int64_t period_ns, next_ns;
+    uint8_t buf[MAX_POLL_LEN];
+    uint8_t latest[MAX_POLL_LEN];
+    struct timespec latest_t;
+    bool have_latest;
+  };
+
+  struct Mailbox {
+    I2CTransaction t;
+    bool posted;  // and not yet picked up
+    uint8_t command[MAX_WRITE];
+    int64_t command_ns;
+    uint8_t sending[MAX_WRITE];
+    struct timespec sent_cmd_t, sent_t;
+    bool have_sent;
+  };
+
+  static void* thread_entry(void *arg);
+  void Run();
+  // where polls and mailboxes start in prio_
+  static const int POLL = NPRIORITIES;
+  static const int MAILBOX = POLL + MAX_POLLS;
+
+  // with mutex_ held: gather the next batch into batch_, or if there's
+  // nothing to do, say how long until a poll's due (-1 for never)
+  bool Gather(int64_t now, int64_t *wait_ns);
+  bool Fits(const I2CTransaction *t) const;
+  void Add(I2CTransaction *t, int prio);
+  // without it: put the batch on the bus
+  bool Execute();
+  // and with it again
+  void Finish(bool ok, int64_t now);
+  // the synchronous I2C calls
+  bool Sync(uint8_t addr, uint8_t reg, bool write, int len, uint8_t *buf,
+      Priority prio) const;
+
+  const I2C &dev_;
+
+  pthread_t thread_;
+  bool running_, done_;
+
+  pthread_mutex_t mutex_;
+  pthread_cond_t work_cond_;  // something's been submitted
+  pthread_cond_t done_cond_;  // a batch finished
+  std::deque<I2CTransaction*> queue_[NPRIORITIES];
+  Poll polls_[MAX_POLLS];
+  int npolls_;
+  Mailbox mailboxes_[MAX_MAILBOXES];
+  int nmailboxes_;
+  // The kernel doesn't say which message in a batch failed, or whether
+  // the ones before it went through, so nothing's retried; instead,
+  // addresses in a failed batch go out on their own until they work, so a
+  // missing device can't keep failing the others' transactions.
+  bool alone_[128];
+
+  // the batch being gathered and executed, and each one's priority, polls
+  // being POLL + their id and mailboxes MAILBOX + theirs; only the bus
+  // thread's
+  I2CTransaction *batch_[MAX_MSGS];
+  int prio_[MAX_MSGS];
+  int nbatch_, nmsgs_, nbytes_;
+  bool solo_;  // nothing else can join it: it's alone_, or ends in a read
+
+  int64_t stats_ns_, busy_ns_;
+  int transactions_, batches_, failures_, superseded_;
+  int64_t latency_sum_ns_[NPRIORITIES], latency_max_ns_[NPRIORITIES];
+  int latency_n_[NPRIORITIES];
+};
+
+#endif  // HW_GPIO_I2CBUS_H_
@@ -0,0 +1,379 @@
+#include <linux/i2c.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <vector>
+
+#include "hw/gpio/i2cbus.h"
+
+// run I2CBus against a fake bus of register files, and check it: keeps
+// threads' transfers apart, puts actuator writes ahead of sensor reads that
+// were waiting first, batches writes and then one read into a transfer,
+// as the Pi's controller requires, polls each device at its own rate, doesn't let a missing device fail
+// everyone else's transactions, and sends only the latest of the commands
+// posted while it was busy
+
+static const uint8_t MISSING = 0x50;
+
+// every address has 256 registers; MISSING NAKs, failing the whole
+// transfer; a read anywhere but last is refused, as i2c-bcm2835 does with
+// -EOPNOTSUPP; and it can be held up, to let a queue build
+class FakeBus : public I2C {
+ public:
+  FakeBus()
+    : held_(false), busy_(false), overlaps_(0), transfers_(0), refused_(0) {
+    memset(regs_, 0, sizeof(regs_));
+    for (int i = 0; i < 128; i++) {
+      reads_[i] = 0;
+    }
+  }
+
+  virtual bool Transfer(struct i2c_msg *msgs, int n) const {
+    while (held_) {
+      usleep(100);
+    }
+    if (busy_.exchange(true)) {
+      overlaps_++;
+    }
+    transfers_++;
+    for (int i = 0; i < n - 1; i++) {
+      if (msgs[i].flags & I2C_M_RD) {
+        refused_++;
+        busy_ = false;
+        return false;
+      }
+    }
+    bool ok = true;
+    int bytes = 0;
+    for (int i = 0; i < n; i++) {
+      const struct i2c_msg &m = msgs[i];
+      log_.push_back(m.addr | (m.flags & I2C_M_RD ? 0x100 : 0));
+      bytes += m.len + 1;
+      if (m.addr == MISSING) {
+        ok = false;
+        break;
+      }
+      uint8_t *regs = regs_[m.addr & 0x7f];
+      if (m.flags & I2C_M_RD) {
+        memcpy(m.buf, regs + ptr_, m.len);
+        reads_[m.addr & 0x7f]++;
+      } else {
+        ptr_ = m.buf[0];
+        memcpy(regs + ptr_, m.buf + 1, m.len - 1);
+      }
+    }
+    // 9 clocks a byte at 400kHz
+    usleep(bytes * 9 * 1000000 / 400000);
+    busy_ = false;
+    return ok;
+  }
+
+  void Hold(bool held) { held_ = held; }
+  int Overlaps() const { return overlaps_; }
+  int Transfers() const { return transfers_; }
+  // transfers with a read before their last message
+  int Refused() const { return refused_; }
+  int Reads(uint8_t addr) const { return reads_[addr]; }
+  const uint8_t *Regs(uint8_t addr) const { return regs_[addr]; }
+  // each message's address, plus 0x100 for reads
+  std::vector<int> *Log() const { return &log_; }
+
+ private:
+  std::atomic<bool> held_;
+  mutable std::atomic<bool> busy_;
+  mutable std::atomic<int> overlaps_, transfers_, refused_;
+  // room past the last register for a read or write starting there
+  mutable uint8_t regs_[128][2 * 256];
+  mutable uint8_t ptr_;
+  mutable std::atomic<int> reads_[128];
+  mutable std::vector<int> log_;
+};
+
+struct Client {
+  I2CBus *bus;
+  uint8_t addr;
+  int errors;
+};
+
+// write a pattern to our own device and read it back, over and over
+static void* ClientThread(void *arg) {
+  Client *c = reinterpret_cast<Client*>(arg);
+  for (int i = 0; i < 200; i++) {
+    uint8_t out[16], in[16];
+    for (int j = 0; j < 16; j++) {
+      out[j] = c->addr + i + j;
+    }
+    if (!c->bus->Write(c->addr, 0x10, sizeof(out), out) ||
+        !c->bus->Read(c->addr, 0x10, sizeof(in), in) ||
+        memcmp(in, out, sizeof(in)) != 0) {
+      c->errors++;
+    }
+  }
+  return NULL;
+}
+
+static int TestThreads() {
+  FakeBus fake;
+  I2CBus bus(fake);
+  bus.Start();
+  int failures = 0;
+  Client clients[3] = {{&bus, 0x10, 0}, {&bus, 0x20, 0}, {&bus, 0x30, 0}};
+  pthread_t threads[3];
+  for (int i = 0; i < 3; i++) {
+    pthread_create(&threads[i], NULL, ClientThread, &clients[i]);
+  }
+  for (int i = 0; i < 3; i++) {
+    pthread_join(threads[i], NULL);
+    if (clients[i].errors) {
+      printf("FAIL: threads: %d bad readbacks from %02x\n",
+          clients[i].errors, clients[i].addr);
+      failures++;
+    }
+  }
+  I2CBus::Stats stats;
+  bus.TakeStats(&stats);
+  printf("threads: %d transactions in %d transfers, %0.0f%% busy, "
+      "latency actuate %0.0f/%0.0fus sense %0.0f/%0.0fus avg/max\n",
+      stats.transactions, stats.batches, stats.utilization * 100,
+      stats.avg_latency_us[I2CBus::ACTUATE],
+      stats.max_latency_us[I2CBus::ACTUATE],
+      stats.avg_latency_us[I2CBus::SENSE],
+      stats.max_latency_us[I2CBus::SENSE]);
+  if (fake.Overlaps()) {
+    printf("FAIL: threads: %d overlapping transfers\n", fake.Overlaps());
+    failures++;
+  }
+  if (fake.Refused()) {
+    printf("FAIL: threads: %d transfers with a read before the end\n",
+        fake.Refused());
+    failures++;
+  }
+  if (stats.transactions != 1200 || stats.failures != 0) {
+    printf("FAIL: threads: %d transactions, %d failed\n",
+        stats.transactions, stats.failures);
+    failures++;
+  }
+  if (stats.batches >= stats.transactions) {
+    printf("FAIL: threads: nothing was batched\n");
+    failures++;
+  }
+  if (stats.utilization <= 0 || stats.utilization > 1) {
+    printf("FAIL: threads: utilization %f\n", stats.utilization);
+    failures++;
+  }
+  bus.Stop();
+  return failures;
+}
+
+static int TestPriority() {
+  FakeBus fake;
+  I2CBus bus(fake);
+  bus.Start();
+  int failures = 0;
+
+  // the bus is held up on the first read while the rest queue
+  fake.Hold(true);
+  uint8_t buf[8][4];
+  I2CTransaction reads[8];
+  for (int i = 0; i < 8; i++) {
+    reads[i].addr = 0x10 + i;
+    reads[i].len = sizeof(buf[i]);
+    reads[i].buf = buf[i];
+    bus.Submit(&reads[i], I2CBus::SENSE);
+    if (i == 0) {
+      usleep(1000);
+    }
+  }
+  uint8_t controls[3] = {1, 2, 3};
+  I2CTransaction write;
+  write.addr = 0x08;
+  write.write = true;
+  write.len = sizeof(controls);
+  write.buf = controls;
+  bus.Submit(&write, I2CBus::ACTUATE);
+  if (write.status != I2CTransaction::PENDING) {
+    printf("FAIL: priority: submitting waited for the bus\n");
+    failures++;
+  }
+  fake.Hold(false);
+
+  bool ok = bus.Wait(&write);
+  for (int i = 0; i < 8; i++) {
+    ok = bus.Wait(&reads[i]) && ok;
+  }
+  if (!ok) {
+    printf("FAIL: priority: transactions failed\n");
+    failures++;
+  }
+  // the first read, then the write ahead of the other seven, which then
+  // each end a transfer of their own
+  const int expected[] = {0x10, 0x110, 0x08, 0x11, 0x111};
+  std::vector<int> *log = fake.Log();
+  if (log->size() != 1 + 2*8 ||
+      memcmp(&(*log)[0], expected, sizeof(expected)) != 0) {
+    printf("FAIL: priority: transfers in the wrong order:");
+    for (size_t i = 0; i < log->size(); i++) {
+      printf(" %03x", (*log)[i]);
+    }
+    printf("\n");
+    failures++;
+  }
+  if (fake.Transfers() != 8) {
+    printf("FAIL: priority: %d transfers, not eight\n", fake.Transfers());
+    failures++;
+  }
+  if (fake.Refused()) {
+    printf("FAIL: priority: %d transfers with a read before the end\n",
+        fake.Refused());
+    failures++;
+  }
+  bus.Stop();
+  return failures;
+}
+
+static int TestPolls() {
+  FakeBus fake;
+  I2CBus bus(fake);
+  int failures = 0;
+  int fast = bus.AddPoll(0x10, 0, 24, 200);
+  int slow = bus.AddPoll(0x20, 0, 8, 50);
+  int missing = bus.AddPoll(MISSING, 0, 8, 100);
+  struct timespec t0, t1;
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  bus.Start();
+
+  // a device that isn't there shouldn't take down a sensor read alongside
+  int read_failures = 0;
+  for (int i = 0; i < 100; i++) {
+    uint8_t buf[12];
+    if (!bus.Read(0x30, 0, sizeof(buf), buf)) {
+      read_failures++;
+    }
+    usleep(10000);
+  }
+  int nfast = fake.Reads(0x10), nslow = fake.Reads(0x20);
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  float secs = t1.tv_sec - t0.tv_sec + (t1.tv_nsec - t0.tv_nsec) * 1e-9;
+  printf("polls: %0.1fHz and %0.1fHz, asked for 200 and 50; %d failed reads "
+      "next to a missing device\n", nfast / secs, nslow / secs,
+      read_failures);
+  if (fabsf(nfast / secs - 200) > 10 || fabsf(nslow / secs - 50) > 2.5) {
+    printf("FAIL: polls: off rate\n");
+    failures++;
+  }
+  if (read_failures > 1) {
+    printf("FAIL: polls: the missing device keeps failing reads\n");
+    failures++;
+  }
+  if (fake.Refused()) {
+    printf("FAIL: polls: %d transfers with a read before the end\n",
+        fake.Refused());
+    failures++;
+  }
+
+  uint8_t buf[24];
+  struct timespec t;
+  if (!bus.GetPoll(fast, buf, &t) || !bus.GetPoll(slow, buf, &t)) {
+    printf("FAIL: polls: no reading\n");
+    failures++;
+  }
+  if (bus.GetPoll(missing, buf, &t)) {
+    printf("FAIL: polls: a reading from a missing device\n");
+    failures++;
+  }
+
+  bus.SetPollRate(fast, 0);
+  usleep(50000);
+  nfast = fake.Reads(0x10);
+  usleep(100000);
+  if (fake.Reads(0x10) != nfast) {
+    printf("FAIL: polls: still polling at 0Hz\n");
+    failures++;
+  }
+  bus.Stop();
+  return failures;
+}
+
+static int TestMailbox() {
+  FakeBus fake;
+  I2CBus bus(fake);
+  int controls = bus.AddMailbox(0x08, 0, 3);
+  bus.Start();
+  int failures = 0;
+
+  // post commands while the bus is held up on a read
+  fake.Hold(true);
+  uint8_t buf[4];
+  I2CTransaction read;
+  read.addr = 0x10;
+  read.len = sizeof(buf);
+  read.buf = buf;
+  bus.Submit(&read, I2CBus::SENSE);
+  usleep(1000);
+  struct timespec t0, t1, posted;
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  for (int i = 0; i < 5; i++) {
+    uint8_t command[3] = {
+      static_cast<uint8_t>(i), static_cast<uint8_t>(2*i),
+      static_cast<uint8_t>(3*i)
+    };
+    clock_gettime(CLOCK_MONOTONIC, &posted);
+    bus.Post(controls, command, posted);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  if (t1.tv_sec - t0.tv_sec + (t1.tv_nsec - t0.tv_nsec) * 1e-9 > 1e-3) {
+    printf("FAIL: mailbox: posting waited for the bus\n");
+    failures++;
+  }
+  struct timespec cmd_t, sent_t;
+  if (bus.LastSent(controls, &cmd_t, &sent_t)) {
+    printf("FAIL: mailbox: sent while the bus was held\n");
+    failures++;
+  }
+  usleep(5000);
+  fake.Hold(false);
+  bus.Wait(&read);
+  usleep(5000);
+
+  const int expected[] = {0x10, 0x110, 0x08};
+  std::vector<int> *log = fake.Log();
+  const uint8_t *regs = fake.Regs(0x08);
+  if (log->size() != 3 || memcmp(&(*log)[0], expected, sizeof(expected)) ||
+      regs[0] != 4 || regs[1] != 8 || regs[2] != 12) {
+    printf("FAIL: mailbox: didn't send just the latest command\n");
+    failures++;
+  }
+  if (!bus.LastSent(controls, &cmd_t, &sent_t) ||
+      cmd_t.tv_sec != posted.tv_sec || cmd_t.tv_nsec != posted.tv_nsec) {
+    printf("FAIL: mailbox: the latest command's timestamp wasn't kept\n");
+    failures++;
+  }
+  float latency_us = (sent_t.tv_sec - cmd_t.tv_sec) * 1e6 +
+    (sent_t.tv_nsec - cmd_t.tv_nsec) * 1e-3;
+  I2CBus::Stats stats;
+  bus.TakeStats(&stats);
+  printf("mailbox: %d superseded, command to bus %0.0fus\n",
+      stats.superseded, latency_us);
+  if (stats.superseded != 4) {
+    printf("FAIL: mailbox: %d superseded, not 4\n", stats.superseded);
+    failures++;
+  }
+  if (latency_us < 5000 || stats.max_latency_us[I2CBus::ACTUATE] < 5000) {
+    printf("FAIL: mailbox: the wait for the bus wasn't measured\n");
+    failures++;
+  }
+  bus.Stop();
+  return failures;
+}
+
+int main() {
+  int failures = TestThreads() + TestPriority() + TestPolls() +
+    TestMailbox();
+  printf("%d failures\n", failures);
+  return failures ? 1 : 0;
+}
@@ -2,8 +2,11 @@
 #define IMU_IMU_H_
 
 #include <stdint.h>
+#include <time.h>
 #include <Eigen/Dense>
+#include "hw/gpio/gpioedge.h"
 #include "hw/gpio/i2c.h"
+#include "hw/imu/magcal.h"
 
 // TODO: rename to imu/dev.h for IMU device raw access
 // then make an IMU class which is self-calibrating, has a kalman filter, etc.
@@ -20,9 +23,18 @@ struct IMUState {
   Eigen::Vector3f g;  // acceleration + gravity (m/s^2)
 };
 
+// one accelerometer and gyro sample out of the FIFO, taken by the chip at
+// CLOCK_MONOTONIC time t
+struct IMUSample {
+  struct timespec t;
+  Eigen::Vector3f accel;  // g
+  Eigen::Vector3f gyro;   // rads/sec
+};
+
 class IMU {
  public:
-  explicit IMU(const I2C &i2c) : i2c_(i2c), YTY_(10, 10) {}
+  explicit IMU(const I2C &i2c) : i2c_(i2c), drdy_(NULL),
+    anchored_(false), period_ns_(1e9 / SAMPLE_HZ) {}
 
   bool Init();
 
@@ -40,24 +52,62 @@ class IMU {
   // void Calibrate(const IMURawState &rawstate, IMUState *state);
 
   // write magnetometer calibration out
-  bool LoadMagCalibration();
-  bool SaveMagCalibration();
+  bool LoadMagCalibration() { return magcal_.Load("magcal.bin"); }
+  bool SaveMagCalibration() { return magcal_.Save("magcal.bin"); }
+
+  // fit the magnetometer's calibration in the background, starting from
+  // the saved one, out of what ReadCalibrated reads
+  bool StartMagCalibration() {
+    LoadMagCalibration();
+    return magcal_.Start();
+  }
 
   bool ReadMag(Eigen::Vector3f *mag);
   bool ReadIMU(Eigen::Vector3f *accel, Eigen::Vector3f *gyro, float *temp);
 
+  // Queue every accel/gyro sample in the chip's FIFO, to be burst-read with
+  // ReadFIFO, so none are missed or read twice however irregularly we get to
+  // them. drdy, if not NULL, sees the chip's data ready interrupt, one edge
+  // per sample, which times each sample to when the chip took it;
+  // otherwise they're timed from when they're read.
+  bool EnableFIFO(GPIOEdge *drdy);
+
+  // everything queued since the last call, oldest first, up to max;
+  // returns how many, or -1 on error. *lost counts samples the FIFO had to
+  // drop since the last call because it filled up.
+  int ReadFIFO(IMUSample *samples, int max, int *lost);
+
+  // wait up to timeout_ms for the next sample; false on timeout, or at once
+  // without a data ready interrupt
+  bool WaitForData(int timeout_ms);
+
+  // Init's sample rate, and how many samples fill the FIFO (~200ms)
+  static const int SAMPLE_HZ = 200;
+  static const int FIFO_SAMPLES = 42;
+
  private:
-  bool CalibrateMag(const Eigen::Vector3f &mag, bool is_calibrated, Eigen::Vector3f *north);
-  bool SolveMagCalibration();
+  int64_t ResetFIFO();
+  void ReadEdges();
+  void OnEdge(int64_t ns);
+  int64_t SampleTime(int64_t index) const;
+  int64_t SamplesBy(int64_t ns) const;
 
   const I2C &i2c_;
 
   Eigen::Vector3f magadj_;
-  Eigen::MatrixXd YTY_;
-  Eigen::Matrix3f proj_;
-  Eigen::Vector3f center_;
-
-  bool mag_calibrated_;
+  MagCalibrator magcal_;
+
+  // FIFO timing. Samples are numbered from the last FIFO reset, and timed
+  // by a sample clock: the latest data ready edge (the anchor) plus a
+  // sample period per sample after it, which also times samples whose
+  // edges we haven't read yet. Each edge is numbered by the clock, so one
+  // lost doesn't put the rest out, and the FIFO's count keeps the
+  // numbering honest.
+  GPIOEdge *drdy_;
+  int64_t next_sample_;  // the next one out of the FIFO
+  bool anchored_;
+  int64_t anchor_index_, anchor_ns_;
+  double period_ns_;  // the chip's oscillator is only good to a percent
 
   // std::vector<Eigen::Vector3f> mag_cal_points_;
   // Eigen::Matrix4f mag_XTX_;
@@ -0,0 +1,228 @@
+#include <math.h>
+#include <sched.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include <Eigen/Eigenvalues>
+#include <iostream>
+
+#include "hw/imu/magcal.h"
+
+using Eigen::Matrix3d;
+using Eigen::Matrix3f;
+using Eigen::Vector3d;
+using Eigen::Vector3f;
+using Eigen::VectorXd;
+
+MagCalibrator::MagCalibrator() {
+  running_ = false;
+  done_ = false;
+  head_ = 0;
+  tail_ = 0;
+  pthread_mutex_init(&fit_mutex_, NULL);
+  YTY_.setZero();
+  seq_ = 0;
+  published_[0].calibrated = published_[1].calibrated = false;
+}
+
+MagCalibrator::~MagCalibrator() {
+  Stop();
+  pthread_mutex_destroy(&fit_mutex_);
+}
+
+bool MagCalibrator::Start() {
+  done_ = false;
+  if (pthread_create(&thread_, NULL, thread_entry, this) != 0) {
+    perror("MagCalibrator: pthread_create");
+    return false;
+  }
+  running_ = true;
+  // only ever the spare cycles
+  struct sched_param param;
+  param.sched_priority = 0;
+  pthread_setschedparam(thread_, SCHED_IDLE, &param);
+  return true;
+}
+
+void MagCalibrator::Stop() {
+  if (running_) {
+    done_ = true;
+    pthread_join(thread_, NULL);
+    running_ = false;
+  }
+}
+
+void* MagCalibrator::thread_entry(void *arg) {
+  reinterpret_cast<MagCalibrator*>(arg)->Run();
+  return NULL;
+}
+
+void MagCalibrator::Add(const Vector3f &mag) {
+  if (!running_) {
+    return;
+  }
+  uint32_t head = head_.load(std::memory_order_relaxed);
+  if (head - tail_.load(std::memory_order_acquire) >= QUEUE_SIZE) {
+    return;
+  }
+  queue_[head % QUEUE_SIZE] = mag;
+  head_.store(head + 1, std::memory_order_release);
+}
+
+bool MagCalibrator::Get(Matrix3f *proj, Vector3f *center) const {
+  // the copy seq_ picks is never the one being written, so there's no
+  // waiting on the calibration thread; a retry means it's started
+  // publishing another solution since, and it only does that every
+  // SOLVE_MS
+  for (;;) {
+    uint32_t seq = seq_.load(std::memory_order_acquire);
+    const Solution &s = published_[seq & 1];
+    bool calibrated = s.calibrated;
+    *proj = s.proj;
+    *center = s.center;
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (seq_.load(std::memory_order_relaxed) == seq) {
+      return calibrated;
+    }
+  }
+}
+
+void MagCalibrator::Publish(const Matrix3f &proj, const Vector3f &center) {
+  // point readers at the other copy, then write the one they were using,
+  // and again for the other; the second copy's release is the next
+  // publish's first store, which is the next time readers go to it
+  uint32_t seq = seq_.load(std::memory_order_relaxed);
+  for (int i = 0; i < 2; i++) {
+    seq_.store(seq + i + 1, std::memory_order_release);
+    std::atomic_thread_fence(std::memory_order_release);
+    Solution &s = published_[(seq + i) & 1];
+    s.proj = proj;
+    s.center = center;
+    s.calibrated = true;
+  }
+}
+
+void MagCalibrator::Run() {
+  while (!done_) {
+    usleep(SOLVE_MS * 1000);
+    if (!Accumulate()) {
+      continue;
+    }
+    Matrix3f proj;
+    Vector3f center;
+    pthread_mutex_lock(&fit_mutex_);
+    bool solved = Solve(&proj, &center);
+    pthread_mutex_unlock(&fit_mutex_);
+    if (solved) {
+      Publish(proj, center);
+    }
+  }
+}
+
+bool MagCalibrator::Accumulate() {
+  uint32_t tail = tail_.load(std::memory_order_relaxed);
+  uint32_t head = head_.load(std::memory_order_acquire);
+  if (tail == head) {
+    return false;
+  }
+  pthread_mutex_lock(&fit_mutex_);
+  for (; tail != head; tail++) {
+    const Vector3f &mag = queue_[tail % QUEUE_SIZE];
+    // Add our datapoint to the YTY_ matrix.
+    //
+    // roll up H^-T Y^T Y H^-1 by doing a rank update of (y H^-1)
+    // H^-1 = 1/sqrt(2) for elements w/ coefficient 2, 1 elsewhere
+    // so 2/sqrt(2) = sqrt(2) = r2
+    const double r2 = sqrt(2.0);  // root 2
+    Eigen::Matrix<double, 10, 1> y;
+    y << mag[0] * mag[0], r2 * mag[0] * mag[1], r2 * mag[0] * mag[2],
+      mag[1] * mag[1], r2 * mag[1] * mag[2],
+      mag[2] * mag[2],
+      mag[0], mag[1], mag[2], 1.0f;
+    YTY_.selfadjointView<Eigen::Lower>().rankUpdate(y, 1);
+  }
+  pthread_mutex_unlock(&fit_mutex_);
+  tail_.store(tail, std::memory_order_release);
+  return true;
+}
+
+// Fits an ellipsoid to the input data using least-squares.
+//
+// Solution takes the same amount of time no matter how many datapoints were
+// added in to YTY_, but they need to be good datapoints as least squares is
+// not robust to outliers.
+//
+// "OLS" solution in Markovsky, Kukush, Van Huffel,
+// "Consistent Fitting of Ellipsoids"
+// http://eprints.soton.ac.uk/263295/1/ellest_comp_published.pdf
+bool MagCalibrator::Solve(Matrix3f *proj, Vector3f *center) {
+  Eigen::SelfAdjointEigenSolver<Eigen::Matrix<double, 10, 10> > eigen_solver;
+  // Solution is the eigenvector corresponding to the smallest eigenvalue,
+  // which is always the first eigenvector returned by eigen_solver; it only
+  // reads the lower triangle, which is all the rank updates fill in
+  eigen_solver.compute(YTY_);
+  VectorXd B = eigen_solver.eigenvectors().col(0);
+  // unpack B into A, b, d, undoing H^-1: y's cross terms are r2 x y,
+  // where x^T A x has 2 A_01 x y
+  const double r2 = sqrt(2.0);
+  Matrix3d A_;
+  Vector3d b;
+  A_ << B[0], B[1] / r2, B[2] / r2,
+     0, B[3], B[4] / r2,
+     0,    0, B[5];
+  Matrix3d A = A_.selfadjointView<Eigen::Upper>();
+  b << B[6], B[7], B[8];
+  double d = B[9];
+  Eigen::LDLT<Matrix3d> ALDLT = A.ldlt();
+  Vector3d c = -0.5 * ALDLT.solve(b);
+  double scale = 1.0 / (c.transpose() * A * c - d);
+  // if any element in scale * vectorD is <0, then we are not calibrated
+  Vector3d D = scale * ALDLT.vectorD();
+  if (D[0] < 0 || D[1] < 0 || D[2] < 0) {
+    return false;
+  }
+
+  Vector3d sqrtD = D.cwiseSqrt();
+  Matrix3d sqrtDD = sqrtD.asDiagonal();
+  // A = P^T L D L^T P, so this is the square root of A * scale
+  Matrix3d U = ALDLT.matrixU();
+  *proj = (sqrtDD * U * ALDLT.transpositionsP()).cast<float>();
+  *center = c.cast<float>();
+
+  return true;
+}
+
+bool MagCalibrator::Load(const char *fname) {
+  // what we store is the raw cumulative sufficient statistics, so we need
+  // to recompute the projection also
+  FILE *fp = fopen(fname, "rb");
+  if (!fp) {
+    return false;
+  }
+  pthread_mutex_lock(&fit_mutex_);
+  bool ok = fread(YTY_.data(), sizeof(double), 10*10, fp) == 10*10;
+  fclose(fp);
+  Matrix3f proj;
+  Vector3f center;
+  ok = ok && Solve(&proj, &center);
+  pthread_mutex_unlock(&fit_mutex_);
+  if (ok) {
+    std::cout << "mag calibration center " << center.transpose()
+        << " projection:" << std::endl << proj << std::endl;
+    Publish(proj, center);
+  }
+  return ok;
+}
+
+bool MagCalibrator::Save(const char *fname) {
+  FILE *fp = fopen(fname, "wb");
+  if (!fp) {
+    perror(fname);
+    return false;
+  }
+  pthread_mutex_lock(&fit_mutex_);
+  fwrite(YTY_.data(), sizeof(double), 10*10, fp);
+  pthread_mutex_unlock(&fit_mutex_);
+  fclose(fp);
+  return true;
+}
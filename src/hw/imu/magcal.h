@@ -0,0 +1,73 @@
+#ifndef HW_IMU_MAGCAL_H_
+#define HW_IMU_MAGCAL_H_
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include <Eigen/Dense>
+#include <atomic>
+
+// Magnetometer calibration, fitted in the background. The sensor thread
+// hands raw readings to Add(), which only copies them into a lock-free
+// queue; a low-priority thread folds them into the ellipsoid fit's
+// sufficient statistics and solves it at most every SOLVE_MS, publishing
+// each solution to two copies in turn behind a sequence count (a latched
+// seqlock), so Get() never sees half of one and half of the next, and never
+// waits for the idle-priority calibration thread to finish publishing.
+class MagCalibrator {
+ public:
+  EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+
+  MagCalibrator();
+  ~MagCalibrator();
+
+  bool Start();
+  void Stop();
+
+  // from one thread only; never blocks, and drops the reading if the
+  // queue's full or nothing's running to take it
+  void Add(const Eigen::Vector3f &mag);
+
+  // the latest solution, north = proj * (mag - center); false until
+  // there's been one
+  bool Get(Eigen::Matrix3f *proj, Eigen::Vector3f *center) const;
+
+  // the fit's statistics, rather than the solution, so it can go on
+  // learning; Load before Start
+  bool Load(const char *fname);
+  bool Save(const char *fname);
+
+  static const int QUEUE_SIZE = 256;  // a couple of seconds at 100Hz
+  static const int SOLVE_MS = 500;
+
+ private:
+  static void* thread_entry(void *arg);
+  void Run();
+  // drain the queue into YTY_, and say whether there was anything in it
+  bool Accumulate();
+  bool Solve(Eigen::Matrix3f *proj, Eigen::Vector3f *center);
+  void Publish(const Eigen::Matrix3f &proj, const Eigen::Vector3f &center);
+
+  pthread_t thread_;
+  volatile bool running_, done_;
+
+  // readings on their way from Add to the calibration thread
+  Eigen::Vector3f queue_[QUEUE_SIZE];
+  std::atomic<uint32_t> head_, tail_;
+
+  // only the calibration thread, or Load/Save, touches the fit
+  pthread_mutex_t fit_mutex_;
+  Eigen::Matrix<double, 10, 10> YTY_;
+
+  struct Solution {
+    bool calibrated;
+    Eigen::Matrix3f proj;
+    Eigen::Vector3f center;
+  };
+  // the published solution, twice; readers use published_[seq_ & 1], which
+  // Publish only writes while seq_ points them at the other one
+  std::atomic<uint32_t> seq_;
+  Solution published_[2];
+};
+
+#endif  // HW_IMU_MAGCAL_H_
@@ -0,0 +1,95 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "hw/imu/magcal.h"
+
+// feed readings off a known, tilted and offset ellipsoid to the background
+// calibration, and check it finds the center and maps them back onto the
+// unit sphere; and that handing it a reading stays cheap
+
+using Eigen::Matrix3f;
+using Eigen::Vector3f;
+
+static Vector3f RandomUnit(unsigned *seed) {
+  for (;;) {
+    Vector3f u;
+    for (int i = 0; i < 3; i++) {
+      u[i] = 2.0f * rand_r(seed) / RAND_MAX - 1;
+    }
+    if (u.norm() > 0.1 && u.norm() <= 1) {
+      return u.normalized();
+    }
+  }
+}
+
+static int64_t Nanos() {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+
+int main() {
+  int failures = 0;
+  const Vector3f center(30, -20, 10);
+  Matrix3f shape;
+  shape = Eigen::AngleAxisf(0.3, Vector3f(1, 1, 0).normalized()) *
+    Eigen::Vector3f(200, 150, 120).asDiagonal();
+
+  MagCalibrator cal;
+  Matrix3f proj;
+  Vector3f c;
+  if (cal.Get(&proj, &c)) {
+    printf("FAIL: calibrated before starting\n");
+    failures++;
+  }
+  if (!cal.Start()) {
+    return 1;
+  }
+
+  // a couple of seconds of readings at 100Hz, in bursts the queue can hold
+  unsigned seed = 1;
+  for (int burst = 0; burst < 4; burst++) {
+    for (int i = 0; i < MagCalibrator::QUEUE_SIZE / 2; i++) {
+      cal.Add(center + shape * RandomUnit(&seed));
+    }
+    usleep(MagCalibrator::SOLVE_MS * 1000 * 3 / 2);
+  }
+
+  if (!cal.Get(&proj, &c)) {
+    printf("FAIL: no calibration\n");
+    return 1;
+  }
+  float max_err = 0;
+  for (int i = 0; i < 1000; i++) {
+    Vector3f m = center + shape * RandomUnit(&seed);
+    float err = fabsf((proj * (m - c)).norm() - 1);
+    max_err = err > max_err ? err : max_err;
+  }
+  printf("center %f %f %f, |north| within %f of 1\n", c[0], c[1], c[2],
+      max_err);
+  if ((c - center).norm() > 0.01 || max_err > 1e-3) {
+    printf("FAIL: calibration is off\n");
+    failures++;
+  }
+
+  // the sensor thread's side, full queue or not
+  const int NADD = 100000;
+  int64_t t0 = Nanos();
+  for (int i = 0; i < NADD; i++) {
+    cal.Add(center + shape * Vector3f(1, 0, 0));
+  }
+  int64_t t1 = Nanos();
+  for (int i = 0; i < NADD; i++) {
+    cal.Get(&proj, &c);
+  }
+  int64_t t2 = Nanos();
+  printf("Add %0.0fns, Get %0.0fns\n", static_cast<double>(t1 - t0) / NADD,
+      static_cast<double>(t2 - t1) / NADD);
+  cal.Stop();
+
+  printf("%d failures\n", failures);
+  return failures ? 1 : 0;
+}
@@ -10,16 +10,12 @@
 #include <unistd.h>
 #include <math.h>
 #include <Eigen/Dense>
-#include <Eigen/Eigenvalues>
-#include <iostream>
 
 #include "hw/gpio/i2c.h"
 #include "hw/imu/imu.h"
 
 using Eigen::Vector3f;
-using Eigen::VectorXd;
 using Eigen::Matrix3f;
-using Eigen::MatrixXd;
 
 bool IMU::Init() {
   i2c_.Write(0x68, 107, 0x80);  // reset
@@ -70,10 +66,6 @@ bool IMU::Init() {
   fprintf(stderr, "AK8975C mag adjust: %f %f %f\r\n",
          magadj_[0], magadj_[1], magadj_[2]);
 
-#if 0
-  mag_calibrated_ = LoadMagCalibration();
-#endif
-
   return true;
 }
 
@@ -93,133 +85,231 @@ bool IMU::ReadMag(Vector3f *mag) {
   return false;
 }
 
-#if 0
-// Fits an ellipsoid to the input data using least-squares.
-//
-// Solution takes the same amount of time no matter how many datapoints were
-// added in to YTY_, but they need to be good datapoints as least squares is
-// not robust to outliers.
-//
-// "OLS" solution in Markovsky, Kukush, Van Huffel,
-// "Consistent Fitting of Ellipsoids"
-// http://eprints.soton.ac.uk/263295/1/ellest_comp_published.pdf
-bool IMU::SolveMagCalibration() {
-  static Eigen::SelfAdjointEigenSolver<MatrixXd> eigen_solver_(10);
-  // Solution is the eigenvector corresponding to the smallest eigenvalue,
-  // which is always the first eigenvector returned by eigen_solver
-  eigen_solver_.compute(YTY_);
-  VectorXd B(10);
-  // save in B, then unpack into A, b, d
-  B = eigen_solver_.eigenvectors().col(0);
-  Matrix3f A_;
-  Vector3f b;
-  A_ << B[0], B[1], B[2],
-     0, B[3], B[4],
-     0,    0, B[5];
-  Matrix3f A = A_.selfadjointView<Eigen::Upper>();
-  b << B[6], B[7], B[8];
-  float d = B[9];
-  Eigen::LDLT<Matrix3f> ALDLT = A.ldlt();
-  Vector3f c = -0.5 * ALDLT.solve(b);
-  float scale = 1.0f / (c.transpose() * A * c - d);
-  // if any element in scale * vectorD is <0, then we are not calibrated
-  Vector3f D = scale * ALDLT.vectorD();
-  if (D[0] < 0 || D[1] < 0 || D[2] < 0) {
+bool IMU::ReadCalibrated(IMUState *state) {
+  Vector3f mag;
+  if (!ReadMag(&mag)) {
     return false;
   }
-
-  Vector3f sqrtD = D.cwiseSqrt();
-  Matrix3f sqrtDD = sqrtD.asDiagonal();
-  proj_ = sqrtDD * ALDLT.matrixU();
-  center_ = c;
-
+  float temp;
+  ReadIMU(&state->g, &state->w, &temp);
+  // the fit happens on the calibration thread; all we do here is hand it
+  // the reading and apply the latest solution
+  magcal_.Add(mag);
+  Matrix3f proj;
+  Vector3f center;
+  if (!magcal_.Get(&proj, &center)) {
+    return false;
+  }
+  state->N = proj * (mag - center);
   return true;
 }
 
-// returns (approximately unit) vector pointing towards magnetic north, after
-// compensating for ellipsoid shape
-bool IMU::CalibrateMag(const Vector3f &mag, bool is_calibrated, Vector3f *north) {
-  if (!is_calibrated) {
-    // Add our datapoint to the YTY_ matrix.
-    //
-    // roll up H^-T Y^T Y H^-1 by doing a rank update of (y H^-1)
-    // H^-1 = 1/sqrt(2) for elements w/ coefficient 2, 1 elsewhere
-    // so 2/sqrt(2) = sqrt(2) = r2
-    const double r2 = sqrt(2.0);  // root 2
-    VectorXd y(10);
-    y << mag[0] * mag[0], r2 * mag[0] * mag[1], r2 * mag[0] * mag[2],
-      mag[1] * mag[1], r2 * mag[1] * mag[2],
-      mag[2] * mag[2],
-      mag[0], mag[1], mag[2], 1.0f;
-    YTY_.selfadjointView<Eigen::Lower>().rankUpdate(y, 1);
-
-    if (!SolveMagCalibration())
-      return false;
+// accel & gyro in the order the data registers, and the FIFO, have them
+static void Convert(const uint8_t *accel6, const uint8_t *gyro6,
+    Vector3f *accel, Vector3f *gyro) {
+  int16_t ax = (accel6[0] << 8) | accel6[1],
+          ay = (accel6[2] << 8) | accel6[3],
+          az = (accel6[4] << 8) | accel6[5];
+  int16_t gx = (gyro6[0] << 8) | gyro6[1],
+          gy = (gyro6[2] << 8) | gyro6[3],
+          gz = (gyro6[4] << 8) | gyro6[5];
+  // we are in 16384 LSB/g scale (+/- 2g)
+  *accel = Vector3f(ax, ay, az) / 16384.0;
+  // TODO: temp calibration
+  // we are in +/- 1000 degrees/second full scale range
+  // return radians/second
+  *gyro = Vector3f(gx, gy, gz) * 1000.0 * M_PI / (180 * 32768.0);
+}
+
+bool IMU::ReadIMU(Vector3f *accel, Vector3f *gyro, float *temp) {
+  uint8_t readbuf[14];
+  // mpu-9150 accel & gyro
+  if (i2c_.Read(0x68, 0x3b, 14, readbuf)) {
+    Convert(readbuf, readbuf + 8, accel, gyro);
+    int16_t t  = (readbuf[6] << 8) | readbuf[7];
+
+    // the datasheet is completely useless for temperature
+    *temp = t * (1.0/333.87) + 21;
+
+    return true;
   }
+  return false;
+}
+
+// FIFO registers and bits
+static const uint8_t FIFO_EN = 35;
+static const uint8_t INT_STATUS = 58;
+static const uint8_t USER_CTRL = 106;
+static const uint8_t FIFO_COUNTH = 114;
+static const uint8_t FIFO_R_W = 116;
+static const uint8_t FIFO_OFLOW_INT = 0x10;
+
+// accel x,y,z then gyro x,y,z, 16 bits each; no temperature
+static const int SAMPLE_BYTES = 12;
+// samples per burst read; some I2C adapters don't like long transfers
+static const int BURST_SAMPLES = 16;
+
+static int64_t Nanos(const struct timespec &t) {
+  return t.tv_sec * 1000000000LL + t.tv_nsec;
+}
 
-  *north = proj_ * (mag - center_);
+static int64_t Now() {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return Nanos(t);
+}
+
+bool IMU::EnableFIFO(GPIOEdge *drdy) {
+  drdy_ = drdy;
+  // dlpf_cfg = 3 as before, plus fifo_mode: when the FIFO's full, drop new
+  // samples rather than overwrite old ones, so what's in it is always the
+  // unbroken run after the last one we read
+  bool ok = i2c_.Write(0x68, 26, 0x43);
+  // bypass, and a 50us data ready pulse per sample rather than a latched
+  // level, so each sample is an edge
+  ok = i2c_.Write(0x68, 55, 0x02) && ok;
+  ok = i2c_.Write(0x68, 56, 0x01) && ok;  // data ready interrupt
+  ok = i2c_.Write(0x68, FIFO_EN, 0x78) && ok;  // gyro x, y, z, accel
+  if (!ok) {
+    return false;
+  }
+  anchored_ = false;
+  ResetFIFO();
+  if (drdy_) {
+    // edges from before, latched or not; the next is sample 0's
+    struct timespec t[16];
+    while (drdy_->Read(t, 16) > 0) {}
+  }
   return true;
 }
 
-bool IMU::LoadMagCalibration() {
-  // what we store in magcal.bin is actually the raw cumulative sufficient
-  // statistics, so we need to recompute the projection also
-  FILE *fp = fopen("magcal.bin", "rb");
-  if (fp) {
-    fread(YTY_.data(), 10*10, sizeof(double), fp);
-    fclose(fp);
-    if (SolveMagCalibration()) {
-      std::cout << "mag calibration center " << center_.transpose()
-          << " projection:" << std::endl << proj_ << std::endl;
-      return true;
-    }
+// starts the numbering over from the first sample after the reset, and
+// returns how many the chip had taken before it
+int64_t IMU::ResetFIFO() {
+  int64_t taken = anchored_ ? SamplesBy(Now()) : next_sample_;
+  i2c_.Write(0x68, USER_CTRL, 0x44);  // fifo_en | fifo_rst
+  if (anchored_) {
+    anchor_index_ -= taken;
   }
-  return false;
+  next_sample_ = 0;
+  return taken;
 }
 
-bool IMU::SaveMagCalibration() {
-  FILE *fp = fopen("magcal.bin", "wb");
-  fwrite(YTY_.data(), 10*10, sizeof(double), fp);
-  fclose(fp);
-  return true;
+void IMU::ReadEdges() {
+  struct timespec edges[16];
+  int n;
+  while ((n = drdy_->Read(edges, 16)) > 0) {
+    for (int i = 0; i < n; i++) {
+      OnEdge(Nanos(edges[i]));
+    }
+  }
 }
 
-bool IMU::ReadCalibrated(IMUState *state) {
-  if (ReadMag(&state->N)) {
-    float temp;
-    ReadIMU(&state->g, &state->w, &temp);
-    if (CalibrateMag(state->N, mag_calibrated_, &state->N)) {
-      return true;
+void IMU::OnEdge(int64_t ns) {
+  int64_t index = next_sample_;  // the first edge is the next sample's
+  if (anchored_) {
+    index = anchor_index_ + llround((ns - anchor_ns_) / period_ns_);
+    if (index > anchor_index_) {
+      double period = static_cast<double>(ns - anchor_ns_) /
+        (index - anchor_index_);
+      period_ns_ += (period - period_ns_) / 16;
     }
   }
-  return false;
+  anchor_index_ = index;
+  anchor_ns_ = ns;
+  anchored_ = true;
 }
-#endif
 
-bool IMU::ReadIMU(Vector3f *accel, Vector3f *gyro, float *temp) {
-  uint8_t readbuf[14];
-  // mpu-9150 accel & gyro
-  if (i2c_.Read(0x68, 0x3b, 14, readbuf)) {
-    int16_t ax = (readbuf[0] << 8) | readbuf[1],
-            ay = (readbuf[2] << 8) | readbuf[3],
-            az = (readbuf[4] << 8) | readbuf[5];
-    int16_t t  = (readbuf[6] << 8) | readbuf[7];
-    int16_t gx = (readbuf[ 8] << 8) | readbuf[ 9],
-            gy = (readbuf[10] << 8) | readbuf[11],
-            gz = (readbuf[12] << 8) | readbuf[13];
-    // we are in 16384 LSB/g scale (+/- 2g)
-    *accel = Vector3f(ax, ay, az) / 16384.0;
-    // TODO: temp calibration
-    // we are in +/- 1000 degrees/second full scale range
-    // return radians/second
-    *gyro = Vector3f(gx, gy, gz) * 1000.0 * M_PI / (180 * 32768.0);
+int64_t IMU::SampleTime(int64_t index) const {
+  return anchor_ns_ + llround((index - anchor_index_) * period_ns_);
+}
 
-    // the datasheet is completely useless for temperature
-    *temp = t * (1.0/333.87) + 21;
+int64_t IMU::SamplesBy(int64_t ns) const {
+  return anchor_index_ + 1 +
+    static_cast<int64_t>(floor((ns - anchor_ns_) / period_ns_));
+}
 
-    return true;
+int IMU::ReadFIFO(IMUSample *samples, int max, int *lost) {
+  *lost = 0;
+  // read the edges first, so any sample the FIFO has an edge for has been
+  // seen; one taken in between is timed off the ones before it
+  if (drdy_) {
+    ReadEdges();
   }
-  return false;
+
+  uint8_t status, countbuf[2];
+  if (!i2c_.Read(0x68, INT_STATUS, 1, &status)) {
+    return -1;
+  }
+  int64_t asked = Now();
+  if (!i2c_.Read(0x68, FIFO_COUNTH, 2, countbuf)) {
+    return -1;
+  }
+  int count = ((countbuf[0] & 0x1f) << 8) | countbuf[1];
+  int queued = count / SAMPLE_BYTES;
+  int64_t first = next_sample_;
+  bool overflow = status & FIFO_OFLOW_INT;
+
+  if (drdy_ && anchored_ && !overflow) {
+    // the FIFO says how many samples the chip has taken, and so does the
+    // clock; if they disagree the first edge after a reset was one too
+    // early or late, so renumber. Not if one was due right around when we
+    // asked, when either might be right.
+    double since = (asked - anchor_ns_) / period_ns_;
+    double phase = since - floor(since);
+    if (phase > 0.1 && phase < 0.9) {
+      anchor_index_ += first + queued - SamplesBy(asked);
+    }
+  } else if (!drdy_) {
+    // the best we can do is that the newest was taken just now; unless
+    // the FIFO's filled up, when the clock from before says how long ago
+    // it stopped
+    if (overflow && anchored_) {
+      anchor_index_ = SamplesBy(asked) - 1;
+      anchor_ns_ = asked;
+    } else if (queued > 0) {
+      anchor_index_ = first + queued - 1;
+      anchor_ns_ = asked;
+      anchored_ = true;
+    }
+  }
+
+  int n = queued < max ? queued : max;
+  uint8_t buf[BURST_SAMPLES * SAMPLE_BYTES];
+  for (int i = 0; i < n; i += BURST_SAMPLES) {
+    int burst = n - i < BURST_SAMPLES ? n - i : BURST_SAMPLES;
+    if (!i2c_.Read(0x68, FIFO_R_W, burst * SAMPLE_BYTES, buf)) {
+      ResetFIFO();  // we've lost our place in it
+      return -1;
+    }
+    for (int j = 0; j < burst; j++) {
+      IMUSample *s = &samples[i + j];
+      const uint8_t *b = buf + j * SAMPLE_BYTES;
+      Convert(b, b + 6, &s->accel, &s->gyro);
+      int64_t t = anchored_ ? SampleTime(next_sample_) : Now();
+      s->t.tv_sec = t / 1000000000LL;
+      s->t.tv_nsec = t % 1000000000LL;
+      next_sample_++;
+    }
+  }
+
+  if (overflow) {
+    // it stopped taking samples when it filled up; the clock says how many
+    // it's missed since, along with any we didn't have room for
+    if (drdy_) {
+      ReadEdges();
+    }
+    int64_t taken = ResetFIFO();
+    if (taken < first + queued) {
+      taken = first + queued;
+    }
+    *lost = taken - (first + n);
+  }
+  return n;
+}
+
+bool IMU::WaitForData(int timeout_ms) {
+  return drdy_ && drdy_->Wait(timeout_ms);
 }
 
 #if 0
@@ -0,0 +1,242 @@
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "hw/imu/mpu9250sim.h"
+
+// the registers that behave as more than memory
+static const uint8_t SMPLRT_DIV = 25;
+static const uint8_t CONFIG = 26;
+static const uint8_t FIFO_EN = 35;
+static const uint8_t INT_PIN_CFG = 55;
+static const uint8_t INT_ENABLE = 56;
+static const uint8_t INT_STATUS = 58;
+static const uint8_t ACCEL_XOUT_H = 59;
+static const uint8_t USER_CTRL = 106;
+static const uint8_t PWR_MGMT_1 = 107;
+static const uint8_t FIFO_COUNTH = 114;
+static const uint8_t FIFO_COUNTL = 115;
+static const uint8_t FIFO_R_W = 116;
+static const uint8_t WHO_AM_I = 117;
+
+static int64_t Now() {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+
+MPU9250Sim::MPU9250Sim(double rate_error)
+  : rate_error_(rate_error), drdy_(this), drop_edge_(false) {
+  Reset();
+}
+
+void MPU9250Sim::Reset() const {
+  memset(regs_, 0, sizeof(regs_));
+  regs_[PWR_MGMT_1] = 0x40;  // asleep
+  regs_[WHO_AM_I] = 0x71;
+  fifo_.clear();
+  next_sample_ns_ = Now();
+}
+
+int64_t MPU9250Sim::SampleTime(int64_t n) const {
+  if (n < 0 || n >= static_cast<int64_t>(sample_times_.size())) {
+    return -1;
+  }
+  return sample_times_[n];
+}
+
+void MPU9250Sim::Update() const {
+  // 1kHz internal rate with the low pass filter on, divided down
+  double period = 1e6 * (1 + regs_[SMPLRT_DIV]) / (1 + rate_error_);
+  int64_t now = Now();
+  if (regs_[PWR_MGMT_1] & 0x40) {
+    next_sample_ns_ = now + period;
+    return;
+  }
+  while (next_sample_ns_ <= now) {
+    TakeSample();
+    next_sample_ns_ += period;
+  }
+}
+
+void MPU9250Sim::TakeSample() const {
+  int64_t n = sample_times_.size();
+  sample_times_.push_back(next_sample_ns_);
+
+  // accel x, y, z, temperature, gyro x, y, z: the data registers' order,
+  // and the FIFO's
+  int16_t values[7] = {
+    static_cast<int16_t>(n & 0x7fff), static_cast<int16_t>(n >> 15), 16384,
+    0, 100, -100, static_cast<int16_t>(n & 0xff)};
+  for (int i = 0; i < 7; i++) {
+    regs_[ACCEL_XOUT_H + 2*i] = values[i] >> 8;
+    regs_[ACCEL_XOUT_H + 2*i + 1] = values[i] & 0xff;
+  }
+
+  if (regs_[USER_CTRL] & 0x40) {
+    uint8_t en = regs_[FIFO_EN];
+    std::vector<uint8_t> bytes;
+    for (int i = 0; i < 7; i++) {
+      // which FIFO_EN bit covers each value
+      static const uint8_t bits[7] = {0x08, 0x08, 0x08, 0x80, 0x40, 0x20,
+        0x10};
+      if (en & bits[i]) {
+        bytes.push_back(values[i] >> 8);
+        bytes.push_back(values[i] & 0xff);
+      }
+    }
+    if (fifo_.size() + bytes.size() > FIFO_SIZE) {
+      regs_[INT_STATUS] |= 0x10;
+      if (regs_[CONFIG] & 0x40) {
+        bytes.clear();  // fifo_mode: full means full
+      } else {
+        fifo_.erase(fifo_.begin(),
+            fifo_.begin() + (fifo_.size() + bytes.size() - FIFO_SIZE));
+      }
+    }
+    fifo_.insert(fifo_.end(), bytes.begin(), bytes.end());
+  }
+
+  // a latched interrupt stays high, without another edge, until cleared
+  bool high = (regs_[INT_PIN_CFG] & 0x20) && (regs_[INT_STATUS] & 0x01);
+  regs_[INT_STATUS] |= 0x01;
+  if ((regs_[INT_ENABLE] & 0x01) && !high) {
+    if (drop_edge_) {
+      drop_edge_ = false;
+    } else if (edges_.size() < EDGE_QUEUE) {
+      edges_.push_back(next_sample_ns_);
+    }
+  }
+}
+
+void MPU9250Sim::WriteReg(uint8_t reg, uint8_t value) const {
+  switch (reg) {
+    case PWR_MGMT_1:
+      if (value & 0x80) {
+        Reset();
+      } else {
+        regs_[reg] = value;
+      }
+      break;
+    case USER_CTRL:
+      if (value & 0x04) {
+        fifo_.clear();
+      }
+      regs_[reg] = value & ~0x04;
+      break;
+    case INT_STATUS:
+    case FIFO_COUNTH:
+    case FIFO_COUNTL:
+    case WHO_AM_I:
+      break;
+    case FIFO_R_W:
+      if (fifo_.size() < FIFO_SIZE) {
+        fifo_.push_back(value);
+      }
+      break;
+    default:
+      regs_[reg] = value;
+  }
+}
+
+bool MPU9250Sim::Write(uint8_t addr, uint8_t reg, uint8_t value) const {
+  return Write(addr, reg, 1, &value);
+}
+
+bool MPU9250Sim::Write(uint8_t addr, uint8_t reg, int len,
+    const uint8_t *buf) const {
+  if (addr == 0x0c) {  // the magnetometer's there, but we ignore it
+    BusTime(len + 2);
+    return true;
+  }
+  if (addr != 0x68) {
+    return false;
+  }
+  Update();
+  for (int i = 0; i < len; i++) {
+    WriteReg(reg, buf[i]);
+    if (reg != FIFO_R_W) {
+      reg++;
+    }
+  }
+  BusTime(len + 2);
+  return true;
+}
+
+bool MPU9250Sim::Read(uint8_t addr, uint8_t reg, int len,
+    uint8_t *outbuf) const {
+  if (addr == 0x0c) {
+    // AK8963: its id, mid-scale sensitivity adjustments, and never a
+    // reading ready
+    for (int i = 0; i < len; i++) {
+      uint8_t r = reg + i;
+      outbuf[i] = r == 0 ? 0x48 : (r >= 0x10 && r <= 0x12) ? 128 : 0;
+    }
+    BusTime(len + 3);
+    return true;
+  }
+  if (addr != 0x68) {
+    return false;
+  }
+  Update();
+  bool clear_status = regs_[INT_PIN_CFG] & 0x10;  // int_anyrd_2clear
+  for (int i = 0; i < len; i++) {
+    if (reg == FIFO_R_W) {
+      if (fifo_.empty()) {
+        outbuf[i] = 0;
+      } else {
+        outbuf[i] = fifo_.front();
+        fifo_.pop_front();
+      }
+      continue;
+    }
+    if (reg == FIFO_COUNTH) {
+      outbuf[i] = fifo_.size() >> 8;
+    } else if (reg == FIFO_COUNTL) {
+      outbuf[i] = fifo_.size() & 0xff;
+    } else {
+      outbuf[i] = regs_[reg];
+    }
+    if (reg == INT_STATUS) {
+      clear_status = true;
+    }
+    reg++;
+  }
+  if (clear_status) {
+    regs_[INT_STATUS] = 0;
+  }
+  BusTime(len + 3);
+  return true;
+}
+
+void MPU9250Sim::BusTime(int len) const {
+  // 9 clocks a byte at 400kHz
+  usleep(len * 9 * 1000000 / 400000);
+}
+
+bool MPU9250Sim::DataReadyPin::Wait(int timeout_ms) {
+  int64_t deadline = Now() + timeout_ms * 1000000LL;
+  for (;;) {
+    sim_->Update();
+    if (!sim_->edges_.empty()) {
+      return true;
+    }
+    if (Now() >= deadline) {
+      return false;
+    }
+    usleep(100);
+  }
+}
+
+int MPU9250Sim::DataReadyPin::Read(struct timespec *t, int max) {
+  sim_->Update();
+  int n = 0;
+  while (n < max && !sim_->edges_.empty()) {
+    int64_t ns = sim_->edges_.front();
+    sim_->edges_.pop_front();
+    t[n].tv_sec = ns / 1000000000LL;
+    t[n].tv_nsec = ns % 1000000000LL;
+    n++;
+  }
+  return n;
+}
@@ -0,0 +1,74 @@
+#ifndef HW_IMU_MPU9250SIM_H_
+#define HW_IMU_MPU9250SIM_H_
+
+#include <stdint.h>
+
+#include <deque>
+#include <vector>
+
+#include "hw/gpio/gpioedge.h"
+#include "hw/gpio/i2c.h"
+
+// A register-level stand-in for an MPU-9250 on the I2C bus, for testing
+// the IMU driver without one: the registers it uses, samples taken in real
+// (CLOCK_MONOTONIC) time at the configured rate off a slightly wrong
+// oscillator, the FIFO, and the data ready interrupt as the kernel would
+// queue its edges. Transfers take as long as they would at 400kHz. Sample
+// n's accelerometer x and y read back as n's low 15 bits and the rest, so
+// a test can tell exactly which samples it got.
+class MPU9250Sim : public I2C {
+ public:
+  // rate_error: how much faster than nominal the chip's clock runs
+  explicit MPU9250Sim(double rate_error);
+
+  GPIOEdge *DataReady() { return &drdy_; }
+
+  // the n-th sample the chip's taken, and when, in ns; -1 if it hasn't
+  int64_t SampleTime(int64_t n) const;
+  static int64_t SampleNumber(int16_t accel_x, int16_t accel_y) {
+    return (static_cast<int64_t>(accel_y) << 15) | accel_x;
+  }
+
+  // the kernel loses the next data ready edge
+  void DropEdge() { drop_edge_ = true; }
+
+  virtual bool Write(uint8_t addr, uint8_t reg, uint8_t value) const;
+  virtual bool Write(uint8_t addr, uint8_t reg, int len,
+      const uint8_t *buf) const;
+  virtual bool Read(uint8_t addr, uint8_t reg, int len,
+      uint8_t *outbuf) const;
+
+  static const int FIFO_SIZE = 512;
+  static const int EDGE_QUEUE = 16;  // the kernel's per-line event fifo
+
+ private:
+  class DataReadyPin : public GPIOEdge {
+   public:
+    explicit DataReadyPin(const MPU9250Sim *sim) : sim_(sim) {}
+    virtual bool Wait(int timeout_ms);
+    virtual int Read(struct timespec *t, int max);
+   private:
+    const MPU9250Sim *sim_;
+  };
+
+  // take every sample due by now
+  void Update() const;
+  void TakeSample() const;
+  void Reset() const;
+  void WriteReg(uint8_t reg, uint8_t value) const;
+  // sleep for a transfer of len bytes
+  void BusTime(int len) const;
+
+  double rate_error_;
+  DataReadyPin drdy_;
+
+  // the I2C interface is const, but the chip has a mind of its own
+  mutable uint8_t regs_[128];
+  mutable std::deque<uint8_t> fifo_;
+  mutable std::deque<int64_t> edges_;
+  mutable std::vector<int64_t> sample_times_;
+  mutable int64_t next_sample_ns_;
+  mutable bool drop_edge_;
+};
+
+#endif  // HW_IMU_MPU9250SIM_H_
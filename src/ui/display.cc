@@ -79,7 +79,7 @@ void UIDisplay::UpdateConeView(const uint8_t *yuv, int ncones, int *conesx) {
   }
 }
 
-void UIDisplay::UpdateParticleView(const coneslam::Localizer *l,
+void UIDisplay::UpdateParticleView(const coneslam::PoseEstimator *l,
         float trackx, float tracky, float nx, float ny) {
   // first determine our offsets and scale; what is the min/max landmark
   // location
@@ -135,6 +135,23 @@ void UIDisplay::UpdateParticleView(const coneslam::Localizer *l,
       buf[320*y + x] = green;
     }
   }
+
+  // mean pose, with a short line in the heading direction
+  static const uint16_t red = (31<<11) + (0<<5) + (0);
+  coneslam::PoseEstimate est;
+  l->GetPoseEstimate(&est);
+  for (int i = 0; i < 6; i++) {
+    int x = x0 + scale * est.x + i * cos(est.theta);
+    int y = y0 - scale * est.y - i * sin(est.theta);
+    if (x >= 0 && x < 320 && y >= 0 && y < 112) {
+      buf[320*y + x] = red;
+    }
+  }
+
+  char strbuf[32];
+  snprintf(strbuf, sizeof(strbuf), "%d particles%s", l->NumParticles(),
+      est.multimodal ? " (ambiguous)" : "");
+  DrawText(strbuf, 0, 102, est.multimodal ? red : yellow, buf);
 }
 
 void UIDisplay::UpdateConfig(const char *configmenu[], int nconfigs,
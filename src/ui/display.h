@@ -15,7 +15,7 @@ class UIDisplay {
 
   void UpdateConeView(const uint8_t *yuv, int ncones, int *conesx);
 
-  void UpdateParticleView(const coneslam::Localizer *l,
+  void UpdateParticleView(const coneslam::PoseEstimator *l,
           float trackx, float tracky, float nx, float ny);
 
   void UpdateConfig(const char *configmenu[], int nconfigs,
@@ -0,0 +1,108 @@
+#include <stdio.h>
+
+#include "util/workerpool.h"
+
+WorkerPool::WorkerPool(int nthreads) {
+  if (nthreads < 1) {
+    nthreads = 1;
+  }
+  nthreads_ = nthreads;
+  generation_ = 0;
+  active_ = 0;
+  shutdown_ = false;
+  fn_ = NULL;
+  arg_ = NULL;
+  ntasks_ = 0;
+  next_task_ = 0;
+
+  pthread_mutex_init(&mutex_, NULL);
+  pthread_cond_init(&start_cond_, NULL);
+  pthread_cond_init(&done_cond_, NULL);
+
+  threads_ = new pthread_t[nthreads_ - 1];
+  for (int i = 0; i < nthreads_ - 1; i++) {
+    if (pthread_create(&threads_[i], NULL, thread_entry, this) != 0) {
+      perror("WorkerPool: pthread_create");
+      // run with however many threads we managed to start
+      nthreads_ = i + 1;
+      break;
+    }
+  }
+}
+
+WorkerPool::~WorkerPool() {
+  pthread_mutex_lock(&mutex_);
+  shutdown_ = true;
+  pthread_cond_broadcast(&start_cond_);
+  pthread_mutex_unlock(&mutex_);
+  for (int i = 0; i < nthreads_ - 1; i++) {
+    pthread_join(threads_[i], NULL);
+  }
+  delete[] threads_;
+  pthread_cond_destroy(&done_cond_);
+  pthread_cond_destroy(&start_cond_);
+  pthread_mutex_destroy(&mutex_);
+}
+
+void WorkerPool::RunTasks() {
+  for (;;) {
+    int task = next_task_.fetch_add(1);
+    if (task >= ntasks_) {
+      break;
+    }
+    fn_(arg_, task);
+  }
+}
+
+void WorkerPool::Run(TaskFn fn, void *arg, int ntasks) {
+  if (nthreads_ == 1 || ntasks <= 1) {
+    for (int i = 0; i < ntasks; i++) {
+      fn(arg, i);
+    }
+    return;
+  }
+
+  pthread_mutex_lock(&mutex_);
+  fn_ = fn;
+  arg_ = arg;
+  ntasks_ = ntasks;
+  next_task_ = 0;
+  active_ = nthreads_ - 1;
+  generation_++;
+  pthread_cond_broadcast(&start_cond_);
+  pthread_mutex_unlock(&mutex_);
+
+  RunTasks();
+
+  pthread_mutex_lock(&mutex_);
+  while (active_ > 0) {
+    pthread_cond_wait(&done_cond_, &mutex_);
+  }
+  pthread_mutex_unlock(&mutex_);
+}
+
+void* WorkerPool::thread_entry(void *arg) {
+  WorkerPool *self = reinterpret_cast<WorkerPool*>(arg);
+
+  int generation = 0;
+  pthread_mutex_lock(&self->mutex_);
+  for (;;) {
+    while (self->generation_ == generation && !self->shutdown_) {
+      pthread_cond_wait(&self->start_cond_, &self->mutex_);
+    }
+    if (self->shutdown_) {
+      break;
+    }
+    generation = self->generation_;
+    pthread_mutex_unlock(&self->mutex_);
+
+    self->RunTasks();
+
+    pthread_mutex_lock(&self->mutex_);
+    if (--self->active_ == 0) {
+      pthread_cond_signal(&self->done_cond_);
+    }
+  }
+  pthread_mutex_unlock(&self->mutex_);
+  return NULL;
+}
@@ -0,0 +1,46 @@
+#ifndef UTIL_WORKERPOOL_H_
+#define UTIL_WORKERPOOL_H_
+
+#include <pthread.h>
+
+#include <atomic>
+
+// A persistent pool of worker threads for splitting up per-frame work.
+//
+// Run() hands out task indices 0..ntasks-1 to the workers and the calling
+// thread, and returns once all of them are done. Which thread runs which
+// task is not defined, so anything that needs to be deterministic should
+// partition its work by task index, not by thread.
+class WorkerPool {
+ public:
+  typedef void (*TaskFn)(void *arg, int task);
+
+  // nthreads includes the calling thread, so WorkerPool(4) starts 3 workers
+  explicit WorkerPool(int nthreads);
+  ~WorkerPool();
+
+  void Run(TaskFn fn, void *arg, int ntasks);
+
+  int NumThreads() const { return nthreads_; }
+
+ private:
+  static void* thread_entry(void *arg);
+  void RunTasks();
+
+  int nthreads_;
+  pthread_t *threads_;
+
+  pthread_mutex_t mutex_;
+  pthread_cond_t start_cond_;
+  pthread_cond_t done_cond_;
+  int generation_;  // incremented for each Run()
+  int active_;      // workers still inside the current Run()
+  bool shutdown_;
+
+  TaskFn fn_;
+  void *arg_;
+  int ntasks_;
+  std::atomic<int> next_task_;
+};
+
+#endif  // UTIL_WORKERPOOL_H_
@@ -1,3 +1,8 @@
+from __future__ import print_function
+
+import os
+import sys
+
 import numpy as np
 import cv2
 
@@ -7,12 +12,12 @@ import imgremap
 ytop = imgremap.ytop
 
 
-def generate_maps():
+def generate_maps(outdir="."):
     camera_matrix = np.load("../camcal/camera_matrix.npy")
     dist_coeffs = np.load("../camcal/dist_coeffs.npy")
     Rdown = np.load("../camcal/Rdown.npy")
 
-    print "loaded calibration from ../autorustler/camcal/"
+    print("loaded calibration from ../camcal/")
 
     camera_matrix[:2] /= 8.
 
@@ -88,24 +93,51 @@ def generate_maps():
         # up
         floodmap[:-1][floodmap[:-1] == -1] = floodmap[1:][floodmap[:-1] == -1]
 
-    np.savetxt("udplane.txt", udplane[:, :, :2].reshape(-1), fmt='%d', newline=',\n')
-    np.savetxt("udmask.txt", udmask.reshape(-1), fmt='%d', newline=',\n')
+    # gather lists for imgproc::Reproject: the source pixels landing in each
+    # output cell, packed as (j << 16) | i and grouped by cell in row-major
+    # order, so each cell can be summed in registers and written once.
+    # Empty cells get the list (and reciprocal count) of the cell they're
+    # flood-filled from, which folds the flood fill into the same pass.
+    W = bucketcount.shape[1]
+    js, is_ = np.nonzero(udmask)
+    cells = ((np.int32(udplane[js, is_, 1]) - y0) * W +
+             np.int32(udplane[js, is_, 0]) - x0)
+    order = np.argsort(cells, kind='stable')
+    gatherpix = (np.uint32(js[order]) << 16) | np.uint32(is_[order])
+    counts = np.bincount(cells, minlength=bucketcount.size)
+    starts = np.concatenate([[0], np.cumsum(counts)[:-1]])
+    src = floodmap.reshape(-1)
+    gatherstart = starts[src]
+    gathercount = counts[src]
+    # Q16 fixed-point 1/count
+    gatherrecip = np.uint32(np.round(65536.0 / gathercount))
+    np.savetxt(os.path.join(outdir, "gatherpix.txt"), gatherpix, fmt='%d', newline=',\n')
+    np.savetxt(os.path.join(outdir, "gatherstart.txt"), gatherstart, fmt='%d', newline=',\n')
+    np.savetxt(os.path.join(outdir, "gathercount.txt"), gathercount, fmt='%d', newline=',\n')
+    np.savetxt(os.path.join(outdir, "gatherrecip.txt"), gatherrecip, fmt='%d', newline=',\n')
+
+    np.savetxt(os.path.join(outdir, "udplane.txt"), udplane[:, :, :2].reshape(-1), fmt='%d', newline=',\n')
+    np.savetxt(os.path.join(outdir, "udmask.txt"), udmask.reshape(-1), fmt='%d', newline=',\n')
     invbucketcount = np.copy(bucketcount)
     invbucketcount[bucketcount != 0] = 1.0 / bucketcount[bucketcount != 0]
-    np.savetxt("bucketcount.txt", invbucketcount.reshape(-1), fmt='%f', newline=',\n')
-    np.savetxt("floodmap.txt", floodmap.reshape(-1), fmt='%d', newline=',\n')
+    np.savetxt(os.path.join(outdir, "bucketcount.txt"), invbucketcount.reshape(-1), fmt='%f', newline=',\n')
+    np.savetxt(os.path.join(outdir, "floodmap.txt"), floodmap.reshape(-1), fmt='%d', newline=',\n')
 
     floodmap = np.stack([
-        floodmap / bucketcount.shape[1],
+        floodmap // bucketcount.shape[1],
         floodmap % bucketcount.shape[1]], axis=2)[bucketcount == 0]
 
     np.save("udplane", udplane)
     np.save("udmask", udmask)
     np.save("bucketcount", invbucketcount)
     np.save("floodmap", floodmap)
-    print "maps saved, output is %d x %d" % (bucketcount.shape[1], bucketcount.shape[0])
-    print "uxrange", uxrange, "uyrange", uyrange, 'x0', x0, 'y0', y0
+    print("maps saved, output is %d x %d" % (
+        bucketcount.shape[1], bucketcount.shape[0]))
+    print("uxrange", uxrange, "uyrange", uyrange, 'x0', x0, 'y0', y0)
 
 
 if __name__ == '__main__':
-    generate_maps()
+    # the .txt tables (src/drive/imgproc.cc includes some) go to the
+    # directory given, or this one; the .npy maps always stay here for
+    # imgremap
+    generate_maps(*sys.argv[1:2])